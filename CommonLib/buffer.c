@@ -78,6 +78,25 @@ void MemBuffer_write( MemBuffer* self, void *addr, size_t size ) {
     self->len = postLen;
 }
 
+void MemBuffer_ensure_space( MemBuffer* self, int size ) {
+    int postLen;
+
+    postLen = self->len + size;
+    if ( postLen > self->space ) {
+        self->space = 2<<l_log2(postLen + 128);
+        self->buf = lrealloc( self->buf, self->space );
+    }
+}
+
+void MemBuffer_drop_left( MemBuffer* self, int len ) {
+    if ( len >= self->len ) {
+        self->len = 0;
+    } else if ( len > 0 ) {
+        memmove( self->buf, self->buf + len, self->len - len );
+        self->len -= len;
+    }
+}
+
 void MemBuffer_write_char( MemBuffer* self, char c ) {
     int postLen;
 
@@ -105,6 +105,30 @@ int             MemBuffer_reserve( MemBuffer* self );
  */
 void            MemBuffer_write( MemBuffer* self, void *addr, size_t size );
 
+/**
+ * Function: MemBuffer_ensure_space
+ *
+ * Reserve the space to append some bytes without reallocating the buffer,
+ * for example to receive data directly after <MemBuffer_address> plus
+ * <MemBuffer_len>. Use <MemBuffer_setlen> to account the written bytes.
+ *
+ * Parameters:
+ *     self - The memory buffer (cannot be NULL)
+ *     size - How many bytes will be appended
+ */
+void            MemBuffer_ensure_space( MemBuffer* self, int size );
+
+/**
+ * Function: MemBuffer_drop_left
+ *
+ * Remove some bytes from the start of the buffer
+ *
+ * Parameters:
+ *     self - The memory buffer (cannot be NULL)
+ *     len - How many bytes to remove
+ */
+void            MemBuffer_drop_left( MemBuffer* self, int len );
+
 /**
  * Function: MemBuffer_write_char
  *
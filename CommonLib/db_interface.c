@@ -67,6 +67,12 @@ lbool DbIterator_controlla_valore_nullo( DbIterator *self, int i ) {
     return self->oClass->controlla_valore_nullo( self, i );
 }
 
+lbool DbIterator_controlla_errore( DbIterator *self ) {
+    l_assert( self!=NULL );
+    if ( self->oClass->controlla_errore==NULL ) return LFALSE;
+    return self->oClass->controlla_errore( self );
+}
+
 const char * DbIterator_dammi_valore( DbIterator *self, int i ) {
     if ( !self ) return NULL;
     return self->oClass->dammi_valore( self, i );
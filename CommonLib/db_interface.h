@@ -184,6 +184,7 @@ struct DbIterator_class {
     int (*prossima_riga)( DbIterator *self );
     const char* (*dammi_valore)( DbIterator *self, int i );
     lbool (*controlla_valore_nullo)( DbIterator *self, int i );
+    lbool (*controlla_errore)( DbIterator *self );
 };
 
 struct DbIterator {
@@ -267,6 +268,21 @@ lbool DbIterator_controlla_valore_nullo( DbIterator *self, int i );
  */
 const char *DbIterator_dammi_valore( DbIterator *self, int i );
 
+/**
+ * Function: DbIterator_controlla_errore
+ *
+ * Check if the iteration stopped because of an error and not because
+ * the rows were finished. Drivers that fetch the whole result at once
+ * never fail here.
+ *
+ * Parameters:
+ *     self - Iterator (not NULL)
+ *
+ * Returns:
+ *     TRUE if <DbIterator_prossima_riga> failed and FALSE elsewhere.
+ */
+lbool DbIterator_controlla_errore( DbIterator *self );
+
 /**
  * Function: DbIterator_get_originating_connection
  *
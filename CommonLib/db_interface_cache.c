@@ -0,0 +1,859 @@
+#include "db_interface_cache.h"
+#include "db_utils.h"
+#include "lhashtable.h"
+#include "refcount.h"
+#include "threading.h"
+#include "buffer.h"
+#include "slist.h"
+#include "lmemory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Separates the query text from the parameters in the cache key */
+#define DB_CACHE_KEY_SEPARATOR '\x1f'
+#define DB_CACHE_KEY_NULL '\x1e'
+
+/* Results bigger than this fraction of the budget are not cached */
+#define DB_CACHE_MAX_ENTRY_FRACTION 8
+
+/* The functions whose result changes at every call or depends on the
+ * transaction: the queries using them are never cached.
+ * This list must be kept sorted as it's searched with bsearch */
+static const char *db_cache_volatile_words[] = {
+    "changes", "clock_timestamp", "current_date", "current_time",
+    "current_timestamp", "currval", "gen_random_uuid", "last_insert_rowid",
+    "lastval", "localtime", "localtimestamp", "nextval", "now", "random",
+    "randomblob", "setval", "statement_timestamp", "timeofday",
+    "total_changes", "transaction_timestamp", "txid_current",
+    "uuid_generate_v1", "uuid_generate_v4"
+};
+
+DbConnection_class *DbConnection_caching_class();
+
+/* DbCachedResult {{{ */
+
+/* A materialized query result. The first row of offsets contains the
+ * column names, a -1 offset represent a NULL value. The structure is
+ * reference counted (refcount.h) because the iterators can outlive the
+ * cache entry, and is immutable. A result is marked as failed if
+ * the iterator stopped because of an error, and then contains only the
+ * rows read before it: it is given to the caller but never cached. */
+typedef struct DbCachedResult {
+    int columns;
+    int rows;
+    lbool failed;
+    size_t size;
+    int *offsets;
+    char *data;
+} DbCachedResult;
+
+static DbCachedResult *DbCachedResult_materialize( DbIterator *iter ) {
+    DbCachedResult *self;
+    MemBuffer *data;
+    MemBuffer *offsets;
+    int columns, rows, offset, i;
+    char *block;
+
+    data = MemBuffer_new( 4096 );
+    offsets = MemBuffer_new( 1024 );
+
+    columns = DbIterator_dammi_numero_campi( iter );
+    for ( i=0; i<columns; i++ ) {
+        offset = MemBuffer_len( data );
+        MemBuffer_write( offsets, &offset, sizeof(int) );
+        MemBuffer_write( data, (void *)DbIterator_dammi_nome_campo( iter, i ), strlen(DbIterator_dammi_nome_campo( iter, i ))+1 );
+    }
+
+    rows = 0;
+    while ( DbIterator_prossima_riga( iter ) ) {
+        for ( i=0; i<columns; i++ ) {
+            if ( DbIterator_controlla_valore_nullo( iter, i ) ) {
+                offset = -1;
+                MemBuffer_write( offsets, &offset, sizeof(int) );
+            } else {
+                offset = MemBuffer_len( data );
+                MemBuffer_write( offsets, &offset, sizeof(int) );
+                MemBuffer_write( data, (void *)DbIterator_dammi_valore( iter, i ), strlen(DbIterator_dammi_valore( iter, i ))+1 );
+            }
+        }
+        rows++;
+    }
+
+    /* Everything in a single block */
+    block = (char *)rc_malloc( sizeof(DbCachedResult) + MemBuffer_len(offsets) + MemBuffer_len(data), NULL );
+    self = (DbCachedResult *)block;
+    self->columns = columns;
+    self->rows = rows;
+    self->failed = DbIterator_controlla_errore( iter );
+    self->size = sizeof(DbCachedResult) + MemBuffer_len(offsets) + MemBuffer_len(data);
+    self->offsets = (int *)(block + sizeof(DbCachedResult));
+    self->data = block + sizeof(DbCachedResult) + MemBuffer_len(offsets);
+    memcpy( self->offsets, MemBuffer_address(offsets), MemBuffer_len(offsets) );
+    memcpy( self->data, MemBuffer_address(data), MemBuffer_len(data) );
+
+    MemBuffer_destroy( data );
+    MemBuffer_destroy( offsets );
+
+    return self;
+}
+
+/* }}} */
+
+/* DbResultCache {{{ */
+
+typedef struct DbCacheEntry DbCacheEntry;
+struct DbCacheEntry {
+    lstring *key;
+    DbCachedResult *result;
+    slist *tables;
+    long long expiresAt;
+    size_t size;
+    DbCacheEntry *prev;
+    DbCacheEntry *next;
+};
+
+struct DbResultCache {
+    lcom_mutex_t *mutex;
+    lhashtable *entries;
+    DbCacheEntry *head;
+    DbCacheEntry *tail;
+    size_t budget;
+    size_t used;
+    long long ttlMicros;
+
+    /* Incremented by every invalidation, a result read while it changed
+     * may be stale and is not stored */
+    unsigned long generation;
+
+    long hits;
+    long misses;
+    long evictions;
+    long invalidations;
+};
+
+DbResultCache *DbResultCache_new(size_t memoryBudget, long ttlMillis) {
+    DbResultCache *self = (DbResultCache *)lmalloczero( sizeof(DbResultCache) );
+
+    self->mutex = lcom_mutex_new();
+    self->entries = lhashtable_new( NULL );
+    self->budget = memoryBudget;
+    self->ttlMicros = ttlMillis>0 ? (long long)ttlMillis * 1000 : 0;
+
+    return self;
+}
+
+/* The following functions must be called with the mutex locked */
+
+static void DbResultCache_unlink( DbResultCache *self, DbCacheEntry *entry ) {
+    if ( entry->prev ) entry->prev->next = entry->next;
+    else self->head = entry->next;
+    if ( entry->next ) entry->next->prev = entry->prev;
+    else self->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void DbResultCache_push_front( DbResultCache *self, DbCacheEntry *entry ) {
+    entry->prev = NULL;
+    entry->next = self->head;
+    if ( self->head ) self->head->prev = entry;
+    self->head = entry;
+    if ( self->tail==NULL ) self->tail = entry;
+}
+
+static void DbResultCache_remove( DbResultCache *self, DbCacheEntry *entry ) {
+    DbResultCache_unlink( self, entry );
+    lhashtable_remove( self->entries, entry->key );
+    self->used -= entry->size;
+
+    rc_unref( entry->result );
+    lstring_delete( entry->key );
+    slist_destroy( entry->tables );
+    lfree( entry );
+}
+
+static DbCachedResult *DbResultCache_lookup( DbResultCache *self, const char *key ) {
+    DbCacheEntry *entry;
+    DbCachedResult *result = NULL;
+
+    lcom_mutex_lock( self->mutex );
+
+    entry = (DbCacheEntry *)lhashtable_get( self->entries, key );
+    if ( entry!=NULL && entry->expiresAt!=0 && entry->expiresAt < l_monotonic_time_micros() ) {
+        DbResultCache_remove( self, entry );
+        entry = NULL;
+    }
+
+    if ( entry!=NULL ) {
+        DbResultCache_unlink( self, entry );
+        DbResultCache_push_front( self, entry );
+        result = entry->result;
+        rc_ref( result );
+        self->hits++;
+    } else {
+        self->misses++;
+    }
+
+    lcom_mutex_unlock( self->mutex );
+    return result;
+}
+
+static unsigned long DbResultCache_generation( DbResultCache *self ) {
+    unsigned long generation;
+
+    lcom_mutex_lock( self->mutex );
+    generation = self->generation;
+    lcom_mutex_unlock( self->mutex );
+
+    return generation;
+}
+
+static void DbResultCache_store( DbResultCache *self, const char *key, const char *sql, 
+        DbCachedResult *result, unsigned long generation ) {
+    DbCacheEntry *entry;
+    DbCacheEntry *old;
+    size_t size;
+
+    size = result->size + strlen(key) + sizeof(DbCacheEntry);
+    if ( size > self->budget / DB_CACHE_MAX_ENTRY_FRACTION ) {
+        return;
+    }
+
+    entry = (DbCacheEntry *)lmalloczero( sizeof(DbCacheEntry) );
+    entry->key = lstring_new_from_cstr( key );
+    entry->tables = slist_new( 0 );
+    db_extract_table_names( sql, entry->tables );
+    entry->size = size;
+    entry->result = result;
+    entry->expiresAt = self->ttlMicros ? l_monotonic_time_micros() + self->ttlMicros : 0;
+
+    lcom_mutex_lock( self->mutex );
+
+    if ( self->generation!=generation ) {
+        lcom_mutex_unlock( self->mutex );
+        lstring_delete( entry->key );
+        slist_destroy( entry->tables );
+        lfree( entry );
+        return;
+    }
+
+    old = (DbCacheEntry *)lhashtable_get( self->entries, key );
+    if ( old!=NULL ) {
+        DbResultCache_remove( self, old );
+    }
+
+    rc_ref( result );
+    lhashtable_put( self->entries, entry->key, entry );
+    DbResultCache_push_front( self, entry );
+    self->used += size;
+
+    while ( self->used > self->budget && self->tail!=NULL ) {
+        DbResultCache_remove( self, self->tail );
+        self->evictions++;
+    }
+
+    lcom_mutex_unlock( self->mutex );
+}
+
+static void DbResultCache_release( DbResultCache *self, DbCachedResult *result ) {
+    lcom_mutex_lock( self->mutex );
+    rc_unref( result );
+    lcom_mutex_unlock( self->mutex );
+}
+
+void DbResultCache_invalidate_table(DbResultCache *self, const char *tableName) {
+    DbCacheEntry *entry, *next;
+    int i;
+
+    l_assert( self!=NULL );
+    l_assert( tableName!=NULL );
+
+    lcom_mutex_lock( self->mutex );
+
+    self->generation++;
+    for ( entry=self->head; entry!=NULL; entry=next ) {
+        next = entry->next;
+        for ( i=0; i<slist_len(entry->tables); i++ ) {
+            if ( 0==l_stricmp( slist_at(entry->tables, i), tableName ) ) {
+                DbResultCache_remove( self, entry );
+                self->invalidations++;
+                break;
+            }
+        }
+    }
+
+    lcom_mutex_unlock( self->mutex );
+}
+
+void DbResultCache_invalidate_all(DbResultCache *self) {
+    l_assert( self!=NULL );
+
+    lcom_mutex_lock( self->mutex );
+    self->generation++;
+    while ( self->head!=NULL ) {
+        DbResultCache_remove( self, self->head );
+        self->invalidations++;
+    }
+    lcom_mutex_unlock( self->mutex );
+}
+
+lstring *DbResultCache_dump_stats_f(DbResultCache *self, lstring *dest) {
+    l_assert( self!=NULL );
+    l_assert( dest!=NULL );
+
+    lcom_mutex_lock( self->mutex );
+    dest = lstring_append_sprintf_f( dest, 
+        "entries=%i used=%lu budget=%lu hits=%ld misses=%ld evictions=%ld invalidations=%ld\n",
+        lhashtable_len(self->entries), (unsigned long)self->used, (unsigned long)self->budget,
+        self->hits, self->misses, self->evictions, self->invalidations );
+    lcom_mutex_unlock( self->mutex );
+
+    return dest;
+}
+
+void DbResultCache_destroy(DbResultCache *self) {
+    if ( self==NULL ) return;
+
+    while ( self->head!=NULL ) {
+        DbResultCache_remove( self, self->head );
+    }
+
+    lhashtable_destroy( self->entries );
+    lcom_mutex_destroy( self->mutex );
+    lfree( self );
+}
+
+/* The cache state of a caching connection. While a transaction is open
+ * the cache is bypassed, as the results could contain uncommitted data,
+ * and the tables modified are invalidated again at the commit, as other
+ * connections could have cached their old content in the meantime */
+typedef struct DbCacheSession {
+    DbResultCache *cache;
+    lbool inTransaction;
+    slist *written;
+    lbool writtenUnknown;
+} DbCacheSession;
+
+static lbool DbCacheSession_starts_with( const char *sql, const char *word ) {
+    int len = strlen( word );
+    return 0==l_strnicmp( sql, word, len ) && !isalnum((unsigned char)sql[len]) && sql[len]!='_';
+}
+
+static void DbCacheSession_end_transaction( DbCacheSession *self, lbool committed ) {
+    int i;
+
+    if ( committed && self->writtenUnknown ) {
+        DbResultCache_invalidate_all( self->cache );
+    } else if ( committed ) {
+        for ( i=0; i<slist_len(self->written); i++ ) {
+            DbResultCache_invalidate_table( self->cache, slist_at(self->written, i) );
+        }
+    }
+
+    self->inTransaction = LFALSE;
+    self->writtenUnknown = LFALSE;
+    slist_resize( self->written, 0 );
+}
+
+/* Decide what a statement does to the cache looking at its first word */
+static void DbCacheSession_after_statement( DbCacheSession *self, const char *sql ) {
+    const char *rest;
+    slist *tables;
+    int i, j;
+
+    while ( isspace((unsigned char)*sql) ) sql++;
+
+    if ( DbCacheSession_starts_with( sql, "begin" ) || DbCacheSession_starts_with( sql, "start" ) ||
+         DbCacheSession_starts_with( sql, "savepoint" ) ) {
+        self->inTransaction = LTRUE;
+        return;
+    }
+
+    if ( DbCacheSession_starts_with( sql, "commit" ) || DbCacheSession_starts_with( sql, "end" ) ) {
+        DbCacheSession_end_transaction( self, LTRUE );
+        return;
+    }
+
+    if ( DbCacheSession_starts_with( sql, "rollback" ) ) {
+        /* ROLLBACK TO a savepoint keeps the transaction open */
+        rest = sql+8;
+        while ( isspace((unsigned char)*rest) ) rest++;
+        if ( !DbCacheSession_starts_with( rest, "to" ) ) {
+            DbCacheSession_end_transaction( self, LFALSE );
+        }
+        return;
+    }
+
+    if ( DbCacheSession_starts_with( sql, "select" ) || DbCacheSession_starts_with( sql, "release" ) ||
+         DbCacheSession_starts_with( sql, "set" ) || DbCacheSession_starts_with( sql, "show" ) ||
+         DbCacheSession_starts_with( sql, "explain" ) || DbCacheSession_starts_with( sql, "values" ) ) {
+        return;
+    }
+
+    tables = slist_new( 0 );
+    db_extract_table_names( sql, tables );
+    if ( slist_len(tables)==0 ) {
+        DbResultCache_invalidate_all( self->cache );
+        self->writtenUnknown = self->inTransaction;
+    } else {
+        for ( i=0; i<slist_len(tables); i++ ) {
+            DbResultCache_invalidate_table( self->cache, slist_at(tables, i) );
+            if ( !self->inTransaction ) {
+                continue;
+            }
+            for ( j=0; j<slist_len(self->written); j++ ) {
+                if ( 0==strcmp( slist_at(self->written, j), slist_at(tables, i) ) ) break;
+            }
+            if ( j==slist_len(self->written) ) {
+                slist_resize( self->written, j+1 );
+                slist_set( self->written, j, slist_at(tables, i) );
+            }
+        }
+    }
+    slist_destroy( tables );
+}
+
+static int DbResultCache_word_compare( const void *key, const void *element ) {
+    return l_stricmp( (const char *)key, *(const char **)element );
+}
+
+/* Only the SELECTs reading tables are cached. The locking reads
+ * (FOR UPDATE, FOR SHARE...), SELECT INTO and the queries calling
+ * volatile functions, like now() or nextval(), are always executed.
+ * The queries without tables are not cached as no write would ever
+ * invalidate them. */
+static lbool DbResultCache_is_cacheable( const char *sql ) {
+    const char *start;
+    char word[32];
+    lbool afterFor = LFALSE;
+    lbool result = LTRUE;
+    slist *tables;
+    int len;
+
+    while ( isspace((unsigned char)*sql) ) sql++;
+    if ( 0!=l_strnicmp( sql, "select", 6 ) || isalnum((unsigned char)sql[6]) || sql[6]=='_' ) {
+        return LFALSE;
+    }
+
+    start = sql;
+    while ( *sql && result ) {
+        if ( *sql=='\'' ) {
+            /* date('now') is volatile in SQLite */
+            if ( 0==l_strnicmp( sql, "'now'", 5 ) ) {
+                result = LFALSE;
+            }
+            sql++;
+            while ( *sql && *sql!='\'' ) sql++;
+            if ( *sql ) sql++;
+        } else if ( *sql=='\"' ) {
+            sql++;
+            while ( *sql && *sql!='\"' ) sql++;
+            if ( *sql ) sql++;
+        } else if ( isalpha((unsigned char)*sql) || *sql=='_' ) {
+            len = 0;
+            while ( isalnum((unsigned char)*sql) || *sql=='_' || *sql=='$' ) {
+                if ( len<(int)sizeof(word)-1 ) word[len++] = *sql;
+                sql++;
+            }
+            word[len] = '\0';
+
+            if ( afterFor && (0==l_stricmp(word, "update") || 0==l_stricmp(word, "share") ||
+                              0==l_stricmp(word, "no") || 0==l_stricmp(word, "key")) ) {
+                result = LFALSE;
+            } else if ( 0==l_stricmp(word, "into") ) {
+                result = LFALSE;
+            } else if ( bsearch( word, db_cache_volatile_words, 
+                    sizeof(db_cache_volatile_words)/sizeof(db_cache_volatile_words[0]),
+                    sizeof(db_cache_volatile_words[0]), DbResultCache_word_compare )!=NULL ) {
+                result = LFALSE;
+            }
+            afterFor = 0==l_stricmp(word, "for");
+        } else {
+            sql++;
+        }
+    }
+
+    if ( result ) {
+        tables = slist_new( 0 );
+        db_extract_table_names( start, tables );
+        result = slist_len( tables )>0;
+        slist_destroy( tables );
+    }
+
+    return result;
+}
+
+/* Collapse the whitespace outside of the string literals */
+static lstring *DbResultCache_normalize_f( lstring *dest, const char *sql ) {
+    lbool pendingSpace = LFALSE;
+
+    lstring_reset( dest );
+    while ( *sql ) {
+        if ( isspace((unsigned char)*sql) ) {
+            pendingSpace = lstring_len(dest)>0;
+            sql++;
+        } else if ( *sql=='\'' ) {
+            if ( pendingSpace ) dest = lstring_append_char_f( dest, ' ' );
+            pendingSpace = LFALSE;
+            dest = lstring_append_char_f( dest, *sql++ );
+            while ( *sql ) {
+                dest = lstring_append_char_f( dest, *sql );
+                if ( *sql=='\'' ) {
+                    sql++;
+                    break;
+                }
+                sql++;
+            }
+        } else {
+            if ( pendingSpace ) dest = lstring_append_char_f( dest, ' ' );
+            pendingSpace = LFALSE;
+            dest = lstring_append_char_f( dest, *sql++ );
+        }
+    }
+
+    return dest;
+}
+
+/* }}} */
+
+/* DbIterator_Cached {{{ */
+
+typedef struct DbIterator_Cached {
+    DbIterator parent;
+    DbResultCache *cache;
+    DbCachedResult *result;
+    int row;
+} DbIterator_Cached;
+
+static void DbIterator_cached_destroy( DbIterator *parent ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+    DbResultCache_release( self->cache, self->result );
+}
+
+static int DbIterator_cached_dammi_numero_campi( DbIterator *parent ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+    return self->result->columns;
+}
+
+static const char *DbIterator_cached_dammi_nome_campo( DbIterator *parent, int i ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+    l_assert( 0<=i && i<self->result->columns );
+    return self->result->data + self->result->offsets[i];
+}
+
+static int DbIterator_cached_prossima_riga( DbIterator *parent ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+
+    if ( self->row >= self->result->rows ) {
+        return 0;
+    }
+    self->row++;
+    return 1;
+}
+
+static const char *DbIterator_cached_dammi_valore( DbIterator *parent, int i ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+    int offset;
+
+    l_assert( 0<=i && i<self->result->columns );
+    l_assert( self->row>0 );
+
+    offset = self->result->offsets[ self->row * self->result->columns + i ];
+    return offset<0 ? "" : self->result->data + offset;
+}
+
+static lbool DbIterator_cached_controlla_valore_nullo( DbIterator *parent, int i ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+
+    l_assert( 0<=i && i<self->result->columns );
+    l_assert( self->row>0 );
+
+    return self->result->offsets[ self->row * self->result->columns + i ] < 0;
+}
+
+static lbool DbIterator_cached_controlla_errore( DbIterator *parent ) {
+    DbIterator_Cached *self = (DbIterator_Cached *)parent;
+    return self->result->failed && self->row >= self->result->rows;
+}
+
+static DbIterator *DbIterator_cached_new( DbConnection *connection, DbResultCache *cache, DbCachedResult *result ) {
+    static DbIterator_class oClass;
+    DbIterator_Cached *self;
+
+    oClass.destroy = DbIterator_cached_destroy;
+    oClass.dammi_numero_campi = DbIterator_cached_dammi_numero_campi;
+    oClass.dammi_nome_campo = DbIterator_cached_dammi_nome_campo;
+    oClass.prossima_riga = DbIterator_cached_prossima_riga;
+    oClass.dammi_valore = DbIterator_cached_dammi_valore;
+    oClass.controlla_valore_nullo = DbIterator_cached_controlla_valore_nullo;
+    oClass.controlla_errore = DbIterator_cached_controlla_errore;
+
+    self = (DbIterator_Cached *)lmalloc( sizeof(DbIterator_Cached) );
+    DbIterator_init( connection, (DbIterator *)self, &oClass );
+    self->cache = cache;
+    self->result = result;
+    self->row = 0;
+
+    return (DbIterator *)self;
+}
+
+/* Serve a query from the cache or populate the cache with the
+ * result of the passed iterator, which is destroyed. The generation
+ * must be read before the query is forwarded */
+static DbIterator *DbIterator_cached_from( DbConnection *connection, DbResultCache *cache, 
+        const char *key, const char *sql, DbIterator *iter, unsigned long generation ) {
+    DbCachedResult *result;
+
+    result = DbCachedResult_materialize( iter );
+    DbIterator_destroy( iter );
+
+    if ( !result->failed ) {
+        DbResultCache_store( cache, key, sql, result, generation );
+    }
+    return DbIterator_cached_new( connection, cache, result );
+}
+
+/* }}} */
+
+/* DbPrepared_Caching {{{ */
+
+typedef struct DbPrepared_Caching {
+    DbPrepared parent;
+    DbPrepared *forwarder;
+    DbResultCache *cache;
+    DbCacheSession *session;
+    lstring *sql;
+    lstring *key;
+    slist *values;
+    int *nulls;
+    int parameters;
+} DbPrepared_Caching;
+
+static void DbPrepared_caching_destroy( DbPrepared *parent ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+    DbPrepared_destroy( self->forwarder );
+    lstring_delete( self->sql );
+    lstring_delete( self->key );
+    slist_destroy( self->values );
+    lfree( self->nulls );
+}
+
+static int DbPrepared_caching_dammi_numero_parametri( DbPrepared *parent ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+    return self->parameters;
+}
+
+static void DbPrepared_caching_metti_parametro_intero( DbPrepared *parent, int n, int valore ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+    char buffer[32];
+
+    DbPrepared_metti_parametro_intero( self->forwarder, n, valore );
+    if ( n<0 || n>=self->parameters ) return;
+    l_itoa_s( valore, buffer, sizeof(buffer), 10 );
+    slist_set( self->values, n, buffer );
+    self->nulls[n] = 0;
+}
+
+static void DbPrepared_caching_metti_parametro_nullo( DbPrepared *parent, int n ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+
+    DbPrepared_metti_parametro_nullo( self->forwarder, n );
+    if ( n<0 || n>=self->parameters ) return;
+    self->nulls[n] = 1;
+}
+
+static void DbPrepared_caching_metti_parametro_stringa( DbPrepared *parent, int n, const char *valore ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+
+    DbPrepared_metti_parametro_stringa( self->forwarder, n, valore );
+    if ( n<0 || n>=self->parameters ) return;
+    if ( valore==NULL ) {
+        self->nulls[n] = 1;
+    } else {
+        slist_set( self->values, n, valore );
+        self->nulls[n] = 0;
+    }
+}
+
+static int DbPrepared_caching_sql_exec( DbPrepared *parent, lerror **error ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+    lbool result;
+
+    result = DbPrepared_sql_exec( self->forwarder, error );
+    DbCacheSession_after_statement( self->session, self->sql );
+
+    return result;
+}
+
+static DbIterator *DbPrepared_caching_sql_retrieve( DbPrepared *parent, lerror **error ) {
+    DbPrepared_Caching *self = (DbPrepared_Caching *)parent;
+    DbCachedResult *result;
+    DbIterator *iter;
+    unsigned long generation;
+    int i;
+
+    if ( self->session->inTransaction || !DbResultCache_is_cacheable( self->sql ) ) {
+        iter = DbPrepared_sql_retrieve( self->forwarder, error );
+        DbCacheSession_after_statement( self->session, self->sql );
+        return iter;
+    }
+
+    self->key = lstring_from_lstr_f( self->key, self->sql );
+    for ( i=0; i<self->parameters; i++ ) {
+        self->key = lstring_append_char_f( self->key, DB_CACHE_KEY_SEPARATOR );
+        if ( self->nulls[i] ) {
+            self->key = lstring_append_char_f( self->key, DB_CACHE_KEY_NULL );
+        } else {
+            self->key = lstring_append_cstr_f( self->key, slist_at( self->values, i ) );
+        }
+    }
+
+    result = DbResultCache_lookup( self->cache, self->key );
+    if ( result!=NULL ) {
+        return DbIterator_cached_new( DbPrepared_get_originating_connection(parent), self->cache, result );
+    }
+
+    generation = DbResultCache_generation( self->cache );
+    iter = DbPrepared_sql_retrieve( self->forwarder, error );
+    if ( iter==NULL ) {
+        return NULL;
+    }
+
+    return DbIterator_cached_from( DbPrepared_get_originating_connection(parent), self->cache, 
+            self->key, self->sql, iter, generation );
+}
+
+static DbPrepared *DbPrepared_caching_new( DbConnection *connection, DbCacheSession *session, DbPrepared *forwarder, const char *sql ) {
+    static DbPrepared_class oClass;
+    DbPrepared_Caching *self;
+
+    oClass.destroy = DbPrepared_caching_destroy;
+    oClass.dammi_numero_parametri = DbPrepared_caching_dammi_numero_parametri;
+    oClass.metti_parametro_intero = DbPrepared_caching_metti_parametro_intero;
+    oClass.metti_parametro_nullo = DbPrepared_caching_metti_parametro_nullo;
+    oClass.metti_parametro_stringa = DbPrepared_caching_metti_parametro_stringa;
+    oClass.sql_exec = DbPrepared_caching_sql_exec;
+    oClass.sql_retrieve = DbPrepared_caching_sql_retrieve;
+
+    self = (DbPrepared_Caching *)lmalloc( sizeof(DbPrepared_Caching) );
+    DbPrepared_init( connection, (DbPrepared *)self, &oClass );
+    self->forwarder = forwarder;
+    self->cache = session->cache;
+    self->session = session;
+    self->sql = DbResultCache_normalize_f( lstring_new(), sql );
+    self->key = lstring_new();
+    self->parameters = DbPrepared_dammi_numero_parametri( forwarder );
+    self->values = slist_new( self->parameters );
+    self->nulls = (int *)lmalloczero( sizeof(int) * (self->parameters+1) );
+
+    return (DbPrepared *)self;
+}
+
+/* }}} */
+
+/* DbConnection_Caching {{{ */
+
+typedef struct DbConnection_Caching {
+    DbConnection parent;
+    DbConnection *forwarder;
+    DbResultCache *cache;
+    DbCacheSession session;
+    lstring *key;
+} DbConnection_Caching;
+
+static void DbConnection_caching_destroy( DbConnection *parent ) {
+    DbConnection_Caching *self = (DbConnection_Caching *)parent;
+    lstring_delete( self->key );
+    slist_destroy( self->session.written );
+}
+
+static lbool DbConnection_caching_sql_exec( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Caching *self = (DbConnection_Caching *)parent;
+    lbool result;
+
+    l_assert( sql!=NULL );
+
+    result = DbConnection_sql_exec( self->forwarder, sql, error );
+    DbCacheSession_after_statement( &self->session, sql );
+
+    return result;
+}
+
+static DbIterator *DbConnection_caching_sql_retrieve( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Caching *self = (DbConnection_Caching *)parent;
+    DbCachedResult *result;
+    DbIterator *iter;
+    unsigned long generation;
+
+    l_assert( sql!=NULL );
+
+    if ( self->session.inTransaction || !DbResultCache_is_cacheable( sql ) ) {
+        iter = DbConnection_sql_retrieve( self->forwarder, sql, error );
+        DbCacheSession_after_statement( &self->session, sql );
+        return iter;
+    }
+
+    self->key = DbResultCache_normalize_f( self->key, sql );
+    result = DbResultCache_lookup( self->cache, self->key );
+    if ( result!=NULL ) {
+        return DbIterator_cached_new( parent, self->cache, result );
+    }
+
+    generation = DbResultCache_generation( self->cache );
+    iter = DbConnection_sql_retrieve( self->forwarder, sql, error );
+    if ( iter==NULL ) {
+        return NULL;
+    }
+
+    return DbIterator_cached_from( parent, self->cache, self->key, sql, iter, generation );
+}
+
+static DbPrepared *DbConnection_caching_sql_prepare( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Caching *self = (DbConnection_Caching *)parent;
+    DbPrepared *forwarder;
+
+    forwarder = DbConnection_sql_prepare( self->forwarder, sql, error );
+    if ( forwarder==NULL ) {
+        return NULL;
+    }
+
+    return DbPrepared_caching_new( parent, &self->session, forwarder, sql );
+}
+
+static const char *DbConnection_caching_get_type( DbConnection *parent ) {
+    DbConnection_Caching *self = (DbConnection_Caching *)parent;
+    return DbConnection_get_type( self->forwarder );
+}
+
+DbConnection_class *DbConnection_caching_class() {
+	static DbConnection_class oClass;
+
+	oClass.destroy = DbConnection_caching_destroy;
+	oClass.sql_exec = DbConnection_caching_sql_exec;
+	oClass.sql_prepare = DbConnection_caching_sql_prepare;
+	oClass.sql_retrieve = DbConnection_caching_sql_retrieve;
+    oClass.get_type = DbConnection_caching_get_type;
+
+	return &oClass;
+}
+
+DbConnection *DbConnection_create_caching(DbConnection *parent, DbResultCache *cache) {
+    DbConnection_Caching *self;
+
+    l_assert( parent!=NULL );
+    l_assert( cache!=NULL );
+
+    self = (DbConnection_Caching *)lmalloc( sizeof(DbConnection_Caching) );
+    DbConnection_init( (DbConnection *)self, DbConnection_caching_class() );
+    self->forwarder = parent;
+    self->cache = cache;
+    self->session.cache = cache;
+    self->session.inTransaction = LFALSE;
+    self->session.written = slist_new( 0 );
+    self->session.writtenUnknown = LFALSE;
+    self->key = lstring_new();
+
+    return (DbConnection *)self;
+}
+
+/* }}} */
@@ -0,0 +1,104 @@
+#ifndef __COMMONLIB_DB_INTERFACE_CACHE_H
+#define __COMMONLIB_DB_INTERFACE_CACHE_H
+
+#include <stddef.h>
+#include "db_interface.h"
+
+/**
+ * File: db_interface_cache.h
+ */
+
+/**
+ * Class: DbResultCache
+ * A cache of query results, shared by one or more caching data
+ * connections. The results are kept in memory in a compact form and
+ * are identified by the query text (with the whitespace normalized)
+ * and by the values of the parameters of the prepared queries.
+ *
+ * Every cached result is tagged with the tables used by the query and
+ * is invalidated when a query executed through a caching connection
+ * modifies one of them. Changes made by other processes are not
+ * detected: use a TTL or invalidate the cache explicitly.
+ *
+ * The cache is protected by a mutex so that connections used in
+ * different threads can share it.
+ */
+typedef struct DbResultCache DbResultCache;
+
+/**
+ * Function: DbResultCache_new
+ * Create a new result cache
+ *
+ * Parameters:
+ *    memoryBudget - The maximum memory, in bytes, used by the cached results.
+ *        The least recently used results are evicted to stay in the budget.
+ *    ttlMillis - The time to live of the cached results in milliseconds.
+ *        Zero means that the results are kept until invalidated or evicted.
+ */
+DbResultCache *DbResultCache_new(size_t memoryBudget, long ttlMillis);
+
+/**
+ * Function: DbResultCache_destroy
+ * Destroy the cache. The caching connections and their iterators
+ * must be destroyed before the cache.
+ *
+ * Parameters:
+ *    self - The cache (can be NULL)
+ */
+void DbResultCache_destroy(DbResultCache *self);
+
+/**
+ * Function: DbResultCache_invalidate_table
+ * Discard the cached results that use a table
+ *
+ * Parameters:
+ *    self - The cache (not NULL)
+ *    tableName - The table name, without the schema (not NULL)
+ */
+void DbResultCache_invalidate_table(DbResultCache *self, const char *tableName);
+
+/**
+ * Function: DbResultCache_invalidate_all
+ * Discard every cached result
+ *
+ * Parameters:
+ *    self - The cache (not NULL)
+ */
+void DbResultCache_invalidate_all(DbResultCache *self);
+
+/**
+ * Function: DbResultCache_dump_stats_f
+ * Append to a string the cache statistics (hits, misses, evictions,
+ * invalidations and memory used)
+ *
+ * Parameters:
+ *    self - The cache (not NULL)
+ *    dest - The destination string (not NULL)
+ * Returns:
+ *    The destination string
+ */
+lstring *DbResultCache_dump_stats_f(DbResultCache *self, lstring *dest);
+
+/**
+ * Function: DbConnection_create_caching
+ * Create a data connection decorator that serves the SELECT queries
+ * from a result cache. Every other statement is forwarded to the parent
+ * connection and invalidates the tables it modifies (or the whole cache
+ * if the tables can't be found).
+ *
+ * The locking reads (FOR UPDATE, FOR SHARE), the queries calling volatile
+ * functions like now() or nextval() and the queries not reading tables
+ * are never cached. Between BEGIN (or START TRANSACTION, or SAVEPOINT)
+ * and COMMIT or ROLLBACK the cache is bypassed, so the uncommitted data
+ * is never shared, and the tables modified in the transaction are
+ * invalidated again at the commit.
+ *
+ * Parameters:
+ *    parent - The parent data connection, that must not be NULL
+ *    cache - The cache, that must not be NULL
+ * Returns:
+ *    The caching data connection
+ */
+DbConnection *DbConnection_create_caching(DbConnection *parent, DbResultCache *cache);
+
+#endif
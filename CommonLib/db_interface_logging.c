@@ -1,6 +1,13 @@
 #include "db_interface_logging.h" 
+#include "db_utils.h"
+#include "lhashtable.h"
 #include "llogging.h"
 #include "lmemory.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Durations are bucketed by their base-2 logarithm in microseconds */
+#define DB_LOGGING_HISTOGRAM_BUCKETS 32
 
 DbConnection_class *DbConnection_logging_class();
 lbool DbConnection_logging_sql_exec( DbConnection *self, const char *sql, lerror **error );
@@ -9,17 +16,284 @@ void DbConnection_logging_destroy(DbConnection *self);
 const char *DbConnection_logging_get_type(DbConnection *self);
 DbIterator* DbConnection_logging_sql_retrieve( DbConnection *self, const char *sql, lerror **error );
 
+typedef struct DbQueryStats {
+    lstring *fingerprint;
+    long calls;
+    long errors;
+    long long rows;
+    long long totalMicros;
+    long long maxMicros;
+    long histogram[DB_LOGGING_HISTOGRAM_BUCKETS];
+} DbQueryStats;
+
 typedef struct DbConnection_Logging {
 	DbConnection parent;
     DbConnection *forwarder;
+    long long slowThresholdMicros;
+    lhashtable *stats;
+    lstring *fingerprint;
 } DbConnection_Logging;
 
+typedef struct DbIterator_Logging {
+    DbIterator parent;
+    DbIterator *forwarder;
+    lstring *sql;
+    long long elapsedMicros;
+    long long rows;
+} DbIterator_Logging;
+
+typedef struct DbPrepared_Logging {
+    DbPrepared parent;
+    DbPrepared *forwarder;
+    lstring *sql;
+} DbPrepared_Logging;
+
+/* Statistics {{{ */
+
+static void DbQueryStats_destroy( DbQueryStats *self ) {
+    if (self==NULL) return;
+    lstring_delete(self->fingerprint);
+    lfree(self);
+}
+
+static long long DbQueryStats_percentile_micros( DbQueryStats *self, int percentile ) {
+    long threshold = (self->calls * percentile + 99) / 100;
+    long seen = 0;
+    int i;
+
+    for (i=0; i<DB_LOGGING_HISTOGRAM_BUCKETS; i++) {
+        seen += self->histogram[i];
+        if (seen>=threshold && seen>0) {
+            /* upper bound of the bucket */
+            return (1LL << (i+1)) - 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The prepares are aggregated apart from the executions of the same
+ * query, so they don't change its calls and its average time */
+static void DbConnection_logging_record( DbConnection_Logging *self, const char *sql, 
+        lbool prepare, long long micros, long long rows, lbool failed ) {
+    DbQueryStats *stats = NULL;
+    int bucket;
+
+    self->fingerprint = db_sql_fingerprint_f(self->fingerprint, sql);
+    if (prepare) {
+        self->fingerprint = lstring_append_cstr_f(self->fingerprint, " -- prepare");
+    }
+    stats = (DbQueryStats *)lhashtable_get(self->stats, self->fingerprint);
+    if (stats==NULL) {
+        stats = (DbQueryStats *)lmalloczero(sizeof(DbQueryStats));
+        stats->fingerprint = lstring_new_from_lstr(self->fingerprint);
+        lhashtable_put(self->stats, self->fingerprint, stats);
+    }
+
+    bucket = micros>0 ? l_log2((uint32_t)(micros > 0xFFFFFFFFLL ? 0xFFFFFFFFLL : micros)) : 0;
+    if (bucket>=DB_LOGGING_HISTOGRAM_BUCKETS) bucket = DB_LOGGING_HISTOGRAM_BUCKETS-1;
+
+    stats->calls++;
+    stats->rows += rows;
+    stats->totalMicros += micros;
+    stats->histogram[bucket]++;
+    if (micros>stats->maxMicros) stats->maxMicros = micros;
+    if (failed) stats->errors++;
+}
+
+static void DbConnection_logging_log( DbConnection_Logging *self, const char *operation,
+        const char *sql, long long micros, long long rows ) {
+    if (self->slowThresholdMicros>=0 && micros<=self->slowThresholdMicros) {
+        return;
+    }
+
+    if (rows>=0) {
+        l_info("[%s] %s (%lld.%03lld ms, %lld rows): %s", DbConnection_get_type(self->forwarder), 
+            operation, micros/1000, micros%1000, rows, sql);
+    } else {
+        l_info("[%s] %s (%lld.%03lld ms): %s", DbConnection_get_type(self->forwarder), 
+            operation, micros/1000, micros%1000, sql);
+    }
+}
+
+/* }}} */
+
+/* DbIterator_Logging {{{ */
+
+static void DbIterator_logging_destroy( DbIterator *parent ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    DbConnection_Logging *logging = (DbConnection_Logging *)DbIterator_get_originating_connection(parent);
+    lbool failed;
+
+    /* The errors while fetching the rows are known only to the iterator */
+    failed = DbIterator_controlla_errore(self->forwarder);
+    DbIterator_destroy(self->forwarder);
+
+    DbConnection_logging_record(logging, self->sql, LFALSE, self->elapsedMicros, self->rows, failed);
+    DbConnection_logging_log(logging, "sql_retrieve", self->sql, self->elapsedMicros, self->rows);
+    lstring_delete(self->sql);
+}
+
+static int DbIterator_logging_dammi_numero_campi( DbIterator *parent ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    return DbIterator_dammi_numero_campi(self->forwarder);
+}
+
+static const char *DbIterator_logging_dammi_nome_campo( DbIterator *parent, int i ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    return DbIterator_dammi_nome_campo(self->forwarder, i);
+}
+
+static int DbIterator_logging_prossima_riga( DbIterator *parent ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    long long start = l_monotonic_time_micros();
+    int result;
+
+    result = DbIterator_prossima_riga(self->forwarder);
+    self->elapsedMicros += l_monotonic_time_micros() - start;
+    if (result) {
+        self->rows++;
+    }
+
+    return result;
+}
+
+static const char *DbIterator_logging_dammi_valore( DbIterator *parent, int i ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    return DbIterator_dammi_valore(self->forwarder, i);
+}
+
+static lbool DbIterator_logging_controlla_valore_nullo( DbIterator *parent, int i ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    return DbIterator_controlla_valore_nullo(self->forwarder, i);
+}
+
+static lbool DbIterator_logging_controlla_errore( DbIterator *parent ) {
+    DbIterator_Logging *self = (DbIterator_Logging *)parent;
+    return DbIterator_controlla_errore(self->forwarder);
+}
+
+static DbIterator *DbIterator_logging_new( DbConnection_Logging *connection, DbIterator *forwarder, 
+        const char *sql, long long elapsedMicros ) {
+    static DbIterator_class oClass;
+    DbIterator_Logging *self = NULL;
+
+    oClass.destroy = DbIterator_logging_destroy;
+    oClass.dammi_numero_campi = DbIterator_logging_dammi_numero_campi;
+    oClass.dammi_nome_campo = DbIterator_logging_dammi_nome_campo;
+    oClass.prossima_riga = DbIterator_logging_prossima_riga;
+    oClass.dammi_valore = DbIterator_logging_dammi_valore;
+    oClass.controlla_valore_nullo = DbIterator_logging_controlla_valore_nullo;
+    oClass.controlla_errore = DbIterator_logging_controlla_errore;
+
+    self = (DbIterator_Logging *)lmalloc(sizeof(DbIterator_Logging));
+    DbIterator_init((DbConnection *)connection, (DbIterator *)self, &oClass);
+    self->forwarder = forwarder;
+    self->sql = lstring_new_from_cstr(sql);
+    self->elapsedMicros = elapsedMicros;
+    self->rows = 0;
+
+    return (DbIterator *)self;
+}
+
+/* }}} */
+
+/* DbPrepared_Logging {{{ */
+
+static void DbPrepared_logging_destroy( DbPrepared *parent ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbPrepared_destroy(self->forwarder);
+    lstring_delete(self->sql);
+}
+
+static int DbPrepared_logging_dammi_numero_parametri( DbPrepared *parent ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    return DbPrepared_dammi_numero_parametri(self->forwarder);
+}
+
+static void DbPrepared_logging_metti_parametro_intero( DbPrepared *parent, int n, int valore ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbPrepared_metti_parametro_intero(self->forwarder, n, valore);
+}
+
+static void DbPrepared_logging_metti_parametro_nullo( DbPrepared *parent, int n ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbPrepared_metti_parametro_nullo(self->forwarder, n);
+}
+
+static void DbPrepared_logging_metti_parametro_stringa( DbPrepared *parent, int n, const char *valore ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbPrepared_metti_parametro_stringa(self->forwarder, n, valore);
+}
+
+static int DbPrepared_logging_sql_exec( DbPrepared *parent, lerror **error ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbConnection_Logging *logging = (DbConnection_Logging *)DbPrepared_get_originating_connection(parent);
+    long long start = l_monotonic_time_micros();
+    long long elapsed;
+    lbool result;
+
+    result = DbPrepared_sql_exec(self->forwarder, error);
+    elapsed = l_monotonic_time_micros() - start;
+
+    DbConnection_logging_record(logging, self->sql, LFALSE, elapsed, 0, !result);
+    DbConnection_logging_log(logging, "prepared sql_exec", self->sql, elapsed, -1);
+
+    return result;
+}
+
+static DbIterator *DbPrepared_logging_sql_retrieve( DbPrepared *parent, lerror **error ) {
+    DbPrepared_Logging *self = (DbPrepared_Logging *)parent;
+    DbConnection_Logging *logging = (DbConnection_Logging *)DbPrepared_get_originating_connection(parent);
+    long long start = l_monotonic_time_micros();
+    long long elapsed;
+    DbIterator *result;
+
+    result = DbPrepared_sql_retrieve(self->forwarder, error);
+    elapsed = l_monotonic_time_micros() - start;
+
+    if (result==NULL) {
+        DbConnection_logging_record(logging, self->sql, LFALSE, elapsed, 0, LTRUE);
+        DbConnection_logging_log(logging, "prepared sql_retrieve", self->sql, elapsed, -1);
+        return NULL;
+    }
+
+    return DbIterator_logging_new(logging, result, self->sql, elapsed);
+}
+
+static DbPrepared *DbPrepared_logging_new( DbConnection_Logging *connection, DbPrepared *forwarder, const char *sql ) {
+    static DbPrepared_class oClass;
+    DbPrepared_Logging *self = NULL;
+
+    oClass.destroy = DbPrepared_logging_destroy;
+    oClass.dammi_numero_parametri = DbPrepared_logging_dammi_numero_parametri;
+    oClass.metti_parametro_intero = DbPrepared_logging_metti_parametro_intero;
+    oClass.metti_parametro_nullo = DbPrepared_logging_metti_parametro_nullo;
+    oClass.metti_parametro_stringa = DbPrepared_logging_metti_parametro_stringa;
+    oClass.sql_exec = DbPrepared_logging_sql_exec;
+    oClass.sql_retrieve = DbPrepared_logging_sql_retrieve;
+
+    self = (DbPrepared_Logging *)lmalloc(sizeof(DbPrepared_Logging));
+    DbPrepared_init((DbConnection *)connection, (DbPrepared *)self, &oClass);
+    self->forwarder = forwarder;
+    self->sql = lstring_new_from_cstr(sql);
+
+    return (DbPrepared *)self;
+}
+
+/* }}} */
+
+/* DbConnection_Logging {{{ */
+
 DbConnection *DbConnection_create_logging(DbConnection *parent) {
 	DbConnection_Logging *self = NULL;
 
 	self = (DbConnection_Logging *)lmalloc( sizeof(DbConnection_Logging) );
 	DbConnection_init( (DbConnection *)self, DbConnection_logging_class() );
     self->forwarder = parent;
+    self->slowThresholdMicros = -1;
+    self->stats = lhashtable_new((destructor_t)DbQueryStats_destroy);
+    self->fingerprint = lstring_new();
 
 	return (DbConnection *)self;
 }
@@ -39,28 +313,50 @@ DbConnection_class *DbConnection_logging_class() {
 void DbConnection_logging_destroy(DbConnection *self) {
 	DbConnection_Logging *logging = (DbConnection_Logging *)self;
     if (self==NULL) return;
+
+    lhashtable_destroy(logging->stats);
+    lstring_delete(logging->fingerprint);
 }
 
 lbool DbConnection_logging_sql_exec( DbConnection *self, const char *sql, lerror **error ) {
 	DbConnection_Logging *logging = (DbConnection_Logging *)self;
+    long long start, elapsed;
+    lbool result;
 
     l_assert(self!=NULL);
     l_assert(sql!=NULL);
     l_assert(error==NULL || *error==NULL);
 
-    l_info("[%s] sql_exec: %s", DbConnection_get_type(self), sql);
+    start = l_monotonic_time_micros();
+    result = DbConnection_sql_exec(logging->forwarder, sql, error);
+    elapsed = l_monotonic_time_micros() - start;
+
+    DbConnection_logging_record(logging, sql, LFALSE, elapsed, 0, !result);
+    DbConnection_logging_log(logging, "sql_exec", sql, elapsed, -1);
 
-    return DbConnection_sql_exec(logging->forwarder, sql, error);
+    return result;
 }
 
 DbPrepared *DbConnection_logging_sql_prepare( DbConnection *self, const char *sql, lerror **error ) {
+	DbConnection_Logging *logging = (DbConnection_Logging *)self;
+    long long start, elapsed;
+    DbPrepared *result;
+
     l_assert(self!=NULL);
     l_assert(sql!=NULL);
     l_assert(error==NULL || *error==NULL);
 
-    l_info("[%s] sql_prepare: %s", DbConnection_get_type(self), sql);
-    
-    return DbConnection_sql_prepare(self, sql, error);
+    start = l_monotonic_time_micros();
+    result = DbConnection_sql_prepare(logging->forwarder, sql, error);
+    elapsed = l_monotonic_time_micros() - start;
+
+    DbConnection_logging_record(logging, sql, LTRUE, elapsed, 0, result==NULL);
+    DbConnection_logging_log(logging, "sql_prepare", sql, elapsed, -1);
+    if (result==NULL) {
+        return NULL;
+    }
+
+    return DbPrepared_logging_new(logging, result, sql);
 }
 
 const char *DbConnection_logging_get_type(DbConnection *self) {
@@ -71,11 +367,92 @@ const char *DbConnection_logging_get_type(DbConnection *self) {
 
 DbIterator* DbConnection_logging_sql_retrieve( DbConnection *self, const char *sql, lerror **error ) {
     DbConnection_Logging *logging = (DbConnection_Logging *)self;
+    long long start, elapsed;
+    DbIterator *result;
 
     l_assert(self!=NULL);
     l_assert(sql!=NULL);
     l_assert(error==NULL || *error==NULL);
 
-    l_info("[%s] sql_retrieve: %s", DbConnection_get_type(self), sql);
-    return DbConnection_sql_retrieve(logging->forwarder, sql, error);
+    start = l_monotonic_time_micros();
+    result = DbConnection_sql_retrieve(logging->forwarder, sql, error);
+    elapsed = l_monotonic_time_micros() - start;
+
+    if (result==NULL) {
+        DbConnection_logging_record(logging, sql, LFALSE, elapsed, 0, LTRUE);
+        DbConnection_logging_log(logging, "sql_retrieve", sql, elapsed, -1);
+        return NULL;
+    }
+
+    return DbIterator_logging_new(logging, result, sql, elapsed);
 }
+
+void DbConnection_logging_set_slow_threshold(DbConnection *self, long millis) {
+    DbConnection_Logging *logging = (DbConnection_Logging *)self;
+
+    l_assert(self!=NULL);
+    l_assert(self->oClass==DbConnection_logging_class());
+
+    logging->slowThresholdMicros = millis<0 ? -1 : (long long)millis * 1000;
+}
+
+void DbConnection_logging_reset_stats(DbConnection *self) {
+    DbConnection_Logging *logging = (DbConnection_Logging *)self;
+
+    l_assert(self!=NULL);
+    l_assert(self->oClass==DbConnection_logging_class());
+
+    lhashtable_clear(logging->stats);
+}
+
+static void DbConnection_logging_collect_stats( const char *key, void *value, void *ctx ) {
+    DbQueryStats ***cursor = (DbQueryStats ***)ctx;
+    **cursor = (DbQueryStats *)value;
+    (*cursor)++;
+}
+
+static int DbConnection_logging_compare_stats( const void *a, const void *b ) {
+    const DbQueryStats *first = *(const DbQueryStats **)a;
+    const DbQueryStats *second = *(const DbQueryStats **)b;
+
+    if (first->totalMicros > second->totalMicros) return -1;
+    if (first->totalMicros < second->totalMicros) return 1;
+    return 0;
+}
+
+lstring *DbConnection_logging_dump_stats_f(DbConnection *self, lstring *dest) {
+    DbConnection_Logging *logging = (DbConnection_Logging *)self;
+    DbQueryStats **all, **cursor;
+    DbQueryStats *stats;
+    int count, i;
+
+    l_assert(self!=NULL);
+    l_assert(self->oClass==DbConnection_logging_class());
+    l_assert(dest!=NULL);
+
+    count = lhashtable_len(logging->stats);
+    if (count==0) {
+        return dest;
+    }
+
+    all = (DbQueryStats **)lmalloc(sizeof(DbQueryStats *) * count);
+    cursor = all;
+    lhashtable_foreach(logging->stats, DbConnection_logging_collect_stats, &cursor);
+    qsort(all, count, sizeof(DbQueryStats *), DbConnection_logging_compare_stats);
+
+    dest = lstring_append_cstr_f(dest, "calls\terrors\trows\ttotal_ms\tavg_ms\tmax_ms\tp50_ms\tp99_ms\tquery\n");
+    for (i=0; i<count; i++) {
+        stats = all[i];
+        dest = lstring_append_sprintf_f(dest, "%ld\t%ld\t%lld\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t",
+            stats->calls, stats->errors, stats->rows, stats->totalMicros/1000.0, 
+            stats->totalMicros/1000.0/stats->calls, stats->maxMicros/1000.0,
+            DbQueryStats_percentile_micros(stats, 50)/1000.0, DbQueryStats_percentile_micros(stats, 99)/1000.0);
+        dest = lstring_append_lstring_f(dest, stats->fingerprint);
+        dest = lstring_append_char_f(dest, '\n');
+    }
+
+    lfree(all);
+    return dest;
+}
+
+/* }}} */
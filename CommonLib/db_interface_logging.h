@@ -6,7 +6,12 @@
 /**
  * Function: DbConnection_create_logging
  * Create a dataconnection decorators that logs every query using CommonLib
- * logging
+ * logging. The decorator also measures the time spent in every query and
+ * the number of rows fetched by every iterator and aggregates these
+ * statistics by the query fingerprint, which is the query text without
+ * the literals. The prepares of a query are aggregated in a fingerprint
+ * ending with "-- prepare". The errors reported by an iterator while
+ * fetching the rows are counted when it's destroyed.
  *
  * Parameters:
  *    parent - The parent data connection, that must not be NULL
@@ -15,4 +20,38 @@
  */
 DbConnection *DbConnection_create_logging(DbConnection *parent);
 
+/**
+ * Function: DbConnection_logging_set_slow_threshold
+ * Log only the queries that take more than the passed time. The time of
+ * a query includes the time spent fetching its rows.
+ *
+ * Parameters:
+ *    self - A logging data connection (not NULL)
+ *    millis - The threshold in milliseconds. A negative value restores
+ *        the default behaviour, which is to log every query.
+ */
+void DbConnection_logging_set_slow_threshold(DbConnection *self, long millis);
+
+/**
+ * Function: DbConnection_logging_dump_stats_f
+ * Append to a string a report of the aggregated statistics, one line
+ * per query fingerprint, ordered by the total time spent.
+ *
+ * Parameters:
+ *    self - A logging data connection (not NULL)
+ *    dest - The destination string (not NULL)
+ * Returns:
+ *    The destination string
+ */
+lstring *DbConnection_logging_dump_stats_f(DbConnection *self, lstring *dest);
+
+/**
+ * Function: DbConnection_logging_reset_stats
+ * Clear the aggregated statistics
+ *
+ * Parameters:
+ *    self - A logging data connection (not NULL)
+ */
+void DbConnection_logging_reset_stats(DbConnection *self);
+
 #endif
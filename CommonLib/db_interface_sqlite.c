@@ -45,6 +45,7 @@ struct DbIterator_Sqlite {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int shared;
+	lbool failed;
 };
 typedef struct DbIterator_Sqlite DbIterator_Sqlite;
 
@@ -55,6 +56,7 @@ DbIterator_Sqlite *DbIterator_alloc_sqlite( DbConnection *connection, sqlite3 *p
 	self->db = pDb;
 	self->statement = pStatement;
 	self->shared = pShared;
+	self->failed = LFALSE;
 
 	return self;
 }
@@ -66,6 +68,9 @@ void DbIterator_Sqlite_destroy( DbIterator *parent ) {
 
 	if ( !self->shared ) {
 		sqlite3_finalize( self->statement );
+	} else {
+		/* The prepared query can be reused with other parameters */
+		sqlite3_reset( self->statement );
 	}
 }
 
@@ -89,6 +94,7 @@ int DbIterator_Sqlite_prossima_riga( DbIterator *iter ) {
 		return 1;
 	default:
 		/* Condizione di errore */
+		self->failed = LTRUE;
 		return 0;
 	}
 }
@@ -119,6 +125,11 @@ static lbool DbIterator_Sqlite_controlla_valore_nullo( DbIterator *iter, int i )
 	return ( valore==NULL );
 }
 
+static lbool DbIterator_Sqlite_controlla_errore( DbIterator *iter ) {
+	DbIterator_Sqlite *self = (DbIterator_Sqlite *)iter;
+	return self->failed;
+}
+
 DbIterator_class * DbIterator_Sqlite_class() {
 	static DbIterator_class oClass;
 
@@ -128,6 +139,7 @@ DbIterator_class * DbIterator_Sqlite_class() {
 	oClass.prossima_riga = DbIterator_Sqlite_prossima_riga;
 	oClass.dammi_valore = DbIterator_Sqlite_dammi_valore;
 	oClass.controlla_valore_nullo = DbIterator_Sqlite_controlla_valore_nullo;
+	oClass.controlla_errore = DbIterator_Sqlite_controlla_errore;
 
 	return &oClass;
 }
@@ -264,6 +276,7 @@ DbConnection_Sqlite *DbConnection_Sqlite_new_mem_shared(const char *dbname) {
 	databaseUri = lstring_append_cstr_f(databaseUri, dbname);
 	databaseUri = lstring_append_cstr_f(databaseUri, "?mode=memory&cache=shared");
 	result = (DbConnection_Sqlite *)DbConnection_Sqlite_new(databaseUri, NULL);
+	lstring_delete(databaseUri);
 
 	return result;
 }
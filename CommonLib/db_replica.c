@@ -0,0 +1,794 @@
+#include "db_replica.h"
+#include "db_interface_sqlite.h"
+#include "db_interface_pq.h"
+#include "db_utils.h"
+#include "sqlhelper.h"
+#include "lhashtable.h"
+#include "lvector.h"
+#include "slist.h"
+#include "llogging.h"
+#include "lmemory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Maximum number of rows inserted by a single statement */
+#define DB_REPLICA_MAX_BATCH_ROWS 256
+
+/* Suffix of the table used to load a new snapshot */
+#define DB_REPLICA_STAGE_SUFFIX "__replica_load"
+
+typedef struct DbReplicaTable {
+    lstring *sourceName;
+    lstring *schema;
+    lstring *localName;
+    lstring *stageName;
+    lstring *key;
+    lstring *watermark;
+    lstring *lastWatermark;
+
+    slist *columns;
+    slist *types;
+    char *booleans;
+    lbool routable;
+    lstring *selectSql;
+
+    SqlHelper *loadHelper;
+} DbReplicaTable;
+
+struct DbReplica {
+    DbConnection *source;
+    DbConnection *local;
+    lstring *name;
+    lstring *defaultSchema;
+    lvector *tables;
+    lhashtable *tableIndex;
+    lstring *buffer;
+
+    /* Rows of the batch being inserted */
+    slist *values;
+    char *nulls;
+};
+
+/* DbReplicaTable {{{ */
+
+static void DbReplicaTable_destroy( DbReplicaTable *self ) {
+    if ( self==NULL ) return;
+
+    lstring_delete( self->sourceName );
+    lstring_delete( self->schema );
+    lstring_delete( self->localName );
+    lstring_delete( self->stageName );
+    lstring_delete( self->key );
+    lstring_delete( self->watermark );
+    lstring_delete( self->lastWatermark );
+    slist_destroy( self->columns );
+    slist_destroy( self->types );
+    lfree( self->booleans );
+    lstring_delete( self->selectSql );
+    SqlHelper_destroy( self->loadHelper );
+    lfree( self );
+}
+
+/* Map a SQLite declared type to its type affinity, using the rules of
+ * SQLite: the local copy then stores and compares the values like the
+ * source database */
+static const char *DbReplica_sqlite_affinity( const char *type ) {
+    lstring *lower;
+    const char *result;
+
+    if ( type==NULL || *type=='\0' ) {
+        return "TEXT";
+    }
+
+    lower = lstring_new_from_cstr( type );
+    lstring_tolower( lower );
+
+    if ( strstr( lower, "int" )!=NULL ) {
+        result = "INTEGER";
+    } else if ( strstr( lower, "char" )!=NULL || strstr( lower, "text" )!=NULL || strstr( lower, "clob" )!=NULL ) {
+        result = "TEXT";
+    } else if ( strstr( lower, "real" )!=NULL || strstr( lower, "floa" )!=NULL || strstr( lower, "doub" )!=NULL ) {
+        result = "REAL";
+    } else {
+        result = "NUMERIC";
+    }
+
+    lstring_delete( lower );
+    return result;
+}
+
+/* Map a PostgreSQL type, as named by information_schema, to a SQLite
+ * type affinity. The booleans are stored as 0 and 1. Returns NULL for the
+ * types, like dates and uuids, whose values can't be compared by SQLite
+ * like PostgreSQL does */
+static const char *DbReplica_pq_affinity( const char *type, char *boolean ) {
+    *boolean = 0;
+
+    if ( 0==strcmp( type, "smallint" ) || 0==strcmp( type, "integer" ) || 0==strcmp( type, "bigint" ) ) {
+        return "INTEGER";
+    } else if ( 0==strcmp( type, "boolean" ) ) {
+        *boolean = 1;
+        return "INTEGER";
+    } else if ( 0==strcmp( type, "real" ) || 0==strcmp( type, "double precision" ) ) {
+        return "REAL";
+    } else if ( 0==strcmp( type, "numeric" ) ) {
+        return "NUMERIC";
+    } else if ( 0==strcmp( type, "text" ) || 0==strcmp( type, "character varying" ) || 0==strcmp( type, "character" ) ) {
+        return "TEXT";
+    } else {
+        return NULL;
+    }
+}
+
+/* Convert a boolean from the text format of the source to 0 or 1 */
+static const char *DbReplica_boolean_value( const char *value ) {
+    if ( 0==l_stricmp( value, "t" ) || 0==l_stricmp( value, "true" ) || 0==strcmp( value, "1" ) ) {
+        return "1";
+    } else {
+        return "0";
+    }
+}
+
+/* Read the column types of the source table from the catalog, when the
+ * source database type is known, and choose the local column types. The
+ * columns of unknown databases are kept as text. A table with columns that
+ * SQLite can't represent faithfully is replicated but never routed. */
+static void DbReplicaTable_read_types( DbReplicaTable *self, DbReplica *replica ) {
+    const char *type = DbConnection_get_type( replica->source );
+    DbIterator *iter = NULL;
+    int i;
+
+    if ( 0==strcmp( type, SQLITE_CONNECTION_TYPE ) ) {
+        replica->buffer = db_put_sql_format_f( replica->buffer, "PRAGMA table_info(%m)", self->localName );
+        iter = DbConnection_sql_retrieve( replica->source, replica->buffer, NULL );
+        while ( iter!=NULL && DbIterator_prossima_riga( iter ) ) {
+            for ( i=0; i<slist_len( self->columns ); i++ ) {
+                if ( 0==strcmp( slist_at( self->columns, i ), DbIterator_dammi_valore( iter, 1 ) ) ) {
+                    slist_set( self->types, i, DbReplica_sqlite_affinity( DbIterator_dammi_valore( iter, 2 ) ) );
+                }
+            }
+        }
+#ifdef POSTGRESQL_CONNECTION_TYPE
+    } else if ( 0==strcmp( type, POSTGRESQL_CONNECTION_TYPE ) ) {
+        const char *dot = strrchr( self->sourceName, '.' );
+        const char *affinity;
+        lstring *schema;
+
+        if ( dot!=NULL ) {
+            schema = lstring_append_generic_f( lstring_new(), self->sourceName, dot - self->sourceName );
+            replica->buffer = db_put_sql_format_f( replica->buffer,
+                "SELECT column_name, data_type FROM information_schema.columns "
+                "WHERE table_name=%s AND table_schema=%s", self->localName, schema );
+            lstring_delete( schema );
+        } else {
+            replica->buffer = db_put_sql_format_f( replica->buffer,
+                "SELECT column_name, data_type FROM information_schema.columns "
+                "WHERE table_name=%s AND table_schema=current_schema()", self->localName );
+        }
+        iter = DbConnection_sql_retrieve( replica->source, replica->buffer, NULL );
+        while ( iter!=NULL && DbIterator_prossima_riga( iter ) ) {
+            for ( i=0; i<slist_len( self->columns ); i++ ) {
+                if ( 0==strcmp( slist_at( self->columns, i ), DbIterator_dammi_valore( iter, 0 ) ) ) {
+                    affinity = DbReplica_pq_affinity( DbIterator_dammi_valore( iter, 1 ), &self->booleans[i] );
+                    slist_set( self->types, i, affinity!=NULL ? affinity : "TEXT" );
+                    if ( affinity==NULL ) {
+                        self->routable = LFALSE;
+                    }
+                }
+            }
+        }
+        for ( i=0; i<slist_len( self->columns ); i++ ) {
+            if ( *slist_at( self->types, i )=='\0' ) {
+                /* not found in the catalog */
+                self->routable = LFALSE;
+            }
+        }
+#endif
+    }
+
+    DbIterator_destroy( iter );
+}
+
+/* Replace a column name given by the user with the name of the source
+ * column matching it case-insensitively. An empty name is left empty. */
+static lbool DbReplicaTable_resolve_column( DbReplicaTable *self, lstring **column, lerror **error ) {
+    int i;
+
+    if ( lstring_len( *column )==0 ) {
+        return LTRUE;
+    }
+
+    for ( i=0; i<slist_len( self->columns ); i++ ) {
+        if ( 0==l_stricmp( slist_at( self->columns, i ), *column ) ) {
+            *column = lstring_from_cstr_f( *column, slist_at( self->columns, i ) );
+            return LTRUE;
+        }
+    }
+
+    lerror_set_sprintf( error, "Table %s has no column %s", self->sourceName, *column );
+    return LFALSE;
+}
+
+/* Read the structure of the source table and prepare the queries */
+static lbool DbReplicaTable_describe( DbReplicaTable *self, DbReplica *replica, lerror **error ) {
+    DbIterator *iter;
+    lstring *name;
+    int columns, i;
+
+    replica->buffer = db_put_sql_format_f( replica->buffer, "SELECT * FROM %k WHERE 1=0", self->sourceName );
+    iter = DbConnection_sql_retrieve( replica->source, replica->buffer, error );
+    if ( iter==NULL ) {
+        return LFALSE;
+    }
+
+    columns = DbIterator_dammi_numero_campi( iter );
+    slist_resize( self->columns, columns );
+    slist_resize( self->types, columns );
+    for ( i=0; i<columns; i++ ) {
+        slist_set( self->columns, i, DbIterator_dammi_nome_campo( iter, i ) );
+        slist_set( self->types, i, "" );
+    }
+    self->booleans = (char *)lmalloczero( columns );
+    self->routable = LTRUE;
+    DbIterator_destroy( iter );
+
+    if ( columns==0 ) {
+        lerror_set_sprintf( error, "Table %s has no columns", self->sourceName );
+        return LFALSE;
+    }
+
+    if ( !DbReplicaTable_resolve_column( self, &self->key, error ) ||
+         !DbReplicaTable_resolve_column( self, &self->watermark, error ) ) {
+        return LFALSE;
+    }
+
+    DbReplicaTable_read_types( self, replica );
+
+    self->loadHelper = SqlHelper_init( self->stageName );
+    self->selectSql = lstring_append_cstr_f( self->selectSql, "SELECT " );
+
+    name = lstring_new();
+    for ( i=0; i<columns; i++ ) {
+        lstring_reset( name );
+        name = db_append_sql_identifier_f( name, slist_at( self->columns, i ) );
+
+        SqlHelper_aggiungi_campo( self->loadHelper, name );
+
+        if ( i!=0 ) {
+            self->selectSql = lstring_append_char_f( self->selectSql, ',' );
+        }
+        self->selectSql = lstring_append_lstring_f( self->selectSql, name );
+    }
+
+    self->selectSql = lstring_append_cstr_f( self->selectSql, " FROM " );
+    self->selectSql = lstring_append_lstring_f( self->selectSql, self->sourceName );
+
+    lstring_delete( name );
+    return LTRUE;
+}
+
+/* }}} */
+
+/* Bulk loading {{{ */
+
+static lbool DbReplica_flush( DbReplica *self, SqlHelper *helper, int columns, int rows, lerror **error ) {
+    DbPrepared *prepared;
+    int i;
+
+    prepared = SqlHelper_prepare_rows( helper, self->local, rows, error );
+    if ( prepared==NULL ) {
+        return LFALSE;
+    }
+
+    for ( i=0; i<rows*columns; i++ ) {
+        if ( self->nulls[i] ) {
+            DbPrepared_metti_parametro_nullo( prepared, i );
+        } else {
+            DbPrepared_metti_parametro_stringa( prepared, i, slist_at( self->values, i ) );
+        }
+    }
+
+    return DbPrepared_sql_exec( prepared, error );
+}
+
+/* Insert in the local database every row of the iterator, batching
+ * the rows in multi-row INSERT statements. Fails if the iterator reports
+ * an error after the last row. */
+static lbool DbReplica_copy_rows( DbReplica *self, DbReplicaTable *table, SqlHelper *helper, DbIterator *iter, lerror **error ) {
+    int columns = slist_len( table->columns );
+    int batchRows, rows, i;
+
+    if ( DbIterator_dammi_numero_campi( iter )!=columns ) {
+        lerror_set_sprintf( error, "The structure of table %s was changed", table->sourceName );
+        return LFALSE;
+    }
+
+    batchRows = SqlHelper_max_rows( helper, self->local );
+    if ( batchRows>DB_REPLICA_MAX_BATCH_ROWS ) {
+        batchRows = DB_REPLICA_MAX_BATCH_ROWS;
+    }
+
+    if ( slist_len( self->values ) < batchRows*columns ) {
+        slist_resize( self->values, batchRows*columns );
+        self->nulls = (char *)lrealloc( self->nulls, batchRows*columns );
+    }
+
+    rows = 0;
+    while ( DbIterator_prossima_riga( iter ) ) {
+        for ( i=0; i<columns; i++ ) {
+            self->nulls[rows*columns + i] = (char)DbIterator_controlla_valore_nullo( iter, i );
+            if ( self->nulls[rows*columns + i] ) {
+                continue;
+            } else if ( table->booleans[i] ) {
+                slist_set( self->values, rows*columns + i, DbReplica_boolean_value( DbIterator_dammi_valore( iter, i ) ) );
+            } else {
+                slist_set( self->values, rows*columns + i, DbIterator_dammi_valore( iter, i ) );
+            }
+        }
+
+        rows++;
+        if ( rows==batchRows ) {
+            if ( !DbReplica_flush( self, helper, columns, rows, error ) ) {
+                return LFALSE;
+            }
+            rows = 0;
+        }
+    }
+
+    /* a source failing in the middle of the rows must not replace the
+     * local table with a truncated copy */
+    if ( DbIterator_controlla_errore( iter ) ) {
+        lerror_set_sprintf( error, "Cannot read the rows of table %s", table->sourceName );
+        return LFALSE;
+    }
+
+    if ( rows>0 ) {
+        return DbReplica_flush( self, helper, columns, rows, error );
+    }
+
+    return LTRUE;
+}
+
+static void DbReplica_update_watermark( DbReplica *self, DbReplicaTable *table ) {
+    const char *value;
+
+    if ( lstring_len( table->watermark )==0 ) {
+        return;
+    }
+
+    self->buffer = db_put_sql_format_f( self->buffer, "SELECT max(%m) FROM %m", table->watermark, table->localName );
+    value = DbConnection_sql_into( self->local, self->buffer, NULL );
+    table->lastWatermark = lstring_from_cstr_f( table->lastWatermark, value!=NULL ? value : "" );
+}
+
+static lbool DbReplica_exec_local( DbReplica *self, const char *sql, lerror **error ) {
+    return DbConnection_sql_exec( self->local, sql, error );
+}
+
+/* Fill a staging table with the rows of the iterator and, in a single
+ * transaction, swap it with the local copy or, for an incremental refresh,
+ * merge it in the local copy replacing the rows with the same key. The
+ * rows are read from the source before touching the local table, which
+ * is then changed by a single statement. */
+static lbool DbReplica_replace_table( DbReplica *self, DbReplicaTable *table, DbIterator *iter,
+        lbool incremental, lerror **error ) {
+    const char *type;
+    lbool result;
+    int i;
+
+    if ( !DbReplica_exec_local( self, "BEGIN", error ) ) {
+        return LFALSE;
+    }
+
+    self->buffer = db_put_sql_format_f( self->buffer, "DROP TABLE IF EXISTS %m", table->stageName );
+    result = DbReplica_exec_local( self, self->buffer, error );
+
+    if ( result ) {
+        self->buffer = db_put_sql_format_f( self->buffer, "CREATE TABLE %m (", table->stageName );
+        for ( i=0; i<slist_len( table->columns ); i++ ) {
+            type = slist_at( table->types, i );
+            self->buffer = db_append_sql_format_f( self->buffer, "%m %k",
+                slist_at( table->columns, i ), *type!='\0' ? type : "TEXT" );
+            if ( lstring_len( table->key )>0 && 0==strcmp( slist_at( table->columns, i ), table->key ) ) {
+                self->buffer = lstring_append_cstr_f( self->buffer, " PRIMARY KEY" );
+            }
+            self->buffer = lstring_append_cstr_f( self->buffer, i+1<slist_len( table->columns ) ? ", " : ")" );
+        }
+        result = DbReplica_exec_local( self, self->buffer, error );
+    }
+
+    if ( result ) {
+        result = DbReplica_copy_rows( self, table, table->loadHelper, iter, error );
+    }
+
+    if ( result && incremental ) {
+        self->buffer = db_put_sql_format_f( self->buffer, "INSERT OR REPLACE INTO %m SELECT * FROM %m", table->localName, table->stageName );
+        result = DbReplica_exec_local( self, self->buffer, error );
+
+        if ( result ) {
+            self->buffer = db_put_sql_format_f( self->buffer, "DROP TABLE %m", table->stageName );
+            result = DbReplica_exec_local( self, self->buffer, error );
+        }
+    } else if ( result ) {
+        self->buffer = db_put_sql_format_f( self->buffer, "DROP TABLE IF EXISTS %m", table->localName );
+        result = DbReplica_exec_local( self, self->buffer, error );
+
+        if ( result ) {
+            self->buffer = db_put_sql_format_f( self->buffer, "ALTER TABLE %m RENAME TO %m", table->stageName, table->localName );
+            result = DbReplica_exec_local( self, self->buffer, error );
+        }
+    }
+
+    if ( result ) {
+        result = DbReplica_exec_local( self, "COMMIT", error );
+    }
+
+    if ( !result ) {
+        DbReplica_exec_local( self, "ROLLBACK", NULL );
+        return LFALSE;
+    }
+
+    DbReplica_update_watermark( self, table );
+    return LTRUE;
+}
+
+/* Load a new snapshot of the table */
+static lbool DbReplica_load_table( DbReplica *self, DbReplicaTable *table, lerror **error ) {
+    DbIterator *iter;
+    lbool result;
+
+    iter = DbConnection_sql_retrieve( self->source, table->selectSql, error );
+    if ( iter==NULL ) {
+        return LFALSE;
+    }
+
+    result = DbReplica_replace_table( self, table, iter, LFALSE, error );
+    DbIterator_destroy( iter );
+
+    return result;
+}
+
+/* Merge in the local copy the rows changed after the last watermark */
+static lbool DbReplica_refresh_table( DbReplica *self, DbReplicaTable *table, lerror **error ) {
+    DbPrepared *prepared = NULL;
+    DbIterator *iter;
+    lbool result;
+
+    if ( lstring_len( table->key )==0 || lstring_len( table->watermark )==0 ) {
+        return DbReplica_load_table( self, table, error );
+    }
+
+    if ( lstring_len( table->lastWatermark )==0 ) {
+        iter = DbConnection_sql_retrieve( self->source, table->selectSql, error );
+    } else {
+        self->buffer = lstring_from_lstr_f( self->buffer, table->selectSql );
+        self->buffer = db_append_sql_format_f( self->buffer, " WHERE %m > ?", table->watermark );
+        prepared = DbConnection_sql_prepare( self->source, self->buffer, error );
+        if ( prepared==NULL ) {
+            return LFALSE;
+        }
+        DbPrepared_metti_parametro_stringa( prepared, 0, table->lastWatermark );
+        iter = DbPrepared_sql_retrieve( prepared, error );
+    }
+
+    if ( iter==NULL ) {
+        DbPrepared_destroy( prepared );
+        return LFALSE;
+    }
+
+    result = DbReplica_replace_table( self, table, iter, LTRUE, error );
+
+    DbIterator_destroy( iter );
+    DbPrepared_destroy( prepared );
+
+    return result;
+}
+
+/* }}} */
+
+/* DbReplica {{{ */
+
+/* The schema where the source resolves the unqualified table names, or an
+ * empty string if the database type is unknown */
+static lstring *DbReplica_read_default_schema( DbConnection *source ) {
+    const char *type = DbConnection_get_type( source );
+    const char *schema = NULL;
+
+    if ( 0==strcmp( type, SQLITE_CONNECTION_TYPE ) ) {
+        schema = "main";
+#ifdef POSTGRESQL_CONNECTION_TYPE
+    } else if ( 0==strcmp( type, POSTGRESQL_CONNECTION_TYPE ) ) {
+        schema = DbConnection_sql_into( source, "SELECT current_schema()", NULL );
+#endif
+    }
+
+    return lstring_new_from_cstr( schema!=NULL ? schema : "" );
+}
+
+DbReplica *DbReplica_new(DbConnection *source, const char *name, lerror **error) {
+    DbReplica *self;
+    DbConnection *local;
+
+    l_assert( source!=NULL );
+    l_assert( name!=NULL );
+
+    local = (DbConnection *)DbConnection_Sqlite_new_mem_shared( name );
+    if ( local==NULL ) {
+        lerror_set_sprintf( error, "Cannot create the in-memory database %s", name );
+        return NULL;
+    }
+
+    self = (DbReplica *)lmalloc( sizeof(DbReplica) );
+    self->source = source;
+    self->local = local;
+    self->name = lstring_new_from_cstr( name );
+    self->defaultSchema = DbReplica_read_default_schema( source );
+    self->tables = lvector_new( 0 );
+    self->tableIndex = lhashtable_new( NULL );
+    self->buffer = lstring_new();
+    self->values = slist_new( 0 );
+    self->nulls = NULL;
+
+    return self;
+}
+
+void DbReplica_destroy(DbReplica *self) {
+    int i;
+
+    if ( self==NULL ) return;
+
+    for ( i=0; i<lvector_len( self->tables ); i++ ) {
+        DbReplicaTable_destroy( (DbReplicaTable *)lvector_at( self->tables, i ) );
+    }
+    lvector_delete( self->tables );
+    lhashtable_destroy( self->tableIndex );
+
+    DbConnection_destroy( self->local );
+    lstring_delete( self->name );
+    lstring_delete( self->defaultSchema );
+    lstring_delete( self->buffer );
+    slist_destroy( self->values );
+    lfree( self->nulls );
+    lfree( self );
+}
+
+lbool DbReplica_add_table(DbReplica *self, const char *tableName, const char *keyColumn,
+    const char *watermarkColumn, lerror **error) {
+    DbReplicaTable *table;
+    const char *dot;
+    int len;
+
+    l_assert( self!=NULL );
+    l_assert( tableName!=NULL );
+    l_assert( error==NULL || *error==NULL );
+
+    dot = strrchr( tableName, '.' );
+
+    table = (DbReplicaTable *)lmalloczero( sizeof(DbReplicaTable) );
+    table->sourceName = lstring_new_from_cstr( tableName );
+    if ( dot!=NULL ) {
+        table->schema = lstring_append_generic_f( lstring_new(), tableName, dot - tableName );
+        lstring_tolower( table->schema );
+    } else {
+        table->schema = lstring_new_from_lstr( self->defaultSchema );
+    }
+    table->localName = lstring_new_from_cstr( dot!=NULL ? dot+1 : tableName );
+    lstring_tolower( table->localName );
+    table->stageName = lstring_new_from_lstr( table->localName );
+    table->stageName = lstring_append_cstr_f( table->stageName, DB_REPLICA_STAGE_SUFFIX );
+    table->key = lstring_new_from_cstr( keyColumn!=NULL ? keyColumn : "" );
+    table->watermark = lstring_new_from_cstr( watermarkColumn!=NULL ? watermarkColumn : "" );
+    table->lastWatermark = lstring_new();
+    table->columns = slist_new( 0 );
+    table->types = slist_new( 0 );
+    table->selectSql = lstring_new();
+
+    if ( lhashtable_get( self->tableIndex, table->localName )!=NULL ) {
+        lerror_set_sprintf( error, "Table %s is already replicated", table->localName );
+        DbReplicaTable_destroy( table );
+        return LFALSE;
+    }
+
+    if ( !DbReplicaTable_describe( table, self, error ) || !DbReplica_load_table( self, table, error ) ) {
+        DbReplicaTable_destroy( table );
+        return LFALSE;
+    }
+
+    len = lvector_len( self->tables );
+    lvector_resize( self->tables, len+1 );
+    lvector_set( self->tables, len, table );
+    lhashtable_put( self->tableIndex, table->localName, table );
+
+    return LTRUE;
+}
+
+lbool DbReplica_refresh(DbReplica *self, lerror **error) {
+    DbReplicaTable *table;
+    int i;
+
+    l_assert( self!=NULL );
+
+    for ( i=0; i<lvector_len( self->tables ); i++ ) {
+        table = (DbReplicaTable *)lvector_at( self->tables, i );
+        if ( !DbReplica_refresh_table( self, table, error ) ) {
+            return LFALSE;
+        }
+    }
+
+    return LTRUE;
+}
+
+lbool DbReplica_reload(DbReplica *self, lerror **error) {
+    DbReplicaTable *table;
+    int i;
+
+    l_assert( self!=NULL );
+
+    for ( i=0; i<lvector_len( self->tables ); i++ ) {
+        table = (DbReplicaTable *)lvector_at( self->tables, i );
+        if ( !DbReplica_load_table( self, table, error ) ) {
+            return LFALSE;
+        }
+    }
+
+    return LTRUE;
+}
+
+lbool DbReplica_contains_table(DbReplica *self, const char *tableName) {
+    l_assert( self!=NULL );
+    l_assert( tableName!=NULL );
+
+    return lhashtable_get( self->tableIndex, tableName )!=NULL;
+}
+
+DbConnection *DbReplica_get_local(DbReplica *self) {
+    l_assert( self!=NULL );
+    return self->local;
+}
+
+/* }}} */
+
+/* DbConnection_Router {{{ */
+
+typedef struct DbConnection_Router {
+    DbConnection parent;
+    DbReplica *replica;
+    DbConnection *remote;
+    DbConnection *local;
+    slist *tables;
+} DbConnection_Router;
+
+/* Check if a table referenced by a query, optionally qualified by a
+ * schema, is a replicated table that can be routed. The unqualified names
+ * are resolved in the default schema of the source, like the source does.
+ * The local copy only knows the schema "main" of SQLite: the names
+ * qualified by another schema, even the one of the replicated table,
+ * are forwarded. */
+static lbool DbConnection_router_is_replicated( DbConnection_Router *self, const char *name ) {
+    DbReplicaTable *table;
+    const char *dot = strrchr( name, '.' );
+    int schemaLen;
+
+    table = (DbReplicaTable *)lhashtable_get( self->replica->tableIndex, dot!=NULL ? dot+1 : name );
+    if ( table==NULL || !table->routable ) {
+        return LFALSE;
+    }
+
+    if ( dot==NULL ) {
+        return 0==strcmp( table->schema, self->replica->defaultSchema );
+    }
+
+    schemaLen = (int)(dot - name);
+    return schemaLen==lstring_len( table->schema ) && 0==strncmp( name, table->schema, schemaLen ) &&
+        0==strcmp( table->schema, "main" );
+}
+
+/* Check if a query only reads replicated tables that can be routed */
+static lbool DbConnection_router_is_local( DbConnection_Router *self, const char *sql ) {
+    int i;
+
+    while ( isspace((unsigned char)*sql) ) sql++;
+    if ( 0!=l_strnicmp( sql, "select", 6 ) || isalnum((unsigned char)sql[6]) || sql[6]=='_' ) {
+        return LFALSE;
+    }
+
+    slist_resize( self->tables, 0 );
+    db_extract_qualified_table_names( sql, self->tables );
+    if ( slist_len( self->tables )==0 ) {
+        return LFALSE;
+    }
+
+    for ( i=0; i<slist_len( self->tables ); i++ ) {
+        if ( !DbConnection_router_is_replicated( self, slist_at( self->tables, i ) ) ) {
+            return LFALSE;
+        }
+    }
+
+    return LTRUE;
+}
+
+static void DbConnection_router_destroy( DbConnection *parent ) {
+    DbConnection_Router *self = (DbConnection_Router *)parent;
+    DbConnection_destroy( self->local );
+    slist_destroy( self->tables );
+}
+
+static lbool DbConnection_router_sql_exec( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Router *self = (DbConnection_Router *)parent;
+    return DbConnection_sql_exec( self->remote, sql, error );
+}
+
+static DbIterator *DbConnection_router_sql_retrieve( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Router *self = (DbConnection_Router *)parent;
+    DbIterator *iter;
+
+    if ( self->local!=NULL && DbConnection_router_is_local( self, sql ) ) {
+        /* the local copy can be locked by a refresh */
+        iter = DbConnection_sql_retrieve( self->local, sql, NULL );
+        if ( iter!=NULL ) {
+            return iter;
+        }
+    }
+
+    return DbConnection_sql_retrieve( self->remote, sql, error );
+}
+
+static DbPrepared *DbConnection_router_sql_prepare( DbConnection *parent, const char *sql, lerror **error ) {
+    DbConnection_Router *self = (DbConnection_Router *)parent;
+    DbPrepared *prepared;
+
+    if ( self->local!=NULL && DbConnection_router_is_local( self, sql ) ) {
+        prepared = DbConnection_sql_prepare( self->local, sql, NULL );
+        if ( prepared!=NULL ) {
+            return prepared;
+        }
+    }
+
+    return DbConnection_sql_prepare( self->remote, sql, error );
+}
+
+static const char *DbConnection_router_get_type( DbConnection *parent ) {
+    DbConnection_Router *self = (DbConnection_Router *)parent;
+    return DbConnection_get_type( self->remote );
+}
+
+static DbConnection_class *DbConnection_router_class() {
+    static DbConnection_class oClass;
+
+    oClass.destroy = DbConnection_router_destroy;
+    oClass.sql_exec = DbConnection_router_sql_exec;
+    oClass.sql_prepare = DbConnection_router_sql_prepare;
+    oClass.sql_retrieve = DbConnection_router_sql_retrieve;
+    oClass.get_type = DbConnection_router_get_type;
+
+    return &oClass;
+}
+
+DbConnection *DbReplica_create_router(DbReplica *self, DbConnection *remote) {
+    DbConnection_Router *router;
+
+    l_assert( self!=NULL );
+    l_assert( remote!=NULL );
+
+    router = (DbConnection_Router *)lmalloc( sizeof(DbConnection_Router) );
+    DbConnection_init( (DbConnection *)router, DbConnection_router_class() );
+    router->replica = self;
+    router->remote = remote;
+    router->tables = slist_new( 0 );
+    router->local = (DbConnection *)DbConnection_Sqlite_new_mem_shared( self->name );
+
+    if ( router->local!=NULL ) {
+        /* Don't wait for the table locks taken by the refreshes: every
+         * refresh fills a staging table, which the routers never read, and
+         * replaces or changes the local table while holding the schema
+         * lock. */
+        DbConnection_sql_exec( router->local, "PRAGMA read_uncommitted=1", NULL );
+    } else {
+        l_error( "Cannot connect to the replica %s: every query will be forwarded", self->name );
+    }
+
+    return (DbConnection *)router;
+}
+
+/* }}} */
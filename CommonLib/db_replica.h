@@ -0,0 +1,156 @@
+#ifndef __COMMONLIB_DB_REPLICA_H
+#define __COMMONLIB_DB_REPLICA_H
+
+#include "db_interface.h"
+#include "lerror.h"
+
+/**
+ * File: db_replica.h
+ */
+
+/**
+ * Class: DbReplica
+ * A local copy of some tables of a (usually remote) database, kept in
+ * a shared in-memory SQLite database. The tables are loaded with
+ * a snapshot of the source and can be refreshed incrementally using a
+ * watermark column, like a modification timestamp or a growing id.
+ *
+ * The queries that only read replicated tables can be routed to the local
+ * copy using the connection created by <DbReplica_create_router>. The SQL
+ * of these queries must be understood by SQLite too.
+ *
+ * The table names are matched with their schema: an unqualified name refers
+ * to a replicated table only if the table belongs to the current schema
+ * of the source, and a qualified name is never routed, since SQLite doesn't
+ * know the schemas of the source, unless the source is SQLite and the schema
+ * is "main". A query reading otherschema.orders is then forwarded even when
+ * public.orders is replicated.
+ *
+ * The replica is meant for reference tables: the rows deleted in the
+ * source are only noticed by a full reload, and the changes made by
+ * the source after the last refresh are not visible in the replica.
+ */
+typedef struct DbReplica DbReplica;
+
+/**
+ * Function: DbReplica_new
+ * Create a new (empty) replica of a data connection
+ *
+ * Parameters:
+ *    source - The data connection to be replicated. It will not be destroyed
+ *        with the replica (not NULL)
+ *    name - The name of the in-memory database, which must be unique
+ *        in the process (not NULL)
+ *    error - The error object
+ * Returns:
+ *    The replica or NULL if the in-memory database can't be created
+ */
+DbReplica *DbReplica_new(DbConnection *source, const char *name, lerror **error);
+
+/**
+ * Function: DbReplica_destroy
+ * Destroy the replica and the local database. The router connections must
+ * be destroyed before the replica.
+ *
+ * Parameters:
+ *    self - The replica (can be NULL)
+ */
+void DbReplica_destroy(DbReplica *self);
+
+/**
+ * Function: DbReplica_add_table
+ * Replicate a table, loading it from the source. The local table will have
+ * the same name, without the schema, and the column types of the source
+ * table mapped to the SQLite type affinities. The PostgreSQL booleans are
+ * stored as 0 and 1. The tables having columns that SQLite can't compare
+ * like the source, as the PostgreSQL dates and uuids, are replicated but
+ * the routers always forward their queries.
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ *    tableName - The source table, optionally with the schema (not NULL)
+ *    keyColumn - The primary key of the table. Can be NULL, but then the table
+ *        can't be refreshed incrementally.
+ *    watermarkColumn - A column whose value grows every time a row is
+ *        inserted or updated. Can be NULL, but then the table is completely
+ *        reloaded at every refresh.
+ *    error - The error object
+ * Returns:
+ *    LTRUE if the table was loaded, LFALSE otherwise
+ */
+lbool DbReplica_add_table(DbReplica *self, const char *tableName, const char *keyColumn,
+    const char *watermarkColumn, lerror **error);
+
+/**
+ * Function: DbReplica_refresh
+ * Refresh every replicated table. The tables with a key and a watermark
+ * column only receive the rows whose watermark is greater than the last
+ * value seen, which replace the local rows with the same key; the other
+ * tables are reloaded. Every table is changed in a single transaction, so
+ * the routers never see a partial refresh, and the refresh fails if
+ * a router is still reading the table: it can be retried later.
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ *    error - The error object
+ * Returns:
+ *    LTRUE if every table was refreshed, LFALSE otherwise
+ */
+lbool DbReplica_refresh(DbReplica *self, lerror **error);
+
+/**
+ * Function: DbReplica_reload
+ * Reload every replicated table from a new snapshot. This is the only way
+ * to remove from the replica the rows deleted in the source.
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ *    error - The error object
+ * Returns:
+ *    LTRUE if every table was reloaded, LFALSE otherwise
+ */
+lbool DbReplica_reload(DbReplica *self, lerror **error);
+
+/**
+ * Function: DbReplica_contains_table
+ * Check if a table is replicated
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ *    tableName - The table name without schema (not NULL)
+ */
+lbool DbReplica_contains_table(DbReplica *self, const char *tableName);
+
+/**
+ * Function: DbReplica_get_local
+ * Get the connection to the local copy. This connection is owned by the
+ * replica and is the one used to load the data: every thread should use
+ * its own router connection instead.
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ */
+DbConnection *DbReplica_get_local(DbReplica *self);
+
+/**
+ * Function: DbReplica_create_router
+ * Create a data connection that executes the queries reading only
+ * replicated tables on a new connection to the local copy and forwards
+ * every other query to a connection to the source database. When the
+ * local copy is locked by a refresh the query is forwarded too.
+ *
+ * The tables must be added to the replica before creating the routers.
+ * A router connection must be used by one thread at a time and must be
+ * destroyed before the replica.
+ *
+ * Parameters:
+ *    self - The replica (not NULL)
+ *    remote - The connection where the other queries are forwarded, usually
+ *        a connection to the source database owned by the calling thread.
+ *        It will not be destroyed with the router (not NULL)
+ * Returns:
+ *    The router connection
+ */
+DbConnection *DbReplica_create_router(DbReplica *self, DbConnection *remote);
+
+#endif
@@ -31,40 +31,339 @@ Author: Leonardo Cecchi <leonardoce@interfree.it>
 #include "db_utils.h"
 #include "separatore_query.h"
 #include "lcross.h"
+#include "db_interface_pq.h"
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
 
 static lstring* db_append_sql_format_vf( lstring *str, const char *format, va_list args );
 static lbool db_is_keyword( const char *str );
+static lbool db_is_reserved_in_table_position( const char *str );
 
 lstring* db_append_sql_escaped_f( lstring *str, const char *value ) 
 {
-    const char *c = NULL;
+    const char *run = NULL;
+    const char *quote = NULL;
+    int valueLen = 0;
+    int quotes = 0;
 
     l_assert( str!=NULL );
 
     if ( value==NULL ) {
-        return lstring_append_cstr_f(str, "NULL");
+        return lstring_append_generic_f(str, "NULL", 4);
+    }
+
+    /* Count the quotes first so that the destination is grown only once */
+    valueLen = strlen( value );
+    for ( quote=memchr(value, '\'', valueLen); quote!=NULL; 
+          quote=memchr(quote+1, '\'', valueLen-(quote+1-value)) ) {
+        quotes++;
+    }
+
+    str = lstring_reserve_f( str, lstring_len(str) + valueLen + quotes + 3 );
+    str = lstring_append_char_f( str, '\'' );
+
+    /* Copy the runs between quotes as a whole */
+    run = value;
+    while ( quotes>0 ) {
+        quote = memchr( run, '\'', valueLen-(run-value) );
+        str = lstring_append_generic_f( str, run, quote-run+1 );
+        str = lstring_append_char_f( str, '\'' );
+        run = quote+1;
+        quotes--;
+    }
+    str = lstring_append_generic_f( str, run, valueLen-(run-value) );
+
+    str = lstring_append_char_f( str, '\'' );
+	return str;
+}
+
+lstring* db_append_sql_identifier_f( lstring *str, const char *name )
+{
+    const char *c = NULL;
+    lbool needs_quotes = LFALSE;
+
+    l_assert( str!=NULL );
+    l_assert( name!=NULL );
+
+    if ( *name=='\0' || isdigit((unsigned char)*name) || db_is_keyword(name) ) {
+        needs_quotes = LTRUE;
+    } else {
+        for ( c=name; *c && !needs_quotes; c++ ) {
+            if ( !isalnum((unsigned char)*c) && *c!='_' && *c!='.' ) {
+                needs_quotes = LTRUE;
+            }
+        }
+    }
+
+    if ( !needs_quotes ) {
+        return lstring_append_cstr_f( str, name );
+    }
+
+    str = lstring_append_char_f( str, '\"' );
+    for ( c=name; *c; c++ ) {
+        if ( *c=='\"' ) {
+            str = lstring_append_char_f( str, '\"' );
+        }
+        str = lstring_append_char_f( str, *c );
     }
+    str = lstring_append_char_f( str, '\"' );
+
+    return str;
+}
+
+lstring* db_append_sql_blob_f( lstring *str, const char *dbType, const void *data, int len )
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const unsigned char *bytes = (const unsigned char *)data;
+    char chunk[256];
+    lbool postgres = LFALSE;
+    int i, j;
+
+    l_assert( str!=NULL );
+    l_assert( len>=0 );
 
-    str = lstring_append_cstr_f(str, "\'" );
-    
-    c = value;
-    while (*c) {
-        switch(*c) {
-        case '\'':
-            str = lstring_append_cstr_f(str, "\'\'" );
+    if ( data==NULL ) {
+        return lstring_append_generic_f( str, "NULL", 4 );
+    }
+
+    postgres = dbType!=NULL && 0==strcmp( dbType, POSTGRESQL_CONNECTION_TYPE );
+
+    str = lstring_reserve_f( str, lstring_len(str) + len*2 + 16 );
+    if ( postgres ) {
+        str = lstring_append_generic_f( str, "decode('", 8 );
+    } else {
+        str = lstring_append_generic_f( str, "X'", 2 );
+    }
+
+    j = 0;
+    for ( i=0; i<len; i++ ) {
+        chunk[j++] = hex[bytes[i] >> 4];
+        chunk[j++] = hex[bytes[i] & 0x0F];
+        if ( j==sizeof(chunk) ) {
+            str = lstring_append_generic_f( str, chunk, j );
+            j = 0;
+        }
+    }
+    str = lstring_append_generic_f( str, chunk, j );
+
+    if ( postgres ) {
+        return lstring_append_generic_f( str, "','hex')", 8 );
+    }
+    return lstring_append_char_f( str, '\'' );
+}
+
+lstring* db_sql_fingerprint_f( lstring *dest, const char *sql )
+{
+    const char *c = NULL;
+    lbool pendingSpace = LFALSE;
+
+    l_assert( dest!=NULL );
+    l_assert( sql!=NULL );
+
+    lstring_reset( dest );
+
+    c = sql;
+    while ( *c ) {
+        if ( isspace((unsigned char)*c) ) {
+            pendingSpace = lstring_len(dest)>0;
+            c++;
+            continue;
+        }
+
+        if ( pendingSpace ) {
+            dest = lstring_append_char_f( dest, ' ' );
+            pendingSpace = LFALSE;
+        }
+
+        if ( *c=='\'' ) {
+            /* string literal, with '' as an escaped quote */
+            c++;
+            while ( *c ) {
+                if ( *c=='\'' && *(c+1)=='\'' ) {
+                    c += 2;
+                } else if ( *c=='\'' ) {
+                    c++;
+                    break;
+                } else {
+                    c++;
+                }
+            }
+            dest = lstring_append_char_f( dest, '?' );
+        } else if ( *c=='\"' ) {
+            /* quoted identifier, kept as is */
+            dest = lstring_append_char_f( dest, *c );
+            c++;
+            while ( *c && *c!='\"' ) {
+                dest = lstring_append_char_f( dest, *c );
+                c++;
+            }
+            if ( *c ) {
+                dest = lstring_append_char_f( dest, *c );
+                c++;
+            }
+        } else if ( isdigit((unsigned char)*c) ) {
+            /* numeric literal */
+            while ( isalnum((unsigned char)*c) || *c=='.' ) {
+                c++;
+            }
+            dest = lstring_append_char_f( dest, '?' );
+        } else if ( isalpha((unsigned char)*c) || *c=='_' ) {
+            /* identifiers can contain digits */
+            while ( isalnum((unsigned char)*c) || *c=='_' || *c=='$' ) {
+                dest = lstring_append_char_f( dest, (char)tolower((unsigned char)*c) );
+                c++;
+            }
+        } else {
+            dest = lstring_append_char_f( dest, *c );
+            c++;
+        }
+    }
+
+    return dest;
+}
+
+/* Reads the next token of a query skipping whitespace, literals and
+ * comments. Identifiers are put in lower case without quotes, except
+ * for the quoted parts which are kept as they are. quoted is set when
+ * the identifier has a quoted part. */
+static const char *db_next_token( const char *sql, lstring **token, lbool *quoted ) {
+    lstring_reset( *token );
+    *quoted = LFALSE;
+
+    while ( *sql ) {
+        if ( isspace((unsigned char)*sql) ) {
+            sql++;
+        } else if ( *sql=='-' && *(sql+1)=='-' ) {
+            while ( *sql && *sql!='\n' ) sql++;
+        } else if ( *sql=='\'' ) {
+            sql++;
+            while ( *sql ) {
+                if ( *sql=='\'' && *(sql+1)=='\'' ) sql += 2;
+                else if ( *sql=='\'' ) { sql++; break; }
+                else sql++;
+            }
+            *token = lstring_append_char_f( *token, '?' );
+            return sql;
+        } else {
             break;
-        default:
-            str = lstring_append_char_f(str, *c);
+        }
+    }
+
+    if ( *sql=='\0' ) {
+        return sql;
+    }
+
+    if ( *sql=='\"' || isalnum((unsigned char)*sql) || *sql=='_' ) {
+        /* identifier, eventually qualified by a schema */
+        while ( *sql=='\"' || isalnum((unsigned char)*sql) || *sql=='_' || *sql=='.' || *sql=='$' ) {
+            if ( *sql=='\"' ) {
+                *quoted = LTRUE;
+                sql++;
+                while ( *sql && *sql!='\"' ) {
+                    *token = lstring_append_char_f( *token, *sql );
+                    sql++;
+                }
+                if ( *sql ) sql++;
+            } else {
+                *token = lstring_append_char_f( *token, (char)tolower((unsigned char)*sql) );
+                sql++;
+            }
+        }
+    } else {
+        *token = lstring_append_char_f( *token, *sql );
+        sql++;
+    }
+
+    return sql;
+}
+
+static void db_add_table_name( slist *dest, const char *name, lbool quoted, lbool keepSchema ) {
+    const char *dot = strrchr( name, '.' );
+    const char *table = dot!=NULL ? dot+1 : name;
+    int i, len;
+
+    if ( !keepSchema ) {
+        name = table;
+    }
+
+    if ( *table=='\0' ) {
+        return;
+    }
+    if ( !quoted && (!(isalpha((unsigned char)*table) || *table=='_') || db_is_reserved_in_table_position(table)) ) {
+        return;
+    }
+
+    len = slist_len( dest );
+    for ( i=0; i<len; i++ ) {
+        if ( 0==strcmp( slist_at(dest, i), name ) ) {
+            return;
+        }
+    }
+
+    slist_resize( dest, len+1 );
+    slist_set( dest, len, name );
+}
+
+static void db_extract_names( const char *sql, slist *dest, lbool keepSchema ) {
+    lstring *token = lstring_new();
+    lbool inFromList = LFALSE;
+    lbool expectTable = LFALSE;
+    lbool quoted = LFALSE;
+
+    l_assert( sql!=NULL );
+    l_assert( dest!=NULL );
+
+    while ( 1 ) {
+        sql = db_next_token( sql, &token, &quoted );
+        if ( lstring_len(token)==0 ) {
             break;
         }
-        
-        c++;
+
+        if ( expectTable ) {
+            expectTable = LFALSE;
+            if ( quoted ) {
+                db_add_table_name( dest, token, LTRUE, keepSchema );
+            } else if ( 0==strcmp(token, "only") || 0==strcmp(token, "if") || 
+                 0==strcmp(token, "not") || 0==strcmp(token, "exists") ) {
+                /* UPDATE ONLY t, DROP TABLE IF EXISTS t */
+                expectTable = LTRUE;
+            } else if ( 0==strcmp(token, "(") ) {
+                /* a subquery: its tables are found by its FROM */
+                inFromList = LFALSE;
+            } else {
+                db_add_table_name( dest, token, LFALSE, keepSchema );
+            }
+        } else if ( 0==strcmp(token, "from") ) {
+            expectTable = LTRUE;
+            inFromList = LTRUE;
+        } else if ( 0==strcmp(token, "join") || 0==strcmp(token, "into") || 
+                    0==strcmp(token, "update") || 0==strcmp(token, "table") ) {
+            expectTable = LTRUE;
+            inFromList = LFALSE;
+        } else if ( inFromList && 0==strcmp(token, ",") ) {
+            expectTable = LTRUE;
+        } else if ( 0==strcmp(token, "where") || 0==strcmp(token, "on") ||
+                    0==strcmp(token, "group") || 0==strcmp(token, "order") ||
+                    0==strcmp(token, "(") || 0==strcmp(token, ")") ||
+                    0==strcmp(token, "set") || 0==strcmp(token, "values") ) {
+            inFromList = LFALSE;
+        }
     }
-    
-    str = lstring_append_cstr_f(str, "\'" );
-	return str;
+
+    lstring_delete( token );
+}
+
+void db_extract_table_names( const char *sql, slist *dest ) {
+    db_extract_names( sql, dest, LFALSE );
+}
+
+void db_extract_qualified_table_names( const char *sql, slist *dest ) {
+    db_extract_names( sql, dest, LTRUE );
 }
 
 int db_compare_datetime( const char *first, const char *second ) 
@@ -145,53 +444,139 @@ void db_execute_sql_script(DbConnection *conndb, const char *sql_script, lerror
 }
 
 
+/* This list must be kept sorted as it's searched with bsearch */
+static const char *db_keywords[] = {
+    "abort", "action", "add", "after", "all", "alter", "analyze", "and",
+    "any", "array", "as", "asc", "asymmetric", "attach", "authorization",
+    "autoincrement", "before", "begin", "between", "binary", "both", "by",
+    "cascade", "case", "cast", "check", "collate", "column", "commit",
+    "concurrently", "conflict", "constraint", "create", "cross", "current",
+    "current_catalog", "current_date", "current_role", "current_schema",
+    "current_time", "current_timestamp", "current_user", "database",
+    "default", "deferrable", "deferred", "delete", "desc", "detach",
+    "distinct", "do", "drop", "each", "else", "end", "escape", "except",
+    "exclusive", "exists", "explain", "fail", "false", "fetch", "filter",
+    "for", "foreign", "freeze", "from", "full", "glob", "grant", "group",
+    "having", "if", "ignore", "ilike", "immediate", "in", "index",
+    "indexed", "initially", "inner", "insert", "instead", "intersect",
+    "into", "is", "isnull", "join", "key", "lateral", "leading", "left",
+    "level", "like", "limit", "localtime", "localtimestamp", "match",
+    "natural", "no", "not", "notnull", "null", "of", "offset", "on",
+    "only", "or", "order", "outer", "over", "overlaps", "placing", "plan",
+    "pragma", "primary", "query", "raise", "recursive", "references",
+    "regexp", "reindex", "release", "rename", "replace", "restrict",
+    "returning", "right", "rollback", "row", "savepoint", "select",
+    "session_user", "set", "similar", "some", "symmetric", "table",
+    "tablesample", "temp", "temporary", "then", "to", "trailing",
+    "transaction", "trigger", "true", "union", "unique", "update", "user",
+    "using", "vacuum", "values", "variadic", "verbose", "view", "virtual",
+    "when", "where", "window", "with", "without"
+};
+
+/* The words that can follow FROM, JOIN, INTO, UPDATE or TABLE but can't
+ * be an unquoted table name. The non-reserved keywords, like "action" or
+ * "user", are valid table names and aren't here.
+ * This list must be kept sorted as it's searched with bsearch */
+static const char *db_table_position_keywords[] = {
+    "all", "and", "as", "cross", "default", "distinct", "except", "fetch",
+    "for", "from", "full", "group", "having", "inner", "intersect", "join",
+    "lateral", "left", "limit", "natural", "nowait", "of", "offset", "on",
+    "or", "order", "outer", "returning", "right", "select", "set", "skip",
+    "union", "using", "values", "where", "window", "with"
+};
+
+static int db_keyword_compare( const void *key, const void *element ) {
+    return l_stricmp( (const char *)key, *(const char **)element );
+}
+
 static lbool db_is_keyword( const char *str ) {
     l_assert( str!=NULL );
 
-    if ( 0==l_stricmp( str, "level" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "from" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "select" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "update" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "where" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "is" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "order" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "by" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "as" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "inner" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "outer" ) ) return LTRUE;
-    if ( 0==l_stricmp( str, "join" ) ) return LTRUE;
+    return bsearch( str, db_keywords, sizeof(db_keywords)/sizeof(db_keywords[0]),
+                    sizeof(db_keywords[0]), db_keyword_compare )!=NULL;
+}
+
+static lbool db_is_reserved_in_table_position( const char *str ) {
+    l_assert( str!=NULL );
 
-    return LFALSE;
+    return bsearch( str, db_table_position_keywords, 
+                    sizeof(db_table_position_keywords)/sizeof(db_table_position_keywords[0]),
+                    sizeof(db_table_position_keywords[0]), db_keyword_compare )!=NULL;
+}
+
+static lstring* db_append_sql_double_f( lstring *str, double value ) {
+    char buffer[64];
+    char *c = NULL;
+
+    if ( value!=value || value==HUGE_VAL || value==-HUGE_VAL ) {
+        /* NaN and infinity don't have a portable SQL literal */
+        return lstring_append_generic_f( str, "NULL", 4 );
+    }
+
+    snprintf( buffer, sizeof(buffer), "%.17g", value );
+
+    /* The decimal separator depends on the current locale */
+    for ( c=buffer; *c; c++ ) {
+        if ( *c==',' ) *c = '.';
+    }
+
+    return lstring_append_cstr_f( str, buffer );
 }
 
 static lstring* db_append_sql_format_vf( lstring *str, const char *format, va_list args ) {
-    const char *tmp = NULL;
-    lbool is_keyword = LFALSE;
+    const char *run = NULL;
+    const char *dbType = NULL;
+    const void *blob = NULL;
+    char buffer[32];
+    int len = 0;
 
     l_assert( str!=NULL );
     l_assert( format!=NULL );
 
+    str = lstring_reserve_f( str, lstring_len(str) + strlen(format) + 64 );
+
     while( (*format)!='\0' ) {
         if ( (*format)!='%' ) {
-            str = lstring_append_char_f( str, *format );
-            format++;
+            /* Copy the literal text until the next placeholder */
+            run = strchr( format, '%' );
+            if ( run==NULL ) {
+                run = format + strlen(format);
+            }
+            str = lstring_append_generic_f( str, format, run-format );
+            format = run;
         } else if ( (*(format+1))=='s' ) {
             str = db_append_sql_escaped_f( str, va_arg(args, const char *) );
             format += 2;
         } else if ( (*(format+1))=='i' ) {
-            str = lstring_append_sprintf_f( str, "%i", va_arg(args, int) );
+            len = snprintf( buffer, sizeof(buffer), "%i", va_arg(args, int) );
+            str = lstring_append_generic_f( str, buffer, len );
+            format += 2;
+        } else if ( 0==strncmp(format+1, "lld", 3) ) {
+            len = snprintf( buffer, sizeof(buffer), "%lld", va_arg(args, long long) );
+            str = lstring_append_generic_f( str, buffer, len );
+            format += 4;
+        } else if ( (*(format+1))=='f' ) {
+            str = db_append_sql_double_f( str, va_arg(args, double) );
+            format += 2;
+        } else if ( (*(format+1))=='b' ) {
+            dbType = va_arg(args, const char *);
+            blob = va_arg(args, const void *);
+            len = va_arg(args, int);
+            str = db_append_sql_blob_f( str, dbType, blob, len );
             format += 2;
         } else if ( (*(format+1))=='k' ) {
             str = lstring_append_cstr_f( str, va_arg(args, const char *) );
             format += 2;
         } else if ( (*(format+1))=='m' ) {
-
-            tmp = va_arg(args, const char *);
-            is_keyword = db_is_keyword( tmp );
-            if ( is_keyword ) str = lstring_append_char_f( str, '\"');
-            str = lstring_append_cstr_f( str, tmp );
-            if ( is_keyword ) str = lstring_append_char_f( str, '\"');
+            str = db_append_sql_identifier_f( str, va_arg(args, const char *) );
             format += 2;
+        } else if ( (*(format+1))=='%' ) {
+            str = lstring_append_char_f( str, '%' );
+            format += 2;
+        } else {
+            /* Unknown placeholder: copy it verbatim */
+            str = lstring_append_char_f( str, *format );
+            format++;
         }
     }
 
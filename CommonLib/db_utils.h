@@ -38,6 +38,7 @@ Author: Leonardo Cecchi <leonardoce@interfree.it>
  */
 
 #include "db_interface.h"
+#include "slist.h"
 
 /**
  * Function: db_append_sql_escaped_f
@@ -48,6 +49,31 @@ Author: Leonardo Cecchi <leonardoce@interfree.it>
  */
 lstring* db_append_sql_escaped_f( lstring *str, const char *value );
 
+/**
+ * Function: db_append_sql_identifier_f
+ * Append to a query a table or field name, quoting it when it is a SQL
+ * keyword or when it contains characters that can't be used in a bare
+ * identifier
+ * Parameters:
+ *    str - Destination lstring
+ *    name - The identifier (not NULL)
+ */
+lstring* db_append_sql_identifier_f( lstring *str, const char *name );
+
+/**
+ * Function: db_append_sql_blob_f
+ * Append to a query a blob literal for the database type. PostgreSQL
+ * reads X'0A1B' as a bit string, so its blobs are written as
+ * decode('0A1B','hex'). The other databases get the X'0A1B' hex format
+ * Parameters:
+ *    str - Destination lstring
+ *    dbType - The connection type (see <DbConnection_get_type>) or NULL
+ *             for the X'0A1B' format
+ *    data - The bytes to encode (can be NULL)
+ *    len - How many bytes to encode
+ */
+lstring* db_append_sql_blob_f( lstring *str, const char *dbType, const void *data, int len );
+
 /**
  * Function: db_put_sql_format_f
  * This function is like db_append_sql_format but will reset the string before
@@ -65,14 +91,61 @@ lstring* db_put_sql_format_f( lstring *str, const char *format, ... );
  *     "%k" to represent a literal string (keyword)
  *     "%m" to represent a meta-data name as a field name of a table name. If the
  *          field name is a SQL keyword it will be quoted in the SQL query
+ *          (see <db_append_sql_identifier_f>)
  *     "%i" to represent a integer parameter
+ *     "%lld" to represent a long long parameter
+ *     "%f" to represent a double parameter (NaN and infinity are written as NULL)
  *     "%s" to represent a string parameter
+ *     "%b" to represent a blob literal. It takes three parameters: the
+ *          connection type, the data pointer and the length in bytes as
+ *          an int (see <db_append_sql_blob_f>)
+ *     "%%" to represent a literal percent sign
  * Parameters:
  *     str - Destination lstring
  *     format - Format string
  */
 lstring* db_append_sql_format_f( lstring *str, const char *format, ... );
 
+/**
+ * Function: db_sql_fingerprint_f
+ * Compute the fingerprint of a query, useful to aggregate statistics of
+ * queries that differ only by their parameters: string and numeric
+ * literals are replaced by "?", the whitespace is collapsed and the text
+ * out of quoted identifiers is put in lower case.
+ *
+ * Parameters:
+ *    dest - The destination lstring, which is reset (not NULL)
+ *    sql - The query (not NULL)
+ */
+lstring* db_sql_fingerprint_f( lstring *dest, const char *sql );
+
+/**
+ * Function: db_extract_table_names
+ * Find the names of the tables referenced by a query, looking at the
+ * identifiers following the FROM, JOIN, INTO, UPDATE and TABLE keywords.
+ * This is a lexical heuristic, not a SQL parser: the names are put in lower
+ * case without the schema and without quotes, and each name is reported
+ * only once. The quoted names keep their case and are reported even if
+ * they are keywords.
+ *
+ * Parameters:
+ *    sql - The query (not NULL)
+ *    dest - The list where the names will be appended (not NULL)
+ */
+void db_extract_table_names( const char *sql, slist *dest );
+
+/**
+ * Function: db_extract_qualified_table_names
+ * Like <db_extract_table_names>, but the names keep the schema they are
+ * qualified with, as in "public.orders". The schema is put in lower case
+ * unless quoted.
+ *
+ * Parameters:
+ *    sql - The query (not NULL)
+ *    dest - The list where the names will be appended (not NULL)
+ */
+void db_extract_qualified_table_names( const char *sql, slist *dest );
+
 /**
  * Function: db_compare_datetime
  * Compare two date/time string with the format "YYYY-MM-DD HH:MM". 
@@ -0,0 +1,631 @@
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+
+#include "net_socket.h"
+
+#include "evloop.h"
+#include "lmemory.h"
+#include "lcross.h"
+#include "threading.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <unistd.h>
+#endif
+
+/* Maximum number of events read by every epoll_wait */
+#define EVENTLOOP_MAX_EVENTS 256
+
+struct EventLoop_watch {
+	int fd;
+	EventLoop_callback callback;
+	void *ctx;
+	struct EventLoop_watch *nextRemoved;
+};
+
+struct EventLoop_timer {
+	EventLoop *loop;
+	EventLoop_timer_callback callback;
+	void *ctx;
+	long long deadline;
+	int repeat;
+	/* Position in the heap of the loop, -1 when the timer is stopped */
+	int heapIndex;
+};
+
+struct EventLoop_task {
+	EventLoop_task_func func;
+	void *ctx;
+	struct EventLoop_task *next;
+};
+
+struct EventLoop {
+	int epollFd;
+	int wakeupFd;
+	volatile lbool stopping;
+
+	/* The watches indexed by file descriptor */
+	lcom_mutex_t *mutex;
+	struct EventLoop_watch **watches;
+	int watchesLen;
+
+	/* The removed watches are freed at the end of the loop iteration,
+	 * because there can be pending events for them */
+	struct EventLoop_watch *removed;
+
+	/* The started timers, in a binary heap ordered by deadline */
+	EventLoop_timer **timers;
+	int timersLen;
+	int timersSize;
+
+	/* The functions posted by the other threads */
+	struct EventLoop_task *firstTask;
+	struct EventLoop_task *lastTask;
+};
+
+#ifdef __linux__
+
+static uint32_t EventLoop_to_epoll(int events) {
+	uint32_t result = 0;
+
+	if (events & EVENTLOOP_READ) result |= EPOLLIN | EPOLLRDHUP;
+	if (events & EVENTLOOP_WRITE) result |= EPOLLOUT;
+	if (events & EVENTLOOP_ONESHOT) result |= EPOLLONESHOT;
+
+	return result;
+}
+
+EventLoop *EventLoop_new(lerror **error) {
+	EventLoop *result = NULL;
+	struct epoll_event ev;
+	int fd;
+	int wakeupFd;
+
+	l_assert(error==NULL || *error==NULL);
+
+	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd<0) {
+		lerror_set_sprintf(error, "epoll_create1: %s", strerror(errno));
+		return NULL;
+	}
+
+	wakeupFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (wakeupFd<0) {
+		lerror_set_sprintf(error, "eventfd: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/* The wakeup events are the only ones without a watch */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(fd, EPOLL_CTL_ADD, wakeupFd, &ev)<0) {
+		lerror_set_sprintf(error, "epoll_ctl: %s", strerror(errno));
+		close(wakeupFd);
+		close(fd);
+		return NULL;
+	}
+
+	result = (EventLoop *)lmalloc(sizeof(struct EventLoop));
+	result->epollFd = fd;
+	result->wakeupFd = wakeupFd;
+	result->stopping = LFALSE;
+	result->mutex = lcom_mutex_new();
+	result->watches = NULL;
+	result->watchesLen = 0;
+	result->removed = NULL;
+	result->timers = NULL;
+	result->timersLen = 0;
+	result->timersSize = 0;
+	result->firstTask = NULL;
+	result->lastTask = NULL;
+
+	return result;
+}
+
+lbool EventLoop_add(EventLoop *self, int fd, int events, EventLoop_callback callback, void *ctx, lerror **error) {
+	struct EventLoop_watch *watch;
+	struct epoll_event ev;
+	int newLen;
+
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(callback!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	watch = (struct EventLoop_watch *)lmalloc(sizeof(struct EventLoop_watch));
+	watch->fd = fd;
+	watch->callback = callback;
+	watch->ctx = ctx;
+	watch->nextRemoved = NULL;
+
+	lcom_mutex_lock(self->mutex);
+	if (fd>=self->watchesLen) {
+		newLen = self->watchesLen==0 ? 64 : self->watchesLen;
+		while (newLen<=fd) newLen *= 2;
+		self->watches = (struct EventLoop_watch **)lrealloc(self->watches, sizeof(struct EventLoop_watch *)*newLen);
+		memset(self->watches+self->watchesLen, 0, sizeof(struct EventLoop_watch *)*(newLen-self->watchesLen));
+		self->watchesLen = newLen;
+	}
+	l_assert(self->watches[fd]==NULL);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EventLoop_to_epoll(events);
+	ev.data.ptr = watch;
+	if (epoll_ctl(self->epollFd, EPOLL_CTL_ADD, fd, &ev)<0) {
+		lcom_mutex_unlock(self->mutex);
+		lerror_set_sprintf(error, "epoll_ctl: %s", strerror(errno));
+		lfree(watch);
+		return LFALSE;
+	}
+
+	self->watches[fd] = watch;
+	lcom_mutex_unlock(self->mutex);
+
+	return LTRUE;
+}
+
+lbool EventLoop_modify(EventLoop *self, int fd, int events, lerror **error) {
+	struct epoll_event ev;
+	lbool result = LTRUE;
+
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	lcom_mutex_lock(self->mutex);
+	if (fd<0 || fd>=self->watchesLen || self->watches[fd]==NULL) {
+		lerror_set_sprintf(error, "The file descriptor %i is not watched", fd);
+		result = LFALSE;
+	} else {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EventLoop_to_epoll(events);
+		ev.data.ptr = self->watches[fd];
+		if (epoll_ctl(self->epollFd, EPOLL_CTL_MOD, fd, &ev)<0) {
+			lerror_set_sprintf(error, "epoll_ctl: %s", strerror(errno));
+			result = LFALSE;
+		}
+	}
+	lcom_mutex_unlock(self->mutex);
+
+	return result;
+}
+
+void EventLoop_remove(EventLoop *self, int fd) {
+	struct EventLoop_watch *watch;
+
+	l_assert(self!=NULL);
+
+	lcom_mutex_lock(self->mutex);
+	if (fd>=0 && fd<self->watchesLen && self->watches[fd]!=NULL) {
+		watch = self->watches[fd];
+		self->watches[fd] = NULL;
+		epoll_ctl(self->epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+		/* The pending events of the removed watches are ignored */
+		watch->callback = NULL;
+		watch->nextRemoved = self->removed;
+		self->removed = watch;
+	}
+	lcom_mutex_unlock(self->mutex);
+}
+
+/* Free the watches removed, when there are no more pending events for them */
+static void EventLoop_free_removed(EventLoop *self) {
+	struct EventLoop_watch *watch;
+
+	lcom_mutex_lock(self->mutex);
+	while (self->removed!=NULL) {
+		watch = self->removed;
+		self->removed = watch->nextRemoved;
+		lfree(watch);
+	}
+	lcom_mutex_unlock(self->mutex);
+}
+
+void EventLoop_wakeup(EventLoop *self) {
+	uint64_t one = 1;
+
+	l_assert(self!=NULL);
+
+	if (write(self->wakeupFd, &one, sizeof(one))<0) {
+		/* The counter is already set: the loop will wake up anyway */
+	}
+}
+
+void EventLoop_post(EventLoop *self, EventLoop_task_func func, void *ctx) {
+	struct EventLoop_task *task;
+
+	l_assert(self!=NULL);
+	l_assert(func!=NULL);
+
+	task = (struct EventLoop_task *)lmalloc(sizeof(struct EventLoop_task));
+	task->func = func;
+	task->ctx = ctx;
+	task->next = NULL;
+
+	lcom_mutex_lock(self->mutex);
+	if (self->lastTask==NULL) {
+		self->firstTask = task;
+	} else {
+		self->lastTask->next = task;
+	}
+	self->lastTask = task;
+	lcom_mutex_unlock(self->mutex);
+
+	EventLoop_wakeup(self);
+}
+
+/* Run the functions posted until now */
+static void EventLoop_run_tasks(EventLoop *self) {
+	struct EventLoop_task *task;
+
+	lcom_mutex_lock(self->mutex);
+	task = self->firstTask;
+	self->firstTask = NULL;
+	self->lastTask = NULL;
+	lcom_mutex_unlock(self->mutex);
+
+	while (task!=NULL) {
+		struct EventLoop_task *next = task->next;
+		task->func(self, task->ctx);
+		lfree(task);
+		task = next;
+	}
+}
+
+/* Timers heap {{{ */
+
+static void EventLoop_heap_set(EventLoop *self, int idx, EventLoop_timer *timer) {
+	self->timers[idx] = timer;
+	timer->heapIndex = idx;
+}
+
+static void EventLoop_heap_up(EventLoop *self, int idx) {
+	EventLoop_timer *timer = self->timers[idx];
+	int parent;
+
+	while (idx>0) {
+		parent = (idx-1)/2;
+		if (self->timers[parent]->deadline<=timer->deadline) break;
+		EventLoop_heap_set(self, idx, self->timers[parent]);
+		idx = parent;
+	}
+	EventLoop_heap_set(self, idx, timer);
+}
+
+static void EventLoop_heap_down(EventLoop *self, int idx) {
+	EventLoop_timer *timer = self->timers[idx];
+	int child;
+
+	while ((child = idx*2+1)<self->timersLen) {
+		if (child+1<self->timersLen && self->timers[child+1]->deadline<self->timers[child]->deadline) {
+			child++;
+		}
+		if (timer->deadline<=self->timers[child]->deadline) break;
+		EventLoop_heap_set(self, idx, self->timers[child]);
+		idx = child;
+	}
+	EventLoop_heap_set(self, idx, timer);
+}
+
+static void EventLoop_heap_push(EventLoop *self, EventLoop_timer *timer) {
+	if (self->timersLen==self->timersSize) {
+		self->timersSize = self->timersSize==0 ? 16 : self->timersSize*2;
+		self->timers = (EventLoop_timer **)lrealloc(self->timers, sizeof(EventLoop_timer *)*self->timersSize);
+	}
+	self->timers[self->timersLen++] = timer;
+	EventLoop_heap_up(self, self->timersLen-1);
+}
+
+static void EventLoop_heap_remove(EventLoop *self, EventLoop_timer *timer) {
+	int idx = timer->heapIndex;
+	EventLoop_timer *moved;
+
+	timer->heapIndex = -1;
+	self->timersLen--;
+	if (idx==self->timersLen) return;
+
+	/* The last timer takes the free place and is moved where it belongs */
+	moved = self->timers[self->timersLen];
+	EventLoop_heap_set(self, idx, moved);
+	EventLoop_heap_up(self, idx);
+	EventLoop_heap_down(self, moved->heapIndex);
+}
+
+/* }}} */
+
+EventLoop_timer *EventLoop_timer_new(EventLoop *loop, EventLoop_timer_callback callback, void *ctx) {
+	EventLoop_timer *result;
+
+	l_assert(loop!=NULL);
+	l_assert(callback!=NULL);
+
+	result = (EventLoop_timer *)lmalloc(sizeof(struct EventLoop_timer));
+	result->loop = loop;
+	result->callback = callback;
+	result->ctx = ctx;
+	result->deadline = 0;
+	result->repeat = 0;
+	result->heapIndex = -1;
+
+	return result;
+}
+
+void EventLoop_timer_start(EventLoop_timer *self, int millis, int repeatMillis) {
+	EventLoop *loop;
+	lbool first;
+
+	l_assert(self!=NULL);
+	l_assert(millis>=0);
+	l_assert(repeatMillis>=0);
+
+	loop = self->loop;
+	lcom_mutex_lock(loop->mutex);
+	if (self->heapIndex>=0) {
+		EventLoop_heap_remove(loop, self);
+	}
+	self->deadline = l_monotonic_time_micros() + millis*1000LL;
+	self->repeat = repeatMillis;
+	EventLoop_heap_push(loop, self);
+	first = self->heapIndex==0;
+	lcom_mutex_unlock(loop->mutex);
+
+	/* The loop could be waiting for a later deadline */
+	if (first) {
+		EventLoop_wakeup(loop);
+	}
+}
+
+void EventLoop_timer_stop(EventLoop_timer *self) {
+	l_assert(self!=NULL);
+
+	lcom_mutex_lock(self->loop->mutex);
+	if (self->heapIndex>=0) {
+		EventLoop_heap_remove(self->loop, self);
+	}
+	lcom_mutex_unlock(self->loop->mutex);
+}
+
+lbool EventLoop_timer_is_active(EventLoop_timer *self) {
+	lbool result;
+
+	l_assert(self!=NULL);
+
+	lcom_mutex_lock(self->loop->mutex);
+	result = self->heapIndex>=0;
+	lcom_mutex_unlock(self->loop->mutex);
+
+	return result;
+}
+
+void EventLoop_timer_destroy(EventLoop_timer *self) {
+	if (self==NULL) return;
+
+	EventLoop_timer_stop(self);
+	lfree(self);
+}
+
+/* Milliseconds to wait for the first timer, -1 if there are no timers */
+static int EventLoop_next_timeout(EventLoop *self) {
+	long long remaining;
+	int result = -1;
+
+	lcom_mutex_lock(self->mutex);
+	if (self->timersLen>0) {
+		remaining = self->timers[0]->deadline - l_monotonic_time_micros();
+		if (remaining<=0) {
+			result = 0;
+		} else if (remaining>=2000000000LL) {
+			result = 2000000;
+		} else {
+			result = (int)((remaining+999)/1000);
+		}
+	}
+	lcom_mutex_unlock(self->mutex);
+
+	return result;
+}
+
+/* Call the expired timers. The repeating timers started again by this
+ * function are called in the next iteration */
+static void EventLoop_run_timers(EventLoop *self) {
+	long long now = l_monotonic_time_micros();
+	EventLoop_timer *timer;
+	EventLoop_timer_callback callback;
+	void *ctx;
+
+	lcom_mutex_lock(self->mutex);
+	while (self->timersLen>0 && self->timers[0]->deadline<=now) {
+		timer = self->timers[0];
+		EventLoop_heap_remove(self, timer);
+		if (timer->repeat>0) {
+			timer->deadline = now + timer->repeat*1000LL;
+			EventLoop_heap_push(self, timer);
+		}
+
+		/* The callback can start, stop or destroy the timer */
+		callback = timer->callback;
+		ctx = timer->ctx;
+		lcom_mutex_unlock(self->mutex);
+		callback(self, timer, ctx);
+		lcom_mutex_lock(self->mutex);
+	}
+	lcom_mutex_unlock(self->mutex);
+}
+
+void EventLoop_run(EventLoop *self) {
+	struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+	struct EventLoop_watch *watch;
+	uint64_t counter;
+	int received;
+	int n;
+	int i;
+
+	l_assert(self!=NULL);
+
+	while (!self->stopping) {
+		n = epoll_wait(self->epollFd, events, EVENTLOOP_MAX_EVENTS, EventLoop_next_timeout(self));
+
+		for (i=0; i<n; i++) {
+			watch = (struct EventLoop_watch *)events[i].data.ptr;
+			if (watch==NULL) {
+				if (read(self->wakeupFd, &counter, sizeof(counter))<0) {
+					/* Already reset */
+				}
+				continue;
+			}
+
+			received = 0;
+			if (events[i].events & EPOLLIN) received |= EVENTLOOP_READ;
+			if (events[i].events & EPOLLOUT) received |= EVENTLOOP_WRITE;
+			if (events[i].events & (EPOLLERR|EPOLLHUP|EPOLLRDHUP)) received |= EVENTLOOP_ERROR;
+
+			/* The watch can be removed by the previous callbacks */
+			if (watch->callback!=NULL) {
+				watch->callback(self, watch->fd, received, watch->ctx);
+			}
+		}
+
+		EventLoop_run_tasks(self);
+		EventLoop_run_timers(self);
+
+		if (self->removed!=NULL) {
+			EventLoop_free_removed(self);
+		}
+	}
+}
+
+void EventLoop_stop(EventLoop *self) {
+	l_assert(self!=NULL);
+	self->stopping = LTRUE;
+	EventLoop_wakeup(self);
+}
+
+void EventLoop_destroy(EventLoop *self) {
+	struct EventLoop_task *task;
+	int i;
+
+	if (self==NULL) return;
+
+	for (i=0; i<self->watchesLen; i++) {
+		lfree(self->watches[i]);
+	}
+	lfree(self->watches);
+	EventLoop_free_removed(self);
+
+	/* The timers belong to their owners */
+	for (i=0; i<self->timersLen; i++) {
+		self->timers[i]->heapIndex = -1;
+	}
+	lfree(self->timers);
+
+	while (self->firstTask!=NULL) {
+		task = self->firstTask;
+		self->firstTask = task->next;
+		lfree(task);
+	}
+
+	close(self->wakeupFd);
+	close(self->epollFd);
+	lcom_mutex_destroy(self->mutex);
+	lfree(self);
+}
+
+#else
+
+EventLoop *EventLoop_new(lerror **error) {
+	l_assert(error==NULL || *error==NULL);
+	lerror_set(error, "The event loop is not supported on this platform");
+	return NULL;
+}
+
+lbool EventLoop_add(EventLoop *self, int fd, int events, EventLoop_callback callback, void *ctx, lerror **error) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+lbool EventLoop_modify(EventLoop *self, int fd, int events, lerror **error) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+void EventLoop_remove(EventLoop *self, int fd) {
+	l_assert(self!=NULL);
+}
+
+void EventLoop_wakeup(EventLoop *self) {
+	l_assert(self!=NULL);
+}
+
+void EventLoop_post(EventLoop *self, EventLoop_task_func func, void *ctx) {
+	l_assert(self!=NULL);
+}
+
+EventLoop_timer *EventLoop_timer_new(EventLoop *loop, EventLoop_timer_callback callback, void *ctx) {
+	l_assert(loop!=NULL);
+	return NULL;
+}
+
+void EventLoop_timer_start(EventLoop_timer *self, int millis, int repeatMillis) {
+	l_assert(self!=NULL);
+}
+
+void EventLoop_timer_stop(EventLoop_timer *self) {
+	l_assert(self!=NULL);
+}
+
+lbool EventLoop_timer_is_active(EventLoop_timer *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+void EventLoop_timer_destroy(EventLoop_timer *self) {
+}
+
+void EventLoop_run(EventLoop *self) {
+	l_assert(self!=NULL);
+}
+
+void EventLoop_stop(EventLoop *self) {
+	l_assert(self!=NULL);
+}
+
+void EventLoop_destroy(EventLoop *self) {
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef __COMMONLIB_EVLOOP_H
+#define __COMMONLIB_EVLOOP_H
+
+#include "lerror.h"
+
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+/**
+ * Class: EventLoop
+ * An event loop dispatching the readiness of file descriptors to
+ * callbacks. It's implemented with epoll and is only available on Linux.
+ *
+ * The loop runs in the thread calling <EventLoop_run>. The file
+ * descriptors can be added, modified and removed from any thread, and the
+ * other threads can wake the loop up to run a function (see
+ * <EventLoop_post>).
+ */
+typedef struct EventLoop EventLoop;
+
+/**
+ * Class: EventLoop_timer
+ * A timer calling a function in the event loop thread after a delay,
+ * once or periodically. The timers are kept in a heap, so there can be
+ * one for every connection.
+ */
+typedef struct EventLoop_timer EventLoop_timer;
+
+/**
+ * Constants: EventLoop events
+ * EVENTLOOP_READ - The file descriptor is readable
+ * EVENTLOOP_WRITE - The file descriptor is writable
+ * EVENTLOOP_ONESHOT - The file descriptor is disabled after the first
+ *     event and must be enabled again with <EventLoop_modify>
+ * EVENTLOOP_ERROR - The peer has closed the connection or an error happened
+ *     (only received by the callbacks)
+ */
+#define EVENTLOOP_READ 1
+#define EVENTLOOP_WRITE 2
+#define EVENTLOOP_ONESHOT 4
+#define EVENTLOOP_ERROR 8
+
+/**
+ * Type: EventLoop_callback
+ * The function called when a file descriptor is ready
+ * Parameters:
+ *     loop - The event loop
+ *     fd - The file descriptor
+ *     events - The received events
+ *     ctx - The context passed to <EventLoop_add>
+ */
+typedef void (*EventLoop_callback)(EventLoop *loop, int fd, int events, void *ctx);
+
+/**
+ * Type: EventLoop_timer_callback
+ * The function called when a timer expires
+ * Parameters:
+ *     loop - The event loop
+ *     timer - The timer, which can be started again or destroyed
+ *     ctx - The context passed to <EventLoop_timer_new>
+ */
+typedef void (*EventLoop_timer_callback)(EventLoop *loop, EventLoop_timer *timer, void *ctx);
+
+/**
+ * Type: EventLoop_task_func
+ * A function posted to the event loop
+ * Parameters:
+ *     loop - The event loop
+ *     ctx - The context passed to <EventLoop_post>
+ */
+typedef void (*EventLoop_task_func)(EventLoop *loop, void *ctx);
+
+/**
+ * Function: EventLoop_new
+ * Create a new event loop
+ * Returns:
+ *     The event loop or NULL if it can't be created
+ */
+EventLoop *EventLoop_new(lerror **error);
+
+/**
+ * Function: EventLoop_add
+ * Watch a file descriptor
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ *     fd - The file descriptor, usually in non-blocking mode
+ *     events - The events to watch (EVENTLOOP_READ, EVENTLOOP_WRITE,
+ *         EVENTLOOP_ONESHOT)
+ *     callback - The function called when the file descriptor is ready
+ *     ctx - Passed to the callback
+ * Returns:
+ *     LTRUE if the file descriptor is watched, LFALSE otherwise
+ */
+lbool EventLoop_add(EventLoop *self, int fd, int events, EventLoop_callback callback, void *ctx, lerror **error);
+
+/**
+ * Function: EventLoop_modify
+ * Change the events watched for a file descriptor, enabling it again
+ * if it was disabled by a one-shot event
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ *     fd - The file descriptor, already watched
+ *     events - The events to watch
+ * Returns:
+ *     LTRUE if the events were changed, LFALSE otherwise
+ */
+lbool EventLoop_modify(EventLoop *self, int fd, int events, lerror **error);
+
+/**
+ * Function: EventLoop_remove
+ * Stop watching a file descriptor. This must be done before closing it.
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ *     fd - The file descriptor
+ */
+void EventLoop_remove(EventLoop *self, int fd);
+
+/**
+ * Function: EventLoop_wakeup
+ * Wake the event loop up if it is waiting for events, so it runs
+ * the posted functions and checks the timers. Can be called from any thread.
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ */
+void EventLoop_wakeup(EventLoop *self);
+
+/**
+ * Function: EventLoop_post
+ * Call a function in the event loop thread, after the pending events.
+ * The functions are called in the order they were posted. Can be called
+ * from any thread.
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ *     func - The function
+ *     ctx - Passed to the function
+ */
+void EventLoop_post(EventLoop *self, EventLoop_task_func func, void *ctx);
+
+/**
+ * Function: EventLoop_timer_new
+ * Create a stopped timer
+ * Parameters:
+ *     loop - The event loop (must be not NULL)
+ *     callback - The function called when the timer expires
+ *     ctx - Passed to the callback
+ * Returns:
+ *     The timer, which must be destroyed before the event loop
+ */
+EventLoop_timer *EventLoop_timer_new(EventLoop *loop, EventLoop_timer_callback callback, void *ctx);
+
+/**
+ * Function: EventLoop_timer_start
+ * Start a timer, or restart it if it was already started. Can be called
+ * from any thread.
+ * Parameters:
+ *     self - The timer (must be not NULL)
+ *     millis - The delay in milliseconds
+ *     repeatMillis - The interval, in milliseconds, between the following
+ *         calls, or zero to call the function only once
+ */
+void EventLoop_timer_start(EventLoop_timer *self, int millis, int repeatMillis);
+
+/**
+ * Function: EventLoop_timer_stop
+ * Stop a timer. Can be called from any thread, but a callback can still
+ * be running in the event loop thread.
+ * Parameters:
+ *     self - The timer (must be not NULL)
+ */
+void EventLoop_timer_stop(EventLoop_timer *self);
+
+/**
+ * Function: EventLoop_timer_is_active
+ * Check if a timer is started
+ * Parameters:
+ *     self - The timer (must be not NULL)
+ */
+lbool EventLoop_timer_is_active(EventLoop_timer *self);
+
+/**
+ * Function: EventLoop_timer_destroy
+ * Stop and destroy a timer. Must be called in the event loop thread, or
+ * when the loop is not running.
+ * Parameters:
+ *     self - The timer (may be NULL)
+ */
+void EventLoop_timer_destroy(EventLoop_timer *self);
+
+/**
+ * Function: EventLoop_run
+ * Dispatch the events until <EventLoop_stop> is called
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ */
+void EventLoop_run(EventLoop *self);
+
+/**
+ * Function: EventLoop_stop
+ * Stop the event loop, after the callbacks of the events already
+ * received. Can be called from any thread and from the callbacks.
+ * Parameters:
+ *     self - The event loop (must be not NULL)
+ */
+void EventLoop_stop(EventLoop *self);
+
+/**
+ * Function: EventLoop_destroy
+ * Destroy the event loop. The file descriptors are not closed and
+ * the functions posted but not called yet are discarded.
+ * Parameters:
+ *     self - The event loop (may be NULL)
+ */
+void EventLoop_destroy(EventLoop *self);
+
+#endif
@@ -33,6 +33,9 @@ Author: Leonardo Cecchi <leonardoce@interfree.it>
 #ifdef _WIN32
 #include <Windows.h>
 #else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 #endif
 
@@ -109,3 +112,46 @@ lstring* lcreatetempname_f(lstring *buffer) {
 	return lstring_from_cstr_f(buffer, tmpnam(NULL));
 #endif
 }
+
+#ifndef _WIN32
+long long send_file_to_socket(const char *fname, TCPSocket *socket, lerror **error) {
+	long long result;
+	int fd;
+
+	l_assert(fname!=NULL);
+	l_assert(socket!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd<0) {
+		lerror_set_sprintf(error, "Can't open file %s: %s", fname, strerror(errno));
+		return -1;
+	}
+
+	result = TCPSocket_send_file(socket, fd, 0, -1, error);
+	close(fd);
+	return result;
+}
+
+long long recv_file_from_socket(const char *fname, TCPSocket *socket, long long len, lerror **error) {
+	long long result;
+	int fd;
+
+	l_assert(fname!=NULL);
+	l_assert(socket!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd<0) {
+		lerror_set_sprintf(error, "IO error writing to %s: %s", fname, strerror(errno));
+		return -1;
+	}
+
+	result = TCPSocket_recv_to_file(socket, fd, 0, len, error);
+	if (close(fd)<0 && result>=0) {
+		lerror_set_sprintf(error, "IO error writing to %s: %s", fname, strerror(errno));
+		result = -1;
+	}
+	return result;
+}
+#endif
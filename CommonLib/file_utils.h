@@ -33,6 +33,9 @@ Author: Leonardo Cecchi <leonardoce@interfree.it>
 
 #include "lstring.h"
 #include "lerror.h"
+#ifndef _WIN32
+#include "net_socket.h"
+#endif
 
 /**
  * Function: create_lstring_from_file
@@ -69,4 +72,36 @@ lbool file_exists(const char *fname);
  */
 lstring* lcreatetempname_f(lstring *buffer);
 
+#ifndef _WIN32
+/**
+ * Function: send_file_to_socket
+ * Send all the file contents to a socket without reading them in memory
+ * (see <TCPSocket_send_file>)
+ *
+ * Parameters:
+ *    fname - The file name (can not be NULL)
+ *    socket - The socket (can not be NULL)
+ *
+ * Returns:
+ *    The number of bytes sent or -1 on error
+ */
+long long send_file_to_socket(const char *fname, TCPSocket *socket, lerror **error);
+
+/**
+ * Function: recv_file_from_socket
+ * Overwrite the named file with the data received from a socket
+ * (see <TCPSocket_recv_to_file>)
+ *
+ * Parameters:
+ *    fname - The file name (can not be NULL)
+ *    socket - The socket (can not be NULL)
+ *    len - The number of bytes to receive, or -1 to receive until the
+ *          connection is closed
+ *
+ * Returns:
+ *    The number of bytes written or -1 on error
+ */
+long long recv_file_from_socket(const char *fname, TCPSocket *socket, long long len, lerror **error);
+#endif
+
 #endif
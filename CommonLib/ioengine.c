@@ -0,0 +1,956 @@
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "ioengine.h"
+#include "lcross.h"
+#include "llogging.h"
+#include "lmemory.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* How many times a full submission queue is submitted again, draining the
+ * completion queue, before failing the new operation */
+#define IOENGINE_URING_SUBMIT_ATTEMPTS 16
+#endif
+
+enum IoEngine_op_type {
+	IOENGINE_ACCEPT,
+	IOENGINE_RECV,
+	IOENGINE_SEND,
+	IOENGINE_READ,
+	IOENGINE_READ_FIXED,
+	IOENGINE_WRITE_FIXED,
+
+	/* A receive completed with the data already buffered by the
+	 * socket, whose length is in len */
+	IOENGINE_BUFFERED
+};
+
+struct IoEngine_op {
+	enum IoEngine_op_type type;
+	int fd;
+	char *buf;
+	int len;
+	long long offset;
+	int bufIndex;
+
+	IoEngine_callback callback;
+	IoEngine_accept_callback acceptCallback;
+	void *ctx;
+
+	/* The socket whose counters are updated, or the listening socket
+	 * of the accepted connection */
+	TCPSocket *socket;
+	TCPListenSocket *listener;
+
+	/* The address of the accepted connection */
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+
+	/* The result of a completed operation whose callback is not
+	 * called yet */
+	int result;
+
+	struct IoEngine_op *next;
+	struct IoEngine_op *prev;
+};
+
+struct IoEngine {
+	lbool stopped;
+	int inFlight;
+
+	/* The operations completed are reused */
+	struct IoEngine_op *freeOps;
+
+	/* The registered buffers */
+	struct iovec *buffers;
+	int bufferCount;
+
+	/* The operations waiting for their sockets, when poll is used, or
+	 * submitted to the kernel, when io_uring is used */
+	struct IoEngine_op *first;
+	struct IoEngine_op *last;
+
+	/* The descriptors polled by every run, grown when needed */
+	struct pollfd *pfds;
+	int pfdsCapacity;
+
+	lbool uring;
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	int ringFd;
+	unsigned sqEntries;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+	lbool extArg;
+	struct __kernel_timespec timeout;
+
+	/* The operations taken from the completion queue, or failed
+	 * before their submission, whose callbacks will be called by the
+	 * next run */
+	struct IoEngine_op *completed;
+	struct IoEngine_op *completedLast;
+#endif
+};
+
+static struct IoEngine_op *IoEngine_op_new(IoEngine *self, enum IoEngine_op_type type, int fd) {
+	struct IoEngine_op *op = self->freeOps;
+
+	if (op!=NULL) {
+		self->freeOps = op->next;
+	} else {
+		op = (struct IoEngine_op *)lmalloc(sizeof(struct IoEngine_op));
+	}
+
+	memset(op, 0, sizeof(struct IoEngine_op));
+	op->type = type;
+	op->fd = fd;
+	return op;
+}
+
+static void IoEngine_op_free(IoEngine *self, struct IoEngine_op *op) {
+	op->next = self->freeOps;
+	self->freeOps = op;
+}
+
+/* Remove an operation submitted to io_uring from the list of the
+ * operations in progress */
+static void IoEngine_unlink(IoEngine *self, struct IoEngine_op *op) {
+	if (!self->uring) {
+		return;
+	}
+
+	if (op->prev!=NULL) {
+		op->prev->next = op->next;
+	} else {
+		self->first = op->next;
+	}
+	if (op->next!=NULL) {
+		op->next->prev = op->prev;
+	} else {
+		self->last = op->prev;
+	}
+}
+
+/* Call the callback of a completed operation and reuse it */
+static void IoEngine_complete(IoEngine *self, struct IoEngine_op *op, int result) {
+	char ip[NI_MAXHOST];
+	TCPSocket *socket = NULL;
+	IoEngine_callback callback = op->callback;
+	IoEngine_accept_callback acceptCallback = op->acceptCallback;
+	void *ctx = op->ctx;
+	lerror *error = NULL;
+
+	self->inFlight--;
+
+	if (op->type==IOENGINE_ACCEPT && result>=0) {
+		if (0!=getnameinfo((struct sockaddr *)&op->addr, op->addrLen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST)) {
+			strcpy(ip, "unknown");
+		}
+		socket = TCPListenSocket_adopt(op->listener, result, ip, &error);
+		result = 0;
+		if (socket==NULL) {
+			l_error("Can't set up the accepted connection: %s", error->message);
+			lerror_delete(&error);
+			result = -EIO;
+		}
+	} else if (op->type==IOENGINE_RECV) {
+		TCPSocket_add_recv_stats(op->socket, result);
+	} else if (op->type==IOENGINE_SEND) {
+		TCPSocket_add_send_stats(op->socket, result, op->len);
+	} else if (op->type==IOENGINE_BUFFERED) {
+		result = op->len;
+	}
+
+	IoEngine_op_free(self, op);
+
+	if (acceptCallback!=NULL) {
+		acceptCallback(self, socket, result, ctx);
+	} else {
+		callback(self, result, ctx);
+	}
+}
+
+/* Operations with poll */
+
+/* Check if an operation must wait for its file descriptor to be ready */
+static lbool IoEngine_op_waits(struct IoEngine_op *op) {
+	return op->type==IOENGINE_ACCEPT || op->type==IOENGINE_RECV || op->type==IOENGINE_SEND ||
+		((op->type==IOENGINE_READ_FIXED || op->type==IOENGINE_WRITE_FIXED) && op->offset<0);
+}
+
+/* Execute an operation, returning its result or -EAGAIN if it must wait */
+static int IoEngine_op_execute(struct IoEngine_op *op) {
+	ssize_t rc = -1;
+	char *fixed = NULL;
+
+	if (op->type==IOENGINE_READ_FIXED || op->type==IOENGINE_WRITE_FIXED) {
+		fixed = op->buf;
+	}
+
+	switch (op->type) {
+	case IOENGINE_ACCEPT:
+		op->addrLen = sizeof(op->addr);
+#ifdef __linux__
+		rc = accept4(op->fd, (struct sockaddr *)&op->addr, &op->addrLen, SOCK_CLOEXEC);
+#else
+		rc = accept(op->fd, (struct sockaddr *)&op->addr, &op->addrLen);
+#endif
+		break;
+	case IOENGINE_RECV:
+		rc = recv(op->fd, op->buf, op->len, MSG_DONTWAIT);
+		break;
+	case IOENGINE_SEND:
+		rc = send(op->fd, op->buf, op->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		break;
+	case IOENGINE_READ:
+		rc = pread(op->fd, op->buf, op->len, (off_t)op->offset);
+		break;
+	case IOENGINE_READ_FIXED:
+		rc = op->offset<0 ? read(op->fd, fixed, op->len) : pread(op->fd, fixed, op->len, (off_t)op->offset);
+		break;
+	case IOENGINE_WRITE_FIXED:
+		rc = op->offset<0 ? write(op->fd, fixed, op->len) : pwrite(op->fd, fixed, op->len, (off_t)op->offset);
+		break;
+	case IOENGINE_BUFFERED:
+		rc = op->len;
+		break;
+	}
+
+	if (rc<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) {
+		return -EAGAIN;
+	} else if (rc<0) {
+		return -errno;
+	}
+	return (int)rc;
+}
+
+static int IoEngine_poll_run_once(IoEngine *self, int timeoutMillis) {
+	struct pollfd *pfds = self->pfds;
+	struct IoEngine_op *op;
+	struct IoEngine_op *next;
+	struct IoEngine_op *ops = self->first;
+	struct IoEngine_op *done = NULL;
+	struct IoEngine_op **doneTail = &done;
+	int count = 0;
+	int nPoll = 0;
+	int nDone = 0;
+	lbool immediate = LFALSE;
+	int i;
+	int rc;
+
+	if (ops==NULL) {
+		return 0;
+	}
+
+	/* The operations started by the callbacks are queued after
+	 * the ones still waiting */
+	self->first = NULL;
+	self->last = NULL;
+
+	for (op=ops; op!=NULL; op=op->next) {
+		count++;
+	}
+	if (count>self->pfdsCapacity) {
+		self->pfdsCapacity = count>2*self->pfdsCapacity ? count : 2*self->pfdsCapacity;
+		self->pfds = (struct pollfd *)lrealloc(self->pfds, sizeof(struct pollfd)*self->pfdsCapacity);
+		pfds = self->pfds;
+	}
+
+	for (op=ops; op!=NULL; op=op->next) {
+		if (IoEngine_op_waits(op)) {
+			pfds[nPoll].fd = op->fd;
+			pfds[nPoll].events = (op->type==IOENGINE_SEND || op->type==IOENGINE_WRITE_FIXED) ? POLLOUT : POLLIN;
+			pfds[nPoll].revents = 0;
+			nPoll++;
+		} else {
+			immediate = LTRUE;
+		}
+	}
+
+	if (nPoll>0) {
+		rc = poll(pfds, nPoll, immediate ? 0 : timeoutMillis);
+		if (rc<0 && errno!=EINTR) {
+			l_error("poll: %s", strerror(errno));
+		}
+	}
+
+	for (op=ops, i=0; op!=NULL; op=next) {
+		next = op->next;
+		op->next = NULL;
+
+		rc = -EAGAIN;
+		if (!IoEngine_op_waits(op)) {
+			rc = IoEngine_op_execute(op);
+		} else if (pfds[i++].revents!=0) {
+			rc = IoEngine_op_execute(op);
+		}
+
+		if (rc==(-EAGAIN)) {
+			if (self->last!=NULL) {
+				self->last->next = op;
+			} else {
+				self->first = op;
+			}
+			self->last = op;
+		} else {
+			op->result = rc;
+			nDone++;
+			*doneTail = op;
+			doneTail = &op->next;
+		}
+	}
+
+	for (op=done; op!=NULL; op=next) {
+		next = op->next;
+		IoEngine_complete(self, op, op->result);
+	}
+
+	return nDone;
+}
+
+/* Operations with io_uring */
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+
+static lbool IoEngine_uring_setup(IoEngine *self, int queueSize) {
+	struct io_uring_params params;
+	char *sq;
+	char *cq;
+
+	memset(&params, 0, sizeof(params));
+	self->ringFd = syscall(__NR_io_uring_setup, queueSize, &params);
+	if (self->ringFd<0) {
+		return LFALSE;
+	}
+
+	/* The kernels without FAST_POLL (before 5.7) lack some of the
+	 * operations or execute them in worker threads */
+	if (!(params.features & IORING_FEAT_FAST_POLL)) {
+		close(self->ringFd);
+		return LFALSE;
+	}
+	self->extArg = (params.features & IORING_FEAT_EXT_ARG)!=0;
+
+	self->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	self->cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (self->cqRingSize>self->sqRingSize) {
+			self->sqRingSize = self->cqRingSize;
+		}
+		self->cqRingSize = self->sqRingSize;
+	}
+
+	self->sqRing = mmap(NULL, self->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->ringFd, IORING_OFF_SQ_RING);
+	if (self->sqRing==MAP_FAILED) {
+		close(self->ringFd);
+		return LFALSE;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		self->cqRing = self->sqRing;
+	} else {
+		self->cqRing = mmap(NULL, self->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->ringFd, IORING_OFF_CQ_RING);
+		if (self->cqRing==MAP_FAILED) {
+			munmap(self->sqRing, self->sqRingSize);
+			close(self->ringFd);
+			return LFALSE;
+		}
+	}
+
+	self->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+	self->sqes = (struct io_uring_sqe *)mmap(NULL, self->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->ringFd, IORING_OFF_SQES);
+	if (self->sqes==MAP_FAILED) {
+		if (self->cqRing!=self->sqRing) {
+			munmap(self->cqRing, self->cqRingSize);
+		}
+		munmap(self->sqRing, self->sqRingSize);
+		close(self->ringFd);
+		return LFALSE;
+	}
+
+	sq = (char *)self->sqRing;
+	cq = (char *)self->cqRing;
+	self->sqEntries = params.sq_entries;
+	self->sqHead = (unsigned *)(sq + params.sq_off.head);
+	self->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	self->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	self->sqArray = (unsigned *)(sq + params.sq_off.array);
+	self->cqHead = (unsigned *)(cq + params.cq_off.head);
+	self->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	self->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	self->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return LTRUE;
+}
+
+static void IoEngine_uring_destroy(IoEngine *self) {
+	munmap(self->sqes, self->sqesSize);
+	if (self->cqRing!=self->sqRing) {
+		munmap(self->cqRing, self->cqRingSize);
+	}
+	munmap(self->sqRing, self->sqRingSize);
+	close(self->ringFd);
+}
+
+/* The number of queued operations not yet consumed by the kernel */
+static unsigned IoEngine_uring_unsubmitted(IoEngine *self) {
+	return *self->sqTail - __atomic_load_n(self->sqHead, __ATOMIC_ACQUIRE);
+}
+
+static int IoEngine_uring_enter(IoEngine *self, unsigned minComplete, unsigned flags, void *arg, size_t argSize) {
+	return (int)syscall(__NR_io_uring_enter, self->ringFd, IoEngine_uring_unsubmitted(self), minComplete, flags, arg, argSize);
+}
+
+/* Move an operation that won't be submitted or that was completed by the
+ * kernel to the list of the operations to dispatch */
+static void IoEngine_uring_set_completed(IoEngine *self, struct IoEngine_op *op, int result) {
+	IoEngine_unlink(self, op);
+	op->result = result;
+	op->next = NULL;
+	if (self->completedLast!=NULL) {
+		self->completedLast->next = op;
+	} else {
+		self->completed = op;
+	}
+	self->completedLast = op;
+}
+
+/* Take the entries of the completion queue, so the kernel can post new
+ * ones. The operations are only freed if discard is set. */
+static void IoEngine_uring_drain(IoEngine *self, lbool discard) {
+	struct io_uring_cqe *cqe;
+	struct IoEngine_op *op;
+	unsigned head = *self->cqHead;
+
+	while (head!=__atomic_load_n(self->cqTail, __ATOMIC_ACQUIRE)) {
+		cqe = &self->cqes[head & *self->cqMask];
+		op = (struct IoEngine_op *)(uintptr_t)cqe->user_data;
+
+		/* The timeouts and the cancellations have no operation */
+		if (op!=NULL && discard) {
+			self->inFlight--;
+			IoEngine_unlink(self, op);
+			lfree(op);
+		} else if (op!=NULL) {
+			IoEngine_uring_set_completed(self, op, cqe->res);
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(self->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Get a free submission entry, submitting the queued ones if the queue is
+ * full. The kernel refuses new entries, with EBUSY, while its completion
+ * queue is full: the completions are drained and the submission is tried
+ * again a few times. Returns NULL if the queue is still full. */
+static struct io_uring_sqe *IoEngine_uring_get_sqe(IoEngine *self) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+	int attempts;
+
+	for (attempts=0; IoEngine_uring_unsubmitted(self)>=self->sqEntries; attempts++) {
+		if (attempts==IOENGINE_URING_SUBMIT_ATTEMPTS) {
+			l_error("io_uring: the submission queue is full");
+			return NULL;
+		}
+
+		IoEngine_uring_drain(self, LFALSE);
+		if (IoEngine_uring_enter(self, 0, 0, NULL, 0)<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+			l_error("io_uring_enter: %s", strerror(errno));
+		}
+	}
+
+	index = *self->sqTail & *self->sqMask;
+	sqe = &self->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	self->sqArray[index] = index;
+	return sqe;
+}
+
+/* Make the entry returned by IoEngine_uring_get_sqe visible to the kernel */
+static void IoEngine_uring_push_sqe(IoEngine *self) {
+	__atomic_store_n(self->sqTail, *self->sqTail+1, __ATOMIC_RELEASE);
+}
+
+static void IoEngine_uring_queue(IoEngine *self, struct IoEngine_op *op) {
+	struct io_uring_sqe *sqe = IoEngine_uring_get_sqe(self);
+
+	if (sqe==NULL) {
+		IoEngine_uring_set_completed(self, op, -EBUSY);
+		return;
+	}
+
+	sqe->fd = op->fd;
+	sqe->user_data = (unsigned long long)(uintptr_t)op;
+
+	switch (op->type) {
+	case IOENGINE_ACCEPT:
+		op->addrLen = sizeof(op->addr);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->addr = (unsigned long long)(uintptr_t)&op->addr;
+		sqe->off = (unsigned long long)(uintptr_t)&op->addrLen;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		break;
+	case IOENGINE_RECV:
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+		sqe->len = op->len;
+		break;
+	case IOENGINE_SEND:
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+		sqe->len = op->len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		break;
+	case IOENGINE_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+		sqe->len = op->len;
+		sqe->off = (unsigned long long)op->offset;
+		break;
+	case IOENGINE_READ_FIXED:
+	case IOENGINE_WRITE_FIXED:
+		sqe->opcode = op->type==IOENGINE_READ_FIXED ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+		sqe->len = op->len;
+		sqe->off = (unsigned long long)op->offset;
+		sqe->buf_index = op->bufIndex;
+		break;
+	case IOENGINE_BUFFERED:
+		sqe->opcode = IORING_OP_NOP;
+		sqe->fd = -1;
+		break;
+	}
+
+	IoEngine_uring_push_sqe(self);
+}
+
+/* Call the callbacks of the completed operations. The operations
+ * started by the callbacks and completed at once are dispatched too. */
+static int IoEngine_uring_reap(IoEngine *self) {
+	struct IoEngine_op *op;
+	int count = 0;
+
+	IoEngine_uring_drain(self, LFALSE);
+
+	while (self->completed!=NULL) {
+		op = self->completed;
+		self->completed = op->next;
+		if (self->completed==NULL) {
+			self->completedLast = NULL;
+		}
+
+		IoEngine_complete(self, op, op->result);
+		count++;
+	}
+
+	return count;
+}
+
+static int IoEngine_uring_run_once(IoEngine *self, int timeoutMillis) {
+	struct io_uring_getevents_arg arg;
+	struct io_uring_sqe *sqe;
+	unsigned flags = 0;
+	unsigned minComplete = 0;
+	lbool ready;
+	int rc;
+
+	ready = self->completed!=NULL || __atomic_load_n(self->cqTail, __ATOMIC_ACQUIRE)!=*self->cqHead;
+	if (!ready && timeoutMillis!=0) {
+		flags = IORING_ENTER_GETEVENTS;
+		minComplete = 1;
+	}
+
+	self->timeout.tv_sec = timeoutMillis/1000;
+	self->timeout.tv_nsec = (long long)(timeoutMillis%1000)*1000000;
+
+	if (minComplete>0 && timeoutMillis>0 && self->extArg) {
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long long)(uintptr_t)&self->timeout;
+		flags |= IORING_ENTER_EXT_ARG;
+		rc = IoEngine_uring_enter(self, minComplete, flags, &arg, sizeof(arg));
+	} else {
+		if (minComplete>0 && timeoutMillis>0) {
+			/* Older kernels wait with a timeout operation, whose
+			 * completion is ignored */
+			sqe = IoEngine_uring_get_sqe(self);
+			if (sqe!=NULL) {
+				sqe->opcode = IORING_OP_TIMEOUT;
+				sqe->fd = -1;
+				sqe->addr = (unsigned long long)(uintptr_t)&self->timeout;
+				sqe->len = 1;
+				IoEngine_uring_push_sqe(self);
+			} else {
+				/* Without the timeout the call could never return */
+				flags = 0;
+				minComplete = 0;
+			}
+		}
+		rc = IoEngine_uring_enter(self, minComplete, flags, NULL, 0);
+	}
+
+	if (rc<0 && errno!=EINTR && errno!=ETIME && errno!=EAGAIN && errno!=EBUSY) {
+		l_error("io_uring_enter: %s", strerror(errno));
+	}
+
+	return IoEngine_uring_reap(self);
+}
+
+/* Cancel the operations in progress and wait for the kernel to release
+ * them, as it could still write in their memory */
+static void IoEngine_uring_cancel_all(IoEngine *self) {
+	struct io_uring_getevents_arg arg;
+	struct io_uring_sqe *sqe;
+	struct IoEngine_op *op;
+	int rc;
+
+	for (op=self->first; op!=NULL; op=op->next) {
+		sqe = IoEngine_uring_get_sqe(self);
+		if (sqe==NULL) {
+			/* The operations not cancelled are leaked */
+			self->first = NULL;
+			return;
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long long)(uintptr_t)op;
+		IoEngine_uring_push_sqe(self);
+	}
+
+	self->timeout.tv_sec = 1;
+	self->timeout.tv_nsec = 0;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (unsigned long long)(uintptr_t)&self->timeout;
+
+	while (self->first!=NULL) {
+		if (self->extArg) {
+			rc = IoEngine_uring_enter(self, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		} else {
+			rc = IoEngine_uring_enter(self, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		}
+
+		if (rc<0 && errno==ETIME) {
+			/* The operations that can't be cancelled are leaked */
+			l_error("io_uring: %i operations not cancelled", self->inFlight);
+			self->first = NULL;
+			break;
+		} else if (rc<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+			l_error("io_uring_enter: %s", strerror(errno));
+			self->first = NULL;
+			break;
+		}
+
+		IoEngine_uring_drain(self, LTRUE);
+	}
+}
+
+#endif
+
+IoEngine *IoEngine_new(int queueSize, lbool useUring, lerror **error) {
+	IoEngine *self;
+
+	l_assert(queueSize>0);
+	l_assert(error==NULL || *error==NULL);
+
+	self = (IoEngine *)lmalloczero(sizeof(struct IoEngine));
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	if (useUring) {
+		self->uring = IoEngine_uring_setup(self, queueSize);
+	}
+#endif
+
+	return self;
+}
+
+lbool IoEngine_uses_uring(IoEngine *self) {
+	l_assert(self!=NULL);
+
+	return self->uring;
+}
+
+static void IoEngine_start(IoEngine *self, struct IoEngine_op *op) {
+	self->inFlight++;
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	if (self->uring) {
+		op->prev = self->last;
+		if (self->last!=NULL) {
+			self->last->next = op;
+		} else {
+			self->first = op;
+		}
+		self->last = op;
+		IoEngine_uring_queue(self, op);
+		return;
+	}
+#endif
+
+	if (self->last!=NULL) {
+		self->last->next = op;
+	} else {
+		self->first = op;
+	}
+	self->last = op;
+}
+
+void IoEngine_accept(IoEngine *self, TCPListenSocket *socket, IoEngine_accept_callback callback, void *ctx) {
+	struct IoEngine_op *op;
+
+	l_assert(self!=NULL);
+	l_assert(socket!=NULL);
+	l_assert(!TCPListenSocket_is_tls(socket));
+	l_assert(callback!=NULL);
+
+	op = IoEngine_op_new(self, IOENGINE_ACCEPT, TCPListenSocket_get_fd(socket));
+	op->listener = socket;
+	op->acceptCallback = callback;
+	op->ctx = ctx;
+	IoEngine_start(self, op);
+}
+
+void IoEngine_recv(IoEngine *self, TCPSocket *socket, void *buf, int len, IoEngine_callback callback, void *ctx) {
+	struct IoEngine_op *op;
+
+	l_assert(self!=NULL);
+	l_assert(socket!=NULL);
+	l_assert(!TCPSocket_is_tls(socket));
+	l_assert(buf!=NULL);
+	l_assert(callback!=NULL);
+
+	/* The data already read by the buffered reader of the socket
+	 * comes first */
+	if (TCPSocket_pending(socket)>0) {
+		op = IoEngine_op_new(self, IOENGINE_BUFFERED, -1);
+		op->len = TCPSocket_recv(socket, buf, len, NULL);
+		op->callback = callback;
+		op->ctx = ctx;
+		IoEngine_start(self, op);
+		return;
+	}
+
+	op = IoEngine_op_new(self, IOENGINE_RECV, TCPSocket_get_fd(socket));
+	op->socket = socket;
+	op->buf = (char *)buf;
+	op->len = len;
+	op->callback = callback;
+	op->ctx = ctx;
+	IoEngine_start(self, op);
+}
+
+void IoEngine_send(IoEngine *self, TCPSocket *socket, const void *buf, int len, IoEngine_callback callback, void *ctx) {
+	struct IoEngine_op *op;
+
+	l_assert(self!=NULL);
+	l_assert(socket!=NULL);
+	l_assert(!TCPSocket_is_tls(socket));
+	l_assert(buf!=NULL);
+	l_assert(callback!=NULL);
+
+	op = IoEngine_op_new(self, IOENGINE_SEND, TCPSocket_get_fd(socket));
+	op->socket = socket;
+	op->buf = (char *)buf;
+	op->len = len;
+	op->callback = callback;
+	op->ctx = ctx;
+	IoEngine_start(self, op);
+}
+
+void IoEngine_read_file(IoEngine *self, int fd, void *buf, int len, long long offset, IoEngine_callback callback, void *ctx) {
+	struct IoEngine_op *op;
+
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(buf!=NULL);
+	l_assert(offset>=0);
+	l_assert(callback!=NULL);
+
+	op = IoEngine_op_new(self, IOENGINE_READ, fd);
+	op->buf = (char *)buf;
+	op->len = len;
+	op->offset = offset;
+	op->callback = callback;
+	op->ctx = ctx;
+	IoEngine_start(self, op);
+}
+
+lbool IoEngine_register_buffers(IoEngine *self, const struct iovec *iov, int count, lerror **error) {
+	l_assert(self!=NULL);
+	l_assert(iov!=NULL);
+	l_assert(count>0);
+	l_assert(self->buffers==NULL);
+	l_assert(self->inFlight==0);
+	l_assert(error==NULL || *error==NULL);
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	if (self->uring && syscall(__NR_io_uring_register, self->ringFd, IORING_REGISTER_BUFFERS, iov, count)<0) {
+		lerror_set_sprintf(error, "Can't register the buffers: %s", strerror(errno));
+		return LFALSE;
+	}
+#endif
+
+	self->buffers = (struct iovec *)lmalloc(sizeof(struct iovec)*count);
+	memcpy(self->buffers, iov, sizeof(struct iovec)*count);
+	self->bufferCount = count;
+	return LTRUE;
+}
+
+static void IoEngine_fixed(IoEngine *self, enum IoEngine_op_type type, int fd, int bufIndex, int bufOffset, int len, long long offset, IoEngine_callback callback, void *ctx) {
+	struct IoEngine_op *op;
+
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(bufIndex>=0 && bufIndex<self->bufferCount);
+	l_assert(bufOffset>=0 && len>=0 && (size_t)bufOffset+len<=self->buffers[bufIndex].iov_len);
+	l_assert(callback!=NULL);
+
+	op = IoEngine_op_new(self, type, fd);
+	op->buf = (char *)self->buffers[bufIndex].iov_base + bufOffset;
+	op->len = len;
+	op->offset = offset;
+	op->bufIndex = bufIndex;
+	op->callback = callback;
+	op->ctx = ctx;
+	IoEngine_start(self, op);
+}
+
+void IoEngine_read_fixed(IoEngine *self, int fd, int bufIndex, int bufOffset, int len, long long offset, IoEngine_callback callback, void *ctx) {
+	IoEngine_fixed(self, IOENGINE_READ_FIXED, fd, bufIndex, bufOffset, len, offset, callback, ctx);
+}
+
+void IoEngine_write_fixed(IoEngine *self, int fd, int bufIndex, int bufOffset, int len, long long offset, IoEngine_callback callback, void *ctx) {
+	IoEngine_fixed(self, IOENGINE_WRITE_FIXED, fd, bufIndex, bufOffset, len, offset, callback, ctx);
+}
+
+int IoEngine_run_once(IoEngine *self, int timeoutMillis) {
+	l_assert(self!=NULL);
+
+	if (self->inFlight==0) {
+		return 0;
+	}
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	if (self->uring) {
+		return IoEngine_uring_run_once(self, timeoutMillis);
+	}
+#endif
+
+	return IoEngine_poll_run_once(self, timeoutMillis);
+}
+
+void IoEngine_run(IoEngine *self) {
+	l_assert(self!=NULL);
+
+	self->stopped = LFALSE;
+	while (!self->stopped && self->inFlight>0) {
+		IoEngine_run_once(self, -1);
+	}
+}
+
+void IoEngine_stop(IoEngine *self) {
+	l_assert(self!=NULL);
+
+	self->stopped = LTRUE;
+}
+
+int IoEngine_pending(IoEngine *self) {
+	l_assert(self!=NULL);
+
+	return self->inFlight;
+}
+
+void IoEngine_destroy(IoEngine *self) {
+	struct IoEngine_op *op;
+
+	if (self==NULL) {
+		return;
+	}
+
+#if defined(__linux__) && defined(IOENGINE_USE_URING)
+	if (self->uring) {
+		IoEngine_uring_cancel_all(self);
+		IoEngine_uring_destroy(self);
+	}
+	while (self->completed!=NULL) {
+		op = self->completed;
+		self->completed = op->next;
+		lfree(op);
+	}
+#endif
+
+	while (self->first!=NULL) {
+		op = self->first;
+		self->first = op->next;
+		lfree(op);
+	}
+	while (self->freeOps!=NULL) {
+		op = self->freeOps;
+		self->freeOps = op->next;
+		lfree(op);
+	}
+
+	if (self->buffers!=NULL) {
+		lfree(self->buffers);
+	}
+	if (self->pfds!=NULL) {
+		lfree(self->pfds);
+	}
+	lfree(self);
+}
@@ -0,0 +1,254 @@
+#ifndef __COMMONLIB_IOENGINE_H
+#define __COMMONLIB_IOENGINE_H
+
+#include "lerror.h"
+#include "net_socket.h"
+#include <sys/uio.h>
+
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+/**
+ * Class: IoEngine
+ * An engine executing socket and file operations asynchronously and
+ * calling a function when each one completes.
+ *
+ * On Linux the operations are queued in an io_uring, when the kernel
+ * supports it, and every call to <IoEngine_run_once> submits all the
+ * queued operations and collects all the completed ones with a single
+ * system call. Otherwise the engine waits for the sockets to be ready
+ * with poll and then executes the operations with the usual system calls.
+ *
+ * The engine must be used by one thread: the operations are started by
+ * the thread running the engine, usually in the callbacks. The buffers
+ * must stay valid until the operation completes. <IoEngine_recv> returns
+ * the data already kept by the buffered reader of a <TCPSocket> before
+ * receiving more, and the operations on the sockets update their
+ * counters.
+ *
+ * The engine moves the bytes of the sockets as they are, so it can't be
+ * used with TLS: the sockets and the listening sockets passed to it must
+ * not use TLS (see <TCPSocket_is_tls> and <TCPListenSocket_is_tls>).
+ */
+typedef struct IoEngine IoEngine;
+
+/**
+ * Type: IoEngine_callback
+ * The function called when an operation completes
+ * Parameters:
+ *     engine - The engine
+ *     result - The number of bytes transferred, or the error code
+ *         with the negative sign (ex. -ECONNRESET). -EBUSY means that
+ *         io_uring didn't accept the operation because its queues were full.
+ *     ctx - The context passed with the operation
+ */
+typedef void (*IoEngine_callback)(IoEngine *engine, int result, void *ctx);
+
+/**
+ * Type: IoEngine_accept_callback
+ * The function called when a connection is accepted
+ * Parameters:
+ *     engine - The engine
+ *     socket - The new connection, with the local address and the mode
+ *         of the listening socket, or NULL on error
+ *     result - Zero, or the error code with the negative sign
+ *     ctx - The context passed with the operation
+ */
+typedef void (*IoEngine_accept_callback)(IoEngine *engine, TCPSocket *socket, int result, void *ctx);
+
+/**
+ * Function: IoEngine_new
+ * Create an engine
+ * Parameters:
+ *     queueSize - The number of operations submitted with a single system
+ *         call, rounded up to a power of two. More operations can be in
+ *         progress at the same time.
+ *     useUring - LFALSE to use poll even when io_uring is available
+ * Returns:
+ *     The engine or NULL if it can't be created
+ */
+IoEngine *IoEngine_new(int queueSize, lbool useUring, lerror **error);
+
+/**
+ * Function: IoEngine_uses_uring
+ * Check if the engine is using io_uring
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ */
+lbool IoEngine_uses_uring(IoEngine *self);
+
+/**
+ * Function: IoEngine_accept
+ * Accept a connection
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     socket - The listening socket (must be not NULL, without TLS)
+ *     callback - Called with the new connection
+ *     ctx - Passed to the callback
+ */
+void IoEngine_accept(IoEngine *self, TCPListenSocket *socket, IoEngine_accept_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_recv
+ * Receive some data, as soon as it's available. The data already kept by
+ * the buffered reader of the socket is returned without receiving.
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     socket - The socket (must be not NULL, without TLS)
+ *     buf - The destination buffer
+ *     len - The size of the buffer
+ *     callback - Called with the number of bytes received, zero when the
+ *         connection was closed
+ *     ctx - Passed to the callback
+ */
+void IoEngine_recv(IoEngine *self, TCPSocket *socket, void *buf, int len, IoEngine_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_send
+ * Send some data. Like send, only a part of the data can be sent.
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     socket - The socket (must be not NULL, without TLS)
+ *     buf - The data
+ *     len - The length of the data
+ *     callback - Called with the number of bytes sent
+ *     ctx - Passed to the callback
+ */
+void IoEngine_send(IoEngine *self, TCPSocket *socket, const void *buf, int len, IoEngine_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_read_file
+ * Read a part of a file
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     fd - The file descriptor
+ *     buf - The destination buffer
+ *     len - The number of bytes to read
+ *     offset - The position in the file
+ *     callback - Called with the number of bytes read, zero at the end
+ *         of the file
+ *     ctx - Passed to the callback
+ */
+void IoEngine_read_file(IoEngine *self, int fd, void *buf, int len, long long offset, IoEngine_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_register_buffers
+ * Register the buffers used by <IoEngine_read_fixed> and
+ * <IoEngine_write_fixed>. The kernel maps them once, instead of at
+ * every operation. Can be called once, with no operations in progress.
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     iov - The buffers, which must stay valid until the engine is
+ *         destroyed (must be not NULL)
+ *     count - The number of buffers
+ * Returns:
+ *     LTRUE if the buffers were registered, LFALSE otherwise
+ */
+lbool IoEngine_register_buffers(IoEngine *self, const struct iovec *iov, int count, lerror **error);
+
+/**
+ * Function: IoEngine_read_fixed
+ * Read from a file or a socket in a registered buffer
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     fd - The file descriptor
+ *     bufIndex - The index of the registered buffer
+ *     bufOffset - The position in the buffer where the data is written
+ *     len - The number of bytes to read
+ *     offset - The position in the file, or -1 for sockets and pipes
+ *     callback - Called with the number of bytes read
+ *     ctx - Passed to the callback
+ */
+void IoEngine_read_fixed(IoEngine *self, int fd, int bufIndex, int bufOffset, int len, long long offset, IoEngine_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_write_fixed
+ * Write to a file or a socket from a registered buffer
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     fd - The file descriptor
+ *     bufIndex - The index of the registered buffer
+ *     bufOffset - The position in the buffer of the data
+ *     len - The number of bytes to write
+ *     offset - The position in the file, or -1 for sockets and pipes
+ *     callback - Called with the number of bytes written
+ *     ctx - Passed to the callback
+ */
+void IoEngine_write_fixed(IoEngine *self, int fd, int bufIndex, int bufOffset, int len, long long offset, IoEngine_callback callback, void *ctx);
+
+/**
+ * Function: IoEngine_run_once
+ * Start the queued operations and call the callbacks of the completed
+ * ones, waiting for at least one if none is completed yet
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ *     timeoutMillis - The maximum wait, zero to not wait or -1 to wait
+ *         until an operation completes
+ * Returns:
+ *     The number of callbacks called
+ */
+int IoEngine_run_once(IoEngine *self, int timeoutMillis);
+
+/**
+ * Function: IoEngine_run
+ * Call <IoEngine_run_once> until <IoEngine_stop> is called or there
+ * are no more operations in progress
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ */
+void IoEngine_run(IoEngine *self);
+
+/**
+ * Function: IoEngine_stop
+ * Make <IoEngine_run> return, usually from a callback
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ */
+void IoEngine_stop(IoEngine *self);
+
+/**
+ * Function: IoEngine_pending
+ * Get the number of operations in progress
+ * Parameters:
+ *     self - The engine (must be not NULL)
+ */
+int IoEngine_pending(IoEngine *self);
+
+/**
+ * Function: IoEngine_destroy
+ * Destroy the engine. The operations in progress are cancelled without
+ * calling their callbacks.
+ * Parameters:
+ *     self - The engine (may be NULL)
+ */
+void IoEngine_destroy(IoEngine *self);
+
+#endif
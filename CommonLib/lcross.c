@@ -162,6 +162,22 @@ long l_current_time_millis(void) {
 }
 #endif
 
+#ifdef _WIN32
+long long l_monotonic_time_micros(void) {
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (long long)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+		(long long)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+#else
+long long l_monotonic_time_micros(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
 int lfopen_s(FILE **pFile, const char *fileName, const char *mode) {
 #ifdef _WIN32
 	return fopen_s(pFile, fileName, mode);
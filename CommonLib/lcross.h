@@ -126,7 +126,6 @@ int l_atoi(const char *s);
  */
 void l_itoa_s(int value, char *str, int bufferSize, int base);
 
-#ifdef _WIN32
 /**
  * Function: l_current_time_millis
  * Gets the current time in milliseconds
@@ -134,7 +133,15 @@ void l_itoa_s(int value, char *str, int bufferSize, int base);
  *   The current time in milliseconds
  */
 long l_current_time_millis(void);
-#endif
+
+/**
+ * Function: l_monotonic_time_micros
+ * Gets the time elapsed from an unspecified starting point using
+ * a monotonic clock. Use this function to measure durations.
+ * Returns:
+ *   The time in microseconds
+ */
+long long l_monotonic_time_micros(void);
 
 #define stringize_op1( x )              #x
 
@@ -0,0 +1,219 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+#include "lhashtable.h"
+#include "lmemory.h"
+#include <string.h>
+
+#define LHASHTABLE_INITIAL_BUCKETS 16
+
+typedef struct lhashtable_entry lhashtable_entry;
+struct lhashtable_entry {
+	lhashtable_entry *next;
+	uint32_t hash;
+	void *value;
+	char key[1];
+};
+
+struct lhashtable {
+	lhashtable_entry **buckets;
+	int bucketCount;
+	int len;
+	destructor_t destructor;
+};
+
+uint32_t lhashtable_hash( const void *data, int len ) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for ( i=0; i<len; i++ ) {
+		hash ^= bytes[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+lhashtable *lhashtable_new( destructor_t destructor ) {
+	lhashtable *self = (lhashtable *)lmalloc( sizeof(struct lhashtable) );
+
+	self->bucketCount = LHASHTABLE_INITIAL_BUCKETS;
+	self->buckets = (lhashtable_entry **)lmalloczero( sizeof(lhashtable_entry *) * self->bucketCount );
+	self->len = 0;
+	self->destructor = destructor;
+
+	return self;
+}
+
+void lhashtable_clear( lhashtable *self ) {
+	lhashtable_entry *entry, *next;
+	int i;
+
+	l_assert( self!=NULL );
+
+	for ( i=0; i<self->bucketCount; i++ ) {
+		for ( entry=self->buckets[i]; entry!=NULL; entry=next ) {
+			next = entry->next;
+			if ( self->destructor!=NULL ) {
+				self->destructor( entry->value );
+			}
+			lfree( entry );
+		}
+		self->buckets[i] = NULL;
+	}
+
+	self->len = 0;
+}
+
+void lhashtable_destroy( lhashtable *self ) {
+	if ( self==NULL ) return;
+
+	lhashtable_clear( self );
+	lfree( self->buckets );
+	lfree( self );
+}
+
+static lhashtable_entry **lhashtable_find( lhashtable *self, const char *key, uint32_t hash ) {
+	lhashtable_entry **ptr = &self->buckets[ hash & (self->bucketCount-1) ];
+
+	while ( *ptr!=NULL ) {
+		if ( (*ptr)->hash==hash && 0==strcmp( (*ptr)->key, key ) ) {
+			break;
+		}
+		ptr = &(*ptr)->next;
+	}
+
+	return ptr;
+}
+
+static void lhashtable_grow( lhashtable *self ) {
+	lhashtable_entry **newBuckets;
+	lhashtable_entry *entry, *next;
+	int newCount = self->bucketCount * 2;
+	int i;
+
+	newBuckets = (lhashtable_entry **)lmalloczero( sizeof(lhashtable_entry *) * newCount );
+	for ( i=0; i<self->bucketCount; i++ ) {
+		for ( entry=self->buckets[i]; entry!=NULL; entry=next ) {
+			next = entry->next;
+			entry->next = newBuckets[ entry->hash & (newCount-1) ];
+			newBuckets[ entry->hash & (newCount-1) ] = entry;
+		}
+	}
+
+	lfree( self->buckets );
+	self->buckets = newBuckets;
+	self->bucketCount = newCount;
+}
+
+void *lhashtable_get( lhashtable *self, const char *key ) {
+	lhashtable_entry **ptr;
+
+	l_assert( self!=NULL );
+	l_assert( key!=NULL );
+
+	ptr = lhashtable_find( self, key, lhashtable_hash( key, strlen(key) ) );
+	return (*ptr)!=NULL ? (*ptr)->value : NULL;
+}
+
+void lhashtable_put( lhashtable *self, const char *key, void *value ) {
+	lhashtable_entry **ptr;
+	lhashtable_entry *entry;
+	uint32_t hash;
+	int keyLen;
+
+	l_assert( self!=NULL );
+	l_assert( key!=NULL );
+
+	keyLen = strlen( key );
+	hash = lhashtable_hash( key, keyLen );
+	ptr = lhashtable_find( self, key, hash );
+
+	if ( *ptr!=NULL ) {
+		if ( self->destructor!=NULL && (*ptr)->value!=value ) {
+			self->destructor( (*ptr)->value );
+		}
+		(*ptr)->value = value;
+		return;
+	}
+
+	entry = (lhashtable_entry *)lmalloc( sizeof(lhashtable_entry) + keyLen );
+	memcpy( entry->key, key, keyLen+1 );
+	entry->hash = hash;
+	entry->value = value;
+	entry->next = NULL;
+	*ptr = entry;
+	self->len++;
+
+	if ( self->len > (self->bucketCount/4)*3 ) {
+		lhashtable_grow( self );
+	}
+}
+
+lbool lhashtable_remove( lhashtable *self, const char *key ) {
+	lhashtable_entry **ptr;
+	lhashtable_entry *entry;
+
+	l_assert( self!=NULL );
+	l_assert( key!=NULL );
+
+	ptr = lhashtable_find( self, key, lhashtable_hash( key, strlen(key) ) );
+	if ( *ptr==NULL ) {
+		return LFALSE;
+	}
+
+	entry = *ptr;
+	*ptr = entry->next;
+	if ( self->destructor!=NULL ) {
+		self->destructor( entry->value );
+	}
+	lfree( entry );
+	self->len--;
+
+	return LTRUE;
+}
+
+int lhashtable_len( lhashtable *self ) {
+	l_assert( self!=NULL );
+	return self->len;
+}
+
+void lhashtable_foreach( lhashtable *self, lhashtable_visitor_t visitor, void *ctx ) {
+	lhashtable_entry *entry;
+	int i;
+
+	l_assert( self!=NULL );
+	l_assert( visitor!=NULL );
+
+	for ( i=0; i<self->bucketCount; i++ ) {
+		for ( entry=self->buckets[i]; entry!=NULL; entry=entry->next ) {
+			visitor( entry->key, entry->value, ctx );
+		}
+	}
+}
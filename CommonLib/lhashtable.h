@@ -0,0 +1,135 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+#ifndef __LHASHTABLE_H
+#define __LHASHTABLE_H
+
+#include "lcross.h"
+#include "refcount.h"
+
+/**
+ * Class: lhashtable
+ * A hash table with string keys and generic values. The keys are
+ * copied inside the table, the values are owned by the table if a
+ * destructor is given.
+ */
+typedef struct lhashtable lhashtable;
+
+/**
+ * Type: lhashtable_visitor_t
+ * Callback used by <lhashtable_foreach>
+ */
+typedef void (*lhashtable_visitor_t)( const char *key, void *value, void *ctx );
+
+/**
+ * Function: lhashtable_new
+ * Create a new empty hash table
+ * Parameters:
+ *   destructor - Invoked on the values removed or replaced in the
+ *     table and on the remaining values when the table is destroyed.
+ *     Can be NULL.
+ */
+lhashtable *lhashtable_new( destructor_t destructor );
+
+/**
+ * Function: lhashtable_destroy
+ * Destroy the hash table and the values it contains
+ * Parameters:
+ *   self - The hash table (can be NULL)
+ */
+void lhashtable_destroy( lhashtable *self );
+
+/**
+ * Function: lhashtable_get
+ * Find a value given its key
+ * Parameters:
+ *   self - The hash table (not NULL)
+ *   key - The key (not NULL)
+ * Returns:
+ *   The value or NULL if the key is not in the table
+ */
+void *lhashtable_get( lhashtable *self, const char *key );
+
+/**
+ * Function: lhashtable_put
+ * Put a value in the table, replacing the value with the same key
+ * Parameters:
+ *   self - The hash table (not NULL)
+ *   key - The key (not NULL)
+ *   value - The value
+ */
+void lhashtable_put( lhashtable *self, const char *key, void *value );
+
+/**
+ * Function: lhashtable_remove
+ * Remove a key from the table, destroying the value
+ * Parameters:
+ *   self - The hash table (not NULL)
+ *   key - The key (not NULL)
+ * Returns:
+ *   True if the key was in the table
+ */
+lbool lhashtable_remove( lhashtable *self, const char *key );
+
+/**
+ * Function: lhashtable_clear
+ * Remove every key from the table
+ * Parameters:
+ *   self - The hash table (not NULL)
+ */
+void lhashtable_clear( lhashtable *self );
+
+/**
+ * Function: lhashtable_len
+ * Get the number of keys in the table
+ * Parameters:
+ *   self - The hash table (not NULL)
+ */
+int lhashtable_len( lhashtable *self );
+
+/**
+ * Function: lhashtable_foreach
+ * Invoke a callback for every element of the table. The table
+ * must not be modified by the callback.
+ * Parameters:
+ *   self - The hash table (not NULL)
+ *   visitor - The callback
+ *   ctx - Passed to the callback
+ */
+void lhashtable_foreach( lhashtable *self, lhashtable_visitor_t visitor, void *ctx );
+
+/**
+ * Function: lhashtable_hash
+ * The hash function used by the table (FNV-1a)
+ * Parameters:
+ *   data - The bytes to hash
+ *   len - The number of bytes
+ */
+uint32_t lhashtable_hash( const void *data, int len );
+
+#endif
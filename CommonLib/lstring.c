@@ -60,7 +60,7 @@ lstring* lstring_new_from_cstr( const char *cstr )
 lstring* lstring_new_from_lstr( lstring* self )
 {
 	lstring_header *self_header = (lstring_header*)(self-sizeof(struct lstring_header));
-	lstring_header *str = (lstring_header *)lmalloc(sizeof(struct lstring_header) + self_header->len);
+	lstring_header *str = (lstring_header *)lmalloc(sizeof(struct lstring_header) + self_header->bufLen);
 	lstring* s = ((char *)str)+sizeof(lstring_header);
 	memcpy(str, self_header, self_header->bufLen + sizeof(struct lstring_header));
 	return s;
@@ -104,6 +104,15 @@ lstring *lstring_append_generic_f( lstring* str, const char *other, int otherLen
 
 	str_header = (lstring_header *)(str - sizeof(lstring_header));
 	newLen = otherLen + str_header->len;
+
+	/* Fast path: the data fits in the reserved space */
+	if ( newLen < str_header->bufLen ) {
+		memcpy( str+str_header->len, other, otherLen );
+		str[newLen]=0;
+		str_header->len = newLen;
+		return str;
+	}
+
 	newBufLen = 2<<l_log2(newLen + 50);
 
 	if( str_header->bufLen > newBufLen )
@@ -137,8 +146,18 @@ lstring *lstring_append_cstr_f( lstring* str, const char *other )
 }
 
 lstring* lstring_append_char_f( lstring* str, char c ) {
+	lstring_header *str_header = NULL;
+
 	l_assert( str!=NULL );
 
+	str_header = (lstring_header *)(str - sizeof(lstring_header));
+	if ( str_header->len+1 < str_header->bufLen ) {
+		str[str_header->len] = c;
+		str_header->len++;
+		str[str_header->len] = 0;
+		return str;
+	}
+
 	return lstring_append_generic_f( str, &c, 1 );
 }
 
@@ -158,6 +177,7 @@ lstring* lstring_reserve_f( lstring* str, int len )
 	{
 		str_header = (lstring_header *)lrealloc(str_header, len+sizeof(lstring_header));
 		str = ((lstring*)str_header)+sizeof(lstring_header);
+		str_header->bufLen = len;
 	}
 
 	return str;
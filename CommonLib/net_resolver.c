@@ -0,0 +1,568 @@
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+#include "net_resolver.h"
+#include "lcross.h"
+#include "lhashtable.h"
+#include "lmemory.h"
+#include "lstring.h"
+#include "lvector.h"
+#include "threading.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Maximum number of hosts kept by the cache */
+#define MAX_CACHE_ENTRIES 1024
+
+/* A host is resolved again in the background when it is used during the
+ * last part of its time, 1/REFRESH_FRACTION of the TTL */
+#define REFRESH_FRACTION 4
+
+/* An asynchronous lookup waiting for the result */
+struct net_resolver_waiter {
+	NetResolver_callback callback;
+	void *ctx;
+	EventLoop *loop;
+	struct net_resolver_waiter *next;
+};
+
+/* The result kept for a host. The entries with a lookup running are
+ * never removed from the cache */
+struct net_resolver_entry {
+	lstring *hostname;
+	lstring *port;
+
+	/* When the result must not be used anymore, zero before the first
+	 * lookup completes */
+	long long expires;
+	long long refreshAt;
+	lbool pending;
+
+	/* The addresses, or -1 and the failure message */
+	int count;
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	lstring *errorMessage;
+
+	struct net_resolver_waiter *waiters;
+};
+
+struct NetResolver {
+	lcom_mutex_t *mutex;
+	lcom_cond_t *completed;
+	lhashtable *entries;
+	int ttlMillis;
+	int negativeTtlMillis;
+
+	/* Started by the first asynchronous lookup */
+	int nThreads;
+	lcom_threadpool_t *pool;
+
+	NetResolverStats stats;
+};
+
+/* A lookup made by the pool */
+struct net_resolver_job {
+	NetResolver *resolver;
+	lstring *key;
+};
+
+/* A result delivered in the thread of an event loop */
+struct net_resolver_delivery {
+	NetResolver *resolver;
+	NetResolver_callback callback;
+	void *ctx;
+	int count;
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	lerror *error;
+};
+
+static pthread_once_t net_resolver_default_once = PTHREAD_ONCE_INIT;
+static NetResolver *net_resolver_default = NULL;
+
+static void net_resolver_entry_destroy(void *p) {
+	struct net_resolver_entry *entry = (struct net_resolver_entry *)p;
+
+	lstring_delete(entry->hostname);
+	lstring_delete(entry->port);
+	lstring_delete(entry->errorMessage);
+	lfree(entry);
+}
+
+static lstring *net_resolver_key_f(lstring *dest, const char *hostname, const char *port) {
+	return lstring_append_sprintf_f(dest, "%s:%s", hostname, port);
+}
+
+/* Call getaddrinfo, alternating the address families so the connections
+ * to a broken family don't delay the other one. Returns the number of
+ * addresses or -1 with the failure message */
+static int net_resolver_lookup(const char *hostname, const char *port, NetAddress *dest, lstring **errorMessage) {
+	struct addrinfo hints, *res = NULL, *ai;
+	NetAddress first[NETRESOLVER_MAX_ADDRESSES];
+	NetAddress other[NETRESOLVER_MAX_ADDRESSES];
+	int nFirst = 0, nOther = 0;
+	int count = 0;
+	int i;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(hostname, port, &hints, &res);
+	if (0!=rc) {
+		*errorMessage = lstring_append_sprintf_f(lstring_new(), "getaddrinfo: %s", gai_strerror(rc));
+		return -1;
+	}
+
+	for (ai=res; ai!=NULL; ai=ai->ai_next) {
+		if (ai->ai_addrlen>sizeof(struct sockaddr_storage)) {
+			continue;
+		}
+		if (ai->ai_family==res->ai_family && nFirst<NETRESOLVER_MAX_ADDRESSES) {
+			first[nFirst].family = ai->ai_family;
+			first[nFirst].len = ai->ai_addrlen;
+			memcpy(&first[nFirst].addr, ai->ai_addr, ai->ai_addrlen);
+			nFirst++;
+		} else if (ai->ai_family!=res->ai_family && nOther<NETRESOLVER_MAX_ADDRESSES) {
+			other[nOther].family = ai->ai_family;
+			other[nOther].len = ai->ai_addrlen;
+			memcpy(&other[nOther].addr, ai->ai_addr, ai->ai_addrlen);
+			nOther++;
+		}
+	}
+	freeaddrinfo(res);
+
+	for (i=0; count<NETRESOLVER_MAX_ADDRESSES && (i<nFirst || i<nOther); i++) {
+		if (i<nFirst) {
+			dest[count++] = first[i];
+		}
+		if (i<nOther && count<NETRESOLVER_MAX_ADDRESSES) {
+			dest[count++] = other[i];
+		}
+	}
+
+	if (count==0) {
+		*errorMessage = lstring_append_sprintf_f(lstring_new(), "No address found for %s", hostname);
+		return -1;
+	}
+	return count;
+}
+
+NetResolver *NetResolver_new(int nThreads, int ttlMillis, int negativeTtlMillis) {
+	NetResolver *self;
+
+	l_assert(nThreads>0);
+	l_assert(ttlMillis>=0);
+	l_assert(negativeTtlMillis>=0);
+
+	self = (NetResolver *)lmalloc(sizeof(struct NetResolver));
+	self->mutex = lcom_mutex_new();
+	self->completed = lcom_cond_new();
+	self->entries = lhashtable_new(net_resolver_entry_destroy);
+	self->ttlMillis = ttlMillis;
+	self->negativeTtlMillis = negativeTtlMillis;
+	self->nThreads = nThreads;
+	self->pool = NULL;
+	memset(&self->stats, 0, sizeof(NetResolverStats));
+	return self;
+}
+
+static void net_resolver_default_init(void) {
+	net_resolver_default = NetResolver_new(2, NETRESOLVER_DEFAULT_TTL_MILLIS, NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS);
+}
+
+NetResolver *NetResolver_get_default(void) {
+	pthread_once(&net_resolver_default_once, net_resolver_default_init);
+	return net_resolver_default;
+}
+
+static void net_resolver_collect_key(const char *key, void *value, void *ctx) {
+	struct net_resolver_entry *entry = (struct net_resolver_entry *)value;
+	lvector *keys = (lvector *)ctx;
+
+	if (!entry->pending) {
+		lvector_resize(keys, lvector_len(keys)+1);
+		lvector_set(keys, lvector_len(keys)-1, lstring_new_from_cstr(key));
+	}
+}
+
+/* Remove every entry without a lookup running. The mutex must be held */
+static void net_resolver_remove_idle(NetResolver *self) {
+	lvector *keys = lvector_new(0);
+	int i;
+
+	lhashtable_foreach(self->entries, net_resolver_collect_key, keys);
+	for (i=0; i<lvector_len(keys); i++) {
+		lhashtable_remove(self->entries, (const char *)lvector_at(keys, i));
+		lstring_delete((lstring *)lvector_at(keys, i));
+	}
+	lvector_delete(keys);
+}
+
+void NetResolver_set_ttl(NetResolver *self, int ttlMillis, int negativeTtlMillis) {
+	l_assert(self!=NULL);
+	l_assert(ttlMillis>=0);
+	l_assert(negativeTtlMillis>=0);
+
+	lcom_mutex_lock(self->mutex);
+	self->ttlMillis = ttlMillis;
+	self->negativeTtlMillis = negativeTtlMillis;
+	net_resolver_remove_idle(self);
+	lcom_mutex_unlock(self->mutex);
+}
+
+/* Copy the result of an entry, returning the number of addresses or -1
+ * with the failure */
+static int net_resolver_entry_result(struct net_resolver_entry *entry, NetAddress *dest, lerror **error) {
+	if (entry->count<0) {
+		lerror_set(error, entry->errorMessage);
+		return -1;
+	}
+	memcpy(dest, entry->addresses, sizeof(NetAddress)*entry->count);
+	return entry->count;
+}
+
+/* Find the entry of a host, creating it if needed. The mutex must be held */
+static struct net_resolver_entry *net_resolver_entry_get(NetResolver *self, const char *key, const char *hostname, const char *port) {
+	struct net_resolver_entry *entry = (struct net_resolver_entry *)lhashtable_get(self->entries, key);
+
+	if (entry!=NULL) {
+		return entry;
+	}
+
+	if (lhashtable_len(self->entries)>=MAX_CACHE_ENTRIES) {
+		net_resolver_remove_idle(self);
+	}
+
+	entry = (struct net_resolver_entry *)lmalloc(sizeof(struct net_resolver_entry));
+	entry->hostname = lstring_new_from_cstr(hostname);
+	entry->port = lstring_new_from_cstr(port);
+	entry->expires = 0;
+	entry->refreshAt = 0;
+	entry->pending = LFALSE;
+	entry->count = -1;
+	entry->errorMessage = NULL;
+	entry->waiters = NULL;
+	lhashtable_put(self->entries, key, entry);
+	return entry;
+}
+
+static void net_resolver_deliver(EventLoop *loop, void *ctx) {
+	struct net_resolver_delivery *delivery = (struct net_resolver_delivery *)ctx;
+
+	delivery->callback(delivery->resolver, delivery->addresses, delivery->count, delivery->error, delivery->ctx);
+	lerror_delete(&delivery->error);
+	lfree(delivery);
+}
+
+/* Call the function of an asynchronous lookup, in its event loop if there
+ * is one */
+static void net_resolver_notify(NetResolver *self, struct net_resolver_waiter *waiter, const NetAddress *addresses, int count, const char *errorMessage) {
+	struct net_resolver_delivery *delivery = (struct net_resolver_delivery *)lmalloc(sizeof(struct net_resolver_delivery));
+
+	delivery->resolver = self;
+	delivery->callback = waiter->callback;
+	delivery->ctx = waiter->ctx;
+	delivery->count = count;
+	delivery->error = NULL;
+	if (count>0) {
+		memcpy(delivery->addresses, addresses, sizeof(NetAddress)*count);
+	} else {
+		lerror_set(&delivery->error, errorMessage);
+	}
+
+	if (waiter->loop!=NULL) {
+		EventLoop_post(waiter->loop, net_resolver_deliver, delivery);
+	} else {
+		net_resolver_deliver(NULL, delivery);
+	}
+}
+
+/* Resolve a host and store the result, waking the lookups waiting for it.
+ * A failed refresh keeps the previous addresses */
+static void net_resolver_complete(NetResolver *self, const char *key) {
+	struct net_resolver_entry *entry;
+	struct net_resolver_waiter *waiters;
+	struct net_resolver_waiter *waiter;
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	lstring *hostname;
+	lstring *port;
+	lstring *errorMessage = NULL;
+	long long now;
+	int count;
+
+	lcom_mutex_lock(self->mutex);
+	entry = (struct net_resolver_entry *)lhashtable_get(self->entries, key);
+	hostname = lstring_new_from_cstr(entry->hostname);
+	port = lstring_new_from_cstr(entry->port);
+	lcom_mutex_unlock(self->mutex);
+
+	count = net_resolver_lookup(hostname, port, addresses, &errorMessage);
+	lstring_delete(hostname);
+	lstring_delete(port);
+
+	lcom_mutex_lock(self->mutex);
+	now = l_monotonic_time_micros();
+	if (count<0) {
+		self->stats.failures++;
+	}
+
+	if (count<0 && entry->count>0 && entry->expires>now) {
+		/* The host is still reachable at the old addresses */
+		entry->refreshAt = now + (long long)self->negativeTtlMillis*1000;
+		if (entry->refreshAt>entry->expires) {
+			entry->refreshAt = entry->expires;
+		}
+	} else if (count<0) {
+		entry->count = -1;
+		lstring_delete(entry->errorMessage);
+		entry->errorMessage = errorMessage;
+		errorMessage = NULL;
+		entry->expires = now + (long long)self->negativeTtlMillis*1000;
+		entry->refreshAt = entry->expires;
+	} else {
+		entry->count = count;
+		memcpy(entry->addresses, addresses, sizeof(NetAddress)*count);
+		entry->expires = now + (long long)self->ttlMillis*1000;
+		entry->refreshAt = entry->expires - (long long)self->ttlMillis*1000/REFRESH_FRACTION;
+	}
+
+	if (entry->count>0) {
+		count = entry->count;
+		memcpy(addresses, entry->addresses, sizeof(NetAddress)*count);
+	} else if (errorMessage==NULL) {
+		errorMessage = lstring_new_from_cstr(entry->errorMessage);
+	}
+	entry->pending = LFALSE;
+	waiters = entry->waiters;
+	entry->waiters = NULL;
+	lcom_cond_broadcast(self->completed);
+	lcom_mutex_unlock(self->mutex);
+
+	while (waiters!=NULL) {
+		waiter = waiters;
+		waiters = waiter->next;
+		net_resolver_notify(self, waiter, addresses, count>0 ? count : -1, errorMessage);
+		lfree(waiter);
+	}
+	lstring_delete(errorMessage);
+}
+
+static void net_resolver_job_run(void *arg) {
+	struct net_resolver_job *job = (struct net_resolver_job *)arg;
+
+	net_resolver_complete(job->resolver, job->key);
+	lstring_delete(job->key);
+	lfree(job);
+}
+
+/* Resolve a host in the pool. The mutex must be held and the entry must
+ * be marked as pending */
+static void net_resolver_submit(NetResolver *self, const char *key) {
+	struct net_resolver_job *job = (struct net_resolver_job *)lmalloc(sizeof(struct net_resolver_job));
+
+	job->resolver = self;
+	job->key = lstring_new_from_cstr(key);
+	if (self->pool==NULL) {
+		self->pool = lcom_threadpool_new(self->nThreads);
+	}
+	lcom_threadpool_submit(self->pool, net_resolver_job_run, job);
+}
+
+/* Check if the result of an entry can be used, starting the background
+ * refresh when it is about to expire. The mutex must be held */
+static lbool net_resolver_entry_fresh(NetResolver *self, struct net_resolver_entry *entry, const char *key) {
+	long long now = l_monotonic_time_micros();
+
+	if (entry->expires<=now) {
+		return LFALSE;
+	}
+
+	if (entry->count<0) {
+		self->stats.negativeHits++;
+	} else {
+		self->stats.hits++;
+	}
+
+	if (!entry->pending && entry->count>0 && entry->refreshAt<=now) {
+		entry->pending = LTRUE;
+		self->stats.refreshes++;
+		net_resolver_submit(self, key);
+	}
+	return LTRUE;
+}
+
+int NetResolver_resolve(NetResolver *self, const char *hostname, const char *port, NetAddress *dest, lerror **error) {
+	struct net_resolver_entry *entry;
+	lstring *key;
+	lbool waited = LFALSE;
+	int result;
+
+	l_assert(self!=NULL);
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(dest!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	key = net_resolver_key_f(lstring_new(), hostname, port);
+
+	lcom_mutex_lock(self->mutex);
+	while (1) {
+		entry = net_resolver_entry_get(self, key, hostname, port);
+		if (waited && !entry->pending && entry->expires>0) {
+			/* The result of the lookup we waited for is used even
+			 * if it expired immediately */
+			break;
+		} else if (net_resolver_entry_fresh(self, entry, key)) {
+			break;
+		} else if (entry->pending) {
+			/* Another thread is resolving the host */
+			if (!waited) {
+				self->stats.shared++;
+			}
+			waited = LTRUE;
+			lcom_cond_wait(self->completed, self->mutex);
+		} else {
+			entry->pending = LTRUE;
+			self->stats.misses++;
+			lcom_mutex_unlock(self->mutex);
+			net_resolver_complete(self, key);
+			lcom_mutex_lock(self->mutex);
+			waited = LTRUE;
+		}
+	}
+
+	result = net_resolver_entry_result(entry, dest, error);
+	lcom_mutex_unlock(self->mutex);
+
+	lstring_delete(key);
+	return result;
+}
+
+void NetResolver_resolve_async(NetResolver *self, const char *hostname, const char *port,
+	EventLoop *loop, NetResolver_callback callback, void *ctx) {
+	struct net_resolver_entry *entry;
+	struct net_resolver_waiter *waiter;
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	lerror *error = NULL;
+	lstring *key;
+	int count;
+
+	l_assert(self!=NULL);
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(callback!=NULL);
+
+	key = net_resolver_key_f(lstring_new(), hostname, port);
+
+	lcom_mutex_lock(self->mutex);
+	entry = net_resolver_entry_get(self, key, hostname, port);
+	if (net_resolver_entry_fresh(self, entry, key)) {
+		count = net_resolver_entry_result(entry, addresses, &error);
+		lcom_mutex_unlock(self->mutex);
+
+		callback(self, addresses, count, error, ctx);
+		lerror_delete(&error);
+		lstring_delete(key);
+		return;
+	}
+
+	waiter = (struct net_resolver_waiter *)lmalloc(sizeof(struct net_resolver_waiter));
+	waiter->callback = callback;
+	waiter->ctx = ctx;
+	waiter->loop = loop;
+	waiter->next = entry->waiters;
+	entry->waiters = waiter;
+
+	if (entry->pending) {
+		self->stats.shared++;
+	} else {
+		entry->pending = LTRUE;
+		self->stats.misses++;
+		net_resolver_submit(self, key);
+	}
+	lcom_mutex_unlock(self->mutex);
+
+	lstring_delete(key);
+}
+
+void NetResolver_forget(NetResolver *self, const char *hostname, const char *port) {
+	struct net_resolver_entry *entry;
+	lstring *key;
+
+	l_assert(self!=NULL);
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+
+	key = net_resolver_key_f(lstring_new(), hostname, port);
+
+	lcom_mutex_lock(self->mutex);
+	entry = (struct net_resolver_entry *)lhashtable_get(self->entries, key);
+	if (entry!=NULL && !entry->pending) {
+		lhashtable_remove(self->entries, key);
+	}
+	lcom_mutex_unlock(self->mutex);
+
+	lstring_delete(key);
+}
+
+void NetResolver_clear(NetResolver *self) {
+	l_assert(self!=NULL);
+
+	lcom_mutex_lock(self->mutex);
+	net_resolver_remove_idle(self);
+	lcom_mutex_unlock(self->mutex);
+}
+
+void NetResolver_get_stats(NetResolver *self, NetResolverStats *stats) {
+	l_assert(self!=NULL);
+	l_assert(stats!=NULL);
+
+	lcom_mutex_lock(self->mutex);
+	*stats = self->stats;
+	lcom_mutex_unlock(self->mutex);
+}
+
+void NetResolver_destroy(NetResolver *self) {
+	if (self==NULL) return;
+
+	/* The lookups already submitted are completed */
+	if (self->pool!=NULL) {
+		lcom_threadpool_destroy(self->pool);
+	}
+
+	lhashtable_destroy(self->entries);
+	lcom_cond_destroy(self->completed);
+	lcom_mutex_destroy(self->mutex);
+	lfree(self);
+}
@@ -0,0 +1,226 @@
+#ifndef __COMMONLIB_NET_RESOLVER_H
+#define __COMMONLIB_NET_RESOLVER_H
+
+#include "lerror.h"
+#include "evloop.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+/**
+ * Class: NetResolver
+ * Resolve host names with getaddrinfo, keeping the results in a cache
+ * shared by every thread.
+ *
+ * The addresses are kept for a configurable time, and the failures for
+ * a shorter one (negative caching), so a storm of reconnections to the
+ * same host makes a single lookup. Concurrent lookups of the same host
+ * wait for the one already running. When a cached host is used near the
+ * end of its time, it is resolved again in the background while the
+ * cached addresses keep being returned.
+ *
+ * The lookups can be made synchronously or asynchronously, in a pool of
+ * threads, delivering the result in the thread of an <EventLoop>.
+ */
+typedef struct NetResolver NetResolver;
+
+/**
+ * Constant: NETRESOLVER_MAX_ADDRESSES
+ * The maximum number of addresses kept for every host
+ */
+#define NETRESOLVER_MAX_ADDRESSES 16
+
+/**
+ * Constant: NETRESOLVER_DEFAULT_TTL_MILLIS
+ * How long the default resolver keeps the addresses of a host
+ */
+#define NETRESOLVER_DEFAULT_TTL_MILLIS 30000
+
+/**
+ * Constant: NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS
+ * How long the default resolver keeps a failure
+ */
+#define NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS 5000
+
+/**
+ * Struct: NetAddress
+ * An address of a host
+ *
+ * Fields:
+ *     family - The address family, AF_INET or AF_INET6
+ *     len - The length of the address
+ *     addr - The address, including the port
+ */
+typedef struct NetAddress {
+	int family;
+	socklen_t len;
+	struct sockaddr_storage addr;
+} NetAddress;
+
+/**
+ * Struct: NetResolverStats
+ * The counters of a resolver
+ *
+ * Fields:
+ *     hits - The lookups answered by the cache with the addresses
+ *     negativeHits - The lookups answered by the cache with a failure
+ *     misses - The lookups that called getaddrinfo
+ *     shared - The lookups that waited for the same host being resolved
+ *     refreshes - The hosts resolved again in the background
+ *     failures - The calls to getaddrinfo that failed
+ */
+typedef struct NetResolverStats {
+	long long hits;
+	long long negativeHits;
+	long long misses;
+	long long shared;
+	long long refreshes;
+	long long failures;
+} NetResolverStats;
+
+/**
+ * Type: NetResolver_callback
+ * The function receiving the result of <NetResolver_resolve_async>
+ * Parameters:
+ *     resolver - The resolver
+ *     addresses - The addresses, valid only during the call
+ *     count - The number of addresses, or -1 if the host can't be resolved
+ *     error - The reason of the failure, NULL on success. It is deleted
+ *         after the call.
+ *     ctx - The context passed to <NetResolver_resolve_async>
+ */
+typedef void (*NetResolver_callback)(NetResolver *resolver, const NetAddress *addresses, int count, lerror *error, void *ctx);
+
+/**
+ * Function: NetResolver_new
+ * Create a resolver
+ * Parameters:
+ *     nThreads - The number of threads making the asynchronous lookups
+ *         and the background refreshes. They are started by the first
+ *         one.
+ *     ttlMillis - How long the addresses of a host are kept, or zero to
+ *         only share the concurrent lookups
+ *     negativeTtlMillis - How long a failure is kept
+ */
+NetResolver *NetResolver_new(int nThreads, int ttlMillis, int negativeTtlMillis);
+
+/**
+ * Function: NetResolver_get_default
+ * Get the resolver used by <TCPSocket_connect> and <TCPListenSocket_new>,
+ * with NETRESOLVER_DEFAULT_TTL_MILLIS and
+ * NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS. It is never destroyed.
+ */
+NetResolver *NetResolver_get_default(void);
+
+/**
+ * Function: NetResolver_set_ttl
+ * Change how long the results are kept. The results already in the cache
+ * are forgotten.
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ *     ttlMillis - How long the addresses of a host are kept, or zero
+ *     negativeTtlMillis - How long a failure is kept, or zero
+ */
+void NetResolver_set_ttl(NetResolver *self, int ttlMillis, int negativeTtlMillis);
+
+/**
+ * Function: NetResolver_resolve
+ * Get the addresses of a host, from the cache or waiting for the lookup.
+ * The addresses of the two families are alternated, as suggested by
+ * RFC 8305.
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ *     hostname - The host name or IP address (must not be NULL)
+ *     port - The TCP port number or the service name (must not be NULL)
+ *     dest - Where the addresses are copied, with room for
+ *         NETRESOLVER_MAX_ADDRESSES of them
+ * Returns:
+ *     The number of addresses or -1 if the host can't be resolved
+ */
+int NetResolver_resolve(NetResolver *self, const char *hostname, const char *port, NetAddress *dest, lerror **error);
+
+/**
+ * Function: NetResolver_resolve_async
+ * Get the addresses of a host without waiting for the lookup. When the
+ * result is in the cache the callback is called immediately by this
+ * function.
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ *     hostname - The host name or IP address (must not be NULL)
+ *     port - The TCP port number or the service name (must not be NULL)
+ *     loop - The event loop whose thread calls the callback, or NULL to
+ *         call it in the thread of the resolver
+ *     callback - The function receiving the addresses (must not be NULL)
+ *     ctx - Passed to the callback
+ */
+void NetResolver_resolve_async(NetResolver *self, const char *hostname, const char *port,
+	EventLoop *loop, NetResolver_callback callback, void *ctx);
+
+/**
+ * Function: NetResolver_forget
+ * Forget the result kept for a host, for example because none of its
+ * addresses can be connected anymore
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ *     hostname - The host name or IP address (must not be NULL)
+ *     port - The TCP port number or the service name (must not be NULL)
+ */
+void NetResolver_forget(NetResolver *self, const char *hostname, const char *port);
+
+/**
+ * Function: NetResolver_clear
+ * Forget every result kept by the cache
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ */
+void NetResolver_clear(NetResolver *self);
+
+/**
+ * Function: NetResolver_get_stats
+ * Get a copy of the counters of the resolver
+ * Parameters:
+ *     self - The resolver (must not be NULL)
+ *     stats - Where the counters are copied (must not be NULL)
+ */
+void NetResolver_get_stats(NetResolver *self, NetResolverStats *stats);
+
+/**
+ * Function: NetResolver_destroy
+ * Destroy the resolver, waiting for the lookups already started. Their
+ * callbacks are still called.
+ * Parameters:
+ *     self - The resolver (may be NULL)
+ */
+void NetResolver_destroy(NetResolver *self);
+
+#endif
@@ -0,0 +1,1106 @@
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "net_rpc.h"
+#include "evloop.h"
+#include "lcross.h"
+#include "llogging.h"
+#include "lmemory.h"
+#include "lstring.h"
+#include "lvector.h"
+#include "threading.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+
+/* Frame encoding */
+
+static void rpc_put_uint32(unsigned char *dest, unsigned int value) {
+	dest[0] = (unsigned char)(value >> 24);
+	dest[1] = (unsigned char)(value >> 16);
+	dest[2] = (unsigned char)(value >> 8);
+	dest[3] = (unsigned char)value;
+}
+
+static unsigned int rpc_get_uint32(const unsigned char *src) {
+	return ((unsigned int)src[0] << 24) | ((unsigned int)src[1] << 16) |
+		((unsigned int)src[2] << 8) | (unsigned int)src[3];
+}
+
+static void RpcFrame_encode_header(unsigned char *dest, const RpcFrameHeader *header, int len) {
+	rpc_put_uint32(dest, (unsigned int)len);
+	rpc_put_uint32(dest+4, header->id);
+	dest[8] = (unsigned char)header->type;
+	dest[9] = 0;
+	dest[10] = (unsigned char)(header->method >> 8);
+	dest[11] = (unsigned char)header->method;
+}
+
+static void RpcFrame_decode_header(const unsigned char *src, RpcFrameHeader *header) {
+	header->length = rpc_get_uint32(src);
+	header->id = rpc_get_uint32(src+4);
+	header->type = src[8];
+	header->method = (src[10] << 8) | src[11];
+}
+
+void RpcFrame_send(TCPSocket *socket, const RpcFrameHeader *header, const void *payload, int len, lerror **error) {
+	unsigned char buf[RPC_FRAME_HEADER_SIZE];
+	struct iovec iov[2];
+
+	l_assert(socket!=NULL);
+	l_assert(header!=NULL);
+	l_assert(payload!=NULL || len==0);
+	l_assert(error==NULL || *error==NULL);
+
+	RpcFrame_encode_header(buf, header, len);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = RPC_FRAME_HEADER_SIZE;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	TCPSocket_sendv(socket, iov, len>0 ? 2 : 1, error);
+}
+
+/* Append a whole frame to a buffer */
+static void RpcFrame_append(MemBuffer *dest, const RpcFrameHeader *header, const void *payload, int len) {
+	unsigned char buf[RPC_FRAME_HEADER_SIZE];
+
+	RpcFrame_encode_header(buf, header, len);
+	MemBuffer_write(dest, buf, RPC_FRAME_HEADER_SIZE);
+	if (len>0) {
+		MemBuffer_write(dest, (void *)payload, len);
+	}
+}
+
+int RpcFrame_recv(TCPSocket *socket, RpcFrameHeader *header, MemBuffer *payload, int maxLen, lerror **error) {
+	unsigned char buf[RPC_FRAME_HEADER_SIZE];
+	int rc;
+
+	l_assert(socket!=NULL);
+	l_assert(header!=NULL);
+	l_assert(payload!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	rc = TCPSocket_read_exact(socket, buf, RPC_FRAME_HEADER_SIZE, error);
+	if (rc<=0) {
+		return rc;
+	}
+
+	RpcFrame_decode_header(buf, header);
+	if (header->length>(unsigned int)maxLen) {
+		lerror_set_sprintf(error, "Frame too big: %u bytes", header->length);
+		return -1;
+	}
+
+	MemBuffer_setlen(payload, 0);
+	if (header->length>0) {
+		MemBuffer_ensure_space(payload, header->length);
+		rc = TCPSocket_read_exact(socket, MemBuffer_address(payload), header->length, error);
+		if (rc==0) {
+			lerror_set_sprintf(error, "Connection closed inside a frame");
+			return -1;
+		} else if (rc<0) {
+			return -1;
+		}
+		MemBuffer_setlen(payload, header->length);
+	}
+
+	return 1;
+}
+
+/* Server */
+
+struct RpcServer_handler {
+	RpcHandler handler;
+	void *ctx;
+};
+
+struct RpcServer_connection {
+	RpcServer *server;
+	TCPSocket *socket;
+
+	/* Protects refs, closed and outgoing. The connection is referenced
+	 * by the event loop, until it's closed, by every request being
+	 * executed and while it waits in the flush queue */
+	lcom_mutex_t *mutex;
+	int refs;
+	lbool closed;
+
+	/* The responses completed by the workers. Only the event loop thread
+	 * writes on the socket: it moves them in the sending buffer, whose
+	 * data from sendPos is not sent yet, and waits for the socket to be
+	 * writable when it's full */
+	MemBuffer *outgoing;
+	MemBuffer *sending;
+	int sendPos;
+	lbool waitingWritable;
+
+	/* No request is read while the responses not sent are more than
+	 * the server maxPendingOutput */
+	lbool readPaused;
+
+	/* Protected by the server flushMutex */
+	lbool flushQueued;
+	struct RpcServer_connection *nextFlush;
+
+	/* The request being read by the event loop */
+	lbool haveHeader;
+	RpcFrameHeader header;
+	char *payload;
+
+	struct RpcServer_connection *prev;
+	struct RpcServer_connection *next;
+};
+
+struct RpcServer_request {
+	struct RpcServer_connection *connection;
+	RpcFrameHeader header;
+	char *payload;
+};
+
+struct RpcServer {
+	lstring *hostname;
+	lstring *port;
+	int nWorkers;
+	int maxFrameSize;
+	int maxPendingOutput;
+	lvector *handlers;
+
+	TCPListenSocket *listenSocket;
+	EventLoop *loop;
+	lcom_thread_t *thread;
+	lcom_threadpool_t *pool;
+
+	/* The open connections, only used by the event loop thread */
+	struct RpcServer_connection *connections;
+
+	/* The connections with new responses to send, and if a function
+	 * sending them is already posted to the event loop */
+	lcom_mutex_t *flushMutex;
+	struct RpcServer_connection *flushQueue;
+	lbool flushPosted;
+};
+
+RpcServer *RpcServer_new(const char *hostname, const char *port, int nWorkers) {
+	RpcServer *self;
+
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(nWorkers>0);
+
+	self = (RpcServer *)lmalloczero(sizeof(struct RpcServer));
+	self->hostname = lstring_new_from_cstr(hostname);
+	self->port = lstring_new_from_cstr(port);
+	self->nWorkers = nWorkers;
+	self->maxFrameSize = RPC_MAX_FRAME_SIZE;
+	self->maxPendingOutput = RPC_MAX_PENDING_OUTPUT;
+	self->handlers = lvector_new(0);
+	self->flushMutex = lcom_mutex_new();
+	return self;
+}
+
+void RpcServer_add_handler(RpcServer *self, int method, RpcHandler handler, void *ctx) {
+	struct RpcServer_handler *entry;
+	int i;
+
+	l_assert(self!=NULL);
+	l_assert(method>=0 && method<=0xffff);
+	l_assert(handler!=NULL);
+	l_assert(self->thread==NULL);
+
+	if (method>=lvector_len(self->handlers)) {
+		i = lvector_len(self->handlers);
+		lvector_resize(self->handlers, method+1);
+		for (; i<=method; i++) {
+			lvector_set(self->handlers, i, NULL);
+		}
+	}
+
+	entry = (struct RpcServer_handler *)lvector_at(self->handlers, method);
+	if (entry==NULL) {
+		entry = (struct RpcServer_handler *)lmalloc(sizeof(struct RpcServer_handler));
+		lvector_set(self->handlers, method, entry);
+	}
+	entry->handler = handler;
+	entry->ctx = ctx;
+}
+
+void RpcServer_set_max_frame_size(RpcServer *self, int maxLen) {
+	l_assert(self!=NULL);
+	l_assert(maxLen>=0);
+
+	self->maxFrameSize = maxLen;
+}
+
+void RpcServer_set_max_pending_output(RpcServer *self, int maxLen) {
+	l_assert(self!=NULL);
+	l_assert(maxLen>=0);
+
+	self->maxPendingOutput = maxLen;
+}
+
+static void RpcServer_release(struct RpcServer_connection *connection) {
+	lbool last;
+
+	lcom_mutex_lock(connection->mutex);
+	connection->refs--;
+	last = connection->refs==0;
+	lcom_mutex_unlock(connection->mutex);
+
+	if (last) {
+		TCPSocket_destroy(connection->socket);
+		lcom_mutex_destroy(connection->mutex);
+		MemBuffer_destroy(connection->outgoing);
+		MemBuffer_destroy(connection->sending);
+		lfree(connection);
+	}
+}
+
+/* Called in the event loop thread */
+static void RpcServer_close(struct RpcServer_connection *connection) {
+	RpcServer *server = connection->server;
+	int fd = TCPSocket_get_fd(connection->socket);
+
+	EventLoop_remove(server->loop, fd);
+
+	if (connection->prev!=NULL) {
+		connection->prev->next = connection->next;
+	} else {
+		server->connections = connection->next;
+	}
+	if (connection->next!=NULL) {
+		connection->next->prev = connection->prev;
+	}
+
+	if (connection->payload!=NULL) {
+		lfree(connection->payload);
+		connection->payload = NULL;
+	}
+
+	/* The following responses are discarded */
+	lcom_mutex_lock(connection->mutex);
+	connection->closed = LTRUE;
+	lcom_mutex_unlock(connection->mutex);
+	shutdown(fd, SHUT_RDWR);
+
+	RpcServer_release(connection);
+}
+
+/* Called in the event loop thread. The length of the responses not
+ * sent yet */
+static int RpcServer_pending_output(struct RpcServer_connection *connection) {
+	int result;
+
+	lcom_mutex_lock(connection->mutex);
+	result = MemBuffer_len(connection->outgoing);
+	lcom_mutex_unlock(connection->mutex);
+
+	return result + MemBuffer_len(connection->sending) - connection->sendPos;
+}
+
+/* Called in the event loop thread. Watch the events the connection is
+ * waiting for */
+static lbool RpcServer_update_events(struct RpcServer_connection *connection, lerror **error) {
+	int events = 0;
+
+	if (!connection->readPaused) {
+		events |= EVENTLOOP_READ;
+	}
+	if (connection->waitingWritable) {
+		events |= EVENTLOOP_WRITE;
+	}
+	return EventLoop_modify(connection->server->loop, TCPSocket_get_fd(connection->socket), events, error);
+}
+
+/* Called in the event loop thread after sending some responses. The
+ * requests already buffered by the socket must be read by the caller */
+static void RpcServer_resume_reading(struct RpcServer_connection *connection) {
+	if (connection->readPaused && RpcServer_pending_output(connection)<=connection->server->maxPendingOutput) {
+		connection->readPaused = LFALSE;
+		RpcServer_update_events(connection, NULL);
+	}
+}
+
+/* Called in the event loop thread. Send the responses of a connection
+ * until the socket is full, then wait for it to be writable. Returns
+ * LFALSE if the connection is closed */
+static lbool RpcServer_flush(struct RpcServer_connection *connection) {
+	lerror *error = NULL;
+	lbool closed;
+	int rc;
+
+	lcom_mutex_lock(connection->mutex);
+	closed = connection->closed;
+	if (!closed && MemBuffer_len(connection->outgoing)>0) {
+		MemBuffer_write(connection->sending, MemBuffer_address(connection->outgoing), MemBuffer_len(connection->outgoing));
+		MemBuffer_setlen(connection->outgoing, 0);
+	}
+	lcom_mutex_unlock(connection->mutex);
+
+	if (closed) {
+		return LFALSE;
+	}
+
+	while (connection->sendPos<MemBuffer_len(connection->sending)) {
+		rc = TCPSocket_send(connection->socket, MemBuffer_address(connection->sending)+connection->sendPos,
+			MemBuffer_len(connection->sending)-connection->sendPos, &error);
+		if (rc==TCPSOCKET_WOULD_BLOCK) {
+			if (!connection->waitingWritable) {
+				connection->waitingWritable = LTRUE;
+				if (!RpcServer_update_events(connection, &error)) {
+					break;
+				}
+			}
+			RpcServer_resume_reading(connection);
+			return LTRUE;
+		} else if (rc<=0) {
+			if (error==NULL) {
+				lerror_set(&error, "Connection closed");
+			}
+			break;
+		}
+		connection->sendPos += rc;
+	}
+
+	if (error!=NULL) {
+		l_error("Can't send the RPC response: %s", error->message);
+		lerror_delete(&error);
+		RpcServer_close(connection);
+		return LFALSE;
+	}
+
+	MemBuffer_setlen(connection->sending, 0);
+	connection->sendPos = 0;
+	if (connection->waitingWritable) {
+		connection->waitingWritable = LFALSE;
+		RpcServer_update_events(connection, NULL);
+	}
+	RpcServer_resume_reading(connection);
+	return LTRUE;
+}
+
+static void RpcServer_read_requests(struct RpcServer_connection *connection);
+
+/* Posted to the event loop by the workers. Called directly by
+ * RpcServer_destroy when the loop is stopped */
+static void RpcServer_flush_queued(EventLoop *loop, void *ctx) {
+	RpcServer *server = (RpcServer *)ctx;
+	struct RpcServer_connection *connection;
+	struct RpcServer_connection *queue;
+	lbool paused;
+
+	lcom_mutex_lock(server->flushMutex);
+	queue = server->flushQueue;
+	server->flushQueue = NULL;
+	server->flushPosted = LFALSE;
+	lcom_mutex_unlock(server->flushMutex);
+
+	while (queue!=NULL) {
+		/* Once unmarked, the connection can be queued again by a worker,
+		 * overwriting nextFlush */
+		connection = queue;
+		lcom_mutex_lock(server->flushMutex);
+		queue = connection->nextFlush;
+		connection->flushQueued = LFALSE;
+		lcom_mutex_unlock(server->flushMutex);
+
+		/* The reading resumed here continues with the requests already
+		 * buffered, which don't wake up the event loop. The workers are
+		 * gone when called by RpcServer_destroy. */
+		paused = connection->readPaused;
+		if (RpcServer_flush(connection) && paused && !connection->readPaused && server->pool!=NULL) {
+			RpcServer_read_requests(connection);
+		}
+		RpcServer_release(connection);
+	}
+}
+
+/* Called by the workers. Queue a response for the event loop thread */
+static void RpcServer_send_response(struct RpcServer_connection *connection, const RpcFrameHeader *header, const void *payload, int len) {
+	RpcServer *server = connection->server;
+	lbool closed;
+	lbool post = LFALSE;
+
+	lcom_mutex_lock(connection->mutex);
+	closed = connection->closed;
+	if (!closed) {
+		RpcFrame_append(connection->outgoing, header, payload, len);
+	}
+	lcom_mutex_unlock(connection->mutex);
+
+	if (closed) {
+		return;
+	}
+
+	lcom_mutex_lock(server->flushMutex);
+	if (!connection->flushQueued) {
+		lcom_mutex_lock(connection->mutex);
+		connection->refs++;
+		lcom_mutex_unlock(connection->mutex);
+
+		connection->flushQueued = LTRUE;
+		connection->nextFlush = server->flushQueue;
+		server->flushQueue = connection;
+	}
+	if (!server->flushPosted) {
+		server->flushPosted = LTRUE;
+		post = LTRUE;
+	}
+	lcom_mutex_unlock(server->flushMutex);
+
+	if (post) {
+		EventLoop_post(server->loop, RpcServer_flush_queued, server);
+	}
+}
+
+static void RpcServer_execute(void *arg) {
+	struct RpcServer_request *request = (struct RpcServer_request *)arg;
+	struct RpcServer_connection *connection = request->connection;
+	RpcServer *server = connection->server;
+	struct RpcServer_handler *entry = NULL;
+	RpcFrameHeader header;
+	MemBuffer *response = MemBuffer_new(256);
+	lerror *error = NULL;
+
+	if (request->header.method<lvector_len(server->handlers)) {
+		entry = (struct RpcServer_handler *)lvector_at(server->handlers, request->header.method);
+	}
+
+	if (entry==NULL) {
+		lerror_set_sprintf(&error, "Unknown method %i", request->header.method);
+	} else {
+		entry->handler(entry->ctx, request->payload, request->header.length, response, &error);
+	}
+
+	header.length = 0;
+	header.id = request->header.id;
+	header.method = request->header.method;
+
+	if (error!=NULL) {
+		header.type = RPC_FRAME_ERROR;
+		RpcServer_send_response(connection, &header, error->message, strlen(error->message));
+	} else {
+		header.type = RPC_FRAME_RESPONSE;
+		RpcServer_send_response(connection, &header, MemBuffer_address(response), MemBuffer_len(response));
+	}
+
+	lerror_delete(&error);
+	MemBuffer_destroy(response);
+	if (request->payload!=NULL) {
+		lfree(request->payload);
+	}
+	lfree(request);
+
+	RpcServer_release(connection);
+}
+
+/* Called in the event loop thread. The frames are read until the socket
+ * would block, since the buffered reader may already hold the following
+ * ones, or until the responses not sent are too many */
+static void RpcServer_read_requests(struct RpcServer_connection *connection) {
+	RpcServer *server = connection->server;
+	struct RpcServer_request *request;
+	unsigned char buf[RPC_FRAME_HEADER_SIZE];
+	lerror *error = NULL;
+	int rc;
+
+	for (;;) {
+		if (!connection->haveHeader) {
+			if (RpcServer_pending_output(connection)>server->maxPendingOutput) {
+				/* RpcServer_flush resumes the reading */
+				connection->readPaused = LTRUE;
+				if (RpcServer_update_events(connection, &error)) {
+					return;
+				}
+				break;
+			}
+
+			rc = TCPSocket_read_exact(connection->socket, buf, RPC_FRAME_HEADER_SIZE, &error);
+			if (rc==TCPSOCKET_WOULD_BLOCK) {
+				return;
+			} else if (rc<=0) {
+				break;
+			}
+
+			RpcFrame_decode_header(buf, &connection->header);
+			if (connection->header.type!=RPC_FRAME_REQUEST) {
+				lerror_set_sprintf(&error, "Unexpected frame type %i", connection->header.type);
+				break;
+			} else if (connection->header.length>(unsigned int)server->maxFrameSize) {
+				lerror_set_sprintf(&error, "Frame too big: %u bytes", connection->header.length);
+				break;
+			}
+
+			connection->haveHeader = LTRUE;
+			if (connection->header.length>0) {
+				connection->payload = (char *)lmalloc(connection->header.length);
+			}
+		}
+
+		if (connection->header.length>0) {
+			rc = TCPSocket_read_exact(connection->socket, connection->payload, connection->header.length, &error);
+			if (rc==TCPSOCKET_WOULD_BLOCK) {
+				return;
+			} else if (rc==0) {
+				lerror_set_sprintf(&error, "Connection closed inside a frame");
+				break;
+			} else if (rc<0) {
+				break;
+			}
+		}
+
+		request = (struct RpcServer_request *)lmalloc(sizeof(struct RpcServer_request));
+		request->connection = connection;
+		request->header = connection->header;
+		request->payload = connection->payload;
+		connection->payload = NULL;
+		connection->haveHeader = LFALSE;
+
+		lcom_mutex_lock(connection->mutex);
+		connection->refs++;
+		lcom_mutex_unlock(connection->mutex);
+
+		lcom_threadpool_submit(server->pool, RpcServer_execute, request);
+	}
+
+	if (error!=NULL) {
+		l_error("RPC connection closed: %s", error->message);
+		lerror_delete(&error);
+	}
+	RpcServer_close(connection);
+}
+
+static void RpcServer_on_event(EventLoop *loop, int fd, int events, void *ctx) {
+	struct RpcServer_connection *connection = (struct RpcServer_connection *)ctx;
+	lbool paused = connection->readPaused;
+
+	if (events & EVENTLOOP_WRITE) {
+		if (!RpcServer_flush(connection)) {
+			return;
+		}
+	}
+
+	if (connection->readPaused) {
+		/* Only the errors are watched, besides the writes */
+		if (events & EVENTLOOP_ERROR) {
+			RpcServer_close(connection);
+		}
+	} else if (paused || (events & (EVENTLOOP_READ | EVENTLOOP_ERROR))) {
+		RpcServer_read_requests(connection);
+	}
+}
+
+static void RpcServer_on_accept(EventLoop *loop, int fd, int events, void *ctx) {
+	RpcServer *self = (RpcServer *)ctx;
+	struct RpcServer_connection *connection;
+	TCPSocket *socket;
+	lerror *error = NULL;
+
+	for (;;) {
+		socket = TCPListenSocket_accept(self->listenSocket, &error);
+		if (socket==NULL) {
+			break;
+		}
+
+		if (!TCPSocket_set_nonblocking(socket, LTRUE, &error) ||
+			!TCPSocket_set_nodelay(socket, LTRUE, &error)) {
+			TCPSocket_destroy(socket);
+			break;
+		}
+
+		connection = (struct RpcServer_connection *)lmalloczero(sizeof(struct RpcServer_connection));
+		connection->server = self;
+		connection->socket = socket;
+		connection->mutex = lcom_mutex_new();
+		connection->outgoing = MemBuffer_new(1024);
+		connection->sending = MemBuffer_new(1024);
+		connection->refs = 1;
+
+		if (!EventLoop_add(loop, TCPSocket_get_fd(socket), EVENTLOOP_READ, RpcServer_on_event, connection, &error)) {
+			TCPSocket_destroy(socket);
+			lcom_mutex_destroy(connection->mutex);
+			MemBuffer_destroy(connection->outgoing);
+			MemBuffer_destroy(connection->sending);
+			lfree(connection);
+			break;
+		}
+
+		connection->next = self->connections;
+		if (self->connections!=NULL) {
+			self->connections->prev = connection;
+		}
+		self->connections = connection;
+	}
+
+	if (error!=NULL) {
+		l_error("Can't accept the RPC connection: %s", error->message);
+		lerror_delete(&error);
+	}
+}
+
+static void RpcServer_run(void *arg) {
+	RpcServer *self = (RpcServer *)arg;
+
+	EventLoop_run(self->loop);
+}
+
+lbool RpcServer_start(RpcServer *self, lerror **error) {
+	TCPListenOptions options;
+
+	l_assert(self!=NULL);
+	l_assert(self->thread==NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	TCPListenOptions_init(&options);
+	options.nonBlocking = LTRUE;
+
+	self->listenSocket = TCPListenSocket_new_with_options(self->hostname, self->port, &options, error);
+	if (self->listenSocket==NULL) {
+		return LFALSE;
+	}
+
+	self->loop = EventLoop_new(error);
+	if (self->loop==NULL) {
+		TCPListenSocket_destroy(self->listenSocket);
+		self->listenSocket = NULL;
+		return LFALSE;
+	}
+
+	if (!EventLoop_add(self->loop, TCPListenSocket_get_fd(self->listenSocket), EVENTLOOP_READ, RpcServer_on_accept, self, error)) {
+		EventLoop_destroy(self->loop);
+		self->loop = NULL;
+		TCPListenSocket_destroy(self->listenSocket);
+		self->listenSocket = NULL;
+		return LFALSE;
+	}
+
+	self->pool = lcom_threadpool_new(self->nWorkers);
+	self->thread = lcom_thread_start(RpcServer_run, self);
+	return LTRUE;
+}
+
+void RpcServer_destroy(RpcServer *self) {
+	int i;
+
+	if (self==NULL) {
+		return;
+	}
+
+	if (self->thread!=NULL) {
+		EventLoop_stop(self->loop);
+		lcom_thread_join(self->thread);
+	}
+
+	/* The requests already read are executed and their responses are
+	 * sent, as far as the sockets accept them, before closing the
+	 * connections */
+	lcom_threadpool_destroy(self->pool);
+	self->pool = NULL;
+	if (self->loop!=NULL) {
+		RpcServer_flush_queued(self->loop, self);
+	}
+	while (self->connections!=NULL) {
+		RpcServer_close(self->connections);
+	}
+
+	if (self->listenSocket!=NULL) {
+		EventLoop_remove(self->loop, TCPListenSocket_get_fd(self->listenSocket));
+		TCPListenSocket_destroy(self->listenSocket);
+	}
+	EventLoop_destroy(self->loop);
+
+	for (i=0; i<lvector_len(self->handlers); i++) {
+		if (lvector_at(self->handlers, i)!=NULL) {
+			lfree(lvector_at(self->handlers, i));
+		}
+	}
+	lvector_delete(self->handlers);
+	lcom_mutex_destroy(self->flushMutex);
+	lstring_delete(self->hostname);
+	lstring_delete(self->port);
+	lfree(self);
+}
+
+/* Client */
+
+struct RpcClient_call {
+	unsigned int id;
+	lcom_cond_t *cond;
+	lbool done;
+	MemBuffer *response;
+	lstring *errorMessage;
+	struct RpcClient_call *next;
+};
+
+struct RpcClient_connection {
+	RpcClient *client;
+
+	/* Serializes the requests and the reconnections */
+	lcom_mutex_t *sendMutex;
+
+	/* Protects the calls, broken and nextId */
+	lcom_mutex_t *mutex;
+	struct RpcClient_call *calls;
+	lbool broken;
+	unsigned int nextId;
+
+	TCPSocket *socket;
+	lcom_thread_t *reader;
+
+	/* The request being sent with a deadline */
+	MemBuffer *frame;
+};
+
+struct RpcClient {
+	lstring *hostname;
+	lstring *port;
+	int nConnections;
+	int maxFrameSize;
+	struct RpcClient_connection *connections;
+
+	lcom_mutex_t *mutex;
+	int nextConnection;
+};
+
+RpcClient *RpcClient_new(const char *hostname, const char *port, int nConnections) {
+	RpcClient *self;
+	int i;
+
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(nConnections>0);
+
+	self = (RpcClient *)lmalloczero(sizeof(struct RpcClient));
+	self->hostname = lstring_new_from_cstr(hostname);
+	self->port = lstring_new_from_cstr(port);
+	self->nConnections = nConnections;
+	self->maxFrameSize = RPC_MAX_FRAME_SIZE;
+	self->mutex = lcom_mutex_new();
+	self->connections = (struct RpcClient_connection *)lmalloczero(sizeof(struct RpcClient_connection)*nConnections);
+
+	for (i=0; i<nConnections; i++) {
+		self->connections[i].client = self;
+		self->connections[i].sendMutex = lcom_mutex_new();
+		self->connections[i].mutex = lcom_mutex_new();
+		self->connections[i].frame = MemBuffer_new(256);
+	}
+
+	return self;
+}
+
+void RpcClient_set_max_frame_size(RpcClient *self, int maxLen) {
+	l_assert(self!=NULL);
+	l_assert(maxLen>=0);
+
+	self->maxFrameSize = maxLen;
+}
+
+/* Called with the connection mutex locked */
+static lbool RpcClient_unlink_call(struct RpcClient_connection *connection, struct RpcClient_call *call) {
+	struct RpcClient_call **link;
+
+	for (link=&connection->calls; *link!=NULL; link=&(*link)->next) {
+		if (*link==call) {
+			*link = call->next;
+			return LTRUE;
+		}
+	}
+	return LFALSE;
+}
+
+static void RpcClient_read_responses(void *arg) {
+	struct RpcClient_connection *connection = (struct RpcClient_connection *)arg;
+	struct RpcClient_call **link;
+	struct RpcClient_call *call;
+	RpcFrameHeader header;
+	MemBuffer *payload = MemBuffer_new(256);
+	lerror *error = NULL;
+	int rc;
+
+	for (;;) {
+		rc = RpcFrame_recv(connection->socket, &header, payload, connection->client->maxFrameSize, &error);
+		if (rc<=0) {
+			break;
+		}
+
+		lcom_mutex_lock(connection->mutex);
+		for (link=&connection->calls; *link!=NULL && (*link)->id!=header.id; link=&(*link)->next);
+
+		/* The calls timed out are not in the list anymore */
+		call = *link;
+		if (call!=NULL) {
+			*link = call->next;
+			if (header.type==RPC_FRAME_ERROR) {
+				call->errorMessage = lstring_append_cstr_f(lstring_new(), "Remote error: ");
+				call->errorMessage = lstring_append_generic_f(call->errorMessage, MemBuffer_address(payload), MemBuffer_len(payload));
+			} else {
+				MemBuffer_setlen(call->response, 0);
+				MemBuffer_write(call->response, MemBuffer_address(payload), MemBuffer_len(payload));
+			}
+			call->done = LTRUE;
+			lcom_cond_signal(call->cond);
+		}
+		lcom_mutex_unlock(connection->mutex);
+	}
+
+	/* The calls waiting for a response fail and the next call
+	 * opens a new connection */
+	lcom_mutex_lock(connection->mutex);
+	connection->broken = LTRUE;
+	while (connection->calls!=NULL) {
+		call = connection->calls;
+		connection->calls = call->next;
+		call->errorMessage = lstring_new_from_cstr(error!=NULL ? error->message : "Connection closed by the server");
+		call->done = LTRUE;
+		lcom_cond_signal(call->cond);
+	}
+	lcom_mutex_unlock(connection->mutex);
+
+	lerror_delete(&error);
+	MemBuffer_destroy(payload);
+}
+
+/* The milliseconds left before a deadline, at least one, or zero for
+ * the calls without a deadline */
+static int RpcClient_remaining_millis(long long deadline) {
+	long long remaining;
+
+	if (deadline==0) {
+		return 0;
+	}
+	remaining = (deadline - l_monotonic_time_micros() + 999)/1000;
+	return remaining>0 ? (int)remaining : 1;
+}
+
+/* Called with the send mutex locked. Send a request before the deadline.
+ * The socket is blocking, because the reader thread waits on it: every
+ * send is limited by SO_SNDTIMEO, set to the time left since the kernel
+ * restarts it at every call */
+static void RpcClient_send_request(struct RpcClient_connection *connection, const RpcFrameHeader *header,
+	const void *request, int len, long long deadline, lerror **error) {
+	MemBuffer *frame = connection->frame;
+	struct timeval tv;
+	int timeoutMillis;
+	int sent;
+	int rc;
+
+	if (deadline==0) {
+		RpcFrame_send(connection->socket, header, request, len, error);
+		return;
+	}
+
+	MemBuffer_setlen(frame, 0);
+	RpcFrame_append(frame, header, request, len);
+
+	for (sent=0; sent<MemBuffer_len(frame); sent+=rc) {
+		if (deadline<=l_monotonic_time_micros()) {
+			lerror_set(error, "Timeout sending the request");
+			return;
+		}
+
+		timeoutMillis = RpcClient_remaining_millis(deadline);
+		tv.tv_sec = timeoutMillis/1000;
+		tv.tv_usec = (timeoutMillis%1000)*1000;
+		if (setsockopt(TCPSocket_get_fd(connection->socket), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))<0) {
+			lerror_set_sprintf(error, "Cannot set the send timeout: %s", strerror(errno));
+			return;
+		}
+
+		rc = TCPSocket_send(connection->socket, MemBuffer_address(frame)+sent, MemBuffer_len(frame)-sent, NULL);
+		if (rc<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+			rc = 0;
+		} else if (rc<=0) {
+			lerror_set_sprintf(error, "Cannot send the request: %s", rc<0 ? strerror(errno) : "connection closed");
+			return;
+		}
+	}
+}
+
+/* Called with the send mutex locked */
+static lbool RpcClient_connect(struct RpcClient_connection *connection, int timeoutMillis, lerror **error) {
+	RpcClient *client = connection->client;
+
+	if (connection->reader!=NULL) {
+		lcom_thread_join(connection->reader);
+		connection->reader = NULL;
+	}
+	if (connection->socket!=NULL) {
+		TCPSocket_destroy(connection->socket);
+		connection->socket = NULL;
+	}
+
+	connection->socket = TCPSocket_connect_with_timeout(client->hostname, client->port, timeoutMillis, error);
+	if (connection->socket==NULL) {
+		return LFALSE;
+	}
+	TCPSocket_set_nodelay(connection->socket, LTRUE, NULL);
+
+	lcom_mutex_lock(connection->mutex);
+	connection->broken = LFALSE;
+	lcom_mutex_unlock(connection->mutex);
+
+	connection->reader = lcom_thread_start(RpcClient_read_responses, connection);
+	return LTRUE;
+}
+
+lbool RpcClient_call(RpcClient *self, int method, const void *request, int len, MemBuffer *response, int timeoutMillis, lerror **error) {
+	struct RpcClient_connection *connection;
+	struct RpcClient_call call;
+	RpcFrameHeader header;
+	lerror *sendError = NULL;
+	long long deadline = 0;
+	long long remaining;
+	lbool broken;
+	lbool result;
+
+	l_assert(self!=NULL);
+	l_assert(method>=0 && method<=0xffff);
+	l_assert(request!=NULL || len==0);
+	l_assert(response!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (timeoutMillis>0) {
+		deadline = l_monotonic_time_micros() + (long long)timeoutMillis*1000;
+	}
+
+	lcom_mutex_lock(self->mutex);
+	connection = &self->connections[self->nextConnection];
+	self->nextConnection = (self->nextConnection+1) % self->nConnections;
+	lcom_mutex_unlock(self->mutex);
+
+	memset(&call, 0, sizeof(call));
+	call.response = response;
+
+	lcom_mutex_lock(connection->sendMutex);
+
+	lcom_mutex_lock(connection->mutex);
+	broken = connection->socket==NULL || connection->broken;
+	lcom_mutex_unlock(connection->mutex);
+
+	if (broken && !RpcClient_connect(connection, RpcClient_remaining_millis(deadline), error)) {
+		lcom_mutex_unlock(connection->sendMutex);
+		return LFALSE;
+	}
+
+	call.cond = lcom_cond_new();
+	lcom_mutex_lock(connection->mutex);
+	call.id = connection->nextId++;
+	call.next = connection->calls;
+	connection->calls = &call;
+	lcom_mutex_unlock(connection->mutex);
+
+	header.length = 0;
+	header.id = call.id;
+	header.type = RPC_FRAME_REQUEST;
+	header.method = method;
+
+	/* A server that stops reading fails the call at its deadline. A frame
+	 * sent in part breaks the connection below. */
+	RpcClient_send_request(connection, &header, request, len, deadline, &sendError);
+
+	if (sendError!=NULL) {
+		/* The reader thread is stopped by the shutdown and fails the
+		 * other calls */
+		lcom_mutex_lock(connection->mutex);
+		RpcClient_unlink_call(connection, &call);
+		connection->broken = LTRUE;
+		lcom_mutex_unlock(connection->mutex);
+		shutdown(TCPSocket_get_fd(connection->socket), SHUT_RDWR);
+		lcom_mutex_unlock(connection->sendMutex);
+
+		lerror_propagate(error, sendError);
+		lcom_cond_destroy(call.cond);
+		return LFALSE;
+	}
+	lcom_mutex_unlock(connection->sendMutex);
+
+	lcom_mutex_lock(connection->mutex);
+	while (!call.done) {
+		if (timeoutMillis<=0) {
+			lcom_cond_wait(call.cond, connection->mutex);
+			continue;
+		}
+
+		remaining = deadline - l_monotonic_time_micros();
+		if (remaining<=0 || !lcom_cond_timed_wait(call.cond, connection->mutex, (int)((remaining+999)/1000))) {
+			if (!call.done && RpcClient_unlink_call(connection, &call)) {
+				call.errorMessage = lstring_new();
+				call.errorMessage = lstring_append_sprintf_f(call.errorMessage, "Timeout waiting for method %i after %i ms", method, timeoutMillis);
+				call.done = LTRUE;
+			}
+		}
+	}
+	lcom_mutex_unlock(connection->mutex);
+
+	result = call.errorMessage==NULL;
+	if (!result) {
+		lerror_set_sprintf(error, "%s", call.errorMessage);
+		lstring_delete(call.errorMessage);
+	}
+	lcom_cond_destroy(call.cond);
+	return result;
+}
+
+void RpcClient_destroy(RpcClient *self) {
+	struct RpcClient_connection *connection;
+	int i;
+
+	if (self==NULL) {
+		return;
+	}
+
+	for (i=0; i<self->nConnections; i++) {
+		connection = &self->connections[i];
+		if (connection->socket!=NULL) {
+			shutdown(TCPSocket_get_fd(connection->socket), SHUT_RDWR);
+		}
+		if (connection->reader!=NULL) {
+			lcom_thread_join(connection->reader);
+		}
+		TCPSocket_destroy(connection->socket);
+		lcom_mutex_destroy(connection->sendMutex);
+		lcom_mutex_destroy(connection->mutex);
+		MemBuffer_destroy(connection->frame);
+	}
+
+	lfree(self->connections);
+	lcom_mutex_destroy(self->mutex);
+	lstring_delete(self->hostname);
+	lstring_delete(self->port);
+	lfree(self);
+}
@@ -0,0 +1,286 @@
+#ifndef __COMMONLIB_NET_RPC_H
+#define __COMMONLIB_NET_RPC_H
+
+#include "lerror.h"
+#include "buffer.h"
+#include "net_socket.h"
+
+/*
+About: License
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
+*/ 
+
+/**
+ * File: net_rpc.h
+ * A framed messaging layer over <TCPSocket>. Every message is sent in
+ * a frame made by a 12 bytes header followed by the payload:
+ *
+ * - the length of the payload (4 bytes, big endian)
+ * - the request id (4 bytes, big endian)
+ * - the frame type (1 byte, see <RPC frame types>)
+ * - a reserved byte, always zero
+ * - the method (2 bytes, big endian)
+ *
+ * The responses carry the id of their request and can be sent in any
+ * order, so a client can have many requests outstanding on the same
+ * connection.
+ */
+
+/**
+ * Constants: RPC frame types
+ * RPC_FRAME_REQUEST - A request, whose payload is passed to the handler
+ *     of the method
+ * RPC_FRAME_RESPONSE - The successful response to a request
+ * RPC_FRAME_ERROR - The request failed and the payload is the error message
+ */
+#define RPC_FRAME_REQUEST 1
+#define RPC_FRAME_RESPONSE 2
+#define RPC_FRAME_ERROR 3
+
+/**
+ * Constant: RPC_FRAME_HEADER_SIZE
+ * The size of the frame header in bytes
+ */
+#define RPC_FRAME_HEADER_SIZE 12
+
+/**
+ * Constant: RPC_MAX_FRAME_SIZE
+ * The default maximum length of a payload. A peer sending a bigger frame
+ * is disconnected.
+ */
+#define RPC_MAX_FRAME_SIZE (16*1024*1024)
+
+/**
+ * Constant: RPC_MAX_PENDING_OUTPUT
+ * The default length of the responses waiting to be sent on a server
+ * connection beyond which its requests are not read anymore, see
+ * <RpcServer_set_max_pending_output>
+ */
+#define RPC_MAX_PENDING_OUTPUT (64*1024*1024)
+
+/**
+ * Struct: RpcFrameHeader
+ * The decoded header of a frame
+ *
+ * Fields:
+ *     length - The length of the payload
+ *     id - The request id
+ *     type - The frame type
+ *     method - The method, from 0 to 65535
+ */
+typedef struct RpcFrameHeader {
+	unsigned int length;
+	unsigned int id;
+	int type;
+	int method;
+} RpcFrameHeader;
+
+/**
+ * Function: RpcFrame_send
+ * Send a frame, with a single system call when the socket buffer
+ * has enough space
+ * Parameters:
+ *     socket - The socket (not NULL)
+ *     header - The header. The length field is ignored (not NULL)
+ *     payload - The payload (can be NULL if len is zero)
+ *     len - The length of the payload
+ *     error - The error object
+ */
+void RpcFrame_send(TCPSocket *socket, const RpcFrameHeader *header, const void *payload, int len, lerror **error);
+
+/**
+ * Function: RpcFrame_recv
+ * Receive a frame from a blocking socket
+ * Parameters:
+ *     socket - The socket (not NULL)
+ *     header - Filled with the received header (not NULL)
+ *     payload - The payload is written here, replacing the
+ *         previous content (not NULL)
+ *     maxLen - The maximum payload length accepted
+ *     error - The error object
+ * Returns:
+ *     1 when a frame was received, 0 if the connection was closed before
+ *     a new frame, -1 on error
+ */
+int RpcFrame_recv(TCPSocket *socket, RpcFrameHeader *header, MemBuffer *payload, int maxLen, lerror **error);
+
+/**
+ * Type: RpcHandler
+ * The function serving the requests of a method. It's called by the
+ * worker threads of the server, so it can be called concurrently.
+ * Parameters:
+ *     ctx - The context passed to <RpcServer_add_handler>
+ *     request - The payload of the request
+ *     len - The length of the payload
+ *     response - The payload of the response is written here
+ *     error - Set it to send the error message to the client instead
+ *         of the response
+ */
+typedef void (*RpcHandler)(void *ctx, const char *request, int len, MemBuffer *response, lerror **error);
+
+/**
+ * Class: RpcServer
+ * A server reading the frames of every connection in an event loop
+ * thread and executing the requests on a pool of worker threads. The
+ * requests of the same connection are executed concurrently and
+ * their responses are sent as soon as they are ready. The responses
+ * are written by the event loop thread, so a client not reading them
+ * never blocks the workers.
+ */
+typedef struct RpcServer RpcServer;
+
+/**
+ * Function: RpcServer_new
+ * Create a server. The socket is not opened until <RpcServer_start>.
+ * Parameters:
+ *     hostname - The address to listen to, like "0.0.0.0" (not NULL)
+ *     port - The port (not NULL)
+ *     nWorkers - The number of threads executing the handlers
+ */
+RpcServer *RpcServer_new(const char *hostname, const char *port, int nWorkers);
+
+/**
+ * Function: RpcServer_add_handler
+ * Register the handler of a method. This must be done before starting
+ * the server.
+ * Parameters:
+ *     self - The server (not NULL)
+ *     method - The method, from 0 to 65535
+ *     handler - The handler (not NULL)
+ *     ctx - Passed to the handler
+ */
+void RpcServer_add_handler(RpcServer *self, int method, RpcHandler handler, void *ctx);
+
+/**
+ * Function: RpcServer_set_max_frame_size
+ * Change the maximum payload length of the requests, <RPC_MAX_FRAME_SIZE>
+ * by default
+ * Parameters:
+ *     self - The server (not NULL)
+ *     maxLen - The maximum length
+ */
+void RpcServer_set_max_frame_size(RpcServer *self, int maxLen);
+
+/**
+ * Function: RpcServer_set_max_pending_output
+ * Change how many bytes of responses can wait to be sent on a connection,
+ * <RPC_MAX_PENDING_OUTPUT> by default. Beyond this length the server
+ * stops reading the requests of the connection until the client reads
+ * enough responses, so a client that sends requests without reading the
+ * responses can't make the server buffer them without bounds. The
+ * responses of the requests already being executed are still queued.
+ * Parameters:
+ *     self - The server (not NULL)
+ *     maxLen - The maximum length
+ */
+void RpcServer_set_max_pending_output(RpcServer *self, int maxLen);
+
+/**
+ * Function: RpcServer_start
+ * Open the listening socket and start the event loop thread
+ * Parameters:
+ *     self - The server (not NULL)
+ *     error - The error object
+ * Returns:
+ *     LTRUE if the server was started, LFALSE otherwise
+ */
+lbool RpcServer_start(RpcServer *self, lerror **error);
+
+/**
+ * Function: RpcServer_destroy
+ * Stop the server, waiting for the requests being executed, and close
+ * every connection. The responses not accepted by the sockets yet are
+ * discarded.
+ * Parameters:
+ *     self - The server (can be NULL)
+ */
+void RpcServer_destroy(RpcServer *self);
+
+/**
+ * Class: RpcClient
+ * A client keeping a pool of connections to a server. Every call
+ * chooses a connection in turn and waits for its response while the other
+ * threads can send their requests on the same connection. The broken
+ * connections are opened again by the next call.
+ *
+ * The client can be used by many threads at the same time.
+ */
+typedef struct RpcClient RpcClient;
+
+/**
+ * Function: RpcClient_new
+ * Create a client. The connections are opened by the first calls using them.
+ * Parameters:
+ *     hostname - The server address (not NULL)
+ *     port - The server port (not NULL)
+ *     nConnections - The number of connections in the pool
+ */
+RpcClient *RpcClient_new(const char *hostname, const char *port, int nConnections);
+
+/**
+ * Function: RpcClient_set_max_frame_size
+ * Change the maximum payload length of the responses, <RPC_MAX_FRAME_SIZE>
+ * by default. A bigger response closes the connection and fails the calls
+ * waiting on it. Must be called before the first call.
+ * Parameters:
+ *     self - The client (not NULL)
+ *     maxLen - The maximum length
+ */
+void RpcClient_set_max_frame_size(RpcClient *self, int maxLen);
+
+/**
+ * Function: RpcClient_call
+ * Send a request and wait for its response
+ * Parameters:
+ *     self - The client (not NULL)
+ *     method - The method, from 0 to 65535
+ *     request - The payload of the request (can be NULL if len is zero)
+ *     len - The length of the payload
+ *     response - The payload of the response is written here, replacing
+ *         the previous content (not NULL)
+ *     timeoutMillis - The maximum time to wait for the response, including
+ *         the time needed to connect and to send the request, or zero to
+ *         wait forever. A response arriving later is discarded.
+ *     error - The error object. The errors sent by the server are reported
+ *         here too.
+ * Returns:
+ *     LTRUE if the response was received, LFALSE otherwise
+ */
+lbool RpcClient_call(RpcClient *self, int method, const void *request, int len, MemBuffer *response, int timeoutMillis, lerror **error);
+
+/**
+ * Function: RpcClient_destroy
+ * Close the connections and destroy the client. There must be no calls
+ * in progress.
+ * Parameters:
+ *     self - The client (can be NULL)
+ */
+void RpcClient_destroy(RpcClient *self);
+
+#endif
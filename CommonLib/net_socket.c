@@ -29,37 +29,456 @@ For more information, please refer to <http://unlicense.org/>
 Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
 */ 
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "net_socket.h"
+#include "net_resolver.h"
 #include "lmemory.h"
 #include "lcross.h"
+#include "lhashtable.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define DEFAULT_CONNECTION_BACKLOG 5
+#ifdef NETSOCKET_USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+/* Kernel TLS, SSL_sendfile and BIO_get_ktls_send are available since
+ * OpenSSL 3.0 */
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER>=0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define NET_USE_KTLS
+#endif
+#endif
+
+
+/* Bytes requested to the kernel by every read of the buffered reader */
+#define READ_CHUNK_SIZE 16384
+
+/* Maximum number of buffers passed to every sendmsg */
+#define MAX_IOVEC 64
+
+/* Size of the buffer used to copy the files when the kernel can't
+ * move the data by itself */
+#define COPY_CHUNK_SIZE 65536
+
+/* Bytes moved by every splice, the default capacity of a pipe */
+#define PIPE_CHUNK_SIZE 65536
+
+/* Maximum number of bytes sent by every sendfile */
+#define SENDFILE_MAX_CHUNK (1024*1024*1024)
+
+/* The writes to a closed connection must fail with EPIPE instead of
+ * raising SIGPIPE, which would terminate the process */
+#ifdef MSG_NOSIGNAL
+#define NET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define NET_SEND_FLAGS 0
+#endif
+
+/* Delay before racing the next address of a host while the previous
+ * connections are still pending (RFC 8305) */
+#define CONNECT_ATTEMPT_DELAY_MILLIS 250
+
+/* Maximum size of the data in a TLS record: the small buffers sent
+ * together are copied to fill the records */
+#define TLS_RECORD_SIZE 16384
+
+/* Maximum number of servers whose TLS sessions are kept by a client
+ * context */
+#define MAX_TLS_SESSIONS 1024
+
+#ifdef NETSOCKET_USE_OPENSSL
+struct TCPTlsContext {
+	SSL_CTX *ctx;
+	lbool server;
+
+	/* The context is released by the last socket using it */
+	int refs;
+
+	/* The last session received from every server, by server name. Only
+	 * for the client contexts */
+	pthread_mutex_t mutex;
+	lhashtable *sessions;
+};
+#endif
 
 struct TCPListenSocket {	
 	int fd;
+	lbool nonBlocking;
 	lstring *localAddress;
+#ifdef NETSOCKET_USE_OPENSSL
+	TCPTlsContext *tls;
+#endif
 };
 
 struct TCPSocket {
 	int fd;
+	lbool nonBlocking;
 	lstring *localAddress;
 	lstring *remoteAddress;
+
+	/* How long the non-blocking socket waits while sending all the data,
+	 * -1 to wait forever */
+	int sendTimeoutMillis;
+
+	/* The data received by the buffered reader and not consumed yet,
+	 * starting from readPos */
+	MemBuffer *readBuffer;
+	int readPos;
+
+	/* The counters of the system calls made on this socket. The receiving
+	 * and the sending ones can be updated by two different threads */
+	TCPSocketStats stats;
+
+#ifdef NETSOCKET_USE_OPENSSL
+	/* The TLS connection, NULL for a plain socket. tlsWait is the event
+	 * OpenSSL needs before the last operation can be retried, which
+	 * can be a read while sending or a write while receiving */
+	SSL *ssl;
+	TCPTlsContext *tls;
+	lstring *tlsSessionKey;
+	short tlsWait;
+#endif
 };
 
+/* The counters of every socket, updated only when enabled */
+static int net_global_stats_enabled = 0;
+static TCPSocketStats net_global_stats;
+
+static lbool net_set_nonblocking(int fd, lbool enabled, lerror **error) {
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags<0) {
+		lerror_set_sprintf(error, "fcntl: %s", strerror(errno));
+		return LFALSE;
+	}
+
+	flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if (fcntl(fd, F_SETFL, flags)<0) {
+		lerror_set_sprintf(error, "fcntl: %s", strerror(errno));
+		return LFALSE;
+	}
+
+	return LTRUE;
+}
+
+static lbool net_would_block(void) {
+	return errno==EAGAIN || errno==EWOULDBLOCK;
+}
+
+/* The writes that can't use MSG_NOSIGNAL, like sendfile and the ones made
+ * by OpenSSL, block SIGPIPE in the calling thread and discard the signal
+ * they raised. Where SO_NOSIGPIPE exists it's set on every socket
+ * instead and the guard does nothing. */
+typedef struct NetSigpipeGuard {
+	sigset_t oldMask;
+	lbool wasPending;
+} NetSigpipeGuard;
+
+static void net_sigpipe_block(NetSigpipeGuard *guard) {
+#ifndef SO_NOSIGPIPE
+	sigset_t sigpipe;
+	sigset_t pending;
+
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	sigpending(&pending);
+	guard->wasPending = sigismember(&pending, SIGPIPE)==1;
+	pthread_sigmask(SIG_BLOCK, &sigpipe, &guard->oldMask);
+#endif
+}
+
+static void net_sigpipe_unblock(NetSigpipeGuard *guard) {
+#ifndef SO_NOSIGPIPE
+	int savedErrno = errno;
+	struct timespec zero = {0, 0};
+	sigset_t sigpipe;
+
+	if (savedErrno==EPIPE && !guard->wasPending) {
+		sigemptyset(&sigpipe);
+		sigaddset(&sigpipe, SIGPIPE);
+		sigtimedwait(&sigpipe, NULL, &zero);
+	}
+	pthread_sigmask(SIG_SETMASK, &guard->oldMask, NULL);
+	errno = savedErrno;
+#endif
+}
+
+/* Wait for a non-blocking socket to be readable */
+static void net_wait_readable(int fd) {
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	poll(&pfd, 1, -1);
+}
+
+#define net_global_add(field, value) \
+	__atomic_fetch_add(&net_global_stats.field, (value), __ATOMIC_RELAXED)
+
+static lbool net_global_stats_active(void) {
+	return __atomic_load_n(&net_global_stats_enabled, __ATOMIC_RELAXED)!=0;
+}
+
+/* Account a system call receiving data, given its result. It must be called
+ * before errno is changed */
+static void TCPSocket_count_recv(TCPSocket *self, ssize_t rc) {
+	lbool global = net_global_stats_active();
+
+	self->stats.recvCalls++;
+	if (global) net_global_add(recvCalls, 1);
+
+	if (rc>0) {
+		self->stats.bytesReceived += rc;
+		if (global) net_global_add(bytesReceived, rc);
+	} else if (rc==(-1) && net_would_block()) {
+		self->stats.recvWouldBlock++;
+		if (global) net_global_add(recvWouldBlock, 1);
+	}
+}
+
+/* Account a system call sending data, given its result and the number of
+ * bytes requested. It must be called before errno is changed */
+static void TCPSocket_count_send(TCPSocket *self, ssize_t rc, size_t requested) {
+	lbool global = net_global_stats_active();
+
+	self->stats.sendCalls++;
+	if (global) net_global_add(sendCalls, 1);
+
+	if (rc>0) {
+		self->stats.bytesSent += rc;
+		if (global) net_global_add(bytesSent, rc);
+		if ((size_t)rc<requested) {
+			self->stats.partialWrites++;
+			if (global) net_global_add(partialWrites, 1);
+		}
+	} else if (rc==(-1) && net_would_block()) {
+		self->stats.sendWouldBlock++;
+		if (global) net_global_add(sendWouldBlock, 1);
+	}
+}
+
+void TCPSocket_add_recv_stats(TCPSocket *self, int result) {
+	int savedErrno = errno;
+
+	l_assert(self!=NULL);
+
+	errno = result<0 ? -result : 0;
+	TCPSocket_count_recv(self, result<0 ? -1 : result);
+	errno = savedErrno;
+}
+
+void TCPSocket_add_send_stats(TCPSocket *self, int result, int requested) {
+	int savedErrno = errno;
+
+	l_assert(self!=NULL);
+
+	errno = result<0 ? -result : 0;
+	TCPSocket_count_send(self, result<0 ? -1 : result, requested);
+	errno = savedErrno;
+}
+
+static int TCPSocket_buffered(TCPSocket *self) {
+	return self->readBuffer!=NULL ? MemBuffer_len(self->readBuffer)-self->readPos : 0;
+}
+
+static const char *TCPSocket_buffered_data(TCPSocket *self) {
+	return self->readBuffer!=NULL ? MemBuffer_address(self->readBuffer)+self->readPos : NULL;
+}
+
+static void TCPSocket_consume(TCPSocket *self, int len) {
+	self->readPos += len;
+	if (self->readPos==MemBuffer_len(self->readBuffer)) {
+		MemBuffer_setlen(self->readBuffer, 0);
+		self->readPos = 0;
+	}
+}
+
+#ifdef NETSOCKET_USE_OPENSSL
+static void TCPTlsContext_retain(TCPTlsContext *self) {
+	__atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void TCPTlsContext_release(TCPTlsContext *self) {
+	if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL)!=0) return;
+
+	SSL_CTX_free(self->ctx);
+	lhashtable_destroy(self->sessions);
+	pthread_mutex_destroy(&self->mutex);
+	lfree(self);
+}
+
+/* Set the error from the OpenSSL error queue, or from errno if it is
+ * empty, and clear the queue */
+static void net_tls_set_error(lerror **error, const char *what) {
+	char message[256];
+	unsigned long code = ERR_get_error();
+
+	if (code!=0) {
+		ERR_error_string_n(code, message, sizeof(message));
+		lerror_set_sprintf(error, "%s: %s", what, message);
+	} else if (errno!=0) {
+		lerror_set_sprintf(error, "%s: %s", what, strerror(errno));
+	} else {
+		lerror_set_sprintf(error, "%s", what);
+	}
+	ERR_clear_error();
+}
+
+/* Translate the result of an OpenSSL operation to the one of the system
+ * calls: -1 with errno set to EAGAIN when the socket is not ready, or
+ * to EPROTO when the TLS protocol fails */
+static ssize_t TCPSocket_tls_result(TCPSocket *self, ssize_t rc) {
+	int savedErrno = errno;
+
+	if (rc>0) {
+		self->tlsWait = 0;
+		return rc;
+	}
+
+	switch (SSL_get_error(self->ssl, (int)rc)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_READ:
+		self->tlsWait = POLLIN;
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_WANT_WRITE:
+		self->tlsWait = POLLOUT;
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		errno = savedErrno!=0 ? savedErrno : ECONNRESET;
+		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+/* Create the TLS connection of a socket */
+static lbool TCPSocket_attach_tls(TCPSocket *self, TCPTlsContext *ctx, lerror **error) {
+	self->ssl = SSL_new(ctx->ctx);
+	if (self->ssl==NULL || !SSL_set_fd(self->ssl, self->fd)) {
+		net_tls_set_error(error, "Can't create the TLS connection");
+		SSL_free(self->ssl);
+		self->ssl = NULL;
+		return LFALSE;
+	}
+
+	SSL_set_app_data(self->ssl, self);
+	TCPTlsContext_retain(ctx);
+	self->tls = ctx;
+	return LTRUE;
+}
+#endif
+
+/* Receive data like recv, decrypting it when the socket uses TLS. The
+ * flags are ignored by TLS */
+static ssize_t TCPSocket_raw_recv(TCPSocket *self, void *buf, size_t len, int flags) {
+#ifdef NETSOCKET_USE_OPENSSL
+	NetSigpipeGuard guard;
+	ssize_t rc;
+
+	if (self->ssl!=NULL) {
+		/* reading can send the messages of the protocol too */
+		ERR_clear_error();
+		net_sigpipe_block(&guard);
+		rc = TCPSocket_tls_result(self, SSL_read(self->ssl, buf, len<INT_MAX ? (int)len : INT_MAX));
+		net_sigpipe_unblock(&guard);
+		return rc;
+	}
+#endif
+	return recv(self->fd, buf, len, flags);
+}
+
+/* Send data like send, encrypting it when the socket uses TLS. After
+ * a partial write of TLS the rest of the data must be sent again */
+static ssize_t TCPSocket_raw_send(TCPSocket *self, const void *buf, size_t len) {
+#ifdef NETSOCKET_USE_OPENSSL
+	NetSigpipeGuard guard;
+	ssize_t rc;
+
+	if (self->ssl!=NULL) {
+		ERR_clear_error();
+		net_sigpipe_block(&guard);
+		rc = TCPSocket_tls_result(self, SSL_write(self->ssl, buf, len<INT_MAX ? (int)len : INT_MAX));
+		net_sigpipe_unblock(&guard);
+		return rc;
+	}
+#endif
+	return send(self->fd, buf, len, NET_SEND_FLAGS);
+}
+
+/* Wait for a non-blocking socket to be ready to retry an operation, for
+ * the events TLS needs if they are different. Returns LFALSE, with errno
+ * set to ETIMEDOUT, if the socket is not ready in time */
+static lbool TCPSocket_wait(TCPSocket *self, short events, int timeoutMillis) {
+	struct pollfd pfd;
+	int rc;
+
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->ssl!=NULL && self->tlsWait!=0) {
+		events = self->tlsWait;
+	}
+#endif
+	pfd.fd = self->fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	do {
+		rc = poll(&pfd, 1, timeoutMillis);
+	} while (rc<0 && errno==EINTR);
+
+	if (rc==0) {
+		errno = ETIMEDOUT;
+		return LFALSE;
+	}
+	return LTRUE;
+}
+
+void TCPListenOptions_init(TCPListenOptions *options) {
+	l_assert(options!=NULL);
+
+	options->backlog = SOMAXCONN;
+	options->reusePort = LFALSE;
+	options->deferAccept = 0;
+	options->nonBlocking = LFALSE;
+}
+
 TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, lerror **error) {
+	return TCPListenSocket_new_with_options(hostname, port, NULL, error);
+}
+
+TCPListenSocket* TCPListenSocket_new_with_options(const char *hostname, const char *port, const TCPListenOptions *options, lerror **error) {
 	TCPListenSocket *result = NULL;
-	struct addrinfo hints, *res, *rp;
+	TCPListenOptions defaults;
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	int count;
+	int i;
 	int rc = 0;
 	int sfd = 0;
 	int yes = 1;
@@ -68,18 +487,18 @@ TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, ler
 	l_assert(port!=NULL);
 	l_assert(error==NULL || *error==NULL);
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	
-	rc = getaddrinfo(hostname, port, &hints, &res);
-	if (0!=rc) {
-		lerror_set_sprintf(error, "getaddrinfo: %s", gai_strerror(rc));
+	if (options==NULL) {
+		TCPListenOptions_init(&defaults);
+		options = &defaults;
+	}
+
+	count = NetResolver_resolve(NetResolver_get_default(), hostname, port, addresses, error);
+	if (count<0) {
 		return NULL;
 	}
 
-	for (rp = res; rp!=NULL; rp = rp->ai_next) {
-		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	for (i=0; i<count; i++) {
+		sfd = socket(addresses[i].family, SOCK_STREAM, 0);
 		if (sfd==(-1)) {
 			// Let's try the next one
 			continue;
@@ -87,10 +506,18 @@ TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, ler
 
 		if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))==(-1)) {
 			// Can't reuse socket address. Why?
+			close(sfd);
+			continue;
+		}
+
+#ifdef SO_REUSEPORT
+		if (options->reusePort && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))==(-1)) {
+			close(sfd);
 			continue;
 		}
+#endif
 
-		if (0==bind(sfd, rp->ai_addr, rp->ai_addrlen)) {
+		if (0==bind(sfd, (struct sockaddr *)&addresses[i].addr, addresses[i].len)) {
 			// Success!
 			break;
 		}
@@ -98,13 +525,19 @@ TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, ler
 		close(sfd);
 	}
 
-	freeaddrinfo(res);
-	if (rp==NULL) {
-		lerror_set(error, "Can't bind find an address to bind");
+	if (i==count) {
+		lerror_set_sprintf(error, "Can't bind %s:%s: %s", hostname, port, strerror(errno));
 		return NULL;
 	}
 
-	rc = listen(sfd, DEFAULT_CONNECTION_BACKLOG);
+#ifdef TCP_DEFER_ACCEPT
+	if (options->deferAccept>0) {
+		/* The connections are accepted when the first data arrives */
+		setsockopt(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options->deferAccept, sizeof(options->deferAccept));
+	}
+#endif
+
+	rc = listen(sfd, options->backlog>0 ? options->backlog : SOMAXCONN);
 	if (rc!=0) {
 		lerror_set_sprintf(error, "Can't mark this socket as listening");
 		close(sfd);
@@ -113,8 +546,53 @@ TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, ler
 	
 	result = (TCPListenSocket *)lmalloc(sizeof(struct TCPListenSocket));
 	result->fd = sfd;
+	result->nonBlocking = LFALSE;
+#ifdef NETSOCKET_USE_OPENSSL
+	result->tls = NULL;
+#endif
 	result->localAddress = lstring_new();
-	result->localAddress = lstring_append_sprintf_f(result->localAddress, "%s:%i", hostname, port);
+	result->localAddress = lstring_append_sprintf_f(result->localAddress, "%s:%s", hostname, port);
+
+	if (options->nonBlocking && !TCPListenSocket_set_nonblocking(result, LTRUE, error)) {
+		TCPListenSocket_destroy(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+lvector *TCPListenSocket_new_shards(const char *hostname, const char *port, int count, const TCPListenOptions *options, lerror **error) {
+	TCPListenOptions shardOptions;
+	TCPListenSocket *shard;
+	lvector *result;
+	int i;
+
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(count>0);
+	l_assert(error==NULL || *error==NULL);
+
+	if (options!=NULL) {
+		shardOptions = *options;
+	} else {
+		TCPListenOptions_init(&shardOptions);
+	}
+	shardOptions.reusePort = LTRUE;
+
+	result = lvector_new(count);
+	for (i=0; i<count; i++) {
+		shard = TCPListenSocket_new_with_options(hostname, port, &shardOptions, error);
+		if (shard==NULL) {
+			while (i>0) {
+				i--;
+				TCPListenSocket_destroy((TCPListenSocket *)lvector_at(result, i));
+			}
+			lvector_delete(result);
+			return NULL;
+		}
+		lvector_set(result, i, shard);
+	}
+
 	return result;
 }
 
@@ -122,82 +600,332 @@ TCPListenSocket* TCPListenSocket_new_from_fd(int fd, const char *localAddress) {
 	TCPListenSocket *result = NULL;
 	result = (TCPListenSocket *)lmalloc(sizeof(struct TCPListenSocket));
 	result->fd = fd;
+	result->nonBlocking = (fcntl(fd, F_GETFL, 0) & O_NONBLOCK)!=0;
+#ifdef NETSOCKET_USE_OPENSSL
+	result->tls = NULL;
+#endif
 	result->localAddress = lstring_new_from_cstr(localAddress);
 	return result;
 }
 
+lbool TCPListenSocket_set_nonblocking(TCPListenSocket *self, lbool enabled, lerror **error) {
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (!net_set_nonblocking(self->fd, enabled, error)) {
+		return LFALSE;
+	}
+	self->nonBlocking = enabled;
+	return LTRUE;
+}
+
+int TCPListenSocket_get_fd(TCPListenSocket *self) {
+	l_assert(self!=NULL);
+	return self->fd;
+}
+
+/* Create the socket of a connection accepted by the listening socket,
+ * setting its mode if modeSet is LFALSE */
+static TCPSocket *TCPListenSocket_wrap(TCPListenSocket *self, int fd, const char *remoteAddress, lbool modeSet, lerror **error) {
+	TCPSocket *result = TCPSocket_new_from_fd(fd, self->localAddress, remoteAddress);
+
+	if (net_global_stats_active()) {
+		net_global_add(accepts, 1);
+	}
+	if (modeSet) {
+		result->nonBlocking = self->nonBlocking;
+	} else if (self->nonBlocking && TCPSocket_set_nonblocking(result, LTRUE, error)==LFALSE) {
+		TCPSocket_destroy(result);
+		return NULL;
+	}
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->tls!=NULL) {
+		/* The handshake is made by the first read or write, so a slow
+		 * client doesn't block the accepting thread */
+		if (!TCPSocket_attach_tls(result, self->tls, error)) {
+			TCPSocket_destroy(result);
+			return NULL;
+		}
+		SSL_set_accept_state(result->ssl);
+	}
+#endif
+	return result;
+}
+
 TCPSocket *TCPListenSocket_accept(TCPListenSocket *self, lerror **error) {
 	int rc = 0;
-	char *ip = NULL;
-	unsigned int len = sizeof(struct sockaddr_storage);
+	char ip[NI_MAXHOST];
+	socklen_t len = sizeof(struct sockaddr_storage);
 	struct sockaddr_storage remoteAddr;
 	TCPSocket *result = NULL;
 	
 	l_assert(self!=NULL);
 	l_assert(error==NULL || *error==NULL);
 
+#ifdef __linux__
+	/* The new socket inherits the mode of the listening one without
+	 * other system calls */
+	rc = accept4(self->fd, (struct sockaddr *)&remoteAddr, &len, SOCK_CLOEXEC | (self->nonBlocking ? SOCK_NONBLOCK : 0));
+#else
 	rc = accept(self->fd, (struct sockaddr *)&remoteAddr, &len);
-	if (rc==(-1)) {
+#endif
+	if (rc==(-1) && self->nonBlocking && net_would_block()) {
+		/* No pending connections */
+		return result;
+	} else if (rc==(-1)) {
 		lerror_set(error, "Can't accept connections on this socket");
 		return result;
 	}
 			
-	ip = inet_ntoa(((struct sockaddr_in *)&remoteAddr)->sin_addr);
-	result = TCPSocket_new_from_fd(rc, self->localAddress, ip);
-	return result;
+	if (0!=getnameinfo((struct sockaddr *)&remoteAddr, len, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST)) {
+		strcpy(ip, "unknown");
+	}
+#ifdef __linux__
+	return TCPListenSocket_wrap(self, rc, ip, LTRUE, error);
+#else
+	return TCPListenSocket_wrap(self, rc, ip, LFALSE, error);
+#endif
+}
+
+TCPSocket *TCPListenSocket_adopt(TCPListenSocket *self, int fd, const char *remoteAddress, lerror **error) {
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(remoteAddress!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	return TCPListenSocket_wrap(self, fd, remoteAddress, LFALSE, error);
 }
 
 void TCPListenSocket_destroy(TCPListenSocket *self) {
 	if (self==NULL) return;
 	
 	close(self->fd);
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->tls!=NULL) {
+		TCPTlsContext_release(self->tls);
+	}
+#endif
 	lstring_delete(self->localAddress);
 	lfree(self);
 }
 
 TCPSocket *TCPSocket_new_from_fd(int fd, const char *localAddress, const char *remoteAddress) {
 	TCPSocket *self = (TCPSocket *)lmalloc(sizeof(struct TCPSocket));
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
 	self->fd = fd;
+	self->nonBlocking = LFALSE;
+	self->sendTimeoutMillis = TCPSOCKET_DEFAULT_SEND_TIMEOUT_MILLIS;
+	self->readBuffer = NULL;
+	self->readPos = 0;
+	memset(&self->stats, 0, sizeof(TCPSocketStats));
+#ifdef NETSOCKET_USE_OPENSSL
+	self->ssl = NULL;
+	self->tls = NULL;
+	self->tlsSessionKey = NULL;
+	self->tlsWait = 0;
+#endif
 	self->localAddress = lstring_new_from_cstr(localAddress);
 	self->remoteAddress = lstring_new_from_cstr(remoteAddress);
 	return self;
 }
 
-TCPSocket *TCPSocket_connect(const char *hostname, const char *port, lerror **error) {
-	struct addrinfo hints, *res;
-	int rc, sfd;
-	TCPSocket *result = NULL;
+void TCPSocket_set_resolve_cache_ttl(int ttlMillis) {
+	l_assert(ttlMillis>=0);
 
-	res = NULL;
-	
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	
-	rc = getaddrinfo(hostname, port, &hints, &res);
-	if (0!=rc) {
-		lerror_set_sprintf(error, "getaddrinfo: %s", gai_strerror(rc));
-		goto end;
+	NetResolver_set_ttl(NetResolver_get_default(), ttlMillis,
+		ttlMillis<NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS ? ttlMillis : NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS);
+}
+
+void TCPSocket_clear_resolve_cache(void) {
+	NetResolver_clear(NetResolver_get_default());
+}
+
+/* Start a non-blocking connection. Returns the socket, or -1 with errno
+ * set if the connection failed immediately */
+static int net_connect_start(const NetAddress *address, lbool *connected) {
+	int fd;
+	int rc;
+
+#ifdef __linux__
+	fd = socket(address->family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd<0) {
+		return -1;
+	}
+#else
+	fd = socket(address->family, SOCK_STREAM, 0);
+	if (fd<0) {
+		return -1;
+	}
+	if (!net_set_nonblocking(fd, LTRUE, NULL)) {
+		close(fd);
+		return -1;
 	}
+#endif
 
-	sfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if ((-1)==sfd) {
-		lerror_set(error, "Can't create connection socket.");
-		goto end;
+	do {
+		rc = connect(fd, (const struct sockaddr *)&address->addr, address->len);
+	} while (rc==(-1) && errno==EINTR);
+
+	if (rc==0) {
+		*connected = LTRUE;
+	} else if (errno==EINPROGRESS) {
+		*connected = LFALSE;
+	} else {
+		rc = errno;
+		close(fd);
+		errno = rc;
+		return -1;
 	}
+	return fd;
+}
 
-	rc = connect(sfd, res->ai_addr, res->ai_addrlen);
-	if ((-1)==rc) {
-		lerror_set_sprintf(error, "Can't connect to host: %s", strerror(errno));
-		close(sfd);
-		goto end;
+/* Connect to the first address answering, starting a new attempt when
+ * the previous ones fail or are still pending after a short delay.
+ * Returns the connected socket or -1 */
+static int net_connect_race(const NetAddress *addresses, int count, int timeoutMillis, lerror **error) {
+	struct pollfd pending[NETRESOLVER_MAX_ADDRESSES];
+	int nPending = 0;
+	int next = 0;
+	int winner = -1;
+	int lastError = ECONNREFUSED;
+	int soError;
+	socklen_t soErrorLen;
+	long long now = l_monotonic_time_micros();
+	long long deadline = timeoutMillis>0 ? now + (long long)timeoutMillis*1000 : 0;
+	long long nextAttempt = now;
+	long long wait;
+	lbool connected;
+	int fd;
+	int i;
+	int rc;
+
+	while (winner<0) {
+		now = l_monotonic_time_micros();
+		if (deadline>0 && now>=deadline) {
+			lastError = ETIMEDOUT;
+			break;
+		}
+
+		if (next<count && (nPending==0 || now>=nextAttempt)) {
+			fd = net_connect_start(&addresses[next], &connected);
+			next++;
+			if (fd<0) {
+				lastError = errno;
+				continue;
+			} else if (connected) {
+				winner = fd;
+				break;
+			}
+
+			pending[nPending].fd = fd;
+			pending[nPending].events = POLLOUT;
+			pending[nPending].revents = 0;
+			nPending++;
+			nextAttempt = now + CONNECT_ATTEMPT_DELAY_MILLIS*1000;
+			continue;
+		} else if (nPending==0) {
+			break;
+		}
+
+		/* Wait for a connection, the next attempt or the timeout */
+		wait = -1;
+		if (next<count) {
+			wait = nextAttempt-now;
+		}
+		if (deadline>0 && (wait<0 || deadline-now<wait)) {
+			wait = deadline-now;
+		}
+		rc = poll(pending, nPending, wait<0 ? -1 : (int)((wait+999)/1000));
+		if (rc<0 && errno!=EINTR) {
+			lastError = errno;
+			break;
+		} else if (rc<=0) {
+			continue;
+		}
+
+		for (i=0; i<nPending && winner<0; i++) {
+			if (pending[i].revents==0) {
+				continue;
+			}
+
+			soError = 0;
+			soErrorLen = sizeof(soError);
+			if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &soError, &soErrorLen)<0) {
+				soError = errno;
+			}
+
+			if (soError==0) {
+				winner = pending[i].fd;
+				pending[i] = pending[--nPending];
+			} else {
+				/* The next address is tried immediately */
+				lastError = soError;
+				close(pending[i].fd);
+				pending[i] = pending[--nPending];
+				nextAttempt = now;
+				i--;
+			}
+		}
+	}
+
+	for (i=0; i<nPending; i++) {
+		close(pending[i].fd);
+	}
+
+	if (winner<0 && lastError==ETIMEDOUT) {
+		lerror_set_sprintf(error, "Can't connect to host: timeout after %i ms", timeoutMillis);
+	} else if (winner<0) {
+		lerror_set_sprintf(error, "Can't connect to host: %s", strerror(lastError));
+	} else if (!net_set_nonblocking(winner, LFALSE, error)) {
+		close(winner);
+		winner = -1;
+	}
+	return winner;
+}
+
+TCPSocket *TCPSocket_connect(const char *hostname, const char *port, lerror **error) {
+	return TCPSocket_connect_with_timeout(hostname, port, 0, error);
+}
+
+TCPSocket *TCPSocket_connect_with_timeout(const char *hostname, const char *port, int timeoutMillis, lerror **error) {
+	NetAddress addresses[NETRESOLVER_MAX_ADDRESSES];
+	TCPSocket *result;
+	long long start;
+	int count;
+	int sfd;
+
+	l_assert(hostname!=NULL);
+	l_assert(port!=NULL);
+	l_assert(timeoutMillis>=0);
+	l_assert(error==NULL || *error==NULL);
+
+	count = NetResolver_resolve(NetResolver_get_default(), hostname, port, addresses, error);
+	if (count<0) {
+		return NULL;
+	}
+
+	start = l_monotonic_time_micros();
+	sfd = net_connect_race(addresses, count, timeoutMillis, error);
+	if (sfd<0) {
+		/* The addresses may have changed, as when a standby takes over */
+		NetResolver_forget(NetResolver_get_default(), hostname, port);
+		if (net_global_stats_active()) {
+			net_global_add(connectFailures, 1);
+		}
+		return NULL;
 	}
 
+	/* The time spent in the handshake is the network latency */
 	result = TCPSocket_new_from_fd(sfd, "local", hostname);
-	
-end:
-	if (res!=NULL) {
-		freeaddrinfo(res);
+	result->stats.connects = 1;
+	result->stats.connectMicros = l_monotonic_time_micros()-start;
+	if (net_global_stats_active()) {
+		net_global_add(connects, 1);
+		net_global_add(connectMicros, result->stats.connectMicros);
 	}
 	return result;
 }
@@ -209,50 +937,1215 @@ int TCPSocket_recv(TCPSocket *self, void *buf, int len, lerror **error) {
 	l_assert(error==NULL || *error==NULL);
 	l_assert(len>0);
 
-	result = recv(self->fd, buf, len, 0);
-	if (result==(-1)) {
+	/* The data already read by the buffered reader comes first */
+	if (TCPSocket_buffered(self)>0) {
+		result = TCPSocket_buffered(self)<len ? TCPSocket_buffered(self) : len;
+		memcpy(buf, TCPSocket_buffered_data(self), result);
+		TCPSocket_consume(self, result);
+		return result;
+	}
+
+	result = TCPSocket_raw_recv(self, buf, len, 0);
+	TCPSocket_count_recv(self, result);
+	if (result==(-1) && self->nonBlocking && net_would_block()) {
+		result = TCPSOCKET_WOULD_BLOCK;
+	} else if (result==(-1)) {
 		lerror_set(error, "Can't read data from stream");
 	}
 	return result;
 }
 
-void TCPSocket_send_full(TCPSocket *self, void *buf, int buf_len, lerror **error) {
-	int bytes_sent = 0;
-	int rc = 0;
-	
-	l_assert(self!=NULL);
-	l_assert(buf!=NULL);
-	l_assert(buf_len>0);
-	l_assert(error==NULL || *error==NULL);
+/* Receive more data in the read buffer, returning the number of bytes
+ * received like TCPSocket_recv */
+static int TCPSocket_fill(TCPSocket *self, lerror **error) {
+	int rc;
 
-	while (bytes_sent!=buf_len) {
-		rc = send(self->fd, buf+bytes_sent, buf_len-bytes_sent, 0);
-		if (rc==(-1)) {
-			lerror_set(error, "Cannot send bytes to this socket");
-			break;
-		} else if (rc==0) {
-			lerror_set(error, "Socket closed connection");
-			break;
-		} else {
-			bytes_sent = bytes_sent + rc;
-		}
+	if (self->readBuffer==NULL) {
+		self->readBuffer = MemBuffer_new(READ_CHUNK_SIZE);
 	}
-}
+	if (self->readPos>0) {
+		MemBuffer_drop_left(self->readBuffer, self->readPos);
+		self->readPos = 0;
+	}
+	MemBuffer_ensure_space(self->readBuffer, READ_CHUNK_SIZE);
 
-void TCPSocket_send_string(TCPSocket *self, const char *buf, lerror **error) {
-	lerror *myError = NULL;
-	
-	l_assert(self!=NULL);
-	l_assert(buf!=NULL);
-	l_assert(error==NULL || *error==NULL);
+	do {
+		rc = TCPSocket_raw_recv(self, MemBuffer_address(self->readBuffer)+MemBuffer_len(self->readBuffer), READ_CHUNK_SIZE, 0);
+		TCPSocket_count_recv(self, rc);
+	} while (rc==(-1) && errno==EINTR);
 
-	TCPSocket_send_full(self, (void *)buf, strlen(buf), &myError);
-	lerror_propagate(error, myError);
+	if (rc==(-1) && self->nonBlocking && net_would_block()) {
+		return TCPSOCKET_WOULD_BLOCK;
+	} else if (rc==(-1)) {
+		lerror_set_sprintf(error, "Can't read data from stream: %s", strerror(errno));
+		return -1;
+	}
+
+	MemBuffer_setlen(self->readBuffer, MemBuffer_len(self->readBuffer)+rc);
+	return rc;
 }
 
-void TCPSocket_destroy(TCPSocket *self) {
-	if (self==NULL) return;
+/* Handle the end of the stream while waiting for more data: it's an error
+ * if some data was already received */
+static int TCPSocket_closed(TCPSocket *self, lerror **error) {
+	if (TCPSocket_buffered(self)==0) {
+		return 0;
+	}
+	lerror_set_sprintf(error, "Connection closed with %i bytes of incomplete data", TCPSocket_buffered(self));
+	return -1;
+}
+
+/* Look for a delimiter in the received data, receiving more if needed.
+ * Returns the number of bytes up to the delimiter, included */
+static int TCPSocket_find(TCPSocket *self, const char *delimiter, int delimiterLen, int maxLen, lerror **error) {
+	int searched = 0;
+	int rc;
+	int i;
+
+	while (1) {
+		const char *data = TCPSocket_buffered_data(self);
+		int available = TCPSocket_buffered(self);
+
+		for (i=searched; i+delimiterLen<=available; i++) {
+			if (data[i]==delimiter[0] && 0==memcmp(data+i, delimiter, delimiterLen)) {
+				if (i+delimiterLen>maxLen) break;
+				return i+delimiterLen;
+			}
+		}
+		if (i+delimiterLen>maxLen || available>=maxLen) {
+			lerror_set_sprintf(error, "Delimiter not found in %i bytes", maxLen);
+			return -1;
+		}
+		searched = i;
+
+		rc = TCPSocket_fill(self, error);
+		if (rc==0) {
+			return TCPSocket_closed(self, error);
+		} else if (rc<0) {
+			return rc;
+		}
+	}
+}
+
+int TCPSocket_read_exact(TCPSocket *self, void *buf, int len, lerror **error) {
+	int copied;
+	int rc;
+
+	l_assert(self!=NULL);
+	l_assert(buf!=NULL);
+	l_assert(len>0);
+	l_assert(error==NULL || *error==NULL);
+
+	if (!self->nonBlocking) {
+		/* The data not buffered yet is received directly in the
+		 * destination */
+		copied = TCPSocket_buffered(self)<len ? TCPSocket_buffered(self) : len;
+		if (copied>0) {
+			memcpy(buf, TCPSocket_buffered_data(self), copied);
+			TCPSocket_consume(self, copied);
+		}
+		while (copied<len) {
+			rc = TCPSocket_raw_recv(self, (char *)buf+copied, len-copied, MSG_WAITALL);
+			TCPSocket_count_recv(self, rc);
+			if (rc==(-1) && errno==EINTR) {
+				continue;
+			} else if (rc==(-1)) {
+				lerror_set_sprintf(error, "Can't read data from stream: %s", strerror(errno));
+				return -1;
+			} else if (rc==0 && copied==0) {
+				return 0;
+			} else if (rc==0) {
+				lerror_set_sprintf(error, "Connection closed after %i of %i bytes", copied, len);
+				return -1;
+			}
+			copied += rc;
+		}
+		return len;
+	}
+
+	/* A non-blocking socket keeps the data until it is complete */
+	while (TCPSocket_buffered(self)<len) {
+		rc = TCPSocket_fill(self, error);
+		if (rc==0) {
+			return TCPSocket_closed(self, error);
+		} else if (rc<0) {
+			return rc;
+		}
+	}
+
+	memcpy(buf, TCPSocket_buffered_data(self), len);
+	TCPSocket_consume(self, len);
+	return len;
+}
+
+int TCPSocket_read_until(TCPSocket *self, const char *delimiter, MemBuffer *dest, int maxLen, lerror **error) {
+	int len;
+
+	l_assert(self!=NULL);
+	l_assert(delimiter!=NULL && delimiter[0]!='\0');
+	l_assert(dest!=NULL);
+	l_assert(maxLen>0);
+	l_assert(error==NULL || *error==NULL);
+
+	len = TCPSocket_find(self, delimiter, strlen(delimiter), maxLen, error);
+	if (len>0) {
+		MemBuffer_write(dest, (void *)TCPSocket_buffered_data(self), len);
+		TCPSocket_consume(self, len);
+	}
+	return len;
+}
+
+int TCPSocket_read_line(TCPSocket *self, lstring **line, int maxLen, lerror **error) {
+	const char *data;
+	int len;
+	int lineLen;
+
+	l_assert(self!=NULL);
+	l_assert(line!=NULL && *line!=NULL);
+	l_assert(maxLen>0);
+	l_assert(error==NULL || *error==NULL);
+
+	len = TCPSocket_find(self, "\n", 1, maxLen, error);
+	if (len>0) {
+		data = TCPSocket_buffered_data(self);
+		lineLen = len-1;
+		if (lineLen>0 && data[lineLen-1]=='\r') {
+			lineLen--;
+		}
+
+		lstring_reset(*line);
+		*line = lstring_append_generic_f(*line, data, lineLen);
+		TCPSocket_consume(self, len);
+	}
+	return len;
+}
+
+int TCPSocket_send(TCPSocket *self, const void *buf, int len, lerror **error) {
+	int result = 0;
+
+	l_assert(self!=NULL);
+	l_assert(buf!=NULL);
+	l_assert(error==NULL || *error==NULL);
+	l_assert(len>0);
+
+	result = TCPSocket_raw_send(self, buf, len);
+	TCPSocket_count_send(self, result, len);
+	if (result==(-1) && self->nonBlocking && net_would_block()) {
+		result = TCPSOCKET_WOULD_BLOCK;
+	} else if (result==(-1)) {
+		lerror_set_sprintf(error, "Cannot send bytes to this socket: %s", strerror(errno));
+	}
+	return result;
+}
+
+lbool TCPSocket_set_nonblocking(TCPSocket *self, lbool enabled, lerror **error) {
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (!net_set_nonblocking(self->fd, enabled, error)) {
+		return LFALSE;
+	}
+	self->nonBlocking = enabled;
+	return LTRUE;
+}
+
+void TCPSocket_set_send_timeout(TCPSocket *self, int timeoutMillis) {
+	l_assert(self!=NULL);
+	l_assert(timeoutMillis>=0);
+	self->sendTimeoutMillis = timeoutMillis>0 ? timeoutMillis : -1;
+}
+
+int TCPSocket_get_fd(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return self->fd;
+}
+
+int TCPSocket_pending(TCPSocket *self) {
+	int result;
+
+	l_assert(self!=NULL);
+
+	result = TCPSocket_buffered(self);
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->ssl!=NULL) {
+		result += SSL_pending(self->ssl);
+	}
+#endif
+	return result;
+}
+
+void TCPSocket_send_full(TCPSocket *self, void *buf, int buf_len, lerror **error) {
+	int bytes_sent = 0;
+	int rc = 0;
+	
+	l_assert(self!=NULL);
+	l_assert(buf!=NULL);
+	l_assert(buf_len>0);
+	l_assert(error==NULL || *error==NULL);
+
+	while (bytes_sent!=buf_len) {
+		rc = TCPSocket_raw_send(self, buf+bytes_sent, buf_len-bytes_sent);
+		TCPSocket_count_send(self, rc, buf_len-bytes_sent);
+		if (rc==(-1) && self->nonBlocking && net_would_block()) {
+			/* Wait for the socket to be writable again */
+			if (!TCPSocket_wait(self, POLLOUT, self->sendTimeoutMillis)) {
+				lerror_set(error, "Timeout sending bytes to this socket");
+				break;
+			}
+		} else if (rc==(-1)) {
+			lerror_set(error, "Cannot send bytes to this socket");
+			break;
+		} else if (rc==0) {
+			lerror_set(error, "Socket closed connection");
+			break;
+		} else {
+			bytes_sent = bytes_sent + rc;
+		}
+	}
+}
+
+/* Send many buffers on a TLS socket. Every write makes a record, so the
+ * small buffers are copied together */
+static void TCPSocket_sendv_tls(TCPSocket *self, const struct iovec *iov, int count, lerror **error) {
+	char *buf = NULL;
+	lerror *myError = NULL;
+	const char *data;
+	size_t left;
+	size_t n;
+	int used = 0;
+	int i;
+
+	for (i=0; i<count && myError==NULL; i++) {
+		data = (const char *)iov[i].iov_base;
+		left = iov[i].iov_len;
+
+		while (left>0 && myError==NULL) {
+			if (used==0 && left>=TLS_RECORD_SIZE) {
+				/* The big buffers are sent as they are */
+				n = left<INT_MAX ? left : INT_MAX;
+				TCPSocket_send_full(self, (void *)data, (int)n, &myError);
+			} else {
+				if (buf==NULL) {
+					buf = (char *)lmalloc(TLS_RECORD_SIZE);
+				}
+				n = left<(size_t)(TLS_RECORD_SIZE-used) ? left : (size_t)(TLS_RECORD_SIZE-used);
+				memcpy(buf+used, data, n);
+				used += n;
+				if (used==TLS_RECORD_SIZE) {
+					TCPSocket_send_full(self, buf, used, &myError);
+					used = 0;
+				}
+			}
+			data += n;
+			left -= n;
+		}
+	}
+
+	if (myError==NULL && used>0) {
+		TCPSocket_send_full(self, buf, used, &myError);
+	}
+	if (buf!=NULL) {
+		lfree(buf);
+	}
+	lerror_propagate(error, myError);
+}
+
+void TCPSocket_sendv(TCPSocket *self, const struct iovec *iov, int count, lerror **error) {
+	struct iovec parts[MAX_IOVEC];
+	struct msghdr msg;
+	size_t requested;
+	int done = 0;
+	int first;
+	int n;
+	int i;
+	ssize_t rc;
+
+	l_assert(self!=NULL);
+	l_assert(iov!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (TCPSocket_is_tls(self)) {
+		TCPSocket_sendv_tls(self, iov, count, error);
+		return;
+	}
+
+	while (done<count) {
+		n = count-done<MAX_IOVEC ? count-done : MAX_IOVEC;
+		memcpy(parts, iov+done, sizeof(struct iovec)*n);
+
+		first = 0;
+		while (first<n) {
+			/* writev can't suppress SIGPIPE */
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = parts+first;
+			msg.msg_iovlen = n-first;
+			rc = sendmsg(self->fd, &msg, NET_SEND_FLAGS);
+			for (i=first, requested=0; i<n; i++) {
+				requested += parts[i].iov_len;
+			}
+			TCPSocket_count_send(self, rc, requested);
+			if (rc==(-1) && errno==EINTR) {
+				continue;
+			} else if (rc==(-1) && self->nonBlocking && net_would_block()) {
+				if (!TCPSocket_wait(self, POLLOUT, self->sendTimeoutMillis)) {
+					lerror_set(error, "Timeout sending bytes to this socket");
+					return;
+				}
+				continue;
+			} else if (rc==(-1)) {
+				lerror_set_sprintf(error, "Cannot send bytes to this socket: %s", strerror(errno));
+				return;
+			}
+
+			/* Skip the buffers sent, and the sent part of the last one */
+			while (first<n && (size_t)rc>=parts[first].iov_len) {
+				rc -= parts[first].iov_len;
+				first++;
+			}
+			if (first<n) {
+				parts[first].iov_base = (char *)parts[first].iov_base + rc;
+				parts[first].iov_len -= rc;
+			}
+		}
+
+		done += n;
+	}
+}
+
+/* Write all the data at a position of a file */
+static lbool net_pwrite_full(int fd, const char *buf, int len, long long offset, lerror **error) {
+	ssize_t rc;
+
+	while (len>0) {
+		rc = pwrite(fd, buf, len, (off_t)offset);
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1)) {
+			lerror_set_sprintf(error, "Can't write the file: %s", strerror(errno));
+			return LFALSE;
+		}
+		buf += rc;
+		len -= rc;
+		offset += rc;
+	}
+	return LTRUE;
+}
+
+/* Send a part of a file reading it in a buffer, when sendfile can't be used */
+static lbool TCPSocket_send_file_copy(TCPSocket *self, int fd, long long offset, long long len, long long *sent, lerror **error) {
+	char *buf = (char *)lmalloc(COPY_CHUNK_SIZE);
+	lerror *myError = NULL;
+	ssize_t rc;
+	int n;
+
+	while (*sent<len) {
+		n = len-*sent<COPY_CHUNK_SIZE ? (int)(len-*sent) : COPY_CHUNK_SIZE;
+		rc = pread(fd, buf, n, (off_t)(offset+*sent));
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1)) {
+			lerror_set_sprintf(&myError, "Can't read the file: %s", strerror(errno));
+			break;
+		} else if (rc==0) {
+			lerror_set_sprintf(&myError, "The file ended after %lld of %lld bytes", *sent, len);
+			break;
+		}
+
+		TCPSocket_send_full(self, buf, rc, &myError);
+		if (myError!=NULL) {
+			break;
+		}
+		*sent += rc;
+	}
+
+	lfree(buf);
+	if (myError!=NULL) {
+		lerror_propagate(error, myError);
+		return LFALSE;
+	}
+	return LTRUE;
+}
+
+#ifdef NETSOCKET_USE_OPENSSL
+/* Send a part of a file on a TLS socket whose records are encrypted by
+ * the kernel, without reading the file. Nothing is sent, and the caller
+ * must continue with the copy, when kernel TLS is not used */
+static lbool TCPSocket_send_file_ktls(TCPSocket *self, int fd, long long offset, long long len, long long *sent, lerror **error) {
+#ifdef NET_USE_KTLS
+	NetSigpipeGuard guard;
+	size_t requested;
+	ssize_t rc;
+
+	if (!BIO_get_ktls_send(SSL_get_wbio(self->ssl))) {
+		return LTRUE;
+	}
+
+	while (*sent<len) {
+		requested = len-*sent<SENDFILE_MAX_CHUNK ? (size_t)(len-*sent) : SENDFILE_MAX_CHUNK;
+		ERR_clear_error();
+		net_sigpipe_block(&guard);
+		rc = TCPSocket_tls_result(self, SSL_sendfile(self->ssl, fd, (off_t)(offset+*sent), requested, 0));
+		net_sigpipe_unblock(&guard);
+		TCPSocket_count_send(self, rc, requested);
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1) && self->nonBlocking && net_would_block()) {
+			if (!TCPSocket_wait(self, POLLOUT, self->sendTimeoutMillis)) {
+				lerror_set(error, "Timeout sending the file");
+				return LFALSE;
+			}
+		} else if (rc<=0) {
+			net_tls_set_error(error, "Can't send the file");
+			return LFALSE;
+		} else {
+			*sent += rc;
+		}
+	}
+#endif
+	return LTRUE;
+}
+#endif
+
+long long TCPSocket_send_file(TCPSocket *self, int fd, long long offset, long long len, lerror **error) {
+	long long sent = 0;
+	struct stat info;
+#ifdef __linux__
+	NetSigpipeGuard guard;
+	off_t pos;
+	size_t requested;
+	ssize_t rc;
+#endif
+
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(offset>=0);
+	l_assert(error==NULL || *error==NULL);
+
+	if (len<0) {
+		if (fstat(fd, &info)<0) {
+			lerror_set_sprintf(error, "Can't get the file size: %s", strerror(errno));
+			return -1;
+		}
+		len = info.st_size>offset ? info.st_size-offset : 0;
+	}
+
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->ssl!=NULL && !TCPSocket_send_file_ktls(self, fd, offset, len, &sent, error)) {
+		return -1;
+	}
+#endif
+
+#ifdef __linux__
+	/* The kernel copies the file pages to the socket without passing them
+	 * to the process */
+	while (sent<len && !TCPSocket_is_tls(self)) {
+		pos = (off_t)(offset+sent);
+		requested = len-sent<SENDFILE_MAX_CHUNK ? (size_t)(len-sent) : SENDFILE_MAX_CHUNK;
+		net_sigpipe_block(&guard);
+		rc = sendfile(self->fd, fd, &pos, requested);
+		net_sigpipe_unblock(&guard);
+		TCPSocket_count_send(self, rc, requested);
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1) && self->nonBlocking && net_would_block()) {
+			if (!TCPSocket_wait(self, POLLOUT, self->sendTimeoutMillis)) {
+				lerror_set(error, "Timeout sending the file");
+				return -1;
+			}
+		} else if (rc==(-1) && (errno==EINVAL || errno==ENOSYS)) {
+			/* The file doesn't support sendfile */
+			break;
+		} else if (rc==(-1)) {
+			lerror_set_sprintf(error, "Can't send the file: %s", strerror(errno));
+			return -1;
+		} else if (rc==0) {
+			lerror_set_sprintf(error, "The file ended after %lld of %lld bytes", sent, len);
+			return -1;
+		} else {
+			sent += rc;
+		}
+	}
+#endif
+
+	if (sent<len && !TCPSocket_send_file_copy(self, fd, offset, len, &sent, error)) {
+		return -1;
+	}
+	return sent;
+}
+
+/* Handle the end of the stream while receiving a file: it's an error only
+ * if the length was known */
+static lbool TCPSocket_recv_to_file_closed(long long received, long long len, lerror **error) {
+	if (len>=0) {
+		lerror_set_sprintf(error, "Connection closed after %lld of %lld bytes", received, len);
+		return LFALSE;
+	}
+	return LTRUE;
+}
+
+#ifdef __linux__
+/* Move the data received by the socket to the file through a pipe, without
+ * copying it in the process memory. Returns LFALSE on error, and sets
+ * *done when the transfer is complete, otherwise the caller must continue
+ * with the copy */
+static lbool TCPSocket_recv_to_file_splice(TCPSocket *self, int fd, long long offset, long long len, long long *received, lbool *done, lerror **error) {
+	char *buf = NULL;
+	lbool result = LTRUE;
+	int pipefd[2];
+	loff_t pos;
+	ssize_t rc;
+	ssize_t moved;
+
+	if (pipe2(pipefd, O_CLOEXEC)<0) {
+		return LTRUE;
+	}
+
+	while (len<0 || *received<len) {
+		rc = splice(self->fd, NULL, pipefd[1], NULL,
+			len<0 || len-*received>PIPE_CHUNK_SIZE ? PIPE_CHUNK_SIZE : (size_t)(len-*received),
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		TCPSocket_count_recv(self, rc);
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1) && self->nonBlocking && net_would_block()) {
+			net_wait_readable(self->fd);
+			continue;
+		} else if (rc==(-1) && (errno==EINVAL || errno==ENOSYS)) {
+			break;
+		} else if (rc==(-1)) {
+			lerror_set_sprintf(error, "Can't read data from stream: %s", strerror(errno));
+			result = LFALSE;
+			break;
+		} else if (rc==0) {
+			result = TCPSocket_recv_to_file_closed(*received, len, error);
+			*done = LTRUE;
+			break;
+		}
+
+		moved = rc;
+		while (moved>0) {
+			pos = (loff_t)(offset+*received);
+			rc = splice(pipefd[0], NULL, fd, &pos, moved, SPLICE_F_MOVE);
+			if (rc==(-1) && errno==EINTR) {
+				continue;
+			} else if (rc==(-1) && (errno==EINVAL || errno==ENOSYS)) {
+				/* The file doesn't support splice: the data already in
+				 * the pipe is copied */
+				if (buf==NULL) {
+					buf = (char *)lmalloc(PIPE_CHUNK_SIZE);
+				}
+				rc = read(pipefd[0], buf, moved);
+				if (rc<=0 || !net_pwrite_full(fd, buf, rc, offset+*received, error)) {
+					if (rc<=0) {
+						lerror_set_sprintf(error, "Can't read the pipe: %s", strerror(errno));
+					}
+					result = LFALSE;
+					break;
+				}
+			} else if (rc==(-1)) {
+				lerror_set_sprintf(error, "Can't write the file: %s", strerror(errno));
+				result = LFALSE;
+				break;
+			}
+			*received += rc;
+			moved -= rc;
+		}
+
+		if (!result || buf!=NULL) {
+			break;
+		}
+	}
+
+	if (result && !*done && len>=0 && *received==len) {
+		*done = LTRUE;
+	}
+
+	if (buf!=NULL) {
+		lfree(buf);
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return result;
+}
+#endif
+
+long long TCPSocket_recv_to_file(TCPSocket *self, int fd, long long offset, long long len, lerror **error) {
+	long long received = 0;
+	lbool done = LFALSE;
+	lerror *myError = NULL;
+	char *buf;
+	int n;
+	int rc;
+
+	l_assert(self!=NULL);
+	l_assert(fd>=0);
+	l_assert(offset>=0);
+	l_assert(error==NULL || *error==NULL);
+
+	/* The data already read by the buffered reader comes first */
+	n = TCPSocket_buffered(self);
+	if (len>=0 && n>len) {
+		n = (int)len;
+	}
+	if (n>0) {
+		if (!net_pwrite_full(fd, TCPSocket_buffered_data(self), n, offset, error)) {
+			return -1;
+		}
+		TCPSocket_consume(self, n);
+		received = n;
+	}
+
+#ifdef __linux__
+	/* The data of a TLS socket must be decrypted by the process */
+	if (!TCPSocket_is_tls(self) && !TCPSocket_recv_to_file_splice(self, fd, offset, len, &received, &done, error)) {
+		return -1;
+	}
+#endif
+
+	if (done || received==len) {
+		return received;
+	}
+
+	buf = (char *)lmalloc(COPY_CHUNK_SIZE);
+	while (len<0 || received<len) {
+		n = len<0 || len-received>COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (int)(len-received);
+		rc = TCPSocket_raw_recv(self, buf, n, 0);
+		TCPSocket_count_recv(self, rc);
+		if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1) && self->nonBlocking && net_would_block()) {
+			TCPSocket_wait(self, POLLIN, -1);
+			continue;
+		} else if (rc==(-1)) {
+			lerror_set_sprintf(&myError, "Can't read data from stream: %s", strerror(errno));
+			break;
+		} else if (rc==0) {
+			TCPSocket_recv_to_file_closed(received, len, &myError);
+			break;
+		}
+
+		if (!net_pwrite_full(fd, buf, rc, offset+received, &myError)) {
+			break;
+		}
+		received += rc;
+	}
+	lfree(buf);
+
+	if (myError!=NULL) {
+		lerror_propagate(error, myError);
+		return -1;
+	}
+	return received;
+}
+
+lbool TCPSocket_set_nodelay(TCPSocket *self, lbool enabled, lerror **error) {
+	int value = enabled ? 1 : 0;
+
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value))<0) {
+		lerror_set_sprintf(error, "Can't set TCP_NODELAY: %s", strerror(errno));
+		return LFALSE;
+	}
+	return LTRUE;
+}
+
+lbool TCPSocket_set_cork(TCPSocket *self, lbool enabled, lerror **error) {
+	int value = enabled ? 1 : 0;
+
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+#if defined(TCP_CORK)
+	if (setsockopt(self->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value))<0) {
+		lerror_set_sprintf(error, "Can't set TCP_CORK: %s", strerror(errno));
+		return LFALSE;
+	}
+	return LTRUE;
+#elif defined(TCP_NOPUSH)
+	if (setsockopt(self->fd, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value))<0) {
+		lerror_set_sprintf(error, "Can't set TCP_NOPUSH: %s", strerror(errno));
+		return LFALSE;
+	}
+	return LTRUE;
+#else
+	lerror_set(error, "TCP_CORK is not supported on this platform");
+	return LFALSE;
+#endif
+}
+
+void TCPSocket_get_stats(TCPSocket *self, TCPSocketStats *stats) {
+	l_assert(self!=NULL);
+	l_assert(stats!=NULL);
+
+	*stats = self->stats;
+}
+
+lbool TCPSocket_get_info(TCPSocket *self, TCPSocketInfo *info, lerror **error) {
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info kernelInfo;
+	socklen_t len = sizeof(kernelInfo);
+#endif
+
+	l_assert(self!=NULL);
+	l_assert(info!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+#if defined(__linux__) && defined(TCP_INFO)
+	memset(&kernelInfo, 0, sizeof(kernelInfo));
+	if (getsockopt(self->fd, IPPROTO_TCP, TCP_INFO, &kernelInfo, &len)<0) {
+		lerror_set_sprintf(error, "Can't get TCP_INFO: %s", strerror(errno));
+		return LFALSE;
+	}
+
+	info->rttMicros = kernelInfo.tcpi_rtt;
+	info->rttVarMicros = kernelInfo.tcpi_rttvar;
+	info->retransmits = kernelInfo.tcpi_retransmits;
+	info->totalRetransmits = kernelInfo.tcpi_total_retrans;
+	info->lost = kernelInfo.tcpi_lost;
+	info->unacked = kernelInfo.tcpi_unacked;
+	info->sendCwnd = kernelInfo.tcpi_snd_cwnd;
+	info->sendMss = kernelInfo.tcpi_snd_mss;
+	info->receiveSpace = kernelInfo.tcpi_rcv_space;
+	info->lastDataSentMillis = kernelInfo.tcpi_last_data_sent;
+	info->lastDataReceivedMillis = kernelInfo.tcpi_last_data_recv;
+	return LTRUE;
+#else
+	lerror_set(error, "TCP_INFO is not supported on this platform");
+	return LFALSE;
+#endif
+}
+
+void TCPSocket_enable_global_stats(lbool enabled) {
+	__atomic_store_n(&net_global_stats_enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void TCPSocket_get_global_stats(TCPSocketStats *stats) {
+	l_assert(stats!=NULL);
+
+	stats->bytesReceived = __atomic_load_n(&net_global_stats.bytesReceived, __ATOMIC_RELAXED);
+	stats->bytesSent = __atomic_load_n(&net_global_stats.bytesSent, __ATOMIC_RELAXED);
+	stats->recvCalls = __atomic_load_n(&net_global_stats.recvCalls, __ATOMIC_RELAXED);
+	stats->sendCalls = __atomic_load_n(&net_global_stats.sendCalls, __ATOMIC_RELAXED);
+	stats->partialWrites = __atomic_load_n(&net_global_stats.partialWrites, __ATOMIC_RELAXED);
+	stats->recvWouldBlock = __atomic_load_n(&net_global_stats.recvWouldBlock, __ATOMIC_RELAXED);
+	stats->sendWouldBlock = __atomic_load_n(&net_global_stats.sendWouldBlock, __ATOMIC_RELAXED);
+	stats->accepts = __atomic_load_n(&net_global_stats.accepts, __ATOMIC_RELAXED);
+	stats->connects = __atomic_load_n(&net_global_stats.connects, __ATOMIC_RELAXED);
+	stats->connectFailures = __atomic_load_n(&net_global_stats.connectFailures, __ATOMIC_RELAXED);
+	stats->connectMicros = __atomic_load_n(&net_global_stats.connectMicros, __ATOMIC_RELAXED);
+}
+
+static lstring *net_format_counter_f(lstring *dest, const char *prefix, const char *name, const char *help, long long value) {
+	return lstring_append_sprintf_f(dest, "# HELP %s_%s %s\n"
+		"# TYPE %s_%s counter\n"
+		"%s_%s %lld\n", prefix, name, help, prefix, name, prefix, name, value);
+}
+
+lstring *TCPSocketStats_format_f(const TCPSocketStats *stats, lstring *dest, const char *prefix) {
+	l_assert(stats!=NULL);
+	l_assert(dest!=NULL);
+	l_assert(prefix!=NULL);
+
+	dest = net_format_counter_f(dest, prefix, "received_bytes_total", "Bytes received.", stats->bytesReceived);
+	dest = net_format_counter_f(dest, prefix, "sent_bytes_total", "Bytes sent.", stats->bytesSent);
+	dest = net_format_counter_f(dest, prefix, "recv_calls_total", "System calls receiving data.", stats->recvCalls);
+	dest = net_format_counter_f(dest, prefix, "send_calls_total", "System calls sending data.", stats->sendCalls);
+	dest = net_format_counter_f(dest, prefix, "partial_writes_total", "Sends accepted only in part by the kernel.", stats->partialWrites);
+	dest = net_format_counter_f(dest, prefix, "recv_would_block_total", "Receives failed with EAGAIN.", stats->recvWouldBlock);
+	dest = net_format_counter_f(dest, prefix, "send_would_block_total", "Sends failed with EAGAIN.", stats->sendWouldBlock);
+	dest = net_format_counter_f(dest, prefix, "accepts_total", "Connections accepted.", stats->accepts);
+	dest = net_format_counter_f(dest, prefix, "connects_total", "Connections opened.", stats->connects);
+	dest = net_format_counter_f(dest, prefix, "connect_failures_total", "Connections failed.", stats->connectFailures);
+
+	dest = lstring_append_sprintf_f(dest, "# HELP %s_connect_seconds Time spent opening connections.\n"
+		"# TYPE %s_connect_seconds summary\n"
+		"%s_connect_seconds_sum %.6f\n"
+		"%s_connect_seconds_count %lld\n", prefix, prefix,
+		prefix, stats->connectMicros/1000000.0,
+		prefix, stats->connects);
+	return dest;
+}
+
+#ifdef NETSOCKET_USE_OPENSSL
+
+static void net_tls_session_free(void *session) {
+	SSL_SESSION_free((SSL_SESSION *)session);
+}
+
+/* Keep the session received by a client connection, to resume it with
+ * the next connection to the same server */
+static int net_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+	TCPSocket *socket = (TCPSocket *)SSL_get_app_data(ssl);
+	TCPTlsContext *tls;
+
+	if (socket==NULL || socket->tlsSessionKey==NULL || !SSL_SESSION_is_resumable(session)) {
+		return 0;
+	}
+
+	tls = socket->tls;
+	pthread_mutex_lock(&tls->mutex);
+	if (lhashtable_len(tls->sessions)>=MAX_TLS_SESSIONS && lhashtable_get(tls->sessions, socket->tlsSessionKey)==NULL) {
+		lhashtable_clear(tls->sessions);
+	}
+	lhashtable_put(tls->sessions, socket->tlsSessionKey, session);
+	pthread_mutex_unlock(&tls->mutex);
+
+	/* The table keeps the reference */
+	return 1;
+}
+
+static TCPTlsContext *TCPTlsContext_new(SSL_CTX *ctx, lbool server) {
+	TCPTlsContext *self = (TCPTlsContext *)lmalloc(sizeof(struct TCPTlsContext));
+
+	self->ctx = ctx;
+	self->server = server;
+	self->refs = 1;
+	pthread_mutex_init(&self->mutex, NULL);
+	self->sessions = lhashtable_new(net_tls_session_free);
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return self;
+}
+
+TCPTlsContext *TCPTlsContext_new_server(const char *certFile, const char *keyFile, lerror **error) {
+	static const unsigned char sessionContext[] = "CommonLib";
+	SSL_CTX *ctx;
+
+	l_assert(certFile!=NULL);
+	l_assert(keyFile!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx==NULL) {
+		net_tls_set_error(error, "Can't create the TLS context");
+		return NULL;
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, certFile)!=1) {
+		net_tls_set_error(error, "Can't load the certificate");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM)!=1 || SSL_CTX_check_private_key(ctx)!=1) {
+		net_tls_set_error(error, "Can't load the private key");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	/* The sessions are resumed from the cache (TLS 1.2 session ids) or
+	 * from the tickets kept by the clients */
+	SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext)-1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+	return TCPTlsContext_new(ctx, LTRUE);
+}
+
+TCPTlsContext *TCPTlsContext_new_client(const char *caFile, lerror **error) {
+	SSL_CTX *ctx;
+	int rc;
+
+	l_assert(error==NULL || *error==NULL);
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx==NULL) {
+		net_tls_set_error(error, "Can't create the TLS context");
+		return NULL;
+	}
+
+	rc = caFile!=NULL ? SSL_CTX_load_verify_locations(ctx, caFile, NULL) : SSL_CTX_set_default_verify_paths(ctx);
+	if (rc!=1) {
+		net_tls_set_error(error, "Can't load the trusted certificates");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	/* The sessions are kept by the context, see net_tls_new_session */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, net_tls_new_session);
+
+	return TCPTlsContext_new(ctx, LFALSE);
+}
+
+void TCPTlsContext_set_verify(TCPTlsContext *self, lbool enabled) {
+	l_assert(self!=NULL);
+	l_assert(!self->server);
+
+	SSL_CTX_set_verify(self->ctx, enabled ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+}
+
+lbool TCPTlsContext_set_ciphers(TCPTlsContext *self, const char *cipherList, const char *cipherSuites, lerror **error) {
+	l_assert(self!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	if (cipherList!=NULL && SSL_CTX_set_cipher_list(self->ctx, cipherList)!=1) {
+		net_tls_set_error(error, "Invalid TLS cipher list");
+		return LFALSE;
+	}
+	if (cipherSuites!=NULL && SSL_CTX_set_ciphersuites(self->ctx, cipherSuites)!=1) {
+		net_tls_set_error(error, "Invalid TLS cipher suites");
+		return LFALSE;
+	}
+	return LTRUE;
+}
+
+void TCPTlsContext_set_session_cache(TCPTlsContext *self, int size, int timeoutSeconds) {
+	l_assert(self!=NULL);
+	l_assert(self->server);
+	l_assert(size>0);
+	l_assert(timeoutSeconds>0);
+
+	SSL_CTX_sess_set_cache_size(self->ctx, size);
+	SSL_CTX_set_timeout(self->ctx, timeoutSeconds);
+}
+
+lbool TCPTlsContext_enable_ktls(TCPTlsContext *self, lbool enabled) {
+	l_assert(self!=NULL);
+
+#if defined(NET_USE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+	if (enabled) {
+		SSL_CTX_set_options(self->ctx, SSL_OP_ENABLE_KTLS);
+	} else {
+		SSL_CTX_clear_options(self->ctx, SSL_OP_ENABLE_KTLS);
+	}
+	return LTRUE;
+#else
+	return LFALSE;
+#endif
+}
+
+void TCPTlsContext_destroy(TCPTlsContext *self) {
+	if (self==NULL) return;
+	TCPTlsContext_release(self);
+}
+
+void TCPListenSocket_set_tls(TCPListenSocket *self, TCPTlsContext *ctx) {
+	l_assert(self!=NULL);
+	l_assert(ctx==NULL || ctx->server);
+
+	if (ctx!=NULL) {
+		TCPTlsContext_retain(ctx);
+	}
+	if (self->tls!=NULL) {
+		TCPTlsContext_release(self->tls);
+	}
+	self->tls = ctx;
+}
+
+lbool TCPListenSocket_is_tls(TCPListenSocket *self) {
+	l_assert(self!=NULL);
+	return self->tls!=NULL;
+}
+
+int TCPSocket_start_tls(TCPSocket *self, TCPTlsContext *ctx, const char *serverName, lerror **error) {
+	unsigned char address[sizeof(struct in6_addr)];
+	SSL_SESSION *session;
+
+	l_assert(self!=NULL);
+	l_assert(ctx!=NULL && !ctx->server);
+	l_assert(self->ssl==NULL);
+	l_assert(TCPSocket_buffered(self)==0);
+	l_assert(error==NULL || *error==NULL);
+
+	if (!TCPSocket_attach_tls(self, ctx, error)) {
+		return -1;
+	}
+	self->tlsSessionKey = lstring_new_from_cstr(serverName!=NULL ? serverName : self->remoteAddress);
+
+	if (serverName!=NULL && (inet_pton(AF_INET, serverName, address)==1 || inet_pton(AF_INET6, serverName, address)==1)) {
+		/* The IP addresses are checked but not sent as names */
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(self->ssl), serverName);
+	} else if (serverName!=NULL) {
+		SSL_set_tlsext_host_name(self->ssl, serverName);
+		SSL_set1_host(self->ssl, serverName);
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	session = (SSL_SESSION *)lhashtable_get(ctx->sessions, self->tlsSessionKey);
+	if (session!=NULL) {
+		SSL_set_session(self->ssl, session);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+
+	SSL_set_connect_state(self->ssl);
+	return TCPSocket_tls_handshake(self, error);
+}
+
+int TCPSocket_tls_handshake(TCPSocket *self, lerror **error) {
+	NetSigpipeGuard guard;
+	ssize_t rc;
+	long verifyResult;
+
+	l_assert(self!=NULL);
+	l_assert(self->ssl!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	while (1) {
+		ERR_clear_error();
+		net_sigpipe_block(&guard);
+		rc = TCPSocket_tls_result(self, SSL_do_handshake(self->ssl));
+		net_sigpipe_unblock(&guard);
+		if (rc>0) {
+			return 1;
+		} else if (rc==(-1) && errno==EINTR) {
+			continue;
+		} else if (rc==(-1) && net_would_block() && self->nonBlocking) {
+			return TCPSOCKET_WOULD_BLOCK;
+		} else if (rc==(-1) && net_would_block()) {
+			TCPSocket_wait(self, POLLIN, -1);
+			continue;
+		}
+
+		verifyResult = SSL_get_verify_result(self->ssl);
+		if (verifyResult!=X509_V_OK) {
+			lerror_set_sprintf(error, "TLS handshake failed: %s", X509_verify_cert_error_string(verifyResult));
+			ERR_clear_error();
+		} else if (rc==0) {
+			lerror_set(error, "Connection closed during the TLS handshake");
+		} else {
+			net_tls_set_error(error, "TLS handshake failed");
+		}
+		return -1;
+	}
+}
+
+lbool TCPSocket_is_tls(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return self->ssl!=NULL;
+}
+
+lbool TCPSocket_tls_session_reused(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return self->ssl!=NULL && SSL_session_reused(self->ssl);
+}
+
+lbool TCPSocket_tls_uses_ktls(TCPSocket *self) {
+	l_assert(self!=NULL);
+#ifdef NET_USE_KTLS
+	return self->ssl!=NULL && BIO_get_ktls_send(SSL_get_wbio(self->ssl));
+#else
+	return LFALSE;
+#endif
+}
+
+lbool TCPSocket_tls_wants_write(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return self->ssl!=NULL && self->tlsWait==POLLOUT;
+}
+
+#else
+
+TCPTlsContext *TCPTlsContext_new_server(const char *certFile, const char *keyFile, lerror **error) {
+	lerror_set(error, "CommonLib is compiled without TLS support");
+	return NULL;
+}
+
+TCPTlsContext *TCPTlsContext_new_client(const char *caFile, lerror **error) {
+	lerror_set(error, "CommonLib is compiled without TLS support");
+	return NULL;
+}
+
+void TCPTlsContext_set_verify(TCPTlsContext *self, lbool enabled) {
+	l_assert(self!=NULL);
+}
+
+lbool TCPTlsContext_set_ciphers(TCPTlsContext *self, const char *cipherList, const char *cipherSuites, lerror **error) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+void TCPTlsContext_set_session_cache(TCPTlsContext *self, int size, int timeoutSeconds) {
+	l_assert(self!=NULL);
+}
+
+lbool TCPTlsContext_enable_ktls(TCPTlsContext *self, lbool enabled) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+void TCPTlsContext_destroy(TCPTlsContext *self) {
+}
+
+void TCPListenSocket_set_tls(TCPListenSocket *self, TCPTlsContext *ctx) {
+	l_assert(self!=NULL);
+	l_assert(ctx==NULL);
+}
+
+lbool TCPListenSocket_is_tls(TCPListenSocket *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+int TCPSocket_start_tls(TCPSocket *self, TCPTlsContext *ctx, const char *serverName, lerror **error) {
+	lerror_set(error, "CommonLib is compiled without TLS support");
+	return -1;
+}
+
+int TCPSocket_tls_handshake(TCPSocket *self, lerror **error) {
+	lerror_set(error, "CommonLib is compiled without TLS support");
+	return -1;
+}
+
+lbool TCPSocket_is_tls(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+lbool TCPSocket_tls_session_reused(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+lbool TCPSocket_tls_uses_ktls(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+lbool TCPSocket_tls_wants_write(TCPSocket *self) {
+	l_assert(self!=NULL);
+	return LFALSE;
+}
+
+#endif
+
+void TCPSocket_send_string(TCPSocket *self, const char *buf, lerror **error) {
+	lerror *myError = NULL;
+	
+	l_assert(self!=NULL);
+	l_assert(buf!=NULL);
+	l_assert(error==NULL || *error==NULL);
+
+	TCPSocket_send_full(self, (void *)buf, strlen(buf), &myError);
+	lerror_propagate(error, myError);
+}
+
+void TCPSocket_destroy(TCPSocket *self) {
+#ifdef NETSOCKET_USE_OPENSSL
+	NetSigpipeGuard guard;
+#endif
+
+	if (self==NULL) return;
+#ifdef NETSOCKET_USE_OPENSSL
+	if (self->ssl!=NULL) {
+		/* The close_notify alert is sent without waiting for the one
+		 * of the peer */
+		if (SSL_is_init_finished(self->ssl)) {
+			net_sigpipe_block(&guard);
+			SSL_shutdown(self->ssl);
+			net_sigpipe_unblock(&guard);
+		}
+		ERR_clear_error();
+		SSL_free(self->ssl);
+		TCPTlsContext_release(self->tls);
+		lstring_delete(self->tlsSessionKey);
+	}
+#endif
 	close(self->fd);
+	MemBuffer_destroy(self->readBuffer);
 	lstring_delete(self->localAddress);
 	lstring_delete(self->remoteAddress);
 	lfree(self);
@@ -2,6 +2,9 @@
 #define __COMMONLIB_NET_SOCKET_H
 
 #include "lerror.h"
+#include "lvector.h"
+#include "buffer.h"
+#include <sys/uio.h>
 
 /*
 About: License
@@ -46,17 +49,166 @@ typedef struct TCPListenSocket TCPListenSocket;
  */
 typedef struct TCPSocket TCPSocket;
 
+/**
+ * Class: TCPTlsContext
+ * The TLS configuration shared by many sockets: the certificates, the
+ * cipher suites and the sessions that can be resumed. The TLS functions
+ * only work if CommonLib is compiled with NETSOCKET_USE_OPENSSL.
+ */
+typedef struct TCPTlsContext TCPTlsContext;
+
+/**
+ * Constant: TCPSOCKET_WOULD_BLOCK
+ * Returned by <TCPSocket_recv> and <TCPSocket_send> when a
+ * non-blocking socket is not ready
+ */
+#define TCPSOCKET_WOULD_BLOCK (-2)
+
+/**
+ * Constant: TCPSOCKET_DEFAULT_SEND_TIMEOUT_MILLIS
+ * How long the functions sending all the data wait for a full
+ * non-blocking socket to be writable again, see <TCPSocket_set_send_timeout>
+ */
+#define TCPSOCKET_DEFAULT_SEND_TIMEOUT_MILLIS 30000
+
+/**
+ * Struct: TCPListenOptions
+ * The options of a listening socket, see <TCPListenOptions_init> for the
+ * defaults
+ *
+ * Fields:
+ *     backlog - The length of the queue of the connections waiting to be
+ *         accepted. Zero for the system maximum (SOMAXCONN).
+ *     reusePort - Set SO_REUSEPORT, so more sockets can listen on the
+ *         same port and the kernel balances the connections between them
+ *     deferAccept - Seconds to wait for the client data before the
+ *         connection can be accepted (TCP_DEFER_ACCEPT, only on Linux).
+ *         Zero to accept the connections immediately.
+ *     nonBlocking - Create the socket in non-blocking mode
+ */
+typedef struct TCPListenOptions {
+	int backlog;
+	lbool reusePort;
+	int deferAccept;
+	lbool nonBlocking;
+} TCPListenOptions;
+
+/**
+ * Struct: TCPSocketStats
+ * The counters of the system calls made on a socket, or on every socket
+ * (see <TCPSocket_enable_global_stats>)
+ *
+ * Fields:
+ *     bytesReceived - The bytes received
+ *     bytesSent - The bytes sent
+ *     recvCalls - The system calls receiving data
+ *     sendCalls - The system calls sending data
+ *     partialWrites - The sends where the kernel accepted only a part
+ *         of the data, usually because the peer is slow
+ *     recvWouldBlock - The receives failed because no data was ready
+ *     sendWouldBlock - The sends failed because the socket buffer was full
+ *     accepts - The connections accepted
+ *     connects - The connections opened by <TCPSocket_connect>
+ *     connectFailures - The connections failed
+ *     connectMicros - The time spent in the TCP handshakes, in microseconds
+ */
+typedef struct TCPSocketStats {
+	long long bytesReceived;
+	long long bytesSent;
+	long long recvCalls;
+	long long sendCalls;
+	long long partialWrites;
+	long long recvWouldBlock;
+	long long sendWouldBlock;
+	long long accepts;
+	long long connects;
+	long long connectFailures;
+	long long connectMicros;
+} TCPSocketStats;
+
+/**
+ * Struct: TCPSocketInfo
+ * The state of a connection as seen by the kernel (TCP_INFO)
+ *
+ * Fields:
+ *     rttMicros - The smoothed round trip time
+ *     rttVarMicros - The variation of the round trip time
+ *     retransmits - The retransmissions of the unacknowledged segment
+ *     totalRetransmits - The segments retransmitted since the connection
+ *         was opened
+ *     lost - The segments considered lost
+ *     unacked - The segments sent and not acknowledged yet
+ *     sendCwnd - The congestion window, in segments
+ *     sendMss - The maximum segment size
+ *     receiveSpace - The receive window advertised to the peer
+ *     lastDataSentMillis - The time since the last data was sent
+ *     lastDataReceivedMillis - The time since the last data was received
+ */
+typedef struct TCPSocketInfo {
+	unsigned int rttMicros;
+	unsigned int rttVarMicros;
+	unsigned int retransmits;
+	unsigned int totalRetransmits;
+	unsigned int lost;
+	unsigned int unacked;
+	unsigned int sendCwnd;
+	unsigned int sendMss;
+	unsigned int receiveSpace;
+	unsigned int lastDataSentMillis;
+	unsigned int lastDataReceivedMillis;
+} TCPSocketInfo;
+
+/**
+ * Function: TCPListenOptions_init
+ * Fill the options with the defaults: the system maximum backlog and
+ * a blocking socket without SO_REUSEPORT and TCP_DEFER_ACCEPT
+ * Parameters:
+ *     options - The options (must be not NULL)
+ */
+void TCPListenOptions_init(TCPListenOptions *options);
+
 /**
  * Function: TCPListenSocket_new
+ * Creates a new listening socket with the default options.
+ * Parameters:
+ *     hostname - The IP address to use to bound the socket, resolved
+ *         with <NetResolver_get_default>
+ *     port - The TCP port number or the service name
+ * Returns:
+ *     A new listening socket already bound to the port and 
+ *     listening
+ */
+TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, lerror **error);
+
+/**
+ * Function: TCPListenSocket_new_with_options
  * Creates a new listening socket.
  * Parameters:
  *     hostname - The IP address to use to bound the socket
  *     port - The TCP port number or the service name
+ *     options - The options, NULL for the defaults
  * Returns:
  *     A new listening socket already bound to the port and 
  *     listening
  */
-TCPListenSocket* TCPListenSocket_new(const char *hostname, const char *port, lerror **error);
+TCPListenSocket* TCPListenSocket_new_with_options(const char *hostname, const char *port, const TCPListenOptions *options, lerror **error);
+
+/**
+ * Function: TCPListenSocket_new_shards
+ * Creates some listening sockets on the same port with SO_REUSEPORT,
+ * usually one for every thread accepting connections. The kernel
+ * distributes the incoming connections between them.
+ * Parameters:
+ *     hostname - The IP address to use to bound the sockets
+ *     port - The TCP port number or the service name
+ *     count - The number of sockets (greater than zero)
+ *     options - The options, NULL for the defaults. SO_REUSEPORT is
+ *         always set.
+ * Returns:
+ *     A vector of listening sockets, or NULL in case of errors. The
+ *     sockets must be destroyed by the caller before the vector.
+ */
+lvector *TCPListenSocket_new_shards(const char *hostname, const char *port, int count, const TCPListenOptions *options, lerror **error);
 
 
 /**
@@ -75,12 +227,53 @@ TCPListenSocket* TCPListenSocket_new_from_fd(int fd, const char *hostname);
 
 /**
  * Function: TCPListenSocket_accept
- * Accept an incoming connection from this server socket 
+ * Accept an incoming connection from this server socket. If the
+ * server socket is in non-blocking mode the connection is non-blocking
+ * too.
  * Parameters:
  *     self - The server socket
+ * Returns:
+ *     The connection or NULL. A non-blocking socket returns NULL without
+ *     an error when there are no pending connections.
  */
 TCPSocket *TCPListenSocket_accept(TCPListenSocket *self, lerror **error);
 
+/**
+ * Function: TCPListenSocket_adopt
+ * Create the socket of a connection accepted from this server socket by
+ * other means, like <IoEngine_accept>. The connection gets the local
+ * address, the mode and the TLS context of the server socket, as with
+ * <TCPListenSocket_accept>.
+ * Parameters:
+ *     self - The server socket (must be not NULL)
+ *     fd - The accepted file descriptor, owned by the new socket
+ *     remoteAddress - The address of the client (must be not NULL)
+ * Returns:
+ *     The connection, or NULL if the mode can't be set. The descriptor
+ *     is closed in this case.
+ */
+TCPSocket *TCPListenSocket_adopt(TCPListenSocket *self, int fd, const char *remoteAddress, lerror **error);
+
+/**
+ * Function: TCPListenSocket_set_nonblocking
+ * Enable or disable the non-blocking mode, to use the socket with
+ * an <EventLoop>
+ * Parameters:
+ *     self - The server socket (must be not NULL)
+ *     enabled - LTRUE for the non-blocking mode
+ * Returns:
+ *     LTRUE if the mode was changed, LFALSE otherwise
+ */
+lbool TCPListenSocket_set_nonblocking(TCPListenSocket *self, lbool enabled, lerror **error);
+
+/**
+ * Function: TCPListenSocket_get_fd
+ * Get the file descriptor of the socket, to watch it with an <EventLoop>
+ * Parameters:
+ *     self - The server socket (must be not NULL)
+ */
+int TCPListenSocket_get_fd(TCPListenSocket *self);
+
 /**
  * Function: TCPListenSocket_destroy
  * Delete all the associated resources of this socket
@@ -91,15 +284,51 @@ void TCPListenSocket_destroy(TCPListenSocket *self);
 
 /**
  * Function: TCPSocket_connect
- * Connect to a remote host
+ * Connect to a remote host, waiting as long as the kernel allows. See
+ * <TCPSocket_connect_with_timeout>.
  * Parameters:
- *     hostname - The IP address to use to bound the socket (must not be NULL)
+ *     hostname - The host name or IP address (must not be NULL)
  *     port - The TCP port number or the service name (must not be NULL)
  * Return:
  *     A connected socket or NULL in case of errors
  */
 TCPSocket *TCPSocket_connect(const char *hostname, const char *port, lerror **error);
 
+/**
+ * Function: TCPSocket_connect_with_timeout
+ * Connect to a remote host trying every address resolved by
+ * <NetResolver_get_default>. The addresses
+ * of the two families are alternated and, when a connection is still
+ * pending after 250ms, the next address is tried in parallel ("happy
+ * eyeballs", RFC 8305). The first connection completed is kept.
+ * Parameters:
+ *     hostname - The host name or IP address (must not be NULL)
+ *     port - The TCP port number or the service name (must not be NULL)
+ *     timeoutMillis - The maximum time to wait for a connection, or zero
+ *         to wait as long as the kernel allows
+ * Return:
+ *     A connected, blocking socket or NULL in case of errors
+ */
+TCPSocket *TCPSocket_connect_with_timeout(const char *hostname, const char *port, int timeoutMillis, lerror **error);
+
+/**
+ * Function: TCPSocket_set_resolve_cache_ttl
+ * Change how long the default resolver keeps the addresses resolved by
+ * the connections, see <NetResolver_set_ttl>. The failures are kept for
+ * the same time, up to NETRESOLVER_DEFAULT_NEGATIVE_TTL_MILLIS. The
+ * addresses of a host are forgotten when none of them can be connected.
+ * Parameters:
+ *     ttlMillis - How long the addresses are kept, or zero to only share
+ *         the concurrent lookups
+ */
+void TCPSocket_set_resolve_cache_ttl(int ttlMillis);
+
+/**
+ * Function: TCPSocket_clear_resolve_cache
+ * Forget every address kept by the resolution cache
+ */
+void TCPSocket_clear_resolve_cache(void);
+
 /**
  * Function: TCPSocket_new_from_fd
  * This function incapsulate a file descriptor inside
@@ -115,7 +344,9 @@ TCPSocket *TCPSocket_new_from_fd(int fd, const char *localAddress, const char *r
 /**
  * Function: TCPSocket_send_full
  * This function send `buf_len` bytes of data from the buffer 
- * to the socket
+ * to the socket. A non-blocking socket waits to be writable
+ * when its buffer is full, up to the send timeout
+ * (<TCPSocket_set_send_timeout>).
  * Parameters:
  *     self - The socket (must be not NULL)
  *     buf - The buffer where to read the data (must be not NULL)
@@ -123,6 +354,155 @@ TCPSocket *TCPSocket_new_from_fd(int fd, const char *localAddress, const char *r
  */
 void TCPSocket_send_full(TCPSocket *self, void *buf, int buf_len, lerror **error);
 
+/**
+ * Function: TCPSocket_sendv
+ * Send some buffers with as few system calls as possible (sendmsg),
+ * waiting for all the data to be sent. A non-blocking socket waits up to
+ * the send timeout (<TCPSocket_set_send_timeout>).
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     iov - The buffers, which are not changed (must be not NULL)
+ *     count - The number of buffers
+ */
+void TCPSocket_sendv(TCPSocket *self, const struct iovec *iov, int count, lerror **error);
+
+/**
+ * Function: TCPSocket_send_file
+ * Send a part of a file, waiting for all the data to be sent. On Linux the
+ * data is moved by the kernel (sendfile) without copying it in the process
+ * memory, otherwise, or when the file doesn't support it, the file is
+ * read in a buffer. A TLS socket uses sendfile only with kernel TLS.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     fd - The file descriptor of a regular file, opened for reading
+ *     offset - The position of the first byte to send
+ *     len - The number of bytes to send, or -1 to send up to the end
+ *         of the file
+ * Returns:
+ *     The number of bytes sent or -1 on error
+ */
+long long TCPSocket_send_file(TCPSocket *self, int fd, long long offset, long long len, lerror **error);
+
+/**
+ * Function: TCPSocket_recv_to_file
+ * Receive data and write it in a file, waiting for all the data to be
+ * received. The data already read by the buffered reader is written
+ * first. On Linux the following data is moved by the kernel through
+ * a pipe (splice), otherwise, or when the file doesn't support it or the
+ * socket uses TLS, the data is received in a buffer.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     fd - The file descriptor of the file, opened for writing
+ *     offset - The position in the file where the first byte is written
+ *     len - The number of bytes to receive, or -1 to receive until the
+ *         connection is closed
+ * Returns:
+ *     The number of bytes written or -1 on error. It's an error if the
+ *     connection is closed before len bytes are received.
+ */
+long long TCPSocket_recv_to_file(TCPSocket *self, int fd, long long offset, long long len, lerror **error);
+
+/**
+ * Function: TCPSocket_set_nodelay
+ * Enable or disable the Nagle algorithm (TCP_NODELAY). Disabling it
+ * sends the small messages immediately.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     enabled - LTRUE to send the data without delay
+ * Returns:
+ *     LTRUE if the option was changed, LFALSE otherwise
+ */
+lbool TCPSocket_set_nodelay(TCPSocket *self, lbool enabled, lerror **error);
+
+/**
+ * Function: TCPSocket_set_cork
+ * Hold the partial segments until the option is disabled (TCP_CORK, or
+ * TCP_NOPUSH on BSD), to send a response written in more parts with
+ * full segments
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     enabled - LTRUE to hold the data, LFALSE to send it
+ * Returns:
+ *     LTRUE if the option was changed, LFALSE otherwise
+ */
+lbool TCPSocket_set_cork(TCPSocket *self, lbool enabled, lerror **error);
+
+/**
+ * Function: TCPSocket_get_stats
+ * Get the counters of a socket. The values are approximate if other
+ * threads are using the socket.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     stats - Filled with the counters (must be not NULL)
+ */
+void TCPSocket_get_stats(TCPSocket *self, TCPSocketStats *stats);
+
+/**
+ * Function: TCPSocket_add_recv_stats
+ * Account in the counters a receive made on the descriptor of the socket
+ * by other means, like <IoEngine_recv>
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     result - The number of bytes received, zero if the connection was
+ *         closed or the error code with the negative sign (ex. -EAGAIN)
+ */
+void TCPSocket_add_recv_stats(TCPSocket *self, int result);
+
+/**
+ * Function: TCPSocket_add_send_stats
+ * Account in the counters a send made on the descriptor of the socket
+ * by other means, like <IoEngine_send>
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     result - The number of bytes sent or the error code with the
+ *         negative sign (ex. -EAGAIN)
+ *     requested - The number of bytes that were to be sent
+ */
+void TCPSocket_add_send_stats(TCPSocket *self, int result, int requested);
+
+/**
+ * Function: TCPSocket_get_info
+ * Get the state of the connection from the kernel. Comparing the round
+ * trip time with the time spent serving a request tells the network
+ * latency from the processing one. Only available on Linux.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     info - Filled with the connection state (must be not NULL)
+ * Returns:
+ *     LTRUE if the state was read, LFALSE otherwise
+ */
+lbool TCPSocket_get_info(TCPSocket *self, TCPSocketInfo *info, lerror **error);
+
+/**
+ * Function: TCPSocket_enable_global_stats
+ * Start or stop adding the counters of every socket to the global ones.
+ * They are disabled by default, as every system call then updates memory
+ * shared between the threads.
+ * Parameters:
+ *     enabled - LTRUE to update the global counters
+ */
+void TCPSocket_enable_global_stats(lbool enabled);
+
+/**
+ * Function: TCPSocket_get_global_stats
+ * Get the global counters
+ * Parameters:
+ *     stats - Filled with the counters (must be not NULL)
+ */
+void TCPSocket_get_global_stats(TCPSocketStats *stats);
+
+/**
+ * Function: TCPSocketStats_format_f
+ * Append the counters to a string, in the Prometheus text format
+ * Parameters:
+ *     stats - The counters (must be not NULL)
+ *     dest - The destination string (must be not NULL)
+ *     prefix - The prefix of the metric names, ex. "net"
+ * Returns:
+ *     The destination string
+ */
+lstring *TCPSocketStats_format_f(const TCPSocketStats *stats, lstring *dest, const char *prefix);
+
 /**
  * Function: TCPSocket_send_string
  * Send a zero-terminated string to the remote side
@@ -141,11 +521,305 @@ void TCPSocket_send_string(TCPSocket *self, const char *buf, lerror **error);
  *     buf - The buffer where to write the data (must be not NULL)
  *     len - The maximum bytes of data to read
  * Return:
- *     The actual number of bytes read or 0 if the remote side
- *     has closed the connection
+ *     The actual number of bytes read, 0 if the remote side
+ *     has closed the connection, -1 in case of errors or
+ *     <TCPSOCKET_WOULD_BLOCK> if the socket is non-blocking and there
+ *     is no data
  */
 int TCPSocket_recv(TCPSocket *self, void *buf, int len, lerror **error);
 
+/**
+ * Function: TCPSocket_read_exact
+ * Read exactly `len` bytes. The data is received in big chunks and the
+ * exceeding part is kept for the next reads, so every read function
+ * (<TCPSocket_recv> too) can be used on the same socket.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     buf - The destination buffer (must be not NULL)
+ *     len - The number of bytes to read (must be greater than zero)
+ * Return:
+ *     `len`, 0 if the remote side has closed the connection before
+ *     sending any data, -1 in case of errors (a connection closed in the
+ *     middle of the data too) or <TCPSOCKET_WOULD_BLOCK> if the socket is
+ *     non-blocking and the data is not complete yet. In this case the data
+ *     received is kept for the next call.
+ */
+int TCPSocket_read_exact(TCPSocket *self, void *buf, int len, lerror **error);
+
+/**
+ * Function: TCPSocket_read_until
+ * Read the data up to a delimiter, like <TCPSocket_read_exact>
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     delimiter - The delimiter (must be not empty)
+ *     dest - The buffer where the data, including the delimiter, is
+ *         appended (must be not NULL)
+ *     maxLen - The maximum length of the data, including the delimiter
+ * Return:
+ *     The number of bytes appended, 0 if the remote side has closed the
+ *     connection before sending any data, -1 in case of errors (also when
+ *     the delimiter is not found in `maxLen` bytes) or
+ *     <TCPSOCKET_WOULD_BLOCK>
+ */
+int TCPSocket_read_until(TCPSocket *self, const char *delimiter, MemBuffer *dest, int maxLen, lerror **error);
+
+/**
+ * Function: TCPSocket_read_line
+ * Read a line terminated by "\n" or "\r\n", like <TCPSocket_read_exact>
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     line - The string receiving the line, without the terminator. It is
+ *         reallocated when needed (must be not NULL).
+ *     maxLen - The maximum length of the line, including the terminator
+ * Return:
+ *     The number of bytes read, including the terminator, 0 if the
+ *     remote side has closed the connection, -1 in case of errors or
+ *     <TCPSOCKET_WOULD_BLOCK>
+ */
+int TCPSocket_read_line(TCPSocket *self, lstring **line, int maxLen, lerror **error);
+
+/**
+ * Function: TCPSocket_send
+ * Send some data with a single call, without waiting for all the data
+ * to be sent
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     buf - The data to send (must be not NULL)
+ *     len - The data length (must be greater than zero)
+ * Return:
+ *     The number of bytes sent, -1 in case of errors or
+ *     <TCPSOCKET_WOULD_BLOCK> if the socket is non-blocking and its
+ *     buffer is full
+ */
+int TCPSocket_send(TCPSocket *self, const void *buf, int len, lerror **error);
+
+/**
+ * Function: TCPSocket_set_nonblocking
+ * Enable or disable the non-blocking mode, to use the socket with
+ * an <EventLoop>. When the socket is readable it must be read until
+ * <TCPSOCKET_WOULD_BLOCK>: the data kept by the buffered reader or
+ * already decrypted by TLS doesn't make the descriptor readable again
+ * (see <TCPSocket_pending>). A TLS socket can need to write while
+ * reading and to read while writing, so after <TCPSOCKET_WOULD_BLOCK>
+ * the caller must wait for the event given by
+ * <TCPSocket_tls_wants_write>.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     enabled - LTRUE for the non-blocking mode
+ * Returns:
+ *     LTRUE if the mode was changed, LFALSE otherwise
+ */
+lbool TCPSocket_set_nonblocking(TCPSocket *self, lbool enabled, lerror **error);
+
+/**
+ * Function: TCPSocket_set_send_timeout
+ * Change how long <TCPSocket_send_full>, <TCPSocket_sendv> and
+ * <TCPSocket_send_file> wait for a non-blocking socket to be writable
+ * again when its buffer is full. When no data can be sent for this time
+ * the functions fail, so a peer that stops reading can't keep the
+ * sending thread forever. The blocking sockets are not affected.
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ *     timeoutMillis - The timeout, or zero to wait forever
+ */
+void TCPSocket_set_send_timeout(TCPSocket *self, int timeoutMillis);
+
+/**
+ * Function: TCPSocket_get_fd
+ * Get the file descriptor of the socket, to watch it with an <EventLoop>
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ */
+int TCPSocket_get_fd(TCPSocket *self);
+
+/**
+ * Function: TCPSocket_pending
+ * Get the number of received bytes that can be read without waiting
+ * for the descriptor: the data kept by the buffered reader and, for a
+ * TLS socket, the data already decrypted
+ * Parameters:
+ *     self - The socket (must be not NULL)
+ */
+int TCPSocket_pending(TCPSocket *self);
+
+/**
+ * Function: TCPTlsContext_new_server
+ * Create a TLS context for the server side of the connections, see
+ * <TCPListenSocket_set_tls>. The sessions are kept in a cache and
+ * in the tickets sent to the clients, so a client connecting again
+ * can resume them without the full handshake. TLS 1.2 is the minimum
+ * version accepted.
+ * Parameters:
+ *     certFile - The PEM file with the certificate chain (must not be NULL)
+ *     keyFile - The PEM file with the private key (must not be NULL)
+ * Returns:
+ *     The context or NULL if the certificate or the key can't be loaded
+ */
+TCPTlsContext *TCPTlsContext_new_server(const char *certFile, const char *keyFile, lerror **error);
+
+/**
+ * Function: TCPTlsContext_new_client
+ * Create a TLS context for the client side of the connections, see
+ * <TCPSocket_start_tls>. The server certificate is verified, and the
+ * sessions received from every server are kept to be resumed by the
+ * next connections to the same server name.
+ * Parameters:
+ *     caFile - The PEM file with the trusted certificates, or NULL to use
+ *         the ones of the system
+ * Returns:
+ *     The context or NULL in case of errors
+ */
+TCPTlsContext *TCPTlsContext_new_client(const char *caFile, lerror **error);
+
+/**
+ * Function: TCPTlsContext_set_verify
+ * Enable or disable the verification of the server certificate, which is
+ * enabled by default. Only for the client contexts.
+ * Parameters:
+ *     self - The context (must not be NULL)
+ *     enabled - LFALSE to accept every certificate
+ */
+void TCPTlsContext_set_verify(TCPTlsContext *self, lbool enabled);
+
+/**
+ * Function: TCPTlsContext_set_ciphers
+ * Choose the ciphers that can be negotiated, in order of preference.
+ * A server context prefers its own order.
+ * Parameters:
+ *     self - The context (must not be NULL)
+ *     cipherList - The OpenSSL cipher list for TLS 1.2, like
+ *         "ECDHE+AESGCM:ECDHE+CHACHA20", or NULL to keep the default
+ *     cipherSuites - The TLS 1.3 cipher suites, like
+ *         "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256", or NULL
+ *         to keep the default
+ * Returns:
+ *     LTRUE if the ciphers were changed, LFALSE if a list has no valid
+ *     cipher
+ */
+lbool TCPTlsContext_set_ciphers(TCPTlsContext *self, const char *cipherList, const char *cipherSuites, lerror **error);
+
+/**
+ * Function: TCPTlsContext_set_session_cache
+ * Configure the sessions kept by a server context
+ * Parameters:
+ *     self - The context (must not be NULL)
+ *     size - The maximum number of sessions in the cache
+ *     timeoutSeconds - How long a session can be resumed
+ */
+void TCPTlsContext_set_session_cache(TCPTlsContext *self, int size, int timeoutSeconds);
+
+/**
+ * Function: TCPTlsContext_enable_ktls
+ * Let the kernel encrypt and decrypt the records (kernel TLS) when the
+ * negotiated cipher and the system support it. Then <TCPSocket_send_file>
+ * sends the files without reading them in the process memory. The
+ * connections fall back to the user space encryption when the kernel
+ * can't be used.
+ * Parameters:
+ *     self - The context (must not be NULL)
+ *     enabled - LTRUE to use kernel TLS when possible
+ * Returns:
+ *     LTRUE if the OpenSSL library supports kernel TLS (OpenSSL 3.0 or
+ *     later on Linux), LFALSE otherwise
+ */
+lbool TCPTlsContext_enable_ktls(TCPTlsContext *self, lbool enabled);
+
+/**
+ * Function: TCPTlsContext_destroy
+ * Release the context. The sockets and the listening sockets using it
+ * keep it alive until they are destroyed.
+ * Parameters:
+ *     self - The context (may be NULL)
+ */
+void TCPTlsContext_destroy(TCPTlsContext *self);
+
+/**
+ * Function: TCPListenSocket_set_tls
+ * Use TLS on every connection accepted from now on. The handshake is made
+ * by the first read or write, or by <TCPSocket_tls_handshake>.
+ * Parameters:
+ *     self - The server socket (must not be NULL)
+ *     ctx - A server context, or NULL to accept plain connections
+ */
+void TCPListenSocket_set_tls(TCPListenSocket *self, TCPTlsContext *ctx);
+
+/**
+ * Function: TCPListenSocket_is_tls
+ * Check if the connections accepted by the socket use TLS
+ * Parameters:
+ *     self - The server socket (must not be NULL)
+ */
+lbool TCPListenSocket_is_tls(TCPListenSocket *self);
+
+/**
+ * Function: TCPSocket_start_tls
+ * Start the client side of TLS on a connected socket, resuming the last
+ * session received from the same server if there is one. The other
+ * functions keep working as before, encrypting and decrypting the data.
+ * A TLS socket must not be read and written by two threads at the same
+ * time.
+ * Parameters:
+ *     self - The socket (must not be NULL), without received data
+ *         waiting in the buffered reader
+ *     ctx - A client context (must not be NULL)
+ *     serverName - The name sent to the server (SNI) and checked in its
+ *         certificate. If NULL the remote address is used as the key of
+ *         the sessions and the name is not checked.
+ * Returns:
+ *     1 if the handshake is complete, TCPSOCKET_WOULD_BLOCK if a
+ *     non-blocking socket must continue it with <TCPSocket_tls_handshake>
+ *     (or with the next read or write), -1 in case of errors
+ */
+int TCPSocket_start_tls(TCPSocket *self, TCPTlsContext *ctx, const char *serverName, lerror **error);
+
+/**
+ * Function: TCPSocket_tls_handshake
+ * Continue the TLS handshake of the socket
+ * Parameters:
+ *     self - A TLS socket (must not be NULL)
+ * Returns:
+ *     1 if the handshake is complete, TCPSOCKET_WOULD_BLOCK if a
+ *     non-blocking socket is not ready, -1 in case of errors
+ */
+int TCPSocket_tls_handshake(TCPSocket *self, lerror **error);
+
+/**
+ * Function: TCPSocket_is_tls
+ * Check if the socket uses TLS
+ * Parameters:
+ *     self - The socket (must not be NULL)
+ */
+lbool TCPSocket_is_tls(TCPSocket *self);
+
+/**
+ * Function: TCPSocket_tls_session_reused
+ * Check if the handshake resumed a previous session
+ * Parameters:
+ *     self - The socket (must not be NULL)
+ */
+lbool TCPSocket_tls_session_reused(TCPSocket *self);
+
+/**
+ * Function: TCPSocket_tls_uses_ktls
+ * Check if the kernel encrypts the data sent by the socket
+ * Parameters:
+ *     self - The socket (must not be NULL)
+ */
+lbool TCPSocket_tls_uses_ktls(TCPSocket *self);
+
+/**
+ * Function: TCPSocket_tls_wants_write
+ * Check which event a non-blocking TLS socket needs after an operation
+ * returned <TCPSOCKET_WOULD_BLOCK>. TLS can need to send data while
+ * receiving (a handshake or a key update) and to receive while sending.
+ * Parameters:
+ *     self - The socket (must not be NULL)
+ * Returns:
+ *     LTRUE if the socket must be watched for writing, LFALSE if it must
+ *     be watched for reading or if it doesn't use TLS
+ */
+lbool TCPSocket_tls_wants_write(TCPSocket *self);
+
 /**
  * Function: TCPSocket_destroy
  * Closes this socket and deallocates the associated resources
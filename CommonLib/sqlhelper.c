@@ -32,58 +32,236 @@ Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
 #include "sqlhelper.h"
 #include "lstring.h"
 #include "lmemory.h"
+#include "slist.h"
+#include "lvector.h"
+#include "db_utils.h"
+#include "db_interface_pq.h"
 #include <stdlib.h>
+#include <string.h>
+
+/* Default limits of the host parameters in a single statement */
+#define SQLITE_MAX_PARAMETERS 999
+#define POSTGRESQL_MAX_PARAMETERS 65535
+
+struct SqlHelper_prepared {
+    int rows;
+    DbPrepared *prepared;
+};
 
 struct SqlHelper {
-    lstring* query;
+    lstring* nomeTabella;
     lstring* buffer;
     int quantiCampi;
+
+    slist *campi;
+    SqlHelper_conflict conflict;
+    lstring *conflictKeys;
+
+    DbConnection *preparedConnection;
+    lvector *preparedCache;
 };
 
+static void SqlHelper_clear_prepared( SqlHelper *self ) {
+    struct SqlHelper_prepared *entry;
+    int i;
+
+    for ( i=0; i<lvector_len( self->preparedCache ); i++ ) {
+        entry = (struct SqlHelper_prepared *)lvector_at( self->preparedCache, i );
+        DbPrepared_destroy( entry->prepared );
+        lfree( entry );
+    }
+
+    lvector_resize( self->preparedCache, 0 );
+    self->preparedConnection = NULL;
+}
+
 SqlHelper *SqlHelper_init( const char *nomeTabella ) {
 	SqlHelper *self = (SqlHelper *)lmalloc( sizeof(SqlHelper) );
 
-    self->query = lstring_new_from_cstr( "INSERT INTO " );
-    self->query = lstring_append_cstr_f( self->query, nomeTabella );
-    self->query = lstring_append_cstr_f( self->query, " (" );
-
+    self->nomeTabella = lstring_new_from_cstr( nomeTabella );
     self->quantiCampi = 0;
 
     self->buffer = lstring_new();
+    self->campi = slist_new( 0 );
+    self->conflict = SQLHELPER_CONFLICT_NONE;
+    self->conflictKeys = lstring_new();
+
+    self->preparedConnection = NULL;
+    self->preparedCache = lvector_new( 0 );
 
     return self;
 }
 
 void SqlHelper_aggiungi_campo( SqlHelper *self, const char *nomeCampo ) {
-    if ( !lstring_ends_with_cstr( self->query, "," ) && !lstring_ends_with_cstr( self->query, "(" ) ) {
-        self->query = lstring_append_cstr_f( self->query, "," );
-    }
-    self->query = lstring_append_cstr_f( self->query, nomeCampo );
+    l_assert( self!=NULL );
+    l_assert( nomeCampo!=NULL );
+
+    slist_resize( self->campi, self->quantiCampi + 1 );
+    slist_set( self->campi, self->quantiCampi, nomeCampo );
 
     self->quantiCampi = self->quantiCampi + 1;
+    SqlHelper_clear_prepared( self );
+}
+
+void SqlHelper_set_conflict( SqlHelper *self, SqlHelper_conflict conflict, const char *conflictKeys ) {
+    l_assert( self!=NULL );
+    l_assert( conflict!=SQLHELPER_CONFLICT_UPDATE || conflictKeys!=NULL );
+
+    self->conflict = conflict;
+    self->conflictKeys = lstring_from_cstr_f( self->conflictKeys, conflictKeys );
+    SqlHelper_clear_prepared( self );
 }
 
 const char *SqlHelper_to_insert( SqlHelper *self ) {
-    int i;
+    return SqlHelper_to_insert_rows( self, 1 );
+}
 
-    self->buffer = lstring_from_cstr_f( self->buffer, self->query );
-    self->buffer = lstring_append_cstr_f( self->buffer, ") VALUES (" );
+static lbool SqlHelper_is_conflict_key( SqlHelper *self, const char *campo ) {
+    const char *key = self->conflictKeys;
+    int len = strlen( campo );
+
+    while ( *key ) {
+        while ( *key==' ' || *key==',' ) key++;
+        if ( 0==l_strnicmp( key, campo, len ) && 
+             (key[len]=='\0' || key[len]==',' || key[len]==' ') ) {
+            return LTRUE;
+        }
+        while ( *key && *key!=',' ) key++;
+    }
+
+    return LFALSE;
+}
+
+const char *SqlHelper_to_insert_rows( SqlHelper *self, int rows ) {
+    int i, j;
+    lbool first;
+
+    l_assert( self!=NULL );
+    l_assert( rows>0 );
+    l_assert( self->quantiCampi>0 );
+
+    lstring_reset( self->buffer );
+    self->buffer = lstring_reserve_f( self->buffer, 
+        64 + lstring_len(self->nomeTabella) + self->quantiCampi*(20 + 2*rows) + 4*rows );
+
+    if ( self->conflict==SQLHELPER_CONFLICT_REPLACE ) {
+        self->buffer = lstring_append_cstr_f( self->buffer, "INSERT OR REPLACE INTO " );
+    } else {
+        self->buffer = lstring_append_cstr_f( self->buffer, "INSERT INTO " );
+    }
+    self->buffer = lstring_append_lstring_f( self->buffer, self->nomeTabella );
+    self->buffer = lstring_append_cstr_f( self->buffer, " (" );
 
     for ( i=0; i<self->quantiCampi; i++ ) {
         if ( i!=0 ) {
-            self->buffer = lstring_append_cstr_f( self->buffer, "," );
+            self->buffer = lstring_append_char_f( self->buffer, ',' );
+        }
+        self->buffer = lstring_append_cstr_f( self->buffer, slist_at( self->campi, i ) );
+    }
+
+    self->buffer = lstring_append_cstr_f( self->buffer, ") VALUES " );
+
+    for ( j=0; j<rows; j++ ) {
+        self->buffer = lstring_append_cstr_f( self->buffer, j==0 ? "(" : ",(" );
+        for ( i=0; i<self->quantiCampi; i++ ) {
+            if ( i!=0 ) {
+                self->buffer = lstring_append_char_f( self->buffer, ',' );
+            }
+            self->buffer = lstring_append_char_f( self->buffer, '?' );
+        }
+        self->buffer = lstring_append_char_f( self->buffer, ')' );
+    }
+
+    if ( self->conflict==SQLHELPER_CONFLICT_IGNORE ) {
+        self->buffer = lstring_append_cstr_f( self->buffer, " ON CONFLICT DO NOTHING" );
+    } else if ( self->conflict==SQLHELPER_CONFLICT_UPDATE ) {
+        self->buffer = lstring_append_cstr_f( self->buffer, " ON CONFLICT (" );
+        self->buffer = lstring_append_lstring_f( self->buffer, self->conflictKeys );
+        self->buffer = lstring_append_cstr_f( self->buffer, ") DO " );
+
+        first = LTRUE;
+        for ( i=0; i<self->quantiCampi; i++ ) {
+            if ( SqlHelper_is_conflict_key( self, slist_at( self->campi, i ) ) ) {
+                continue;
+            }
+            self->buffer = lstring_append_cstr_f( self->buffer, first ? "UPDATE SET " : "," );
+            self->buffer = db_append_sql_format_f( self->buffer, "%k=excluded.%k", 
+                slist_at( self->campi, i ), slist_at( self->campi, i ) );
+            first = LFALSE;
+        }
+
+        if ( first ) {
+            /* Every field is part of the key: nothing to update */
+            self->buffer = lstring_append_cstr_f( self->buffer, "NOTHING" );
         }
-        self->buffer = lstring_append_cstr_f( self->buffer, "?" );
     }
 
-    self->buffer = lstring_append_cstr_f( self->buffer, ")" );
     return self->buffer;
 }
 
+int SqlHelper_max_rows( SqlHelper *self, DbConnection *conn ) {
+    int maxParameters = SQLITE_MAX_PARAMETERS;
+    int result;
+
+    l_assert( self!=NULL );
+    l_assert( conn!=NULL );
+    l_assert( self->quantiCampi>0 );
+
+#ifdef POSTGRESQL_CONNECTION_TYPE
+    if ( 0==strcmp( DbConnection_get_type(conn), POSTGRESQL_CONNECTION_TYPE ) ) {
+        maxParameters = POSTGRESQL_MAX_PARAMETERS;
+    }
+#endif
+
+    result = maxParameters / self->quantiCampi;
+    return result>0 ? result : 1;
+}
+
+DbPrepared *SqlHelper_prepare_rows( SqlHelper *self, DbConnection *conn, int rows, lerror **error ) {
+    struct SqlHelper_prepared *entry;
+    DbPrepared *prepared;
+    int i;
+
+    l_assert( self!=NULL );
+    l_assert( conn!=NULL );
+    l_assert( rows>0 );
+    l_assert( error==NULL || *error==NULL );
+
+    if ( self->preparedConnection!=conn ) {
+        SqlHelper_clear_prepared( self );
+        self->preparedConnection = conn;
+    }
+
+    for ( i=0; i<lvector_len( self->preparedCache ); i++ ) {
+        entry = (struct SqlHelper_prepared *)lvector_at( self->preparedCache, i );
+        if ( entry->rows==rows ) {
+            return entry->prepared;
+        }
+    }
+
+    prepared = DbConnection_sql_prepare( conn, SqlHelper_to_insert_rows( self, rows ), error );
+    if ( prepared==NULL ) {
+        return NULL;
+    }
+
+    entry = (struct SqlHelper_prepared *)lmalloc( sizeof(struct SqlHelper_prepared) );
+    entry->rows = rows;
+    entry->prepared = prepared;
+
+    i = lvector_len( self->preparedCache );
+    lvector_resize( self->preparedCache, i+1 );
+    lvector_set( self->preparedCache, i, entry );
+
+    return prepared;
+}
+
 void SqlHelper_destroy( SqlHelper *self ) {
     if ( !self ) return;
-    lstring_delete( self->query );
+    SqlHelper_clear_prepared( self );
+    lvector_delete( self->preparedCache );
+    slist_destroy( self->campi );
+    lstring_delete( self->conflictKeys );
+    lstring_delete( self->nomeTabella );
     lstring_delete( self->buffer );
     lfree( self );
 }
-
@@ -32,14 +32,36 @@ Author: Leonardo Cecchi <mailto:leonardoce@interfree.it>
 #ifndef __SQLHELPER_H
 #define __SQLHELPER_H
 
+#include "db_interface.h"
+
 /**
  * Class: SqlHelper
  *
  * Objects of this class will help you to generate an INSERT statement
- * with a variable number of fields (and values with parameters)
+ * with a variable number of fields (and values with parameters).
+ * The statement can insert more than one row at a time and can be
+ * turned in an UPSERT.
  */
 typedef struct SqlHelper SqlHelper;
 
+/**
+ * Enum: SqlHelper_conflict
+ * How the generated INSERT statement handles rows that already exist
+ *
+ * SQLHELPER_CONFLICT_NONE - A plain INSERT statement
+ * SQLHELPER_CONFLICT_REPLACE - INSERT OR REPLACE (SQLite only)
+ * SQLHELPER_CONFLICT_IGNORE - INSERT ... ON CONFLICT DO NOTHING
+ * SQLHELPER_CONFLICT_UPDATE - INSERT ... ON CONFLICT (keys) DO UPDATE SET
+ *     of every field which is not a conflict key (PostgreSQL and
+ *     SQLite 3.24 or newer)
+ */
+typedef enum SqlHelper_conflict {
+    SQLHELPER_CONFLICT_NONE,
+    SQLHELPER_CONFLICT_REPLACE,
+    SQLHELPER_CONFLICT_IGNORE,
+    SQLHELPER_CONFLICT_UPDATE
+} SqlHelper_conflict;
+
 /**
  * Function: SqlHelper_init
  *
@@ -74,6 +96,63 @@ void SqlHelper_aggiungi_campo( SqlHelper *self, const char *nomeCampo );
  */
 const char *SqlHelper_to_insert( SqlHelper *self );
 
+/**
+ * Function: SqlHelper_set_conflict
+ *
+ * Choose how the INSERT statement will handle existing rows
+ *
+ * Parameters:
+ *   self - The object (must be not NULL)
+ *   conflict - The conflict handling mode
+ *   conflictKeys - The comma separated list of the fields of the
+ *       unique key. Must not be NULL with SQLHELPER_CONFLICT_UPDATE
+ */
+void SqlHelper_set_conflict( SqlHelper *self, SqlHelper_conflict conflict, const char *conflictKeys );
+
+/**
+ * Function: SqlHelper_to_insert_rows
+ *
+ * Create a new INSERT statement with a VALUES list of `rows` rows.
+ * The parameters are ordered row by row.
+ *
+ * Parameters:
+ *   self - The object (must be not NULL)
+ *   rows - The number of rows (greater than zero)
+ */
+const char *SqlHelper_to_insert_rows( SqlHelper *self, int rows );
+
+/**
+ * Function: SqlHelper_max_rows
+ *
+ * Compute the maximum number of rows that a statement can insert
+ * without exceeding the number of parameters that the backend of the
+ * connection can handle
+ *
+ * Parameters:
+ *   self - The object (must be not NULL)
+ *   conn - The connection where the statement will be executed
+ */
+int SqlHelper_max_rows( SqlHelper *self, DbConnection *conn );
+
+/**
+ * Function: SqlHelper_prepare_rows
+ *
+ * Get a prepared query for the INSERT statement of `rows` rows. The
+ * prepared queries are cached by the number of rows and are owned by
+ * this object: don't destroy them. The cache is cleared when the
+ * fields or the connection change.
+ *
+ * Parameters:
+ *   self - The object (must be not NULL)
+ *   conn - The connection (must be not NULL)
+ *   rows - The number of rows (greater than zero)
+ *   error - The error object
+ *
+ * Returns:
+ *   The prepared query or NULL in error conditions
+ */
+DbPrepared *SqlHelper_prepare_rows( SqlHelper *self, DbConnection *conn, int rows, lerror **error );
+
 /**
  * Function: SqlHelper_destroy
  *
@@ -0,0 +1,231 @@
+#include "net_rpc.h"
+#include "threading.h"
+#include "minunit.h"
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_PORT "19190"
+#define TEST_THREADS 4
+#define TEST_CALLS 200
+
+int tests_run;
+
+static RpcClient *client;
+static int failedCalls;
+static lcom_mutex_t *failedMutex;
+static int executedCalls;
+
+static char *test_frame_encoding() {
+	int fds[2];
+	TCPSocket *sender;
+	TCPSocket *receiver;
+	RpcFrameHeader header;
+	RpcFrameHeader received;
+	MemBuffer *payload = MemBuffer_new(16);
+	unsigned char raw[RPC_FRAME_HEADER_SIZE+5];
+	static const unsigned char expected[RPC_FRAME_HEADER_SIZE] = {
+		0, 0, 0, 5, 0xde, 0xad, 0xbe, 0xef, RPC_FRAME_ERROR, 0, 0xff, 0xfe };
+	lerror *error = NULL;
+
+	mu_assert("socket pair", socketpair(AF_UNIX, SOCK_STREAM, 0, fds)==0);
+	sender = TCPSocket_new_from_fd(fds[0], "local", "remote");
+	receiver = TCPSocket_new_from_fd(fds[1], "local", "remote");
+
+	memset(&header, 0, sizeof(header));
+	header.id = 0xdeadbeef;
+	header.type = RPC_FRAME_ERROR;
+	header.method = 65534;
+
+	/* The header is big endian */
+	RpcFrame_send(sender, &header, "hello", 5, &error);
+	mu_assert("frame sent", error==NULL);
+	mu_assert("raw frame", TCPSocket_read_exact(receiver, raw, sizeof(raw), &error)==sizeof(raw));
+	mu_assert("header layout", memcmp(raw, expected, RPC_FRAME_HEADER_SIZE)==0);
+	mu_assert("payload after the header", memcmp(raw+RPC_FRAME_HEADER_SIZE, "hello", 5)==0);
+
+	RpcFrame_send(sender, &header, "hello", 5, &error);
+	mu_assert("frame received", RpcFrame_recv(receiver, &received, payload, 100, &error)==1);
+	mu_assert("length decoded", received.length==5);
+	mu_assert("id decoded", received.id==0xdeadbeef);
+	mu_assert("type decoded", received.type==RPC_FRAME_ERROR);
+	mu_assert("method decoded", received.method==65534);
+	mu_assert("payload received", MemBuffer_len(payload)==5 && memcmp(MemBuffer_address(payload), "hello", 5)==0);
+
+	/* A frame without payload */
+	header.type = RPC_FRAME_RESPONSE;
+	RpcFrame_send(sender, &header, NULL, 0, &error);
+	mu_assert("empty frame received", RpcFrame_recv(receiver, &received, payload, 100, &error)==1);
+	mu_assert("empty payload", received.length==0 && MemBuffer_len(payload)==0);
+
+	/* The frames bigger than the limit are refused */
+	RpcFrame_send(sender, &header, "hello", 5, &error);
+	mu_assert("frame too big", RpcFrame_recv(receiver, &received, payload, 4, &error)==-1);
+	mu_assert("error set", error!=NULL);
+	lerror_delete(&error);
+
+	/* The connection closed between the frames or inside one */
+	TCPSocket_destroy(sender);
+	mu_assert("rest of the refused frame", TCPSocket_read_exact(receiver, raw, 5, &error)==5);
+	mu_assert("closed between the frames", RpcFrame_recv(receiver, &received, payload, 100, &error)==0);
+	mu_assert("no errors", error==NULL);
+
+	TCPSocket_destroy(receiver);
+	mu_assert("socket pair", socketpair(AF_UNIX, SOCK_STREAM, 0, fds)==0);
+	receiver = TCPSocket_new_from_fd(fds[1], "local", "remote");
+	mu_assert("partial frame", write(fds[0], expected, 8)==8);
+	close(fds[0]);
+	mu_assert("closed inside a frame", RpcFrame_recv(receiver, &received, payload, 100, &error)==-1);
+	lerror_delete(&error);
+
+	TCPSocket_destroy(receiver);
+	MemBuffer_destroy(payload);
+	return 0;
+}
+
+/* Answers with the request after a delay depending on it, so the
+ * responses of a connection arrive out of order */
+static void delayed_echo(void *ctx, const char *request, int len, MemBuffer *response, lerror **error) {
+	usleep((request[len-1]%4)*1000);
+	MemBuffer_write(response, (void *)request, len);
+}
+
+static void failing(void *ctx, const char *request, int len, MemBuffer *response, lerror **error) {
+	lerror_set(error, "failed");
+}
+
+static void big_response(void *ctx, const char *request, int len, MemBuffer *response, lerror **error) {
+	char chunk[1000];
+	int i;
+
+	memset(chunk, 'x', sizeof(chunk));
+	for (i=0; i<1000; i++) {
+		MemBuffer_write(response, chunk, sizeof(chunk));
+	}
+	__sync_fetch_and_add(&executedCalls, 1);
+}
+
+static void caller(void *arg) {
+	MemBuffer *response = MemBuffer_new(64);
+	char request[64];
+	lerror *error = NULL;
+	int len;
+	int i;
+
+	for (i=0; i<TEST_CALLS; i++) {
+		len = sprintf(request, "%ld-%i", (long)arg, i);
+		if (!RpcClient_call(client, 1, request, len, response, 5000, &error) ||
+			MemBuffer_len(response)!=len || memcmp(MemBuffer_address(response), request, len)!=0) {
+			lerror_delete(&error);
+			lcom_mutex_lock(failedMutex);
+			failedCalls++;
+			lcom_mutex_unlock(failedMutex);
+		}
+	}
+
+	MemBuffer_destroy(response);
+}
+
+static char *test_response_matching() {
+	RpcServer *server;
+	MemBuffer *response = MemBuffer_new(64);
+	lcom_thread_t *threads[TEST_THREADS];
+	lerror *error = NULL;
+	long i;
+
+	server = RpcServer_new("127.0.0.1", TEST_PORT, 4);
+	RpcServer_add_handler(server, 1, delayed_echo, NULL);
+	RpcServer_add_handler(server, 2, failing, NULL);
+	mu_assert("server started", RpcServer_start(server, &error));
+
+	/* Every response reaches the call with the same id */
+	client = RpcClient_new("127.0.0.1", TEST_PORT, 1);
+	failedMutex = lcom_mutex_new();
+	for (i=0; i<TEST_THREADS; i++) {
+		threads[i] = lcom_thread_start(caller, (void *)i);
+	}
+	for (i=0; i<TEST_THREADS; i++) {
+		lcom_thread_join(threads[i]);
+	}
+	mu_assert("responses matched", failedCalls==0);
+
+	mu_assert("error response", !RpcClient_call(client, 2, "x", 1, response, 5000, &error));
+	mu_assert("remote error message", error!=NULL && strstr(error->message, "failed")!=NULL);
+	lerror_delete(&error);
+
+	mu_assert("unknown method", !RpcClient_call(client, 3, "x", 1, response, 5000, &error));
+	lerror_delete(&error);
+	RpcClient_destroy(client);
+
+	/* The responses bigger than the client limit fail the call */
+	client = RpcClient_new("127.0.0.1", TEST_PORT, 1);
+	RpcClient_set_max_frame_size(client, 4);
+	mu_assert("response too big", !RpcClient_call(client, 1, "hello", 5, response, 5000, &error));
+	lerror_delete(&error);
+	mu_assert("response within the limit", RpcClient_call(client, 1, "hell", 4, response, 5000, &error));
+
+	RpcClient_destroy(client);
+	RpcServer_destroy(server);
+	lcom_mutex_destroy(failedMutex);
+	MemBuffer_destroy(response);
+	return 0;
+}
+
+static char *test_pending_output() {
+	RpcServer *server;
+	TCPSocket *socket;
+	RpcFrameHeader header;
+	MemBuffer *payload = MemBuffer_new(64);
+	lerror *error = NULL;
+	int i;
+
+	server = RpcServer_new("127.0.0.1", TEST_PORT, 2);
+	RpcServer_add_handler(server, 1, big_response, NULL);
+	RpcServer_set_max_pending_output(server, 3000000);
+	mu_assert("server started", RpcServer_start(server, &error));
+	socket = TCPSocket_connect("127.0.0.1", TEST_PORT, &error);
+	mu_assert("connected", socket!=NULL);
+
+	/* A client sending requests without reading the responses */
+	memset(&header, 0, sizeof(header));
+	header.type = RPC_FRAME_REQUEST;
+	header.method = 1;
+	for (i=0; i<50; i++) {
+		header.id = i;
+		RpcFrame_send(socket, &header, "x", 1, &error);
+		mu_assert("request sent", error==NULL);
+		usleep(20000);
+	}
+	mu_assert("requests not read", executedCalls<50);
+
+	/* The reading resumes with the responses */
+	for (i=0; i<50; i++) {
+		mu_assert("response received", RpcFrame_recv(socket, &header, payload, 2000000, &error)==1);
+	}
+	mu_assert("every request executed", executedCalls==50);
+
+	TCPSocket_destroy(socket);
+	RpcServer_destroy(server);
+	MemBuffer_destroy(payload);
+	return 0;
+}
+
+static char *all_tests() {
+	mu_run_test(test_frame_encoding);
+	mu_run_test(test_response_matching);
+	mu_run_test(test_pending_output);
+	return 0;
+}
+
+int main() {
+	char *result = all_tests();
+	if (result) {
+		printf("Test errato: %s\n", result);
+	} else {
+		printf("OK. Ho eseguito %i tests\n", tests_run);
+	}
+
+	return result!=0;
+}
@@ -0,0 +1,193 @@
+#include "net_socket.h"
+#include "minunit.h"
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int tests_run;
+
+/* A connected pair: the socket under test and the descriptor writing
+ * the data it receives */
+static TCPSocket *socket_pair(int *peer, lbool nonBlocking) {
+	int fds[2];
+	TCPSocket *result;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)<0) {
+		return NULL;
+	}
+	result = TCPSocket_new_from_fd(fds[0], "local", "remote");
+	if (nonBlocking) {
+		TCPSocket_set_nonblocking(result, LTRUE, NULL);
+	}
+	*peer = fds[1];
+	return result;
+}
+
+static lbool peer_write(int peer, const char *data, int len) {
+	return write(peer, data, len)==len;
+}
+
+static char *test_read_exact_would_block() {
+	TCPSocket *socket;
+	int peer;
+	char buf[6];
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LTRUE);
+	mu_assert("socket created", socket!=NULL);
+
+	mu_assert("nothing received", TCPSocket_read_exact(socket, buf, 6, &error)==TCPSOCKET_WOULD_BLOCK);
+	mu_assert("first part sent", peer_write(peer, "abc", 3));
+	mu_assert("incomplete data", TCPSocket_read_exact(socket, buf, 6, &error)==TCPSOCKET_WOULD_BLOCK);
+	mu_assert("second part sent", peer_write(peer, "defgh", 5));
+	mu_assert("data complete", TCPSocket_read_exact(socket, buf, 6, &error)==6);
+	mu_assert("data kept between the calls", memcmp(buf, "abcdef", 6)==0);
+	mu_assert("exceeding data buffered", TCPSocket_pending(socket)==2);
+	mu_assert("buffered data returned by recv", TCPSocket_recv(socket, buf, sizeof(buf), &error)==2 && memcmp(buf, "gh", 2)==0);
+	mu_assert("no errors", error==NULL);
+
+	TCPSocket_destroy(socket);
+	close(peer);
+	return 0;
+}
+
+static char *test_read_exact_closed() {
+	TCPSocket *socket;
+	int peer;
+	char buf[6];
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LFALSE);
+	mu_assert("socket created", socket!=NULL);
+
+	mu_assert("data sent", peer_write(peer, "abc", 3));
+	close(peer);
+	mu_assert("closed inside the data", TCPSocket_read_exact(socket, buf, 6, &error)==-1);
+	mu_assert("error set", error!=NULL);
+	lerror_delete(&error);
+
+	TCPSocket_destroy(socket);
+	return 0;
+}
+
+static char *test_read_until_split_delimiter() {
+	TCPSocket *socket;
+	int peer;
+	MemBuffer *dest = MemBuffer_new(64);
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LTRUE);
+	mu_assert("socket created", socket!=NULL);
+
+	/* The delimiter arrives in two reads */
+	mu_assert("first part sent", peer_write(peer, "abc\r", 4));
+	mu_assert("delimiter incomplete", TCPSocket_read_until(socket, "\r\n", dest, 100, &error)==TCPSOCKET_WOULD_BLOCK);
+	mu_assert("nothing appended", MemBuffer_len(dest)==0);
+	mu_assert("second part sent", peer_write(peer, "\nxyz\r\n", 6));
+	mu_assert("first line", TCPSocket_read_until(socket, "\r\n", dest, 100, &error)==5);
+	mu_assert("first line content", memcmp(MemBuffer_address(dest), "abc\r\n", 5)==0);
+
+	MemBuffer_setlen(dest, 0);
+	mu_assert("second line from the buffer", TCPSocket_read_until(socket, "\r\n", dest, 100, &error)==5);
+	mu_assert("second line content", memcmp(MemBuffer_address(dest), "xyz\r\n", 5)==0);
+	mu_assert("no errors", error==NULL);
+
+	TCPSocket_destroy(socket);
+	close(peer);
+	MemBuffer_destroy(dest);
+	return 0;
+}
+
+static char *test_read_until_many_fills() {
+	TCPSocket *socket;
+	int peer;
+	int i;
+	char chunk[1000];
+	MemBuffer *dest = MemBuffer_new(64);
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LTRUE);
+	mu_assert("socket created", socket!=NULL);
+
+	/* 40000 bytes without the delimiter need more than a fill */
+	memset(chunk, 'a', sizeof(chunk));
+	for (i=0; i<40; i++) {
+		mu_assert("data sent", peer_write(peer, chunk, sizeof(chunk)));
+		mu_assert("delimiter not found yet", TCPSocket_read_until(socket, "--", dest, 50000, &error)==TCPSOCKET_WOULD_BLOCK);
+	}
+	mu_assert("delimiter sent", peer_write(peer, "-", 1) && peer_write(peer, "-!", 2));
+	mu_assert("data complete", TCPSocket_read_until(socket, "--", dest, 50000, &error)==40002);
+	mu_assert("data content", MemBuffer_address(dest)[0]=='a' && memcmp(MemBuffer_address(dest)+40000, "--", 2)==0);
+	mu_assert("following data kept", TCPSocket_pending(socket)==1);
+	mu_assert("no errors", error==NULL);
+
+	TCPSocket_destroy(socket);
+	close(peer);
+	MemBuffer_destroy(dest);
+	return 0;
+}
+
+static char *test_read_until_max_len() {
+	TCPSocket *socket;
+	int peer;
+	MemBuffer *dest = MemBuffer_new(64);
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LFALSE);
+	mu_assert("socket created", socket!=NULL);
+
+	mu_assert("data sent", peer_write(peer, "abcd\nabcdefgh\n", 14));
+	mu_assert("delimiter at the limit", TCPSocket_read_until(socket, "\n", dest, 5, &error)==5);
+	MemBuffer_setlen(dest, 0);
+	mu_assert("delimiter beyond the limit", TCPSocket_read_until(socket, "\n", dest, 5, &error)==-1);
+	mu_assert("error set", error!=NULL);
+	lerror_delete(&error);
+
+	TCPSocket_destroy(socket);
+	close(peer);
+	MemBuffer_destroy(dest);
+	return 0;
+}
+
+static char *test_read_line() {
+	TCPSocket *socket;
+	int peer;
+	lstring *line = lstring_new();
+	lerror *error = NULL;
+
+	socket = socket_pair(&peer, LFALSE);
+	mu_assert("socket created", socket!=NULL);
+
+	mu_assert("data sent", peer_write(peer, "first\r\nsecond\n", 14));
+	close(peer);
+	mu_assert("line with CRLF", TCPSocket_read_line(socket, &line, 100, &error)==7 && strcmp(line, "first")==0);
+	mu_assert("line with LF", TCPSocket_read_line(socket, &line, 100, &error)==7 && strcmp(line, "second")==0);
+	mu_assert("connection closed", TCPSocket_read_line(socket, &line, 100, &error)==0);
+	mu_assert("no errors", error==NULL);
+
+	TCPSocket_destroy(socket);
+	lstring_delete(line);
+	return 0;
+}
+
+static char *all_tests() {
+	mu_run_test(test_read_exact_would_block);
+	mu_run_test(test_read_exact_closed);
+	mu_run_test(test_read_until_split_delimiter);
+	mu_run_test(test_read_until_many_fills);
+	mu_run_test(test_read_until_max_len);
+	mu_run_test(test_read_line);
+	return 0;
+}
+
+int main() {
+	char *result = all_tests();
+	if (result) {
+		printf("Test errato: %s\n", result);
+	} else {
+		printf("OK. Ho eseguito %i tests\n", tests_run);
+	}
+
+	return result!=0;
+}
@@ -433,6 +433,7 @@ enum {
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+  LISTEN_BACKLOG,
   NUM_OPTIONS
 };
 
@@ -461,6 +462,7 @@ static const char *config_options[] = {
   "w", "url_rewrite_patterns", NULL,
   "x", "hide_files_patterns", NULL,
   "z", "request_timeout_ms", "30000",
+  "b", "listen_backlog", NULL,
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
@@ -898,6 +900,14 @@ static int should_keep_alive(const struct mg_connection *conn) {
   return 1;
 }
 
+int mg_should_keep_alive(const struct mg_connection *conn) {
+  return should_keep_alive(conn);
+}
+
+void mg_set_must_close(struct mg_connection *conn) {
+  conn->must_close = 1;
+}
+
 static const char *suggest_connection_header(const struct mg_connection *conn) {
   return should_keep_alive(conn) ? "keep-alive" : "close";
 }
@@ -1572,6 +1582,13 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   return (int) total;
 }
 
+int mg_get_socket(struct mg_connection *conn) {
+  if (conn->ssl != NULL || conn->throttle > 0) {
+    return -1;
+  }
+  return (int) conn->client.sock;
+}
+
 // Print message to buffer. If buffer is large enough to hold the message,
 // return buffer. If buffer is to small, allocate large enough buffer on heap,
 // and return allocated buffer.
@@ -4337,7 +4354,8 @@ static int set_ports_option(struct mg_context *ctx) {
                setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
                           (void *) &on, sizeof(on)) != 0 ||
                bind(so.sock, &so.lsa.sa, sizeof(so.lsa)) != 0 ||
-               listen(so.sock, SOMAXCONN) != 0) {
+               listen(so.sock, ctx->config[LISTEN_BACKLOG] == NULL ?
+                      SOMAXCONN : atoi(ctx->config[LISTEN_BACKLOG])) != 0) {
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
           (int) vec.len, vec.ptr, strerror(ERRNO));
       closesocket(so.sock);
@@ -4741,7 +4759,7 @@ static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len) {
 
   if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
     snprintf(ebuf, ebuf_len, "%s", "Request Too Large");
-  } if (conn->request_len <= 0) {
+  } else if (conn->request_len <= 0) {
     snprintf(ebuf, ebuf_len, "%s", "Client closed connection");
   } else if (parse_http_message(conn->buf, conn->buf_size,
                                 &conn->request_info) <= 0) {
@@ -4797,6 +4815,8 @@ static void process_new_connection(struct mg_connection *conn) {
   do {
     if (!getreq(conn, ebuf, sizeof(ebuf))) {
       send_http_error(conn, 500, "Server Error", "%s", ebuf);
+      // The request info is stale, don't wait for another request
+      conn->must_close = 1;
     } else if (!is_valid_uri(conn->request_info.uri)) {
       snprintf(ebuf, sizeof(ebuf), "Invalid URI: [%s]", ri->uri);
       send_http_error(conn, 400, "Bad Request", "%s", ebuf);
@@ -152,6 +152,21 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Return the socket of the connection, to send data bypassing mg_write()
+// (ex. with sendfile()). Return -1 if the data must go through mg_write(),
+// because the connection is SSL-ed or throttled.
+int mg_get_socket(struct mg_connection *);
+
+
+// Return 1 if the connection will be kept alive after the current request,
+// according to the configuration and to the request headers.
+int mg_should_keep_alive(const struct mg_connection *);
+
+
+// Close the connection after the current request.
+void mg_set_must_close(struct mg_connection *);
+
+
 #undef PRINTF_FORMAT_STRING
 #if _MSC_VER >= 1400
 #include <sal.h>
@@ -5,8 +5,11 @@
 
 #ifndef _WIN32
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
 #else
 #include <windows.h>
+#include <process.h>
 #endif
 
 #ifdef _WIN32
@@ -23,6 +26,7 @@ lcom_mutex_t *lcom_mutex_new(void) {
 void lcom_mutex_destroy(lcom_mutex_t *mutex) {
 	l_assert(mutex!=NULL);
 	DeleteCriticalSection(&mutex->critical);
+	lfree(mutex);
 }
 
 void lcom_mutex_lock(lcom_mutex_t *mutex) {
@@ -34,6 +38,317 @@ void lcom_mutex_unlock(lcom_mutex_t *mutex) {
 	l_assert(mutex!=NULL);
 	LeaveCriticalSection(&mutex->critical);
 }
+
+struct lcom_cond {
+	CONDITION_VARIABLE cond;
+};
+
+lcom_cond_t *lcom_cond_new(void) {
+	lcom_cond_t *result = (lcom_cond_t *)lmalloc(sizeof(struct lcom_cond));
+	InitializeConditionVariable(&result->cond);
+	return result;
+}
+
+void lcom_cond_destroy(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	lfree(cond);
+}
+
+void lcom_cond_wait(lcom_cond_t *cond, lcom_mutex_t *mutex) {
+	l_assert(cond!=NULL);
+	l_assert(mutex!=NULL);
+	SleepConditionVariableCS(&cond->cond, &mutex->critical, INFINITE);
+}
+
+lbool lcom_cond_timed_wait(lcom_cond_t *cond, lcom_mutex_t *mutex, int millis) {
+	l_assert(cond!=NULL);
+	l_assert(mutex!=NULL);
+	return SleepConditionVariableCS(&cond->cond, &mutex->critical, millis) ? LTRUE : LFALSE;
+}
+
+void lcom_cond_signal(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	WakeConditionVariable(&cond->cond);
+}
+
+void lcom_cond_broadcast(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	WakeAllConditionVariable(&cond->cond);
+}
+
+struct lcom_thread {
+	HANDLE handle;
+	lcom_thread_func_t func;
+	void *arg;
+};
+
+static unsigned __stdcall lcom_thread_main(void *arg) {
+	lcom_thread_t *thread = (lcom_thread_t *)arg;
+	thread->func(thread->arg);
+	return 0;
+}
+
+lcom_thread_t *lcom_thread_start(lcom_thread_func_t func, void *arg) {
+	lcom_thread_t *result = (lcom_thread_t *)lmalloc(sizeof(struct lcom_thread));
+
+	l_assert(func!=NULL);
+
+	result->func = func;
+	result->arg = arg;
+	result->handle = (HANDLE)_beginthreadex(NULL, 0, lcom_thread_main, result, 0, NULL);
+	if (result->handle==0) {
+		lfree(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+void lcom_thread_join(lcom_thread_t *thread) {
+	l_assert(thread!=NULL);
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+	lfree(thread);
+}
 #else
+struct lcom_mutex {
+	pthread_mutex_t mutex;
+};
+
+lcom_mutex_t *lcom_mutex_new(void) {
+	lcom_mutex_t *result = (lcom_mutex_t *)lmalloc(sizeof(struct lcom_mutex));
+	pthread_mutex_init(&result->mutex, NULL);
+	return result;
+}
+
+void lcom_mutex_destroy(lcom_mutex_t *mutex) {
+	l_assert(mutex!=NULL);
+	pthread_mutex_destroy(&mutex->mutex);
+	lfree(mutex);
+}
+
+void lcom_mutex_lock(lcom_mutex_t *mutex) {
+	l_assert(mutex!=NULL);
+	pthread_mutex_lock(&mutex->mutex);
+}
 
+void lcom_mutex_unlock(lcom_mutex_t *mutex) {
+	l_assert(mutex!=NULL);
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+struct lcom_cond {
+	pthread_cond_t cond;
+};
+
+lcom_cond_t *lcom_cond_new(void) {
+	lcom_cond_t *result = (lcom_cond_t *)lmalloc(sizeof(struct lcom_cond));
+	pthread_condattr_t attr;
+
+	/* The timed waits use the monotonic clock, not affected by the
+	 * changes of the system time */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&result->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return result;
+}
+
+void lcom_cond_destroy(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	pthread_cond_destroy(&cond->cond);
+	lfree(cond);
+}
+
+void lcom_cond_wait(lcom_cond_t *cond, lcom_mutex_t *mutex) {
+	l_assert(cond!=NULL);
+	l_assert(mutex!=NULL);
+	pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+lbool lcom_cond_timed_wait(lcom_cond_t *cond, lcom_mutex_t *mutex, int millis) {
+	struct timespec deadline;
+
+	l_assert(cond!=NULL);
+	l_assert(mutex!=NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += millis/1000;
+	deadline.tv_nsec += (long)(millis%1000)*1000000L;
+	if (deadline.tv_nsec>=1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, &deadline)==ETIMEDOUT ? LFALSE : LTRUE;
+}
+
+void lcom_cond_signal(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	pthread_cond_signal(&cond->cond);
+}
+
+void lcom_cond_broadcast(lcom_cond_t *cond) {
+	l_assert(cond!=NULL);
+	pthread_cond_broadcast(&cond->cond);
+}
+
+struct lcom_thread {
+	pthread_t thread;
+	lcom_thread_func_t func;
+	void *arg;
+};
+
+static void *lcom_thread_main(void *arg) {
+	lcom_thread_t *thread = (lcom_thread_t *)arg;
+	thread->func(thread->arg);
+	return NULL;
+}
+
+lcom_thread_t *lcom_thread_start(lcom_thread_func_t func, void *arg) {
+	lcom_thread_t *result = (lcom_thread_t *)lmalloc(sizeof(struct lcom_thread));
+
+	l_assert(func!=NULL);
+
+	result->func = func;
+	result->arg = arg;
+	if (0!=pthread_create(&result->thread, NULL, lcom_thread_main, result)) {
+		lfree(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+void lcom_thread_join(lcom_thread_t *thread) {
+	l_assert(thread!=NULL);
+	pthread_join(thread->thread, NULL);
+	lfree(thread);
+}
 #endif
+
+struct lcom_threadpool_job {
+	lcom_thread_func_t func;
+	void *arg;
+	struct lcom_threadpool_job *next;
+};
+
+struct lcom_threadpool {
+	lcom_mutex_t *mutex;
+	lcom_cond_t *cond;
+	struct lcom_threadpool_job *head;
+	struct lcom_threadpool_job *tail;
+	int pending;
+	lbool stopping;
+	int nThreads;
+	lcom_thread_t **threads;
+};
+
+static void lcom_threadpool_main(void *arg) {
+	lcom_threadpool_t *pool = (lcom_threadpool_t *)arg;
+	struct lcom_threadpool_job *job;
+
+	lcom_mutex_lock(pool->mutex);
+	while (1) {
+		while (pool->head==NULL && !pool->stopping) {
+			lcom_cond_wait(pool->cond, pool->mutex);
+		}
+
+		job = pool->head;
+		if (job==NULL) {
+			/* stopping and the queue is empty */
+			break;
+		}
+
+		pool->head = job->next;
+		if (pool->head==NULL) pool->tail = NULL;
+		pool->pending--;
+		lcom_mutex_unlock(pool->mutex);
+
+		job->func(job->arg);
+		lfree(job);
+
+		lcom_mutex_lock(pool->mutex);
+	}
+	lcom_mutex_unlock(pool->mutex);
+}
+
+lcom_threadpool_t *lcom_threadpool_new(int nThreads) {
+	lcom_threadpool_t *result = (lcom_threadpool_t *)lmalloc(sizeof(struct lcom_threadpool));
+	int i;
+
+	l_assert(nThreads>0);
+
+	result->mutex = lcom_mutex_new();
+	result->cond = lcom_cond_new();
+	result->head = NULL;
+	result->tail = NULL;
+	result->pending = 0;
+	result->stopping = LFALSE;
+	result->nThreads = 0;
+	result->threads = (lcom_thread_t **)lmalloc(sizeof(lcom_thread_t *)*nThreads);
+
+	for (i=0; i<nThreads; i++) {
+		result->threads[result->nThreads] = lcom_thread_start(lcom_threadpool_main, result);
+		if (result->threads[result->nThreads]!=NULL) {
+			result->nThreads++;
+		}
+	}
+	l_assert(result->nThreads>0);
+
+	return result;
+}
+
+void lcom_threadpool_submit(lcom_threadpool_t *pool, lcom_thread_func_t func, void *arg) {
+	struct lcom_threadpool_job *job = (struct lcom_threadpool_job *)lmalloc(sizeof(struct lcom_threadpool_job));
+
+	l_assert(pool!=NULL);
+	l_assert(func!=NULL);
+
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+
+	lcom_mutex_lock(pool->mutex);
+	if (pool->tail==NULL) {
+		pool->head = job;
+	} else {
+		pool->tail->next = job;
+	}
+	pool->tail = job;
+	pool->pending++;
+	lcom_cond_signal(pool->cond);
+	lcom_mutex_unlock(pool->mutex);
+}
+
+int lcom_threadpool_pending(lcom_threadpool_t *pool) {
+	int result;
+
+	l_assert(pool!=NULL);
+
+	lcom_mutex_lock(pool->mutex);
+	result = pool->pending;
+	lcom_mutex_unlock(pool->mutex);
+
+	return result;
+}
+
+void lcom_threadpool_destroy(lcom_threadpool_t *pool) {
+	int i;
+
+	if (pool==NULL) return;
+
+	lcom_mutex_lock(pool->mutex);
+	pool->stopping = LTRUE;
+	lcom_cond_broadcast(pool->cond);
+	lcom_mutex_unlock(pool->mutex);
+
+	for (i=0; i<pool->nThreads; i++) {
+		lcom_thread_join(pool->threads[i]);
+	}
+
+	lfree(pool->threads);
+	lcom_cond_destroy(pool->cond);
+	lcom_mutex_destroy(pool->mutex);
+	lfree(pool);
+}
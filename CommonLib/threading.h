@@ -1,6 +1,8 @@
 #ifndef __COMMONLIB_THREADING_H
 #define __COMMONLIB_THREADING_H
 
+#include "lcross.h"
+
 /**
  * Type: lcom_mutex_t
  * This type represent a critical section
@@ -38,4 +40,137 @@ void lcom_mutex_lock(lcom_mutex_t *mutex);
  */
 void lcom_mutex_unlock(lcom_mutex_t *mutex);
 
+/**
+ * Type: lcom_cond_t
+ * This type represent a condition variable, used together with a mutex
+ */
+typedef struct lcom_cond lcom_cond_t;
+
+/**
+ * Function: lcom_cond_new
+ * Initialize a condition variable
+ * Returns: a new condition variable
+ */
+lcom_cond_t *lcom_cond_new(void);
+
+/**
+ * Function: lcom_cond_destroy
+ * Destroy the resources associated to this condition variable
+ * Parameters:
+ *   cond - The condition variable
+ */
+void lcom_cond_destroy(lcom_cond_t *cond);
+
+/**
+ * Function: lcom_cond_wait
+ * Unlock the mutex and wait for the condition to be signaled, locking
+ * the mutex again before returning. The wait can end without a signal,
+ * so the condition must be checked again.
+ * Parameters:
+ *   cond - The condition variable
+ *   mutex - The mutex, locked by the calling thread
+ */
+void lcom_cond_wait(lcom_cond_t *cond, lcom_mutex_t *mutex);
+
+/**
+ * Function: lcom_cond_timed_wait
+ * Like <lcom_cond_wait> but waiting at most the specified time
+ * Parameters:
+ *   cond - The condition variable
+ *   mutex - The mutex, locked by the calling thread
+ *   millis - The maximum wait in milliseconds
+ * Returns:
+ *   LFALSE if the time has elapsed, LTRUE otherwise
+ */
+lbool lcom_cond_timed_wait(lcom_cond_t *cond, lcom_mutex_t *mutex, int millis);
+
+/**
+ * Function: lcom_cond_signal
+ * Wake up one of the threads waiting on this condition variable
+ * Parameters:
+ *   cond - The condition variable
+ */
+void lcom_cond_signal(lcom_cond_t *cond);
+
+/**
+ * Function: lcom_cond_broadcast
+ * Wake up every thread waiting on this condition variable
+ * Parameters:
+ *   cond - The condition variable
+ */
+void lcom_cond_broadcast(lcom_cond_t *cond);
+
+/**
+ * Type: lcom_thread_t
+ * This type represent a thread
+ */
+typedef struct lcom_thread lcom_thread_t;
+
+/**
+ * Type: lcom_thread_func_t
+ * The function executed by a thread
+ */
+typedef void (*lcom_thread_func_t)(void *arg);
+
+/**
+ * Function: lcom_thread_start
+ * Start a new thread
+ * Parameters:
+ *   func - The function to execute
+ *   arg - The argument passed to the function
+ * Returns:
+ *   The thread, that must be joined, or NULL if the thread can't be created
+ */
+lcom_thread_t *lcom_thread_start(lcom_thread_func_t func, void *arg);
+
+/**
+ * Function: lcom_thread_join
+ * Wait for the end of the thread and destroy the associated resources
+ * Parameters:
+ *   thread - The thread
+ */
+void lcom_thread_join(lcom_thread_t *thread);
+
+/**
+ * Type: lcom_threadpool_t
+ * A fixed set of threads executing the jobs taken from a queue
+ */
+typedef struct lcom_threadpool lcom_threadpool_t;
+
+/**
+ * Function: lcom_threadpool_new
+ * Create a thread pool, starting its threads
+ * Parameters:
+ *   nThreads - The number of threads (greater than zero)
+ * Returns:
+ *   The new thread pool
+ */
+lcom_threadpool_t *lcom_threadpool_new(int nThreads);
+
+/**
+ * Function: lcom_threadpool_submit
+ * Add a job to the queue. The job will be executed by the first free thread.
+ * Parameters:
+ *   pool - The thread pool
+ *   func - The function to execute
+ *   arg - The argument passed to the function
+ */
+void lcom_threadpool_submit(lcom_threadpool_t *pool, lcom_thread_func_t func, void *arg);
+
+/**
+ * Function: lcom_threadpool_pending
+ * Get the number of jobs waiting for a free thread
+ * Parameters:
+ *   pool - The thread pool
+ */
+int lcom_threadpool_pending(lcom_threadpool_t *pool);
+
+/**
+ * Function: lcom_threadpool_destroy
+ * Execute the jobs still in the queue, stop the threads and destroy the pool
+ * Parameters:
+ *   pool - The thread pool (can be NULL)
+ */
+void lcom_threadpool_destroy(lcom_threadpool_t *pool);
+
 #endif
@@ -0,0 +1,816 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "webevent.h"
+#include "evloop.h"
+#include "threading.h"
+#include "lmemory.h"
+#include "lstring.h"
+#include "llogging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Maximum size of the request line and of the headers */
+#define WEBEVENT_MAX_REQUEST_SIZE 16384
+
+/* Maximum number of connections accepted for every readiness event */
+#define WEBEVENT_ACCEPT_BATCH 64
+
+/* Interval, in milliseconds, between the checks of the idle connections */
+#define WEBEVENT_SWEEP_INTERVAL 1000
+
+#define WEBEVENT_DEFAULT_TIMEOUT 30000
+
+#define WEBEVENT_DEFAULT_MAX_BODY_SIZE (16*1024*1024)
+
+enum webevent_conn_state {
+    /* Waiting for a request in the event loop */
+    WEBEVENT_IDLE,
+    /* Owned by a worker */
+    WEBEVENT_BUSY
+};
+
+struct webevent_conn_t {
+    struct webevent_t *server;
+    int fd;
+    enum webevent_conn_state state;
+    long long deadline;
+
+    /* The request headers followed by the part of the body, and
+     * eventually of the next requests, already received */
+    char *buf;
+    int bufLen;
+    int requestLen;
+
+    struct webevent_request_t request;
+    long long bodyRead;
+    lbool mustClose;
+
+    struct webevent_conn_t *prev;
+    struct webevent_conn_t *next;
+};
+
+struct webevent_t {
+    lstring *address;
+    lstring *port;
+    int nWorkers;
+    webevent_handler_t handler;
+    void *ctx;
+
+    lbool keepAlive;
+    int requestTimeout;
+    int listenBacklog;
+    long long maxBodySize;
+
+    int listenFd;
+    EventLoop_timer *sweepTimer;
+    EventLoop *loop;
+    lcom_thread_t *loopThread;
+    lcom_threadpool_t *workers;
+
+    /* Every open connection */
+    lcom_mutex_t *mutex;
+    struct webevent_conn_t *conns;
+    int connCount;
+};
+
+struct webevent_t *webevent_new( const char *address, const char *port, int nWorkers, webevent_handler_t handler, void *ctx ) {
+    struct webevent_t *result;
+
+    l_assert( address!=NULL );
+    l_assert( port!=NULL );
+    l_assert( nWorkers>0 );
+    l_assert( handler!=NULL );
+
+    result = (struct webevent_t *)lmalloc( sizeof(struct webevent_t) );
+    result->address = lstring_new_from_cstr( address );
+    result->port = lstring_new_from_cstr( port );
+    result->nWorkers = nWorkers;
+    result->handler = handler;
+    result->ctx = ctx;
+    result->keepAlive = LFALSE;
+    result->requestTimeout = WEBEVENT_DEFAULT_TIMEOUT;
+    result->listenBacklog = -1;
+    result->maxBodySize = WEBEVENT_DEFAULT_MAX_BODY_SIZE;
+    result->listenFd = -1;
+    result->sweepTimer = NULL;
+    result->loop = NULL;
+    result->loopThread = NULL;
+    result->workers = NULL;
+    result->mutex = lcom_mutex_new();
+    result->conns = NULL;
+    result->connCount = 0;
+
+    return result;
+}
+
+void webevent_set_keep_alive( struct webevent_t *self, lbool enabled ) {
+    l_assert( self!=NULL );
+    self->keepAlive = enabled;
+}
+
+void webevent_set_request_timeout( struct webevent_t *self, int millis ) {
+    l_assert( self!=NULL );
+    l_assert( millis>0 );
+    self->requestTimeout = millis;
+}
+
+void webevent_set_listen_backlog( struct webevent_t *self, int backlog ) {
+    l_assert( self!=NULL );
+    l_assert( backlog>0 );
+    self->listenBacklog = backlog;
+}
+
+void webevent_set_max_body_size( struct webevent_t *self, long long maxSize ) {
+    l_assert( self!=NULL );
+    l_assert( maxSize>=0 );
+    self->maxBodySize = maxSize;
+}
+
+int webevent_get_connection_count( struct webevent_t *self ) {
+    int result;
+
+    l_assert( self!=NULL );
+
+    lcom_mutex_lock( self->mutex );
+    result = self->connCount;
+    lcom_mutex_unlock( self->mutex );
+
+    return result;
+}
+
+const struct webevent_request_t *webevent_get_request( struct webevent_conn_t *conn ) {
+    l_assert( conn!=NULL );
+    return &conn->request;
+}
+
+const char *webevent_get_header( struct webevent_conn_t *conn, const char *name ) {
+    int i;
+
+    l_assert( conn!=NULL );
+    l_assert( name!=NULL );
+
+    for ( i=0; i<conn->request.num_headers; i++ ) {
+        if ( 0==l_stricmp( conn->request.headers[i].name, name ) ) {
+            return conn->request.headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+lbool webevent_should_keep_alive( struct webevent_conn_t *conn ) {
+    const char *connection;
+
+    l_assert( conn!=NULL );
+
+    if ( !conn->server->keepAlive || conn->mustClose ) {
+        return LFALSE;
+    }
+
+    connection = webevent_get_header( conn, "Connection" );
+    if ( connection!=NULL ) {
+        return 0==l_stricmp( connection, "keep-alive" );
+    } else {
+        return 0==strcmp( conn->request.http_version, "1.1" );
+    }
+}
+
+void webevent_set_must_close( struct webevent_conn_t *conn ) {
+    l_assert( conn!=NULL );
+    conn->mustClose = LTRUE;
+}
+
+int webevent_get_socket( struct webevent_conn_t *conn ) {
+    l_assert( conn!=NULL );
+    return conn->fd;
+}
+
+/* Request parsing {{{ */
+
+/* Get the length of the request line and of the headers, or 0 if the
+ * empty line ending them was not received yet */
+static int webevent_request_len( const char *buf, int len ) {
+    int i;
+
+    for ( i=0; i<len; i++ ) {
+        if ( buf[i]=='\n' ) {
+            if ( i+1<len && buf[i+1]=='\n' ) return i+2;
+            if ( i+2<len && buf[i+1]=='\r' && buf[i+2]=='\n' ) return i+3;
+        }
+    }
+
+    return 0;
+}
+
+/* Decode the "%xx" sequences of the path in place */
+static void webevent_url_decode( char *s ) {
+    char *dest = s;
+    int a, b;
+
+    while ( *s!='\0' ) {
+        if ( s[0]=='%' && isxdigit( (unsigned char)s[1] ) && isxdigit( (unsigned char)s[2] ) ) {
+            a = tolower( (unsigned char)s[1] );
+            b = tolower( (unsigned char)s[2] );
+            *dest++ = (char)(((isdigit(a) ? a-'0' : a-'a'+10) << 4) | (isdigit(b) ? b-'0' : b-'a'+10));
+            s += 3;
+        } else {
+            *dest++ = *s++;
+        }
+    }
+    *dest = '\0';
+}
+
+/* Take the next line of the request, terminating it */
+static char *webevent_next_line( char **pos ) {
+    char *line = *pos;
+    char *end = strchr( line, '\n' );
+
+    if ( end==NULL ) {
+        /* the last line, whose end was replaced by the terminator */
+        end = line + strlen( line );
+        *pos = end;
+    } else {
+        *end = '\0';
+        *pos = end+1;
+    }
+    if ( end>line && end[-1]=='\r' ) end[-1] = '\0';
+
+    return line;
+}
+
+/* Parse a Content-Length value: only digits, eventually followed by
+ * spaces, without overflowing */
+static lbool webevent_parse_length( const char *value, long long *result ) {
+    long long length = 0;
+    int digit;
+
+    if ( !isdigit( (unsigned char)*value ) ) return LFALSE;
+
+    while ( isdigit( (unsigned char)*value ) ) {
+        digit = *value - '0';
+        if ( length>(LLONG_MAX-digit)/10 ) return LFALSE;
+        length = length*10 + digit;
+        value++;
+    }
+    while ( *value==' ' || *value=='\t' ) value++;
+    if ( *value!='\0' ) return LFALSE;
+
+    *result = length;
+    return LTRUE;
+}
+
+/* Parse the request at the start of the buffer.
+ * Returns 1 if the request is complete, 0 if the headers were not
+ * completely received and an HTTP status code for the malformed ones */
+static int webevent_parse( struct webevent_conn_t *conn ) {
+    struct webevent_request_t *req = &conn->request;
+    char *pos;
+    char *line;
+    char *value;
+    char *target;
+    char *version;
+    const char *contentLength;
+    int skip = 0;
+
+    /* Tolerate the empty lines before the request */
+    while ( skip<conn->bufLen && (conn->buf[skip]=='\r' || conn->buf[skip]=='\n') ) skip++;
+    if ( skip>0 ) {
+        memmove( conn->buf, conn->buf+skip, conn->bufLen-skip );
+        conn->bufLen -= skip;
+    }
+
+    conn->requestLen = webevent_request_len( conn->buf, conn->bufLen );
+    if ( conn->requestLen==0 ) {
+        return conn->bufLen>=WEBEVENT_MAX_REQUEST_SIZE ? 431 : 0;
+    }
+
+    /* The request is parsed in place: the byte ending the headers
+     * becomes the terminator of the last line */
+    conn->buf[conn->requestLen-1] = '\0';
+    pos = conn->buf;
+    memset( req, 0, sizeof(struct webevent_request_t) );
+    conn->bodyRead = 0;
+    conn->mustClose = LFALSE;
+
+    line = webevent_next_line( &pos );
+    req->method = line;
+    target = strchr( line, ' ' );
+    if ( target==NULL ) return 400;
+    *target++ = '\0';
+    version = strchr( target, ' ' );
+    if ( version==NULL ) return 400;
+    *version++ = '\0';
+
+    if ( 0==strcmp( version, "HTTP/1.1" ) ) {
+        req->http_version = "1.1";
+    } else if ( 0==strcmp( version, "HTTP/1.0" ) ) {
+        req->http_version = "1.0";
+    } else {
+        return 505;
+    }
+
+    if ( target[0]!='/' ) return 400;
+    value = strchr( target, '?' );
+    if ( value!=NULL ) {
+        *value++ = '\0';
+        req->query_string = value;
+    }
+    webevent_url_decode( target );
+    req->uri = target;
+
+    while ( *pos!='\0' ) {
+        line = webevent_next_line( &pos );
+        if ( *line=='\0' ) break;
+
+        value = strchr( line, ':' );
+        if ( value==NULL ) return 400;
+        if ( req->num_headers>=WEBEVENT_MAX_HEADERS ) return 431;
+
+        *value++ = '\0';
+        while ( *value==' ' || *value=='\t' ) value++;
+        req->headers[req->num_headers].name = line;
+        req->headers[req->num_headers].value = value;
+        req->num_headers++;
+    }
+
+    /* Chunked request bodies are not supported */
+    if ( webevent_get_header( conn, "Transfer-Encoding" )!=NULL ) {
+        return 411;
+    }
+
+    contentLength = webevent_get_header( conn, "Content-Length" );
+    if ( contentLength!=NULL ) {
+        if ( !webevent_parse_length( contentLength, &req->content_length ) ) return 400;
+        if ( req->content_length>conn->server->maxBodySize ) return 413;
+    }
+
+    return 1;
+}
+
+/* }}} */
+
+#ifdef __linux__
+
+static void webevent_conn_callback( EventLoop *loop, int fd, int events, void *ctx );
+
+static long long webevent_now( void ) {
+    return l_monotonic_time_micros()/1000;
+}
+
+/* Close a connection and free it */
+static void webevent_close( struct webevent_conn_t *conn ) {
+    struct webevent_t *server = conn->server;
+
+    lcom_mutex_lock( server->mutex );
+    if ( conn->prev!=NULL ) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+    if ( conn->next!=NULL ) conn->next->prev = conn->prev;
+    server->connCount--;
+    lcom_mutex_unlock( server->mutex );
+
+    EventLoop_remove( server->loop, conn->fd );
+    close( conn->fd );
+    lfree( conn->buf );
+    lfree( conn );
+}
+
+/* Answer a request that can't be handled and close the connection */
+static void webevent_reject( struct webevent_conn_t *conn, int status ) {
+    char response[128];
+    const char *desc;
+
+    switch ( status ) {
+    case 411: desc = "Length Required"; break;
+    case 413: desc = "Request Entity Too Large"; break;
+    case 431: desc = "Request Header Fields Too Large"; break;
+    case 505: desc = "HTTP Version Not Supported"; break;
+    default: desc = "Bad Request"; break;
+    }
+
+    snprintf( response, sizeof(response),
+        "HTTP/1.1 %i %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, desc );
+    send( conn->fd, response, strlen( response ), MSG_DONTWAIT|MSG_NOSIGNAL );
+    webevent_close( conn );
+}
+
+/* Give the connection back to the event loop to wait for the next request */
+static void webevent_wait_request( struct webevent_conn_t *conn ) {
+    struct webevent_t *server = conn->server;
+
+    if ( conn->bufLen==0 ) {
+        /* an idle connection doesn't keep a buffer */
+        lfree( conn->buf );
+        conn->buf = NULL;
+    }
+
+    /* The connection is enabled with the lock held, so the sweep can't
+     * close it in the meantime */
+    lcom_mutex_lock( server->mutex );
+    conn->state = WEBEVENT_IDLE;
+    conn->deadline = webevent_now() + server->requestTimeout;
+    EventLoop_modify( server->loop, conn->fd, EVENTLOOP_READ|EVENTLOOP_ONESHOT, NULL );
+    lcom_mutex_unlock( server->mutex );
+}
+
+/* Execute the requests of a connection in a worker thread */
+static void webevent_process( void *arg ) {
+    struct webevent_conn_t *conn = (struct webevent_conn_t *)arg;
+    struct webevent_t *server = conn->server;
+    long long next;
+    int status;
+
+    while ( 1 ) {
+        server->handler( server->ctx, conn );
+
+        if ( conn->bodyRead<conn->request.content_length ) {
+            /* the rest of the body would be taken for the next request */
+            conn->mustClose = LTRUE;
+        }
+        if ( !webevent_should_keep_alive( conn ) ) {
+            webevent_close( conn );
+            return;
+        }
+
+        /* Keep the pipelined requests */
+        next = (long long)conn->requestLen + conn->request.content_length;
+        if ( next<conn->bufLen ) {
+            memmove( conn->buf, conn->buf+next, (size_t)(conn->bufLen-next) );
+            conn->bufLen -= (int)next;
+        } else {
+            conn->bufLen = 0;
+        }
+
+        status = conn->bufLen>0 ? webevent_parse( conn ) : 0;
+        if ( status==0 ) {
+            webevent_wait_request( conn );
+            return;
+        } else if ( status!=1 ) {
+            webevent_reject( conn, status );
+            return;
+        }
+    }
+}
+
+static void webevent_conn_callback( EventLoop *loop, int fd, int events, void *ctx ) {
+    struct webevent_conn_t *conn = (struct webevent_conn_t *)ctx;
+    struct webevent_t *server = conn->server;
+    int n;
+    int status;
+
+    if ( conn->buf==NULL ) {
+        conn->buf = (char *)lmalloc( WEBEVENT_MAX_REQUEST_SIZE+1 );
+    }
+
+    n = recv( fd, conn->buf+conn->bufLen, WEBEVENT_MAX_REQUEST_SIZE-conn->bufLen, MSG_DONTWAIT );
+    if ( n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) ) {
+        EventLoop_modify( loop, fd, EVENTLOOP_READ|EVENTLOOP_ONESHOT, NULL );
+        return;
+    } else if ( n<=0 ) {
+        webevent_close( conn );
+        return;
+    }
+    conn->bufLen += n;
+
+    status = webevent_parse( conn );
+    if ( status==0 ) {
+        EventLoop_modify( loop, fd, EVENTLOOP_READ|EVENTLOOP_ONESHOT, NULL );
+    } else if ( status==1 ) {
+        lcom_mutex_lock( server->mutex );
+        conn->state = WEBEVENT_BUSY;
+        lcom_mutex_unlock( server->mutex );
+        lcom_threadpool_submit( server->workers, webevent_process, conn );
+    } else {
+        webevent_reject( conn, status );
+    }
+}
+
+static void webevent_accept_callback( EventLoop *loop, int fd, int events, void *ctx ) {
+    struct webevent_t *server = (struct webevent_t *)ctx;
+    struct webevent_conn_t *conn;
+    struct timeval timeout;
+    int yes = 1;
+    int connFd;
+    int i;
+
+    timeout.tv_sec = server->requestTimeout/1000;
+    timeout.tv_usec = (server->requestTimeout%1000)*1000;
+
+    for ( i=0; i<WEBEVENT_ACCEPT_BATCH; i++ ) {
+        /* The connection socket is blocking: the event loop reads it with
+         * MSG_DONTWAIT and the workers can use it directly */
+        connFd = accept4( fd, NULL, NULL, SOCK_CLOEXEC );
+        if ( connFd<0 ) {
+            if ( errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR && errno!=ECONNABORTED ) {
+                l_error( "accept: %s", strerror(errno) );
+            }
+            return;
+        }
+
+        setsockopt( connFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+        setsockopt( connFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+        setsockopt( connFd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes) );
+
+        conn = (struct webevent_conn_t *)lmalloc( sizeof(struct webevent_conn_t) );
+        memset( conn, 0, sizeof(struct webevent_conn_t) );
+        conn->server = server;
+        conn->fd = connFd;
+        conn->state = WEBEVENT_IDLE;
+        conn->deadline = webevent_now() + server->requestTimeout;
+
+        lcom_mutex_lock( server->mutex );
+        conn->next = server->conns;
+        if ( server->conns!=NULL ) server->conns->prev = conn;
+        server->conns = conn;
+        server->connCount++;
+        lcom_mutex_unlock( server->mutex );
+
+        if ( !EventLoop_add( loop, connFd, EVENTLOOP_READ|EVENTLOOP_ONESHOT, webevent_conn_callback, conn, NULL ) ) {
+            webevent_close( conn );
+        }
+    }
+}
+
+/* Close the connections waiting too much for a request */
+static void webevent_sweep_callback( EventLoop *loop, EventLoop_timer *timer, void *ctx ) {
+    struct webevent_t *server = (struct webevent_t *)ctx;
+    struct webevent_conn_t *conn;
+    struct webevent_conn_t *expired = NULL;
+    struct webevent_conn_t *next;
+    long long now = webevent_now();
+
+    /* The expired connections are taken out of the list, using the
+     * prev pointer to chain them */
+    lcom_mutex_lock( server->mutex );
+    for ( conn=server->conns; conn!=NULL; conn=next ) {
+        next = conn->next;
+        if ( conn->state==WEBEVENT_IDLE && conn->deadline<now ) {
+            if ( conn->prev!=NULL ) {
+                conn->prev->next = conn->next;
+            } else {
+                server->conns = conn->next;
+            }
+            if ( conn->next!=NULL ) conn->next->prev = conn->prev;
+            server->connCount--;
+
+            conn->prev = expired;
+            expired = conn;
+        }
+    }
+    lcom_mutex_unlock( server->mutex );
+
+    while ( expired!=NULL ) {
+        conn = expired;
+        expired = conn->prev;
+
+        EventLoop_remove( loop, conn->fd );
+        close( conn->fd );
+        lfree( conn->buf );
+        lfree( conn );
+    }
+}
+
+static void webevent_loop_main( void *arg ) {
+    EventLoop_run( (EventLoop *)arg );
+}
+
+int webevent_read( struct webevent_conn_t *conn, void *buf, size_t len ) {
+    long long remaining;
+    long long buffered;
+    int n;
+
+    l_assert( conn!=NULL );
+    l_assert( buf!=NULL );
+
+    remaining = conn->request.content_length - conn->bodyRead;
+    if ( remaining<=0 || len==0 ) {
+        return 0;
+    }
+    if ( (unsigned long long)remaining<len ) {
+        len = (size_t)remaining;
+    }
+    if ( len>INT_MAX ) {
+        /* the result must fit the return value */
+        len = INT_MAX;
+    }
+
+    /* The body part received with the headers */
+    buffered = (long long)conn->bufLen - conn->requestLen - conn->bodyRead;
+    if ( buffered>0 ) {
+        if ( buffered>(long long)len ) buffered = (long long)len;
+        memcpy( buf, conn->buf+conn->requestLen+conn->bodyRead, (size_t)buffered );
+        conn->bodyRead += buffered;
+        return (int)buffered;
+    }
+
+    do {
+        n = recv( conn->fd, buf, len, 0 );
+    } while ( n<0 && errno==EINTR );
+
+    if ( n<=0 ) {
+        conn->mustClose = LTRUE;
+        return n==0 ? 0 : -1;
+    }
+
+    conn->bodyRead += n;
+    return n;
+}
+
+int webevent_write( struct webevent_conn_t *conn, const void *buf, size_t len ) {
+    size_t sent = 0;
+    ssize_t n;
+
+    l_assert( conn!=NULL );
+    l_assert( buf!=NULL );
+
+    while ( sent<len ) {
+        n = send( conn->fd, (const char *)buf+sent, len-sent, MSG_NOSIGNAL );
+        if ( n<0 && errno==EINTR ) continue;
+        if ( n<=0 ) {
+            conn->mustClose = LTRUE;
+            return -1;
+        }
+        sent += n;
+    }
+
+    return (int)sent;
+}
+
+lbool webevent_start( struct webevent_t *self, lerror **error ) {
+    struct addrinfo hints, *res, *rp;
+    sigset_t sigpipe;
+    sigset_t oldMask;
+    int yes = 1;
+    int rc;
+
+    l_assert( self!=NULL );
+    l_assert( self->loop==NULL );
+    l_assert( error==NULL || *error==NULL );
+
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    rc = getaddrinfo( self->address[0]=='\0' ? NULL : self->address, self->port, &hints, &res );
+    if ( rc!=0 ) {
+        lerror_set_sprintf( error, "getaddrinfo: %s", gai_strerror(rc) );
+        return LFALSE;
+    }
+
+    for ( rp=res; rp!=NULL; rp=rp->ai_next ) {
+        self->listenFd = socket( rp->ai_family, rp->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, rp->ai_protocol );
+        if ( self->listenFd<0 ) continue;
+
+        setsockopt( self->listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes) );
+        if ( 0==bind( self->listenFd, rp->ai_addr, rp->ai_addrlen ) &&
+             0==listen( self->listenFd, self->listenBacklog>0 ? self->listenBacklog : SOMAXCONN ) ) {
+            break;
+        }
+
+        close( self->listenFd );
+        self->listenFd = -1;
+    }
+    freeaddrinfo( res );
+
+    if ( self->listenFd<0 ) {
+        lerror_set_sprintf( error, "Can't listen on %s:%s: %s", self->address, self->port, strerror(errno) );
+        return LFALSE;
+    }
+
+    self->loop = EventLoop_new( error );
+    if ( self->loop==NULL ) {
+        return LFALSE;
+    }
+
+    if ( !EventLoop_add( self->loop, self->listenFd, EVENTLOOP_READ, webevent_accept_callback, self, error ) ) {
+        return LFALSE;
+    }
+
+    self->sweepTimer = EventLoop_timer_new( self->loop, webevent_sweep_callback, self );
+    EventLoop_timer_start( self->sweepTimer, WEBEVENT_SWEEP_INTERVAL, WEBEVENT_SWEEP_INTERVAL );
+
+    /* The sends use MSG_NOSIGNAL. The threads are started with SIGPIPE
+     * blocked, so the writes of the handlers on the socket, like writev
+     * and sendfile, don't raise it either, without changing the signal
+     * disposition of the application */
+    sigemptyset( &sigpipe );
+    sigaddset( &sigpipe, SIGPIPE );
+    pthread_sigmask( SIG_BLOCK, &sigpipe, &oldMask );
+    self->workers = lcom_threadpool_new( self->nWorkers );
+    self->loopThread = lcom_thread_start( webevent_loop_main, self->loop );
+    pthread_sigmask( SIG_SETMASK, &oldMask, NULL );
+    if ( self->loopThread==NULL ) {
+        lerror_set( error, "Can't start the event loop thread" );
+        return LFALSE;
+    }
+
+    return LTRUE;
+}
+
+void webevent_destroy( struct webevent_t *self ) {
+    struct webevent_conn_t *conn;
+
+    if ( self==NULL ) return;
+
+    if ( self->loopThread!=NULL ) {
+        EventLoop_stop( self->loop );
+        lcom_thread_join( self->loopThread );
+    }
+
+    /* The workers complete the requests being handled */
+    lcom_threadpool_destroy( self->workers );
+
+    while ( self->conns!=NULL ) {
+        conn = self->conns;
+        self->conns = conn->next;
+        close( conn->fd );
+        lfree( conn->buf );
+        lfree( conn );
+    }
+
+    EventLoop_timer_destroy( self->sweepTimer );
+    EventLoop_destroy( self->loop );
+    if ( self->listenFd>=0 ) close( self->listenFd );
+
+    lcom_mutex_destroy( self->mutex );
+    lstring_delete( self->address );
+    lstring_delete( self->port );
+    lfree( self );
+}
+
+#else
+
+int webevent_read( struct webevent_conn_t *conn, void *buf, size_t len ) {
+    return -1;
+}
+
+int webevent_write( struct webevent_conn_t *conn, const void *buf, size_t len ) {
+    return -1;
+}
+
+lbool webevent_start( struct webevent_t *self, lerror **error ) {
+    l_assert( self!=NULL );
+    lerror_set( error, "The event-driven web server is not supported on this platform" );
+    return LFALSE;
+}
+
+void webevent_destroy( struct webevent_t *self ) {
+    if ( self==NULL ) return;
+
+    lcom_mutex_destroy( self->mutex );
+    lstring_delete( self->address );
+    lstring_delete( self->port );
+    lfree( self );
+}
+
+#endif
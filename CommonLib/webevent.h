@@ -0,0 +1,218 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+#ifndef __WEBEVENT_H
+#define __WEBEVENT_H
+
+#include "lcross.h"
+#include "lerror.h"
+#include <stddef.h>
+
+/**
+ * File: webevent.h
+ */
+
+/**
+ * Class: webevent_t
+ * An event-driven HTTP/1.1 server. A single thread accepts the
+ * connections and reads the request headers from all of them with
+ * epoll; a complete request is passed to a pool of worker threads,
+ * which execute the handler and write the response. The connections
+ * waiting for a request only cost a small structure, so the server
+ * can keep many idle keep-alive clients without pinning threads.
+ *
+ * While a worker handles a request the connection socket is in
+ * blocking mode, with the request timeout applied to every read and
+ * write, so the handler can use it directly.
+ *
+ * Only available on Linux.
+ */
+struct webevent_t;
+
+/**
+ * Class: webevent_conn_t
+ * A connection processing a request
+ */
+struct webevent_conn_t;
+
+/* Maximum number of headers of a request */
+#define WEBEVENT_MAX_HEADERS 64
+
+/**
+ * Struct: webevent_request_t
+ * A parsed HTTP request
+ *
+ * Fields:
+ *     method - The HTTP method, ex. "GET"
+ *     uri - The URL-decoded path
+ *     http_version - "1.0" or "1.1"
+ *     query_string - The part of the URL after "?", or NULL
+ *     content_length - The body length (0 if the request has no body)
+ *     num_headers - The number of headers
+ *     headers - The headers
+ */
+struct webevent_request_t {
+    const char *method;
+    const char *uri;
+    const char *http_version;
+    const char *query_string;
+    long long content_length;
+    int num_headers;
+    struct {
+        const char *name;
+        const char *value;
+    } headers[WEBEVENT_MAX_HEADERS];
+};
+
+/**
+ * Type: webevent_handler_t
+ * The function called by the workers for every request
+ */
+typedef void (*webevent_handler_t)( void *ctx, struct webevent_conn_t *conn );
+
+/**
+ * Function: webevent_new
+ * Create a new server. The server doesn't listen until <webevent_start>.
+ *
+ * Parameters:
+ *     address - Address of the interface that must be listening for requests
+ *     port - The port number
+ *     nWorkers - The number of threads executing the handlers
+ *     handler - The request handler
+ *     ctx - Passed to the handler
+ */
+struct webevent_t *webevent_new( const char *address, const char *port, int nWorkers, webevent_handler_t handler, void *ctx );
+
+/**
+ * Function: webevent_set_keep_alive
+ * Keep the connections open between requests. Disabled by default.
+ */
+void webevent_set_keep_alive( struct webevent_t *self, lbool enabled );
+
+/**
+ * Function: webevent_set_request_timeout
+ * Change the time waited for a request, and for every read and write of
+ * a request being handled. The default is 30 seconds.
+ */
+void webevent_set_request_timeout( struct webevent_t *self, int millis );
+
+/**
+ * Function: webevent_set_listen_backlog
+ * Change the length of the queue of the connections waiting to be
+ * accepted. The default is SOMAXCONN.
+ */
+void webevent_set_listen_backlog( struct webevent_t *self, int backlog );
+
+/**
+ * Function: webevent_set_max_body_size
+ * Change the maximum size of the request bodies. The requests declaring
+ * a bigger Content-Length receive a "413 Request Entity Too Large" and
+ * the connection is closed without calling the handler. The default is
+ * 16MB.
+ */
+void webevent_set_max_body_size( struct webevent_t *self, long long maxSize );
+
+/**
+ * Function: webevent_start
+ * Bind the listening socket and start the event and worker threads
+ *
+ * Returns:
+ *     LTRUE if the server was started, LFALSE otherwise
+ */
+lbool webevent_start( struct webevent_t *self, lerror **error );
+
+/**
+ * Function: webevent_destroy
+ * Stop the server, waiting for the requests being handled, and close
+ * every connection
+ */
+void webevent_destroy( struct webevent_t *self );
+
+/**
+ * Function: webevent_get_connection_count
+ * Get the number of open connections
+ */
+int webevent_get_connection_count( struct webevent_t *self );
+
+/**
+ * Function: webevent_get_request
+ * Get the request being handled
+ */
+const struct webevent_request_t *webevent_get_request( struct webevent_conn_t *conn );
+
+/**
+ * Function: webevent_get_header
+ * Get a request header
+ *
+ * Parameters:
+ *     conn - The connection
+ *     name - The header name (case insensitive)
+ * Returns:
+ *     The header value or NULL if the request doesn't have the header
+ */
+const char *webevent_get_header( struct webevent_conn_t *conn, const char *name );
+
+/**
+ * Function: webevent_read
+ * Read the request body
+ *
+ * Returns:
+ *     The number of bytes read, 0 at the end of the body, -1 on errors
+ */
+int webevent_read( struct webevent_conn_t *conn, void *buf, size_t len );
+
+/**
+ * Function: webevent_write
+ * Write data to the client
+ *
+ * Returns:
+ *     The number of bytes written, that is len unless there is an error
+ */
+int webevent_write( struct webevent_conn_t *conn, const void *buf, size_t len );
+
+/**
+ * Function: webevent_get_socket
+ * Get the connection socket, to write the response with writev or
+ * sendfile. The handlers run with SIGPIPE blocked, so these writes
+ * fail with EPIPE when the client has closed the connection.
+ */
+int webevent_get_socket( struct webevent_conn_t *conn );
+
+/**
+ * Function: webevent_should_keep_alive
+ * Check if the connection will be kept open after the response
+ */
+lbool webevent_should_keep_alive( struct webevent_conn_t *conn );
+
+/**
+ * Function: webevent_set_must_close
+ * Close the connection after the response
+ */
+void webevent_set_must_close( struct webevent_conn_t *conn );
+
+#endif
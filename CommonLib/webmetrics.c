@@ -0,0 +1,335 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+
+#include "webmetrics.h"
+#include "lmemory.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef _MSC_VER
+#define WEBMETRICS_THREAD_LOCAL __declspec(thread)
+#else
+#define WEBMETRICS_THREAD_LOCAL __thread
+#endif
+
+/* Number of shards of every service: the threads beyond this number share
+ * a shard with another thread */
+#define WEBMETRICS_SHARDS 16
+
+/* Linear buckets for every power of two */
+#define WEBMETRICS_SUB_BUCKET_BITS 3
+#define WEBMETRICS_SUB_BUCKETS (1<<WEBMETRICS_SUB_BUCKET_BITS)
+
+/* Greatest recorded latency, about 71 minutes: the longer requests
+ * are recorded in the last bucket */
+#define WEBMETRICS_MAX_EXPONENT 31
+#define WEBMETRICS_BUCKETS ((WEBMETRICS_MAX_EXPONENT-WEBMETRICS_SUB_BUCKET_BITS+2)*WEBMETRICS_SUB_BUCKETS)
+
+/* Status classes: unknown, 1xx, 2xx, 3xx, 4xx, 5xx */
+#define WEBMETRICS_STATUS_CLASSES 6
+
+struct webmetrics_shard_t {
+    long long requests[WEBMETRICS_STATUS_CLASSES];
+    long long inFlight;
+    long long sum;
+    long long buckets[WEBMETRICS_BUCKETS];
+};
+
+struct webmetrics_service_t {
+    lstring *name;
+    struct webmetrics_shard_t shards[WEBMETRICS_SHARDS];
+    struct webmetrics_service_t *next;
+};
+
+struct webmetrics_t {
+    struct webmetrics_service_t *first;
+    struct webmetrics_service_t *last;
+};
+
+static WEBMETRICS_THREAD_LOCAL int webmetrics_thread_shard = -1;
+static long long webmetrics_next_shard = 0;
+
+static const double webmetrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static long long webmetrics_add( long long *counter, long long value ) {
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd64( counter, value );
+#else
+    return __atomic_fetch_add( counter, value, __ATOMIC_RELAXED );
+#endif
+}
+
+static long long webmetrics_load( long long *counter ) {
+#ifdef _MSC_VER
+    return *(volatile long long *)counter;
+#else
+    return __atomic_load_n( counter, __ATOMIC_RELAXED );
+#endif
+}
+
+static struct webmetrics_shard_t *webmetrics_get_shard( struct webmetrics_service_t *service ) {
+    if ( webmetrics_thread_shard<0 ) {
+        webmetrics_thread_shard = (int)(webmetrics_add( &webmetrics_next_shard, 1 ) % WEBMETRICS_SHARDS);
+    }
+    return &service->shards[webmetrics_thread_shard];
+}
+
+static int webmetrics_bucket_index( long long micros ) {
+    int exponent = 0;
+
+    if ( micros<WEBMETRICS_SUB_BUCKETS ) {
+        return micros<0 ? 0 : (int)micros;
+    }
+    if ( micros>=(1LL<<(WEBMETRICS_MAX_EXPONENT+1)) ) {
+        return WEBMETRICS_BUCKETS-1;
+    }
+
+    while ( (micros>>(exponent+1))!=0 ) {
+        exponent++;
+    }
+
+    return (exponent-WEBMETRICS_SUB_BUCKET_BITS+1)*WEBMETRICS_SUB_BUCKETS
+        + (int)((micros>>(exponent-WEBMETRICS_SUB_BUCKET_BITS)) & (WEBMETRICS_SUB_BUCKETS-1));
+}
+
+/* The greatest latency recorded in a bucket */
+static long long webmetrics_bucket_value( int index ) {
+    int exponent;
+    long long width;
+
+    if ( index<WEBMETRICS_SUB_BUCKETS ) {
+        return index;
+    }
+
+    exponent = index/WEBMETRICS_SUB_BUCKETS + WEBMETRICS_SUB_BUCKET_BITS - 1;
+    width = 1LL<<(exponent-WEBMETRICS_SUB_BUCKET_BITS);
+
+    return (WEBMETRICS_SUB_BUCKETS + index%WEBMETRICS_SUB_BUCKETS)*width + width - 1;
+}
+
+struct webmetrics_t *webmetrics_new( void ) {
+    return (struct webmetrics_t *)lmalloczero( sizeof(struct webmetrics_t) );
+}
+
+void webmetrics_destroy( struct webmetrics_t *self ) {
+    struct webmetrics_service_t *service;
+
+    if ( self==NULL ) return;
+
+    while ( self->first!=NULL ) {
+        service = self->first;
+        self->first = service->next;
+        lstring_delete( service->name );
+        lfree( service );
+    }
+
+    lfree( self );
+}
+
+struct webmetrics_service_t *webmetrics_add_service( struct webmetrics_t *self, const char *name ) {
+    struct webmetrics_service_t *service;
+
+    l_assert( self!=NULL );
+    l_assert( name!=NULL );
+
+    service = (struct webmetrics_service_t *)lmalloczero( sizeof(struct webmetrics_service_t) );
+    service->name = lstring_new_from_cstr( name );
+
+    if ( self->last==NULL ) {
+        self->first = service;
+    } else {
+        self->last->next = service;
+    }
+    self->last = service;
+
+    return service;
+}
+
+void webmetrics_begin( struct webmetrics_service_t *service ) {
+    webmetrics_add( &webmetrics_get_shard( service )->inFlight, 1 );
+}
+
+void webmetrics_end( struct webmetrics_service_t *service, int status, long long micros ) {
+    struct webmetrics_shard_t *shard = webmetrics_get_shard( service );
+    int statusClass = status/100;
+
+    if ( statusClass<1 || statusClass>=WEBMETRICS_STATUS_CLASSES ) {
+        statusClass = 0;
+    }
+    if ( micros<0 ) {
+        micros = 0;
+    }
+
+    webmetrics_add( &shard->requests[statusClass], 1 );
+    webmetrics_add( &shard->sum, micros );
+    webmetrics_add( &shard->buckets[webmetrics_bucket_index( micros )], 1 );
+    webmetrics_add( &shard->inFlight, -1 );
+}
+
+/* Sum the histograms of every shard, returning the number of requests */
+static long long webmetrics_collect( struct webmetrics_service_t *service, long long *buckets ) {
+    long long total = 0;
+    long long count;
+    int i, j;
+
+    memset( buckets, 0, sizeof(long long)*WEBMETRICS_BUCKETS );
+
+    for ( i=0; i<WEBMETRICS_SHARDS; i++ ) {
+        for ( j=0; j<WEBMETRICS_BUCKETS; j++ ) {
+            count = webmetrics_load( &service->shards[i].buckets[j] );
+            buckets[j] += count;
+            total += count;
+        }
+    }
+
+    return total;
+}
+
+static long long webmetrics_percentile( long long *buckets, long long total, double quantile ) {
+    long long rank = (long long)(quantile*total + 0.5);
+    long long seen = 0;
+    int i;
+
+    if ( total==0 ) {
+        return 0;
+    }
+    if ( rank<1 ) {
+        rank = 1;
+    }
+
+    for ( i=0; i<WEBMETRICS_BUCKETS; i++ ) {
+        seen += buckets[i];
+        if ( seen>=rank ) {
+            return webmetrics_bucket_value( i );
+        }
+    }
+
+    return webmetrics_bucket_value( WEBMETRICS_BUCKETS-1 );
+}
+
+long long webmetrics_get_percentile( struct webmetrics_service_t *service, double quantile ) {
+    long long buckets[WEBMETRICS_BUCKETS];
+    long long total;
+
+    l_assert( service!=NULL );
+
+    total = webmetrics_collect( service, buckets );
+    return webmetrics_percentile( buckets, total, quantile );
+}
+
+static lstring *webmetrics_append_label_f( lstring *dest, lstring *value ) {
+    const char *p;
+
+    for ( p=value; *p!='\0'; p++ ) {
+        if ( *p=='\\' || *p=='"' ) {
+            dest = lstring_append_char_f( dest, '\\' );
+            dest = lstring_append_char_f( dest, *p );
+        } else if ( *p=='\n' ) {
+            dest = lstring_append_cstr_f( dest, "\\n" );
+        } else {
+            dest = lstring_append_char_f( dest, *p );
+        }
+    }
+
+    return dest;
+}
+
+static lstring *webmetrics_append_series_f( lstring *dest, const char *prefix, const char *name,
+        struct webmetrics_service_t *service ) {
+    dest = lstring_append_sprintf_f( dest, "%s_%s{service=\"", prefix, name );
+    dest = webmetrics_append_label_f( dest, service->name );
+    return lstring_append_char_f( dest, '"' );
+}
+
+lstring *webmetrics_format_f( struct webmetrics_t *self, lstring *dest, const char *prefix ) {
+    static const char *classes[WEBMETRICS_STATUS_CLASSES] = { "unknown", "1xx", "2xx", "3xx", "4xx", "5xx" };
+    long long buckets[WEBMETRICS_BUCKETS];
+    struct webmetrics_service_t *service;
+    long long count;
+    long long total;
+    long long sum;
+    int i, j;
+
+    l_assert( self!=NULL );
+    l_assert( dest!=NULL );
+    l_assert( prefix!=NULL );
+
+    dest = lstring_append_sprintf_f( dest, "# HELP %s_requests_total Requests completed by every service.\n"
+        "# TYPE %s_requests_total counter\n", prefix, prefix );
+    for ( service=self->first; service!=NULL; service=service->next ) {
+        for ( i=0; i<WEBMETRICS_STATUS_CLASSES; i++ ) {
+            count = 0;
+            for ( j=0; j<WEBMETRICS_SHARDS; j++ ) {
+                count += webmetrics_load( &service->shards[j].requests[i] );
+            }
+            /* The unexpected classes appear only when used */
+            if ( count==0 && (i==0 || i==1) ) {
+                continue;
+            }
+            dest = webmetrics_append_series_f( dest, prefix, "requests_total", service );
+            dest = lstring_append_sprintf_f( dest, ",code=\"%s\"} %lld\n", classes[i], count );
+        }
+    }
+
+    dest = lstring_append_sprintf_f( dest, "# HELP %s_requests_in_flight Requests in progress.\n"
+        "# TYPE %s_requests_in_flight gauge\n", prefix, prefix );
+    for ( service=self->first; service!=NULL; service=service->next ) {
+        count = 0;
+        for ( j=0; j<WEBMETRICS_SHARDS; j++ ) {
+            count += webmetrics_load( &service->shards[j].inFlight );
+        }
+        dest = webmetrics_append_series_f( dest, prefix, "requests_in_flight", service );
+        dest = lstring_append_sprintf_f( dest, "} %lld\n", count );
+    }
+
+    dest = lstring_append_sprintf_f( dest, "# HELP %s_request_duration_seconds Request latency.\n"
+        "# TYPE %s_request_duration_seconds summary\n", prefix, prefix );
+    for ( service=self->first; service!=NULL; service=service->next ) {
+        total = webmetrics_collect( service, buckets );
+        sum = 0;
+        for ( j=0; j<WEBMETRICS_SHARDS; j++ ) {
+            sum += webmetrics_load( &service->shards[j].sum );
+        }
+
+        for ( i=0; i<(int)(sizeof(webmetrics_quantiles)/sizeof(webmetrics_quantiles[0])); i++ ) {
+            dest = webmetrics_append_series_f( dest, prefix, "request_duration_seconds", service );
+            dest = lstring_append_sprintf_f( dest, ",quantile=\"%g\"} %.6f\n", webmetrics_quantiles[i],
+                webmetrics_percentile( buckets, total, webmetrics_quantiles[i] )/1e6 );
+        }
+        dest = webmetrics_append_series_f( dest, prefix, "request_duration_seconds_sum", service );
+        dest = lstring_append_sprintf_f( dest, "} %.6f\n", sum/1e6 );
+        dest = webmetrics_append_series_f( dest, prefix, "request_duration_seconds_count", service );
+        dest = lstring_append_sprintf_f( dest, "} %lld\n", total );
+    }
+
+    return dest;
+}
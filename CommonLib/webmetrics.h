@@ -0,0 +1,129 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+#ifndef __WEBMETRICS_H
+#define __WEBMETRICS_H
+
+#include "lcross.h"
+#include "lstring.h"
+
+/**
+ * File: webmetrics.h
+ */
+
+/**
+ * Class: webmetrics_t
+ * The statistics of a set of services: the number of requests by
+ * status class, the requests in progress and the latency distribution.
+ *
+ * The latencies are kept in log-linear histograms (every power of two
+ * is split in 8 linear buckets, so a percentile has at most a 12.5%
+ * error) covering from one microsecond to more than an hour.
+ *
+ * The statistics are recorded without locks: every thread updates its
+ * own shard, chosen the first time the thread records something, and the
+ * shards are summed when the statistics are read.
+ */
+struct webmetrics_t;
+
+/**
+ * Class: webmetrics_service_t
+ * The statistics of a service
+ */
+struct webmetrics_service_t;
+
+/**
+ * Function: webmetrics_new
+ * Create a new, empty, set of statistics
+ */
+struct webmetrics_t *webmetrics_new( void );
+
+/**
+ * Function: webmetrics_destroy
+ * Destroy the statistics of every service
+ */
+void webmetrics_destroy( struct webmetrics_t *self );
+
+/**
+ * Function: webmetrics_add_service
+ * Add a service. The services must be added before recording the
+ * requests.
+ *
+ * Parameters:
+ *     self - The statistics
+ *     name - The service name, used as the "service" label
+ * Returns:
+ *     The statistics of the service, owned by self
+ */
+struct webmetrics_service_t *webmetrics_add_service( struct webmetrics_t *self, const char *name );
+
+/**
+ * Function: webmetrics_begin
+ * Record the start of a request
+ */
+void webmetrics_begin( struct webmetrics_service_t *service );
+
+/**
+ * Function: webmetrics_end
+ * Record the end of a request
+ *
+ * Parameters:
+ *     service - The service
+ *     status - The HTTP status code of the response
+ *     micros - The request duration in microseconds
+ */
+void webmetrics_end( struct webmetrics_service_t *service, int status, long long micros );
+
+/**
+ * Function: webmetrics_get_percentile
+ * Compute a latency percentile of a service
+ *
+ * Parameters:
+ *     service - The service
+ *     quantile - The quantile, between 0 and 1 (ex. 0.99)
+ * Returns:
+ *     The latency in microseconds, or 0 if no request was recorded
+ */
+long long webmetrics_get_percentile( struct webmetrics_service_t *service, double quantile );
+
+/**
+ * Function: webmetrics_format_f
+ * Append the statistics of every service to a string, in the Prometheus
+ * text format. The latencies are exposed as summaries with the 0.5, 0.9,
+ * 0.99 and 0.999 quantiles.
+ *
+ * Parameters:
+ *     self - The statistics
+ *     dest - The destination string
+ *     prefix - The prefix of the metric names, ex. "webserver"
+ * Returns:
+ *     The destination string
+ */
+lstring *webmetrics_format_f( struct webmetrics_t *self, lstring *dest, const char *prefix );
+
+#endif
@@ -0,0 +1,423 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+
+#include "webrouter.h"
+#include "lhashtable.h"
+#include "lvector.h"
+#include "lstring.h"
+#include "lmemory.h"
+#include <string.h>
+
+/* Maximum number of parameters captured by a route */
+#define WEBROUTER_MAX_CAPTURES 32
+
+/* The routes registered on the same pattern, one for every method */
+struct webroute_t {
+    lstring *method;
+    slist *paramNames;
+    void *data;
+    struct webroute_t *next;
+};
+
+struct webrouter_node_t {
+    lstring *segment;
+    lvector *children;
+    struct webrouter_node_t *param;
+    struct webroute_t *routes;
+    struct webroute_t *wildcard;
+};
+
+struct webrouter_t {
+    lhashtable *exact;
+    struct webrouter_node_t *root;
+};
+
+struct webrouter_capture_t {
+    const char *start;
+    int len;
+};
+
+/* Routes {{{ */
+
+static void webroute_destroy( struct webroute_t *self ) {
+    struct webroute_t *next;
+
+    while ( self!=NULL ) {
+        next = self->next;
+        lstring_delete( self->method );
+        slist_destroy( self->paramNames );
+        lfree( self );
+        self = next;
+    }
+}
+
+/* Add a route to a list, replacing the one with the same method */
+static struct webroute_t *webroute_add( struct webroute_t *list, const char *method, slist *paramNames, void *data ) {
+    struct webroute_t *route;
+    struct webroute_t *last;
+
+    for ( route=list; route!=NULL; route=route->next ) {
+        if ( (method==NULL && route->method==NULL) || 
+             (method!=NULL && route->method!=NULL && 0==l_stricmp( method, route->method )) ) {
+            slist_destroy( route->paramNames );
+            route->paramNames = paramNames;
+            route->data = data;
+            return list;
+        }
+    }
+
+    route = (struct webroute_t *)lmalloc( sizeof(struct webroute_t) );
+    route->method = method!=NULL ? lstring_new_from_cstr( method ) : NULL;
+    route->paramNames = paramNames;
+    route->data = data;
+
+    /* the routes for every method are the last resort */
+    if ( method!=NULL || list==NULL ) {
+        route->next = list;
+        return route;
+    }
+
+    route->next = NULL;
+    last = list;
+    while ( last->next!=NULL ) {
+        last = last->next;
+    }
+    last->next = route;
+    return list;
+}
+
+static struct webroute_t *webroute_find( struct webroute_t *list, const char *method ) {
+    for ( ; list!=NULL; list=list->next ) {
+        if ( list->method==NULL || 0==l_stricmp( list->method, method ) ) {
+            return list;
+        }
+    }
+    return NULL;
+}
+
+/* }}} */
+
+/* Trie {{{ */
+
+static struct webrouter_node_t *webrouter_node_new( const char *segment, int len ) {
+    struct webrouter_node_t *self = (struct webrouter_node_t *)lmalloczero( sizeof(struct webrouter_node_t) );
+    self->segment = lstring_append_generic_f( lstring_new(), segment, len );
+    self->children = lvector_new( 0 );
+    return self;
+}
+
+static void webrouter_node_destroy( struct webrouter_node_t *self ) {
+    int i;
+
+    if ( self==NULL ) return;
+
+    for ( i=0; i<lvector_len( self->children ); i++ ) {
+        webrouter_node_destroy( (struct webrouter_node_t *)lvector_at( self->children, i ) );
+    }
+    lvector_delete( self->children );
+    webrouter_node_destroy( self->param );
+    webroute_destroy( self->routes );
+    webroute_destroy( self->wildcard );
+    lstring_delete( self->segment );
+    lfree( self );
+}
+
+static struct webrouter_node_t *webrouter_node_child( struct webrouter_node_t *self, const char *segment, int len ) {
+    struct webrouter_node_t *child;
+    int i;
+
+    for ( i=0; i<lvector_len( self->children ); i++ ) {
+        child = (struct webrouter_node_t *)lvector_at( self->children, i );
+        if ( lstring_len( child->segment )==len && 0==memcmp( child->segment, segment, len ) ) {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the route matching a path, which doesn't start with "/". The literal
+ * segments are tried first, then the parameters and then the wildcard. */
+static struct webroute_t *webrouter_node_match( struct webrouter_node_t *self, const char *path, const char *method,
+        struct webrouter_capture_t *captures, int count, lbool *pathFound ) {
+    struct webrouter_node_t *child;
+    struct webroute_t *result = NULL;
+    const char *end;
+    int len;
+
+    end = strchr( path, '/' );
+    len = end!=NULL ? (int)(end - path) : (int)strlen( path );
+
+    if ( end==NULL && len==0 && self->routes!=NULL ) {
+        /* this is the complete path */
+        *pathFound = LTRUE;
+        result = webroute_find( self->routes, method );
+        if ( result!=NULL ) {
+            return result;
+        }
+    }
+
+    if ( end!=NULL || len>0 ) {
+        child = webrouter_node_child( self, path, len );
+        if ( child!=NULL ) {
+            result = webrouter_node_match( child, end!=NULL ? end+1 : path+len, method, captures, count, pathFound );
+        }
+    }
+
+    if ( result==NULL && self->param!=NULL && len>0 && count<WEBROUTER_MAX_CAPTURES ) {
+        captures[count].start = path;
+        captures[count].len = len;
+        result = webrouter_node_match( self->param, end!=NULL ? end+1 : path+len, method, captures, count+1, pathFound );
+    }
+
+    if ( result==NULL && self->wildcard!=NULL && count<WEBROUTER_MAX_CAPTURES ) {
+        *pathFound = LTRUE;
+        captures[count].start = path;
+        captures[count].len = strlen( path );
+        result = webroute_find( self->wildcard, method );
+    }
+
+    return result;
+}
+
+/* Find the node of a path which matches a pattern, without the method */
+static struct webroute_t *webrouter_node_routes( struct webrouter_node_t *self, const char *path ) {
+    struct webrouter_node_t *child;
+    struct webroute_t *result = NULL;
+    const char *end;
+    int len;
+
+    end = strchr( path, '/' );
+    len = end!=NULL ? (int)(end - path) : (int)strlen( path );
+
+    if ( end==NULL && len==0 && self->routes!=NULL ) {
+        return self->routes;
+    }
+
+    if ( end!=NULL || len>0 ) {
+        child = webrouter_node_child( self, path, len );
+        if ( child!=NULL ) {
+            result = webrouter_node_routes( child, end!=NULL ? end+1 : path+len );
+        }
+    }
+
+    if ( result==NULL && self->param!=NULL && len>0 ) {
+        result = webrouter_node_routes( self->param, end!=NULL ? end+1 : path+len );
+    }
+
+    if ( result==NULL ) {
+        result = self->wildcard;
+    }
+
+    return result;
+}
+
+/* }}} */
+
+/* Router {{{ */
+
+static void webrouter_exact_destroy( void *node ) {
+    webrouter_node_destroy( (struct webrouter_node_t *)node );
+}
+
+struct webrouter_t *webrouter_new( void ) {
+    struct webrouter_t *self = (struct webrouter_t *)lmalloc( sizeof(struct webrouter_t) );
+
+    self->exact = lhashtable_new( webrouter_exact_destroy );
+    self->root = webrouter_node_new( "", 0 );
+
+    return self;
+}
+
+void webrouter_destroy( struct webrouter_t *self ) {
+    if ( self==NULL ) return;
+
+    lhashtable_destroy( self->exact );
+    webrouter_node_destroy( self->root );
+    lfree( self );
+}
+
+lbool webrouter_add( struct webrouter_t *self, const char *method, const char *pattern, void *data ) {
+    struct webrouter_node_t *node;
+    struct webrouter_node_t *child;
+    slist *paramNames;
+    const char *segment;
+    const char *end;
+    int len;
+
+    l_assert( self!=NULL );
+    l_assert( pattern!=NULL );
+
+    if ( pattern[0]!='/' ) {
+        return LFALSE;
+    }
+
+    if ( strchr( pattern, '{' )==NULL && strchr( pattern, '*' )==NULL ) {
+        node = (struct webrouter_node_t *)lhashtable_get( self->exact, pattern );
+        if ( node==NULL ) {
+            node = webrouter_node_new( "", 0 );
+            lhashtable_put( self->exact, pattern, node );
+        }
+        node->routes = webroute_add( node->routes, method, slist_new( 0 ), data );
+        return LTRUE;
+    }
+
+    paramNames = slist_new( 0 );
+    node = self->root;
+    segment = pattern + 1;
+
+    while ( LTRUE ) {
+        end = strchr( segment, '/' );
+        len = end!=NULL ? (int)(end - segment) : (int)strlen( segment );
+
+        if ( len==1 && segment[0]=='*' ) {
+            if ( end!=NULL ) {
+                slist_destroy( paramNames );
+                return LFALSE;
+            }
+            slist_resize( paramNames, slist_len( paramNames )+1 );
+            slist_set( paramNames, slist_len( paramNames )-1, "*" );
+            node->wildcard = webroute_add( node->wildcard, method, paramNames, data );
+            return LTRUE;
+        }
+
+        if ( len>=2 && segment[0]=='{' && segment[len-1]=='}' ) {
+            lstring *name = lstring_append_generic_f( lstring_new(), segment+1, len-2 );
+            slist_resize( paramNames, slist_len( paramNames )+1 );
+            slist_set( paramNames, slist_len( paramNames )-1, name );
+            lstring_delete( name );
+
+            if ( node->param==NULL ) {
+                node->param = webrouter_node_new( "", 0 );
+            }
+            node = node->param;
+        } else if ( memchr( segment, '{', len )!=NULL || memchr( segment, '*', len )!=NULL ) {
+            slist_destroy( paramNames );
+            return LFALSE;
+        } else {
+            child = webrouter_node_child( node, segment, len );
+            if ( child==NULL ) {
+                child = webrouter_node_new( segment, len );
+                lvector_resize( node->children, lvector_len( node->children )+1 );
+                lvector_set( node->children, lvector_len( node->children )-1, child );
+            }
+            node = child;
+        }
+
+        if ( end==NULL ) {
+            break;
+        }
+        segment = end+1;
+    }
+
+    node->routes = webroute_add( node->routes, method, paramNames, data );
+    return LTRUE;
+}
+
+enum webrouter_result webrouter_match( struct webrouter_t *self, const char *method, const char *path,
+    slist *params, void **data ) {
+    struct webrouter_capture_t captures[WEBROUTER_MAX_CAPTURES];
+    struct webrouter_node_t *node;
+    struct webroute_t *route = NULL;
+    lbool pathFound = LFALSE;
+    lstring *value;
+    int i;
+
+    l_assert( self!=NULL );
+    l_assert( method!=NULL );
+    l_assert( path!=NULL );
+    l_assert( data!=NULL );
+
+    *data = NULL;
+    if ( params!=NULL ) {
+        slist_resize( params, 0 );
+    }
+
+    node = (struct webrouter_node_t *)lhashtable_get( self->exact, path );
+    if ( node!=NULL ) {
+        pathFound = LTRUE;
+        route = webroute_find( node->routes, method );
+        if ( route!=NULL ) {
+            *data = route->data;
+            return WEBROUTER_FOUND;
+        }
+    }
+
+    if ( path[0]=='/' ) {
+        route = webrouter_node_match( self->root, path+1, method, captures, 0, &pathFound );
+    }
+
+    if ( route==NULL ) {
+        return pathFound ? WEBROUTER_METHOD_NOT_ALLOWED : WEBROUTER_NOT_FOUND;
+    }
+
+    *data = route->data;
+
+    if ( params!=NULL ) {
+        slist_resize( params, 2*slist_len( route->paramNames ) );
+        value = lstring_new();
+        for ( i=0; i<slist_len( route->paramNames ); i++ ) {
+            lstring_reset( value );
+            value = lstring_append_generic_f( value, captures[i].start, captures[i].len );
+            slist_set( params, 2*i, slist_at( route->paramNames, i ) );
+            slist_set( params, 2*i+1, value );
+        }
+        lstring_delete( value );
+    }
+
+    return WEBROUTER_FOUND;
+}
+
+lstring *webrouter_allowed_methods_f( struct webrouter_t *self, lstring *dest, const char *path ) {
+    struct webrouter_node_t *node;
+    struct webroute_t *routes = NULL;
+    lbool first = LTRUE;
+
+    l_assert( self!=NULL );
+    l_assert( dest!=NULL );
+    l_assert( path!=NULL );
+
+    node = (struct webrouter_node_t *)lhashtable_get( self->exact, path );
+    if ( node!=NULL ) {
+        routes = node->routes;
+    } else if ( path[0]=='/' ) {
+        routes = webrouter_node_routes( self->root, path+1 );
+    }
+
+    for ( ; routes!=NULL; routes=routes->next ) {
+        if ( routes->method==NULL ) continue;
+        if ( !first ) dest = lstring_append_cstr_f( dest, ", " );
+        dest = lstring_append_lstring_f( dest, routes->method );
+        first = LFALSE;
+    }
+
+    return dest;
+}
+
+/* }}} */
@@ -0,0 +1,128 @@
+/*
+Author: Leonardo Cecchi <leonardoce@interfree.it>
+
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/ 
+#ifndef __WEBROUTER_H
+#define __WEBROUTER_H
+
+#include "lcross.h"
+#include "lstring.h"
+#include "slist.h"
+
+/**
+ * File: webrouter.h
+ */
+
+/**
+ * Class: webrouter_t
+ * Map the request method and path to the data of a route. The routes
+ * without parameters are kept in a hash table, the others in a trie of
+ * path segments.
+ *
+ * A route pattern is a path where:
+ *     "{name}" - matches a single path segment, captured as a parameter
+ *     "*"      - as the last segment, matches every remaining path,
+ *                captured as the "*" parameter
+ *
+ * When more routes match a path, the ones with literal segments win over
+ * the ones with parameters, which win over the wildcard ones.
+ */
+struct webrouter_t;
+
+/**
+ * Constants: webrouter_result
+ * WEBROUTER_FOUND - A route was found
+ * WEBROUTER_NOT_FOUND - No route matches the path
+ * WEBROUTER_METHOD_NOT_ALLOWED - The path matches, but not the method
+ */
+enum webrouter_result {
+    WEBROUTER_FOUND,
+    WEBROUTER_NOT_FOUND,
+    WEBROUTER_METHOD_NOT_ALLOWED
+};
+
+/**
+ * Function: webrouter_new
+ * Create a new empty router
+ */
+struct webrouter_t *webrouter_new( void );
+
+/**
+ * Function: webrouter_destroy
+ * Destroy the router. The route data are not owned by the router.
+ *
+ * Parameters:
+ *     self - The router (can be NULL)
+ */
+void webrouter_destroy( struct webrouter_t *self );
+
+/**
+ * Function: webrouter_add
+ * Add a route
+ *
+ * Parameters:
+ *     self - The router (not NULL)
+ *     method - The HTTP method, or NULL for every method
+ *     pattern - The route pattern, starting with "/" (not NULL)
+ *     data - The route data
+ * Returns:
+ *     LFALSE if the pattern is not valid
+ */
+lbool webrouter_add( struct webrouter_t *self, const char *method, const char *pattern, void *data );
+
+/**
+ * Function: webrouter_match
+ * Find the route of a request
+ *
+ * Parameters:
+ *     self - The router (not NULL)
+ *     method - The request method (not NULL)
+ *     path - The decoded request path (not NULL)
+ *     params - Where the captured parameters are stored as name and value
+ *         pairs. Can be NULL.
+ *     data - Where the data of the found route is stored (not NULL)
+ * Returns:
+ *     One of the <webrouter_result> constants
+ */
+enum webrouter_result webrouter_match( struct webrouter_t *self, const char *method, const char *path,
+    slist *params, void **data );
+
+/**
+ * Function: webrouter_allowed_methods_f
+ * Append to a string the comma separated list of the methods allowed on
+ * a path, as needed by the "Allow" header
+ *
+ * Parameters:
+ *     self - The router (not NULL)
+ *     dest - The destination string (not NULL)
+ *     path - The decoded request path (not NULL)
+ * Returns:
+ *     The destination string
+ */
+lstring *webrouter_allowed_methods_f( struct webrouter_t *self, lstring *dest, const char *path );
+
+#endif
@@ -29,116 +29,576 @@ For more information, please refer to <http://unlicense.org/>
 
 #include "third-party/mongoose.h"
 #include "webserver.h"
+#include "webrouter.h"
+#include "webevent.h"
+#include "webmetrics.h"
 #include "lstring.h"
 #include "lcross.h"
 #include "lmemory.h"
 #include "buffer.h"
+#include "lvector.h"
+#include "slist.h"
+#include "lhashtable.h"
+#include "threading.h"
 #include "llogging.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* The files sent are not inherited by the processes started by the
+ * handlers */
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#ifdef WEBSERVER_USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Maximum number of files whose validators are cached */
+#define MAX_FILE_INFO 4096
+
+/* Buffer used to send the files when sendfile can't be used */
+#define FILE_BUFFER_SIZE 65536
+
+/* Request bodies not read by the handlers are discarded up to this size
+ * to keep the connection alive, and the bigger ones close the connection */
+#define MAX_DISCARDED_BODY 65536
+
+/* Default maximum size of the request bodies */
+#define DEFAULT_MAX_BODY_SIZE (16*1024*1024)
+
+/* Size of the chunks used to read the request bodies */
+#define BODY_CHUNK_SIZE 16384
+
+/* Records of the access log waiting to be written: when the queue is
+ * full the records are dropped, so a slow stderr can't block the server */
+#define ACCESS_LOG_QUEUE_SIZE 4096
+#define ACCESS_LOG_RECORD_SIZE 512
+
+/* Seconds suggested to the clients rejected because of the load */
+#define OVERLOAD_RETRY_AFTER 1
+
+/* Default minimum size of the compressed responses */
+#define DEFAULT_COMPRESSION_MIN_SIZE 1024
+
+/* Content types compressed by default */
+static const char *default_compressible_types[] = {
+    "text/", "application/json", "application/javascript", "application/xml", "image/svg+xml", NULL
+};
+
+/* Response content encodings */
+enum webresp_encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE
+};
+
+/* A zlib stream kept between the responses, together with the buffer
+ * for the compressed data */
+struct webzstream_t {
+#ifdef WEBSERVER_USE_ZLIB
+    z_stream strm;
+#endif
+    enum webresp_encoding encoding;
+    unsigned char *out;
+    size_t outSize;
+    struct webzstream_t *next;
+};
+
+/* A part of the data sent by webresp_send */
+struct webresp_part_t {
+    const char *data;
+    size_t len;
+};
 
-#define MAX_RULES 1024
+/* The connection serving a request: it hides the engine, mongoose or
+ * the event-driven one, from the requests and the responses */
+struct webconn_t {
+    struct mg_connection *mg;
+    struct webevent_conn_t *ev;
+    struct mg_request_info *info;
+};
 
 struct rules_t {
-    lstring *uri;
     void *ctx;
     webservice_handler_t handler;
+    lstring *method;
+    lstring *pattern;
+    struct webmetrics_service_t *metrics;
+    int cache_ttl;
+
+    /* Admission control: no limit if max_concurrent is zero */
+    int max_concurrent;
+    int max_queue_millis;
+    int active;
+    lcom_cond_t *slot_freed;
+};
+
+enum webcache_state {
+    /* The response is being produced by a request, the others wait */
+    WEBCACHE_PENDING,
+    WEBCACHE_READY
+};
+
+/* A cached response */
+struct webcache_entry_t {
+    lstring *key;
+    enum webcache_state state;
+    /* The cache generation when the response was requested */
+    long long generation;
+    long long expires;
+    long long size;
+
+    int http_status;
+    lstring *http_status_desc;
+    lstring *content_type;
+    lbool content_type_set;
+    lstring *headers;
+    char *body;
+    int body_len;
+
+    /* Least recently used list, only for the ready entries */
+    struct webcache_entry_t *prev;
+    struct webcache_entry_t *next;
+};
+
+/* The cache of the responses of the GET services */
+struct webcache_t {
+    lcom_mutex_t *mutex;
+    lcom_cond_t *cond;
+    lhashtable *entries;
+    long long max_size;
+    long long size;
+    /* Most and least recently used entries */
+    struct webcache_entry_t *first;
+    struct webcache_entry_t *last;
+    /* Changed at every invalidation: the responses produced meanwhile
+     * are not stored */
+    long long generation;
+};
+
+/* The access log, written by its own thread */
+struct webaccesslog_t {
+    lcom_mutex_t *mutex;
+    lcom_cond_t *cond;
+    lcom_thread_t *thread;
+    char (*records)[ACCESS_LOG_RECORD_SIZE];
+    int first;
+    int count;
+    long long dropped;
+    lbool stopping;
+};
+
+/* The validators of a file sent by a service */
+struct webfile_info_t {
+    long long size;
+    long long mtime;
+    char etag[48];
+    char last_modified[48];
 };
 
 struct webserver_t {
+    enum webserver_engine engine;
     struct mg_context *ctx;
+    struct webevent_t *event;
     lstring *addr;
     lstring *docRoot;
     lstring *port;
     lstring *n_threads;
-
-    struct rules_t rules[MAX_RULES];
-    int rules_count;
+    lbool keep_alive;
+    lstring *request_timeout;
+    lstring *listen_backlog;
+
+    struct webrouter_t *router;
+    lvector *rules;
+
+    lhashtable *file_info;
+    lcom_mutex_t *file_info_mutex;
+
+    lbool compression;
+    int compression_level;
+    int compression_min_size;
+    slist *compressible_types;
+    struct webzstream_t *zstreams;
+    lcom_mutex_t *zstreams_mutex;
+
+    long long max_body_size;
+
+    struct webcache_t *cache;
+
+    /* Admission control, the counters are protected by admission_mutex */
+    lcom_mutex_t *admission_mutex;
+    lbool adaptive_limit;
+    double limit;
+    int min_limit;
+    int max_limit;
+    long long target_latency;
+    long long last_decrease;
+    int in_flight;
+
+    struct webmetrics_t *metrics;
+    lbool access_log_enabled;
+    struct webaccesslog_t *access_log;
 };
 
 struct webrequest_t {
-    struct mg_connection *conn;
+    struct webconn_t *conn;
     struct mg_request_info *info;
+    slist *pathParams;
+    slist *params;
+    lstring *body;
+    long long bodyRead;
 };
 
 struct webresponse_t {
-    struct mg_connection *conn;
+    struct webserver_t *server;
+    struct webconn_t *conn;
     int http_status;
     lstring *http_status_desc;
     lstring *content_type;
+    lbool content_type_set;
+    lstring *headers;
+    lstring *head;
     MemBuffer *buffer;
+
+    int file_fd;
+    long long file_offset;
+    long long file_len;
+    lbool file_whole;
+    struct webfile_info_t file_info;
+
+    int flush_threshold;
+    lbool headers_sent;
+    lbool chunked;
+    /* The client can't receive the rest of a streamed response */
+    lbool send_failed;
 };
 
+/* Connection {{{ */
+
+static const char *webconn_get_header( struct webconn_t *conn, const char *name ) {
+    if ( conn->mg!=NULL ) {
+        return mg_get_header( conn->mg, name );
+    } else {
+        return webevent_get_header( conn->ev, name );
+    }
+}
+
+static int webconn_read( struct webconn_t *conn, void *buf, size_t len ) {
+    if ( conn->mg!=NULL ) {
+        return mg_read( conn->mg, buf, len );
+    } else {
+        return webevent_read( conn->ev, buf, len );
+    }
+}
+
+static int webconn_write( struct webconn_t *conn, const void *buf, size_t len ) {
+    if ( conn->mg!=NULL ) {
+        return mg_write( conn->mg, buf, len );
+    } else {
+        return webevent_write( conn->ev, buf, len );
+    }
+}
+
+/* Get the socket, or -1 if the data must be written with webconn_write */
+static int webconn_get_socket( struct webconn_t *conn ) {
+    if ( conn->mg!=NULL ) {
+        return mg_get_socket( conn->mg );
+    } else {
+        return webevent_get_socket( conn->ev );
+    }
+}
+
+static lbool webconn_should_keep_alive( struct webconn_t *conn ) {
+    if ( conn->mg!=NULL ) {
+        return mg_should_keep_alive( conn->mg ) ? LTRUE : LFALSE;
+    } else {
+        return webevent_should_keep_alive( conn->ev );
+    }
+}
+
+static void webconn_set_must_close( struct webconn_t *conn ) {
+    if ( conn->mg!=NULL ) {
+        mg_set_must_close( conn->mg );
+    } else {
+        webevent_set_must_close( conn->ev );
+    }
+}
+
+/* }}} */
+
 /* WebRequest {{{ */
 
-struct webrequest_t *webreq_new( struct mg_connection *conn ) {
+struct webrequest_t *webreq_new( struct webconn_t *conn ) {
     struct webrequest_t *result = NULL;
 
     l_assert( conn!=NULL );
     
     result = (struct webrequest_t *)lmalloc(sizeof(struct webrequest_t));
     result->conn = conn;
-    result->info = mg_get_request_info( conn );
+    result->info = conn->info;
+    result->pathParams = slist_new( 0 );
+    result->params = NULL;
+    result->body = NULL;
+    result->bodyRead = 0;
 
     return result;
 }
 
 void webreq_destroy( struct webrequest_t *self ) {
     if ( self!=NULL ) {
+        slist_destroy( self->pathParams );
+        if ( self->params!=NULL ) slist_destroy( self->params );
+        if ( self->body!=NULL ) lstring_delete( self->body );
         lfree( self );
     }
 }
 
-lstring* webreq_get_param_f( struct webrequest_t *req, lstring *dest, const char *paramName ) {
-    char buffer[1024];
-    size_t bufferLen = 1024;
-    int status = 0;
+const char *webreq_get_path_param( struct webrequest_t *req, const char *paramName ) {
+    int i;
 
     l_assert( req!=NULL );
-    l_assert( dest!=NULL );
     l_assert( paramName!=NULL );
 
-    if ( req->info->query_string==NULL ) {
-        /* not found */
-        lstring_truncate( dest, 0 );
-        return NULL;
+    for ( i=0; i+1<slist_len( req->pathParams ); i+=2 ) {
+        if ( 0==strcmp( slist_at( req->pathParams, i ), paramName ) ) {
+            return slist_at( req->pathParams, i+1 );
+        }
     }
 
-    status = mg_get_var(req->info->query_string, strlen(req->info->query_string),
-               paramName, buffer, bufferLen);
-    if ( status==-1 ) {
-        /* not found */
-        lstring_truncate( dest, 0 );
-    } else if ( status==-2 ) {
-        /* no sufficient space */
-        lstring_truncate( dest, 0 );
+    return NULL;
+}
+
+const char *webreq_get_header( struct webrequest_t *req, const char *name ) {
+    l_assert( req!=NULL );
+    l_assert( name!=NULL );
+
+    return webconn_get_header( req->conn, name );
+}
+
+long long webreq_get_content_length( struct webrequest_t *req ) {
+    const char *contentLength;
+
+    l_assert( req!=NULL );
+
+    contentLength = webconn_get_header( req->conn, "Content-Length" );
+    if ( contentLength==NULL ) {
+        return -1;
     } else {
-        dest = lstring_from_cstr_f( dest, buffer );
+        return strtoll( contentLength, NULL, 10 );
+    }
+}
+
+int webreq_read_body( struct webrequest_t *req, void *buffer, int len, lerror **error ) {
+    int n;
+
+    l_assert( req!=NULL );
+    l_assert( buffer!=NULL );
+    l_assert( len>0 );
+    l_assert( error==NULL || *error==NULL );
+
+    if ( req->body!=NULL ) {
+        lerror_set( error, "The request body was already read" );
+        return -1;
+    }
+
+    n = webconn_read( req->conn, buffer, len );
+    if ( n<0 ) {
+        lerror_set_sprintf( error, "Error reading the request body: %s", strerror(errno) );
+        return -1;
     }
 
-	return dest;
+    req->bodyRead += n;
+    return n;
 }
 
-lbool webreq_has_param( struct webrequest_t *req, const char *paramName ) {
-    char buffer[1024];
-    size_t bufferLen = 1024;
-    int status = 0;
+const char *webreq_get_body( struct webrequest_t *req, int *len, lerror **error ) {
+    lstring *body;
+    long long contentLength;
+    char buffer[BODY_CHUNK_SIZE];
+    int n;
 
     l_assert( req!=NULL );
-    l_assert( paramName!=NULL );
+    l_assert( error==NULL || *error==NULL );
 
-    if ( req->info->query_string==NULL ) {
-        return LFALSE;
+    if ( req->body==NULL ) {
+        if ( req->bodyRead>0 ) {
+            lerror_set( error, "The request body was already read" );
+            return NULL;
+        }
+
+        /* The size was checked against the server limit before calling
+         * the handler */
+        contentLength = webreq_get_content_length( req );
+        body = lstring_new();
+        if ( contentLength>0 ) {
+            body = lstring_reserve_f( body, (int)contentLength+1 );
+        }
+
+        while ( (n = webconn_read( req->conn, buffer, sizeof(buffer) ))>0 ) {
+            body = lstring_append_generic_f( body, buffer, n );
+        }
+
+        if ( n<0 ) {
+            lerror_set_sprintf( error, "Error reading the request body: %s", strerror(errno) );
+            lstring_delete( body );
+            return NULL;
+        }
+
+        req->body = body;
+    }
+
+    if ( len!=NULL ) {
+        *len = lstring_len( req->body );
+    }
+    return req->body;
+}
+
+/* Decode a form-url-encoded string appending it to dest */
+static lstring *webreq_url_decode_f( lstring *dest, const char *src, size_t len ) {
+    size_t i;
+    char hex[3];
+
+    hex[2] = '\0';
+    for ( i=0; i<len; i++ ) {
+        if ( src[i]=='%' && i+2<len &&
+             isxdigit( (unsigned char)src[i+1] ) && isxdigit( (unsigned char)src[i+2] ) ) {
+            hex[0] = src[i+1];
+            hex[1] = src[i+2];
+            dest = lstring_append_char_f( dest, (char)strtol( hex, NULL, 16 ) );
+            i += 2;
+        } else if ( src[i]=='+' ) {
+            dest = lstring_append_char_f( dest, ' ' );
+        } else {
+            dest = lstring_append_char_f( dest, src[i] );
+        }
+    }
+
+    return dest;
+}
+
+/* Add the "name=value&..." parameters to the list of the request ones */
+static void webreq_parse_params( struct webrequest_t *req, const char *data, size_t len ) {
+    const char *end = data + len;
+    const char *next;
+    const char *equal;
+    lstring *name = lstring_new();
+    lstring *value = lstring_new();
+    int count;
+
+    while ( data<end ) {
+        next = (const char *)memchr( data, '&', end-data );
+        if ( next==NULL ) next = end;
+
+        equal = (const char *)memchr( data, '=', next-data );
+        if ( equal==NULL ) equal = next;
+
+        if ( equal>data ) {
+            lstring_reset( name );
+            lstring_reset( value );
+            name = webreq_url_decode_f( name, data, equal-data );
+            if ( equal<next ) {
+                value = webreq_url_decode_f( value, equal+1, next-equal-1 );
+            }
+
+            count = slist_len( req->params );
+            slist_resize( req->params, count+2 );
+            slist_set( req->params, count, name );
+            slist_set( req->params, count+1, value );
+        }
+
+        data = next+1;
+    }
+
+    lstring_delete( name );
+    lstring_delete( value );
+}
+
+/* Build the parameter list from the query string and, for the forms,
+ * from the request body */
+static void webreq_load_params( struct webrequest_t *req ) {
+    const char *contentType;
+    const char *body;
+    int bodyLen;
+    lerror *error = NULL;
+    lstring *msg;
+
+    if ( req->params!=NULL ) {
+        return;
+    }
+
+    req->params = slist_new( 0 );
+    if ( req->info->query_string!=NULL ) {
+        webreq_parse_params( req, req->info->query_string, strlen( req->info->query_string ) );
+    }
+
+    contentType = webconn_get_header( req->conn, "Content-Type" );
+    if ( contentType!=NULL && 0==l_strnicmp( contentType, "application/x-www-form-urlencoded", 33 ) ) {
+        body = webreq_get_body( req, &bodyLen, &error );
+        if ( body!=NULL ) {
+            webreq_parse_params( req, body, bodyLen );
+        } else {
+            msg = lstring_new();
+            msg = lerror_fill_f( error, msg );
+            l_error( "Can't read the form of %s: %s", req->info->uri, msg );
+            lstring_delete( msg );
+            lerror_delete( &error );
+        }
+    }
+}
+
+static const char *webreq_find_param( struct webrequest_t *req, const char *paramName ) {
+    int i;
+
+    webreq_load_params( req );
+    for ( i=0; i+1<slist_len( req->params ); i+=2 ) {
+        if ( 0==l_stricmp( slist_at( req->params, i ), paramName ) ) {
+            return slist_at( req->params, i+1 );
+        }
     }
 
-    status = mg_get_var(req->info->query_string, strlen(req->info->query_string),
-               paramName, buffer, bufferLen);
-    if ( status==-1 ) {
-	return LFALSE;
+    return NULL;
+}
+
+lstring* webreq_get_param_f( struct webrequest_t *req, lstring *dest, const char *paramName ) {
+    const char *value;
+
+    l_assert( req!=NULL );
+    l_assert( dest!=NULL );
+    l_assert( paramName!=NULL );
+
+    value = webreq_find_param( req, paramName );
+    if ( value==NULL ) {
+        /* not found */
+        lstring_truncate( dest, 0 );
     } else {
-	return LTRUE;
+        dest = lstring_from_cstr_f( dest, value );
     }
+
+    return dest;
+}
+
+lbool webreq_has_param( struct webrequest_t *req, const char *paramName ) {
+    l_assert( req!=NULL );
+    l_assert( paramName!=NULL );
+
+    return webreq_find_param( req, paramName )!=NULL;
 }
 
 lstring *webreq_get_required_param_f(struct webrequest_t *req, lstring *dest, const char *paramName, lerror **error) {
@@ -161,25 +621,37 @@ lstring *webreq_get_required_param_f(struct webrequest_t *req, lstring *dest, co
 
 /* WebResponse {{{ */
 
-struct webresponse_t *webresp_new( struct mg_connection *conn ) {
+struct webresponse_t *webresp_new( struct webserver_t *server, struct webconn_t *conn ) {
     struct webresponse_t *result = NULL;
 
     l_assert( conn!=NULL );
     
     result = (struct webresponse_t *)lmalloc(sizeof(struct webresponse_t));
+    result->server = server;
     result->conn = conn;
     result->http_status = 200;
     result->http_status_desc = lstring_new_from_cstr( "OK" );
     result->content_type = lstring_new_from_cstr( "text/plain" );
+    result->content_type_set = LFALSE;
+    result->headers = lstring_new();
+    result->head = lstring_new();
     result->buffer = MemBuffer_new( 1024 );
+    result->file_fd = -1;
+    result->flush_threshold = 0;
+    result->headers_sent = LFALSE;
+    result->chunked = LFALSE;
+    result->send_failed = LFALSE;
 
     return result;
 }
 
 void webresp_destroy( struct webresponse_t *self ) {
     if ( self!=NULL ) {
+        if ( self->file_fd>=0 ) close( self->file_fd );
         lstring_delete( self->http_status_desc );
         lstring_delete( self->content_type );
+        lstring_delete( self->headers );
+        lstring_delete( self->head );
         MemBuffer_destroy( self->buffer );
         lfree( self );
     }
@@ -204,161 +676,1687 @@ void webresp_set_content_type( struct webresponse_t *self, const char *content_t
     l_assert( self!=NULL );
     l_assert( content_type!=NULL && content_type!=NULL );
     self->content_type = lstring_from_cstr_f( self->content_type, content_type );
+    self->content_type_set = LTRUE;
+}
+
+void webresp_add_header( struct webresponse_t *self, const char *name, const char *value ) {
+    l_assert( self!=NULL );
+    l_assert( name!=NULL && value!=NULL );
+    l_assert( !self->headers_sent );
+
+    if ( *name=='\0' || strpbrk( name, ":\r\n" )!=NULL || strpbrk( value, "\r\n" )!=NULL ) {
+        l_error( "Invalid response header %s", name );
+        return;
+    }
+
+    self->headers = lstring_append_cstr_f( self->headers, name );
+    self->headers = lstring_append_cstr_f( self->headers, ": " );
+    self->headers = lstring_append_cstr_f( self->headers, value );
+    self->headers = lstring_append_cstr_f( self->headers, "\r\n" );
+}
+
+/* Format the status line and the headers in the head buffer */
+static void webresp_format_head( struct webresponse_t *conn, long long contentLength, const char *extra ) {
+    lstring_reset( conn->head );
+    conn->head = lstring_append_sprintf_f( conn->head, 
+        "HTTP/1.1 %i %s\r\n"
+        "Content-Type: %s\r\n",
+        conn->http_status, conn->http_status_desc, conn->content_type );
+    if ( contentLength>=0 ) {
+        conn->head = lstring_append_sprintf_f( conn->head, "Content-Length: %lld\r\n", contentLength );
+    }
+    conn->head = lstring_append_cstr_f( conn->head, 
+        webconn_should_keep_alive( conn->conn ) ? "Connection: keep-alive\r\n" : "Connection: close\r\n" );
+    conn->head = lstring_append_cstr_f( conn->head, extra );
+    conn->head = lstring_append_lstring_f( conn->head, conn->headers );
+    conn->head = lstring_append_cstr_f( conn->head, "\r\n" );
+}
+
+/* Send some buffers to the client, with a single system call when the
+ * connection socket can be used directly */
+static lbool webresp_send( struct webresponse_t *conn, struct webresp_part_t *parts, int count ) {
+    int i;
+#ifndef _WIN32
+    struct iovec iov[4];
+    int sock = webconn_get_socket( conn->conn );
+    int first = 0;
+    ssize_t n;
+
+    l_assert( count<=4 );
+
+    if ( sock>=0 ) {
+        for ( i=0; i<count; i++ ) {
+            iov[i].iov_base = (void *)parts[i].data;
+            iov[i].iov_len = parts[i].len;
+        }
+
+        while ( first<count ) {
+            if ( iov[first].iov_len==0 ) {
+                first++;
+                continue;
+            }
+
+            n = writev( sock, iov+first, count-first );
+            if ( n<0 && errno==EINTR ) continue;
+            if ( n<=0 ) return LFALSE;
+
+            while ( first<count && (size_t)n>=iov[first].iov_len ) {
+                n -= iov[first].iov_len;
+                iov[first].iov_len = 0;
+                first++;
+            }
+            if ( first<count ) {
+                iov[first].iov_base = (char *)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+            }
+        }
+        return LTRUE;
+    }
+#endif
+
+    for ( i=0; i<count; i++ ) {
+        if ( parts[i].len>0 && webconn_write( conn->conn, parts[i].data, parts[i].len )!=(int)parts[i].len ) {
+            return LFALSE;
+        }
+    }
+    return LTRUE;
 }
 
 void webresp_write_text( struct webresponse_t *conn, const char *txt )
 {
     l_assert( conn!=NULL && txt!=NULL );
-    MemBuffer_write( conn->buffer, (void *)txt, strlen(txt) );
+    webresp_write_text_len( conn, txt, strlen(txt) );
 }
 
 void webresp_write_lstring( struct webresponse_t *conn, lstring *txt ) 
 {
     l_assert( conn!=NULL && txt!=NULL );
-    MemBuffer_write( conn->buffer, (void *)txt, lstring_len(txt) );
+    webresp_write_text_len( conn, txt, lstring_len(txt) );
 }
 
 void webresp_write_text_len( struct webresponse_t *conn, const char *txt, int len )
 {
     l_assert( conn!=NULL && txt!=NULL );
     MemBuffer_write( conn->buffer, (void *)txt, len );
+
+    if ( conn->flush_threshold>0 && MemBuffer_len(conn->buffer)>=conn->flush_threshold ) {
+        webresp_flush( conn );
+    }
 }
 
-static void webresp_commit( struct webresponse_t *conn ) 
+void webresp_enable_streaming( struct webresponse_t *self, int flushThreshold )
 {
-    l_assert( conn!=NULL );
-    mg_printf(conn->conn,
-               "HTTP/1.1 %i %s\r\n"
-               "Content-Type: %s\r\n"
-               "Content-Length: %d\r\n" // Always set Content-Length
-               "\r\n",
-               conn->http_status, conn->http_status_desc, 
-               conn->content_type, 
-               MemBuffer_len(conn->buffer)); 
-    mg_write(conn->conn, MemBuffer_address(conn->buffer), MemBuffer_len(conn->buffer));
+    l_assert( self!=NULL );
+    l_assert( flushThreshold>0 );
+    self->flush_threshold = flushThreshold;
 }
 
-/* }}} */
-
-
-/* Web server and framework {{{ */
+/* The responses to the HEAD requests have the headers of the GET
+ * response, but no body */
+static lbool webresp_omits_body( struct webresponse_t *conn ) {
+    return 0==strcmp( conn->conn->info->request_method, "HEAD" );
+}
 
-struct webserver_t *webserver_new( const char *address, const char *port, int n_threads, const char *docRoot ) {
-    struct webserver_t *result = (struct webserver_t *)lmalloc(sizeof(struct webserver_t) );
+/* Send the buffered data of a streamed response, preceded by the status
+ * line and the headers the first time. HTTP/1.1 clients get a chunked
+ * body, the older ones a body delimited by the connection close. After
+ * a send error the data is discarded and the connection is closed. */
+lbool webresp_flush( struct webresponse_t *conn )
+{
+    struct webresp_part_t parts[4];
+    char chunkHeader[16];
+    int count = 0;
+    const char *version;
 
-    l_assert( address!=NULL );
-    l_assert( port!=NULL );
-    l_assert( docRoot!=NULL );
+    l_assert( conn!=NULL );
 
-    result->ctx = NULL;
-    result->addr = lstring_new_from_cstr( address );
-    result->docRoot = lstring_new_from_cstr( docRoot );
-    result->port = lstring_new_from_cstr( port );
-    result->rules_count = 0;
-    result->n_threads = lstring_new();
-    result->n_threads = lstring_append_sprintf_f( result->n_threads, "%i", n_threads);
+    if ( conn->flush_threshold<=0 ) {
+        /* buffered mode */
+        return LTRUE;
+    }
 
-    return result;
-}
+    if ( conn->send_failed ) {
+        MemBuffer_setlen( conn->buffer, 0 );
+        return LFALSE;
+    }
 
-static int handle_rule( struct webserver_t *self, struct rules_t *rule, struct mg_connection *conn ) {
-    struct webresponse_t *webresp;
-    struct webrequest_t *webreq;
-    lerror *my_error = NULL;
-    lstring *data = NULL;
+    if ( !conn->headers_sent ) {
+        version = conn->conn->info->http_version;
+        conn->chunked = version!=NULL && 0==strcmp( version, "1.1" );
+        if ( !conn->chunked ) {
+            webconn_set_must_close( conn->conn );
+        }
 
-    l_assert( self!=NULL );
-    l_assert( rule!=NULL );
-    l_assert( conn!=NULL );
+        webresp_format_head( conn, -1, conn->chunked ? "Transfer-Encoding: chunked\r\n" : "" );
+        parts[count].data = conn->head;
+        parts[count].len = lstring_len( conn->head );
+        count++;
+        conn->headers_sent = LTRUE;
+    }
 
-    webresp = webresp_new( conn );
-    webreq = webreq_new( conn );
+    if ( MemBuffer_len(conn->buffer)>0 && !webresp_omits_body( conn ) ) {
+        if ( conn->chunked ) {
+            snprintf( chunkHeader, sizeof(chunkHeader), "%x\r\n", MemBuffer_len(conn->buffer) );
+            parts[count].data = chunkHeader;
+            parts[count].len = strlen( chunkHeader );
+            count++;
+        }
 
-    rule->handler( rule->ctx, webreq, webresp, &my_error );
-    if ( my_error!=NULL ) {
-        data = lstring_new();
-        data = lerror_fill_f( my_error, data );
+        parts[count].data = MemBuffer_address(conn->buffer);
+        parts[count].len = MemBuffer_len(conn->buffer);
+        count++;
 
-        webresp_write_lstring( webresp, data );
-        webresp_set_http_status( webresp, 500 );
-        webresp_set_http_status_description( webresp, "Internal Error" );
-        lerror_delete( &my_error );
+        if ( conn->chunked ) {
+            parts[count].data = "\r\n";
+            parts[count].len = 2;
+            count++;
+        }
     }
 
-    webresp_commit( webresp );
-
-    webreq_destroy( webreq );
-    webresp_destroy( webresp );
+    if ( !webresp_send( conn, parts, count ) ) {
+        conn->send_failed = LTRUE;
+        webconn_set_must_close( conn->conn );
+    }
+    MemBuffer_setlen( conn->buffer, 0 );
 
-    return 1;
+    return !conn->send_failed;
 }
 
-static int request_handler( struct mg_connection *conn ) {
-    struct mg_request_info *info = mg_get_request_info(conn);
-    struct webserver_t *self = (struct webserver_t *)(info->user_data);
-    int i = 0;
+/* File responses {{{ */
 
-    lstring *buffer = lstring_new();
-    buffer = lstring_append_sprintf_f(buffer, "%s %s [%s]", info->request_method, info->uri, info->query_string);
-    l_info("%s", buffer);
-    lstring_delete(buffer);
+static void webfile_info_compute( struct webfile_info_t *info, struct stat *st ) {
+    time_t mtime = st->st_mtime;
+    struct tm tm;
 
-    l_assert( self!=NULL );
+#ifdef _WIN32
+    gmtime_s( &tm, &mtime );
+#else
+    gmtime_r( &mtime, &tm );
+#endif
+
+    info->size = (long long)st->st_size;
+    info->mtime = (long long)st->st_mtime;
+    snprintf( info->etag, sizeof(info->etag), "\"%llx-%llx\"", info->mtime, info->size );
+    strftime( info->last_modified, sizeof(info->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm );
+}
 
-    for ( i=0; i<self->rules_count; i++ ) {
-        if ( 0==strcmp( info->uri, self->rules[i].uri) ) {
-            return handle_rule( self, &self->rules[i], conn );
+/* Get the validators of a file from the cache, computing them when
+ * the file is new or was changed */
+static void webserver_file_info( struct webserver_t *self, const char *path, struct stat *st, struct webfile_info_t *dest ) {
+    struct webfile_info_t *info;
+
+    lcom_mutex_lock( self->file_info_mutex );
+
+    info = (struct webfile_info_t *)lhashtable_get( self->file_info, path );
+    if ( info==NULL || info->size!=(long long)st->st_size || info->mtime!=(long long)st->st_mtime ) {
+        if ( info==NULL ) {
+            if ( lhashtable_len( self->file_info )>=MAX_FILE_INFO ) {
+                lhashtable_clear( self->file_info );
+            }
+            info = (struct webfile_info_t *)lmalloc( sizeof(struct webfile_info_t) );
+            lhashtable_put( self->file_info, path, info );
         }
+        webfile_info_compute( info, st );
     }
+    memcpy( dest, info, sizeof(struct webfile_info_t) );
 
-    return 0;
+    lcom_mutex_unlock( self->file_info_mutex );
 }
 
-void webserver_start( struct webserver_t *self, lerror **error ) {
-    const char *options[] = {
-        "document_root", self->docRoot,
-        "listening_ports", self->port, 
-        "num_threads", self->n_threads,
-        NULL
-    };
+static void webresp_discard_file( struct webresponse_t *self ) {
+    if ( self->file_fd>=0 ) {
+        close( self->file_fd );
+        self->file_fd = -1;
+    }
+}
 
-    struct mg_callbacks callbacks;
+static void webresp_set_file( struct webresponse_t *self, int fd, struct stat *st, long long offset, long long len ) {
+    webresp_discard_file( self );
+    MemBuffer_setlen( self->buffer, 0 );
 
-    memset( &callbacks, 0, sizeof(struct mg_callbacks) );
-    callbacks.begin_request = request_handler;
+    if ( offset<0 ) offset = 0;
+    if ( offset>(long long)st->st_size ) offset = (long long)st->st_size;
+    if ( len<0 || offset+len>(long long)st->st_size ) len = (long long)st->st_size - offset;
+
+    self->file_fd = fd;
+    self->file_offset = offset;
+    self->file_len = len;
+    self->file_whole = offset==0 && len==(long long)st->st_size;
+}
+
+lbool webresp_send_file( struct webresponse_t *self, const char *path, long long offset, long long len ) {
+    struct stat st;
+    int fd;
 
     l_assert( self!=NULL );
-    l_assert( error==NULL || (*error)==NULL );
+    l_assert( path!=NULL );
+    l_assert( !self->headers_sent );
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd<0 || fstat( fd, &st )!=0 || !S_ISREG(st.st_mode) ) {
+        if ( fd>=0 ) close( fd );
+        webresp_set_http_status( self, 404 );
+        webresp_set_http_status_description( self, "Not Found" );
+        return LFALSE;
+    }
 
-    self->ctx = mg_start( &callbacks, self, options );
-    if ( self->ctx==NULL ) {
-        lerror_set( error, "Can't start the web server." );
-        return;
+    if ( !self->content_type_set ) {
+        self->content_type = lstring_from_cstr_f( self->content_type, mg_get_builtin_mime_type( path ) );
     }
+
+    webserver_file_info( self->server, path, &st, &self->file_info );
+    webresp_set_file( self, fd, &st, offset, len );
+    return LTRUE;
 }
 
-void webserver_destroy( struct webserver_t *self ) {
+lbool webresp_send_fd( struct webresponse_t *self, int fd, long long offset, long long len ) {
+    struct stat st;
+
     l_assert( self!=NULL );
+    l_assert( fd>=0 );
+    l_assert( !self->headers_sent );
 
-    if ( self->ctx ) mg_stop( self->ctx );
-    self->ctx = NULL;
-    lstring_delete( self->addr );
-    lstring_delete( self->docRoot );
-    lstring_delete( self->port );
-    lfree( self );
+    if ( fstat( fd, &st )!=0 ) {
+        close( fd );
+        return LFALSE;
+    }
+
+    webfile_info_compute( &self->file_info, &st );
+    webresp_set_file( self, fd, &st, offset, len );
+    return LTRUE;
 }
 
-void webserver_add_service( struct webserver_t *self, const char *uri, webservice_handler_t handler, void *ctx ) {
-    l_assert( self!=NULL );
-    l_assert( uri!=NULL );
-    l_assert( handler!=NULL );
+/* Parse a single "bytes=" range. Returns 1 if the range is valid, 0 if
+ * it must be ignored and -1 if it can't be satisfied. */
+static int webresp_parse_range( const char *header, long long size, long long *start, long long *len ) {
+    long long first = -1, last = -1;
+    char *end;
+
+    if ( 0!=strncmp( header, "bytes=", 6 ) || strchr( header, ',' )!=NULL ) {
+        return 0;
+    }
+    header += 6;
+
+    if ( *header=='-' ) {
+        /* the suffix of the file */
+        last = strtoll( header+1, &end, 10 );
+        if ( end==header+1 || *end!='\0' ) return 0;
+        if ( last<=0 ) return -1;
+        if ( last>size ) last = size;
+        *start = size - last;
+        *len = last;
+        return 1;
+    }
 
-    if ( self->rules_count>=MAX_RULES ) return;
-    self->rules[ self->rules_count ].ctx = ctx;
-    self->rules[ self->rules_count ].uri = lstring_new_from_cstr( uri );
-    self->rules[ self->rules_count ].handler = handler;
+    first = strtoll( header, &end, 10 );
+    if ( end==header || *end!='-' ) return 0;
+    header = end+1;
+    if ( *header!='\0' ) {
+        last = strtoll( header, &end, 10 );
+        if ( *end!='\0' || last<first ) return 0;
+    }
+
+    if ( first>=size ) return -1;
+    if ( last<0 || last>=size ) last = size-1;
+
+    *start = first;
+    *len = last - first + 1;
+    return 1;
+}
+
+/* Send part of the file with sendfile when the connection allows it,
+ * and through a buffer otherwise */
+static lbool webresp_send_file_data( struct webresponse_t *conn, long long offset, long long len ) {
+    char *buffer;
+    int n;
+
+#ifdef __linux__
+    int sock = webconn_get_socket( conn->conn );
+    off_t off = (off_t)offset;
+    ssize_t sent;
+
+    if ( sock>=0 ) {
+        while ( len>0 ) {
+            sent = sendfile( sock, conn->file_fd, &off, len>0x40000000 ? 0x40000000 : (size_t)len );
+            if ( sent<0 && errno==EINTR ) continue;
+            if ( sent<=0 ) return LFALSE;
+            len -= sent;
+        }
+        return LTRUE;
+    }
+#endif
+
+    if ( lseek( conn->file_fd, offset, SEEK_SET )<0 ) {
+        return LFALSE;
+    }
+
+    buffer = (char *)lmalloc( FILE_BUFFER_SIZE );
+    while ( len>0 ) {
+        n = read( conn->file_fd, buffer, len>FILE_BUFFER_SIZE ? FILE_BUFFER_SIZE : (int)len );
+        if ( n<=0 || webconn_write( conn->conn, buffer, n )!=n ) {
+            break;
+        }
+        len -= n;
+    }
+    lfree( buffer );
+
+    return len==0;
+}
+
+static void webresp_commit_file( struct webresponse_t *conn ) {
+    struct mg_request_info *info = conn->conn->info;
+    const char *ifNoneMatch = webconn_get_header( conn->conn, "If-None-Match" );
+    const char *ifModifiedSince = webconn_get_header( conn->conn, "If-Modified-Since" );
+    const char *range = webconn_get_header( conn->conn, "Range" );
+    long long start = conn->file_offset;
+    long long len = conn->file_len;
+    char contentRange[96] = "";
+    char validators[256];
+    struct webresp_part_t part;
+    lbool sendBody = LTRUE;
+
+    if ( conn->http_status==200 && conn->file_whole ) {
+        if ( (ifNoneMatch!=NULL && (0==strcmp( ifNoneMatch, "*" ) || strstr( ifNoneMatch, conn->file_info.etag )!=NULL)) ||
+             (ifNoneMatch==NULL && ifModifiedSince!=NULL && 0==strcmp( ifModifiedSince, conn->file_info.last_modified )) ) {
+            webresp_set_http_status( conn, 304 );
+            webresp_set_http_status_description( conn, "Not Modified" );
+            sendBody = LFALSE;
+            len = 0;
+        } else if ( range!=NULL ) {
+            switch ( webresp_parse_range( range, conn->file_info.size, &start, &len ) ) {
+            case 1:
+                webresp_set_http_status( conn, 206 );
+                webresp_set_http_status_description( conn, "Partial Content" );
+                snprintf( contentRange, sizeof(contentRange), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                    start, start+len-1, conn->file_info.size );
+                break;
+            case -1:
+                webresp_set_http_status( conn, 416 );
+                webresp_set_http_status_description( conn, "Requested Range Not Satisfiable" );
+                snprintf( contentRange, sizeof(contentRange), "Content-Range: bytes */%lld\r\n", conn->file_info.size );
+                sendBody = LFALSE;
+                len = 0;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    snprintf( validators, sizeof(validators), "%sETag: %s\r\nLast-Modified: %s\r\n%s",
+        conn->file_whole ? "Accept-Ranges: bytes\r\n" : "",
+        conn->file_info.etag, conn->file_info.last_modified, contentRange );
+
+    /* a 304 has no body, and its Content-Length would describe the
+     * representation it refers to */
+    webresp_format_head( conn, conn->http_status==304 ? -1 : len, validators );
+    part.data = conn->head;
+    part.len = lstring_len( conn->head );
+    webresp_send( conn, &part, 1 );
+
+    if ( sendBody && len>0 && !webresp_omits_body( conn ) ) {
+        if ( !webresp_send_file_data( conn, start, len ) ) {
+            l_error( "Error sending %s: %s", info->uri, strerror(errno) );
+        }
+    }
+
+    webresp_discard_file( conn );
+}
+
+/* }}} */
+
+/* Response compression {{{ */
+
+/* Check if the client accepts an encoding, reading the Accept-Encoding
+ * header. The encodings with "q=0" are refused and an explicit entry
+ * has the precedence over "*". */
+static lbool webresp_accepts_encoding( const char *acceptEncoding, const char *encoding ) {
+    const char *token = acceptEncoding;
+    const char *end;
+    const char *params;
+    const char *quality;
+    size_t tokenLen;
+    size_t encodingLen = strlen( encoding );
+    int explicitAccepted = -1;
+    int starAccepted = -1;
+    int accepted;
+
+    while ( *token!='\0' ) {
+        while ( *token==' ' || *token==',' ) token++;
+
+        end = strchr( token, ',' );
+        if ( end==NULL ) end = token + strlen( token );
+
+        params = (const char *)memchr( token, ';', end-token );
+        tokenLen = (params!=NULL ? params : end) - token;
+        while ( tokenLen>0 && token[tokenLen-1]==' ' ) tokenLen--;
+
+        accepted = 1;
+        if ( params!=NULL ) {
+            quality = strstr( params, "q=" );
+            if ( quality!=NULL && quality<end && atof( quality+2 )<=0 ) {
+                accepted = 0;
+            }
+        }
+
+        if ( tokenLen==encodingLen && 0==l_strnicmp( token, encoding, (int)tokenLen ) ) {
+            explicitAccepted = accepted;
+        } else if ( tokenLen==1 && token[0]=='*' ) {
+            starAccepted = accepted;
+        }
+
+        token = end;
+    }
+
+    return explicitAccepted>=0 ? explicitAccepted==1 : starAccepted==1;
+}
+
+static lbool webresp_is_compressible( struct webserver_t *server, const char *contentType ) {
+    int i;
+    const char *type;
+
+    for ( i=0; i<slist_len( server->compressible_types ); i++ ) {
+        type = slist_at( server->compressible_types, i );
+        if ( 0==l_strnicmp( contentType, type, (int)strlen( type ) ) ) {
+            return LTRUE;
+        }
+    }
+
+    return LFALSE;
+}
+
+/* Choose the encoding of a buffered response */
+static enum webresp_encoding webresp_choose_encoding( struct webresponse_t *conn ) {
+    const char *acceptEncoding;
+
+    if ( !conn->server->compression || !webresp_is_compressible( conn->server, conn->content_type ) ) {
+        return ENCODING_IDENTITY;
+    }
+
+    /* The response depends on the request headers even if it's not compressed */
+    conn->headers = lstring_append_cstr_f( conn->headers, "Vary: Accept-Encoding\r\n" );
+
+    acceptEncoding = webconn_get_header( conn->conn, "Accept-Encoding" );
+    if ( acceptEncoding==NULL || MemBuffer_len( conn->buffer )<conn->server->compression_min_size ) {
+        return ENCODING_IDENTITY;
+    } else if ( webresp_accepts_encoding( acceptEncoding, "gzip" ) ) {
+        return ENCODING_GZIP;
+    } else if ( webresp_accepts_encoding( acceptEncoding, "deflate" ) ) {
+        return ENCODING_DEFLATE;
+    } else {
+        return ENCODING_IDENTITY;
+    }
+}
+
+static void webzstream_destroy( struct webzstream_t *self ) {
+#ifdef WEBSERVER_USE_ZLIB
+    deflateEnd( &self->strm );
+#endif
+    lfree( self->out );
+    lfree( self );
+}
+
+#ifdef WEBSERVER_USE_ZLIB
+
+/* Take a compression stream from the server pool, creating it if there isn't one */
+static struct webzstream_t *webzstream_acquire( struct webserver_t *server, enum webresp_encoding encoding ) {
+    struct webzstream_t *result = NULL;
+    struct webzstream_t **prev;
+
+    lcom_mutex_lock( server->zstreams_mutex );
+    for ( prev = &server->zstreams; *prev!=NULL; prev = &(*prev)->next ) {
+        if ( (*prev)->encoding==encoding ) {
+            result = *prev;
+            *prev = result->next;
+            break;
+        }
+    }
+    lcom_mutex_unlock( server->zstreams_mutex );
+
+    if ( result!=NULL ) {
+        deflateReset( &result->strm );
+        return result;
+    }
+
+    result = (struct webzstream_t *)lmalloc( sizeof(struct webzstream_t) );
+    memset( &result->strm, 0, sizeof(z_stream) );
+    /* 15 bits of window for the zlib format, 15+16 for the gzip one */
+    if ( Z_OK!=deflateInit2( &result->strm, server->compression_level, Z_DEFLATED,
+                             encoding==ENCODING_GZIP ? 31 : 15, 8, Z_DEFAULT_STRATEGY ) ) {
+        lfree( result );
+        return NULL;
+    }
+    result->encoding = encoding;
+    result->out = NULL;
+    result->outSize = 0;
+    result->next = NULL;
+
+    return result;
+}
+
+static void webzstream_release( struct webserver_t *server, struct webzstream_t *self ) {
+    lcom_mutex_lock( server->zstreams_mutex );
+    self->next = server->zstreams;
+    server->zstreams = self;
+    lcom_mutex_unlock( server->zstreams_mutex );
+}
+
+/* Compress a buffer in the stream output. Returns the compressed size
+ * or 0 if the compressed data isn't smaller than the original one. */
+static size_t webzstream_compress( struct webzstream_t *self, const char *data, size_t len ) {
+    size_t bound = deflateBound( &self->strm, (uLong)len );
+
+    if ( self->outSize<bound ) {
+        lfree( self->out );
+        self->out = (unsigned char *)lmalloc( bound );
+        self->outSize = bound;
+    }
+
+    self->strm.next_in = (Bytef *)data;
+    self->strm.avail_in = (uInt)len;
+    self->strm.next_out = self->out;
+    self->strm.avail_out = (uInt)self->outSize;
+
+    if ( Z_STREAM_END!=deflate( &self->strm, Z_FINISH ) || self->strm.total_out>=len ) {
+        return 0;
+    }
+
+    return self->strm.total_out;
+}
+
+#endif
+
+/* Send a buffered response compressing the body. Returns LFALSE if the
+ * response must be sent as is. */
+static lbool webresp_commit_compressed( struct webresponse_t *conn, enum webresp_encoding encoding ) {
+#ifdef WEBSERVER_USE_ZLIB
+    struct webzstream_t *zstream = webzstream_acquire( conn->server, encoding );
+    struct webresp_part_t parts[2];
+    size_t len;
+
+    if ( zstream==NULL ) {
+        return LFALSE;
+    }
+
+    len = webzstream_compress( zstream, MemBuffer_address( conn->buffer ), MemBuffer_len( conn->buffer ) );
+    if ( len>0 ) {
+        webresp_format_head( conn, (long long)len,
+            encoding==ENCODING_GZIP ? "Content-Encoding: gzip\r\n" : "Content-Encoding: deflate\r\n" );
+        parts[0].data = conn->head;
+        parts[0].len = lstring_len( conn->head );
+        parts[1].data = (const char *)zstream->out;
+        parts[1].len = len;
+        webresp_send( conn, parts, webresp_omits_body( conn ) ? 1 : 2 );
+    }
+
+    webzstream_release( conn->server, zstream );
+    return len>0;
+#else
+    return LFALSE;
+#endif
+}
+
+/* }}} */
+
+static void webresp_commit( struct webresponse_t *conn ) 
+{
+    struct webresp_part_t parts[2];
+    enum webresp_encoding encoding;
+
+    l_assert( conn!=NULL );
+
+    if ( conn->file_fd>=0 ) {
+        webresp_commit_file( conn );
+        return;
+    }
+
+    if ( conn->headers_sent ) {
+        if ( webresp_flush( conn ) && conn->chunked && !webresp_omits_body( conn ) ) {
+            parts[0].data = "0\r\n\r\n";
+            parts[0].len = 5;
+            webresp_send( conn, parts, 1 );
+        }
+        return;
+    }
+
+    encoding = webresp_choose_encoding( conn );
+    if ( encoding!=ENCODING_IDENTITY && webresp_commit_compressed( conn, encoding ) ) {
+        return;
+    }
+
+    webresp_format_head( conn, MemBuffer_len(conn->buffer), "" );
+    parts[0].data = conn->head;
+    parts[0].len = lstring_len( conn->head );
+    parts[1].data = MemBuffer_address(conn->buffer);
+    parts[1].len = MemBuffer_len(conn->buffer);
+    webresp_send( conn, parts, webresp_omits_body( conn ) ? 1 : 2 );
+}
+
+/* }}} */
+
+
+/* Response cache {{{ */
+
+static void webcache_entry_destroy( void *ptr ) {
+    struct webcache_entry_t *self = (struct webcache_entry_t *)ptr;
+
+    lstring_delete( self->key );
+    lstring_delete( self->http_status_desc );
+    lstring_delete( self->content_type );
+    lstring_delete( self->headers );
+    lfree( self->body );
+    lfree( self );
+}
+
+static struct webcache_t *webcache_new( long long maxSize ) {
+    struct webcache_t *self = (struct webcache_t *)lmalloc( sizeof(struct webcache_t) );
+
+    self->mutex = lcom_mutex_new();
+    self->cond = lcom_cond_new();
+    self->entries = lhashtable_new( webcache_entry_destroy );
+    self->max_size = maxSize;
+    self->size = 0;
+    self->first = NULL;
+    self->last = NULL;
+    self->generation = 0;
+
+    return self;
+}
+
+static void webcache_destroy( struct webcache_t *self ) {
+    if ( self==NULL ) return;
+
+    lhashtable_destroy( self->entries );
+    lcom_cond_destroy( self->cond );
+    lcom_mutex_destroy( self->mutex );
+    lfree( self );
+}
+
+static int webcache_compare_params( const void *a, const void *b ) {
+    return strcmp( *(const char **)a, *(const char **)b );
+}
+
+/* The cache key: the path and the query string with the parameters
+ * sorted, so their order doesn't matter */
+static lstring *webcache_key_f( lstring *dest, const char *uri, const char *queryString ) {
+    lstring *query;
+    char **params;
+    char *p;
+    char *end;
+    int count = 0;
+    int i;
+
+    dest = lstring_append_cstr_f( dest, uri );
+    if ( queryString==NULL || queryString[0]=='\0' ) {
+        return dest;
+    }
+
+    query = lstring_new_from_cstr( queryString );
+    params = (char **)lmalloc( sizeof(char *) * (lstring_len( query )/2+1) );
+    for ( p=query; *p!='\0'; p=end ) {
+        end = strchr( p, '&' );
+        if ( end==NULL ) {
+            end = p+strlen( p );
+        } else {
+            *end++ = '\0';
+        }
+        if ( *p!='\0' ) params[count++] = p;
+    }
+    qsort( params, count, sizeof(char *), webcache_compare_params );
+
+    for ( i=0; i<count; i++ ) {
+        dest = lstring_append_char_f( dest, i==0 ? '?' : '&' );
+        dest = lstring_append_cstr_f( dest, params[i] );
+    }
+
+    lfree( params );
+    lstring_delete( query );
+    return dest;
+}
+
+static void webcache_unlink( struct webcache_t *self, struct webcache_entry_t *entry ) {
+    if ( entry->prev!=NULL ) entry->prev->next = entry->next;
+    else self->first = entry->next;
+    if ( entry->next!=NULL ) entry->next->prev = entry->prev;
+    else self->last = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void webcache_link_first( struct webcache_t *self, struct webcache_entry_t *entry ) {
+    entry->prev = NULL;
+    entry->next = self->first;
+    if ( self->first!=NULL ) self->first->prev = entry;
+    else self->last = entry;
+    self->first = entry;
+}
+
+/* Remove a ready entry, with the lock held */
+static void webcache_remove( struct webcache_t *self, struct webcache_entry_t *entry ) {
+    webcache_unlink( self, entry );
+    self->size -= entry->size;
+    lhashtable_remove( self->entries, entry->key );
+}
+
+/* Look for the response of a request. With WEBCACHE_READY the response was
+ * copied from the cache; with WEBCACHE_PENDING the caller must produce it
+ * and then call webcache_complete with *entry; with NULL *entry and
+ * WEBCACHE_PENDING the request which was producing the response couldn't
+ * store it, so the caller must produce it by itself without storing it */
+static enum webcache_state webcache_lookup( struct webcache_t *self, const char *key, struct webresponse_t *resp,
+                                            struct webcache_entry_t **pending ) {
+    struct webcache_entry_t *entry;
+    lbool waited = LFALSE;
+
+    *pending = NULL;
+
+    lcom_mutex_lock( self->mutex );
+    while ( 1 ) {
+        entry = (struct webcache_entry_t *)lhashtable_get( self->entries, key );
+
+        if ( entry==NULL && waited ) {
+            break;
+        } else if ( entry==NULL ) {
+            entry = (struct webcache_entry_t *)lmalloczero( sizeof(struct webcache_entry_t) );
+            entry->key = lstring_new_from_cstr( key );
+            entry->state = WEBCACHE_PENDING;
+            entry->generation = self->generation;
+            lhashtable_put( self->entries, key, entry );
+            *pending = entry;
+            break;
+        } else if ( entry->state==WEBCACHE_PENDING ) {
+            lcom_cond_wait( self->cond, self->mutex );
+            waited = LTRUE;
+        } else if ( entry->expires<=l_monotonic_time_micros() ) {
+            webcache_remove( self, entry );
+        } else {
+            webcache_unlink( self, entry );
+            webcache_link_first( self, entry );
+
+            resp->http_status = entry->http_status;
+            resp->http_status_desc = lstring_from_cstr_f( resp->http_status_desc, entry->http_status_desc );
+            resp->content_type = lstring_from_cstr_f( resp->content_type, entry->content_type );
+            resp->content_type_set = entry->content_type_set;
+            resp->headers = lstring_from_cstr_f( resp->headers, entry->headers );
+            MemBuffer_write( resp->buffer, entry->body, entry->body_len );
+
+            lcom_mutex_unlock( self->mutex );
+            return WEBCACHE_READY;
+        }
+    }
+    lcom_mutex_unlock( self->mutex );
+
+    return WEBCACHE_PENDING;
+}
+
+/* Only the complete, successful, responses without cookies are stored */
+static lbool webcache_is_cacheable( struct webresponse_t *resp ) {
+    return resp->http_status==200 && !resp->headers_sent && resp->file_fd<0 &&
+           strstr( resp->headers, "Set-Cookie:" )==NULL;
+}
+
+/* Store the response produced for a pending entry, or drop the entry
+ * if the response can't be cached */
+static void webcache_complete( struct webcache_t *self, struct webcache_entry_t *entry, struct webresponse_t *resp,
+                               lbool stored, int ttl ) {
+    int bodyLen = MemBuffer_len( resp->buffer );
+    long long size = sizeof(struct webcache_entry_t) + lstring_len( entry->key ) + bodyLen +
+                     lstring_len( resp->headers ) + lstring_len( resp->content_type );
+
+    lcom_mutex_lock( self->mutex );
+
+    if ( stored && entry->generation==self->generation && size<=self->max_size ) {
+        entry->state = WEBCACHE_READY;
+        entry->expires = l_monotonic_time_micros() + ttl*1000LL;
+        entry->size = size;
+        entry->http_status = resp->http_status;
+        entry->http_status_desc = lstring_new_from_cstr( resp->http_status_desc );
+        entry->content_type = lstring_new_from_cstr( resp->content_type );
+        entry->content_type_set = resp->content_type_set;
+        entry->headers = lstring_new_from_cstr( resp->headers );
+        entry->body = (char *)lmalloc( bodyLen>0 ? bodyLen : 1 );
+        memcpy( entry->body, MemBuffer_address( resp->buffer ), bodyLen );
+        entry->body_len = bodyLen;
+
+        webcache_link_first( self, entry );
+        self->size += size;
+        while ( self->size>self->max_size ) {
+            webcache_remove( self, self->last );
+        }
+    } else {
+        lhashtable_remove( self->entries, entry->key );
+    }
+
+    lcom_cond_broadcast( self->cond );
+    lcom_mutex_unlock( self->mutex );
+}
+
+/* Remove the responses whose key starts with the prefix */
+static void webcache_invalidate( struct webcache_t *self, const char *prefix ) {
+    struct webcache_entry_t *entry;
+    struct webcache_entry_t *next;
+    size_t len = prefix!=NULL ? strlen( prefix ) : 0;
+
+    lcom_mutex_lock( self->mutex );
+    self->generation++;
+    for ( entry=self->first; entry!=NULL; entry=next ) {
+        next = entry->next;
+        if ( prefix==NULL || 0==strncmp( entry->key, prefix, len ) ) {
+            webcache_remove( self, entry );
+        }
+    }
+    lcom_mutex_unlock( self->mutex );
+}
+
+/* }}} */
+
+
+/* Access log {{{ */
+
+static void webaccesslog_run( void *arg ) {
+    struct webaccesslog_t *self = (struct webaccesslog_t *)arg;
+    char record[ACCESS_LOG_RECORD_SIZE];
+    long long dropped;
+
+    lcom_mutex_lock( self->mutex );
+    while ( self->count>0 || !self->stopping ) {
+        if ( self->count==0 ) {
+            lcom_cond_wait( self->cond, self->mutex );
+            continue;
+        }
+
+        memcpy( record, self->records[self->first], ACCESS_LOG_RECORD_SIZE );
+        self->first = (self->first+1) % ACCESS_LOG_QUEUE_SIZE;
+        self->count--;
+        dropped = self->dropped;
+        self->dropped = 0;
+        lcom_mutex_unlock( self->mutex );
+
+        if ( dropped>0 ) {
+            l_error( "%lld access log records dropped", dropped );
+        }
+        l_info( "%s", record );
+
+        lcom_mutex_lock( self->mutex );
+    }
+    lcom_mutex_unlock( self->mutex );
+}
+
+static struct webaccesslog_t *webaccesslog_new( void ) {
+    struct webaccesslog_t *self = (struct webaccesslog_t *)lmalloc( sizeof(struct webaccesslog_t) );
+
+    self->mutex = lcom_mutex_new();
+    self->cond = lcom_cond_new();
+    self->records = lmalloc( ACCESS_LOG_QUEUE_SIZE * ACCESS_LOG_RECORD_SIZE );
+    self->first = 0;
+    self->count = 0;
+    self->dropped = 0;
+    self->stopping = LFALSE;
+    self->thread = lcom_thread_start( webaccesslog_run, self );
+
+    return self;
+}
+
+/* Write the queued records and stop the thread */
+static void webaccesslog_destroy( struct webaccesslog_t *self ) {
+    if ( self==NULL ) return;
+
+    lcom_mutex_lock( self->mutex );
+    self->stopping = LTRUE;
+    lcom_cond_signal( self->cond );
+    lcom_mutex_unlock( self->mutex );
+    lcom_thread_join( self->thread );
+
+    lcom_cond_destroy( self->cond );
+    lcom_mutex_destroy( self->mutex );
+    lfree( self->records );
+    lfree( self );
+}
+
+/* Queue the record of a completed request */
+static void webaccesslog_write( struct webaccesslog_t *self, struct mg_request_info *info, int status, long long micros ) {
+    char *record;
+
+    lcom_mutex_lock( self->mutex );
+    if ( self->count==ACCESS_LOG_QUEUE_SIZE ) {
+        self->dropped++;
+        lcom_mutex_unlock( self->mutex );
+        return;
+    }
+
+    record = self->records[(self->first+self->count) % ACCESS_LOG_QUEUE_SIZE];
+    if ( status>0 ) {
+        snprintf( record, ACCESS_LOG_RECORD_SIZE, "%s %s [%s] %i %.3fms", info->request_method, info->uri,
+                  info->query_string!=NULL ? info->query_string : "", status, micros/1000.0 );
+    } else {
+        snprintf( record, ACCESS_LOG_RECORD_SIZE, "%s %s [%s]", info->request_method, info->uri,
+                  info->query_string!=NULL ? info->query_string : "" );
+    }
+    self->count++;
+    lcom_cond_signal( self->cond );
+    lcom_mutex_unlock( self->mutex );
+}
+
+/* }}} */
+
+
+/* Web server and framework {{{ */
+
+struct webserver_t *webserver_new( const char *address, const char *port, int n_threads, const char *docRoot ) {
+    struct webserver_t *result = (struct webserver_t *)lmalloc(sizeof(struct webserver_t) );
+    int i;
+
+    l_assert( address!=NULL );
+    l_assert( port!=NULL );
+    l_assert( docRoot!=NULL );
+
+    result->engine = WEBSERVER_ENGINE_THREADED;
+    result->ctx = NULL;
+    result->event = NULL;
+    result->addr = lstring_new_from_cstr( address );
+    result->docRoot = lstring_new_from_cstr( docRoot );
+    result->port = lstring_new_from_cstr( port );
+    result->router = webrouter_new();
+    result->rules = lvector_new( 0 );
+    result->file_info = lhashtable_new( lfree );
+    result->file_info_mutex = lcom_mutex_new();
+    result->n_threads = lstring_new();
+    result->n_threads = lstring_append_sprintf_f( result->n_threads, "%i", n_threads);
+    result->keep_alive = LFALSE;
+    result->request_timeout = NULL;
+    result->listen_backlog = NULL;
+    result->compression = LFALSE;
+    result->compression_level = -1;
+    result->compression_min_size = DEFAULT_COMPRESSION_MIN_SIZE;
+    result->compressible_types = slist_new( 0 );
+    for ( i=0; default_compressible_types[i]!=NULL; i++ ) {
+        webserver_add_compressible_type( result, default_compressible_types[i] );
+    }
+    result->zstreams = NULL;
+    result->zstreams_mutex = lcom_mutex_new();
+    result->max_body_size = DEFAULT_MAX_BODY_SIZE;
+    result->cache = NULL;
+    result->admission_mutex = lcom_mutex_new();
+    result->adaptive_limit = LFALSE;
+    result->limit = 0;
+    result->min_limit = 0;
+    result->max_limit = 0;
+    result->target_latency = 0;
+    result->last_decrease = 0;
+    result->in_flight = 0;
+    result->metrics = webmetrics_new();
+    result->access_log_enabled = LTRUE;
+    result->access_log = NULL;
+
+    return result;
+}
+
+/* Read the request body not consumed by the handler, or close the
+ * connection when it is too big */
+static void webreq_discard_body( struct webconn_t *conn ) {
+    char buffer[4096];
+    int total = 0;
+    int n = 0;
+
+    while ( total<MAX_DISCARDED_BODY && (n = webconn_read( conn, buffer, sizeof(buffer) ))>0 ) {
+        total += n;
+    }
+
+    if ( n>0 ) {
+        webconn_set_must_close( conn );
+    }
+}
+
+static int handle_rule( struct webserver_t *self, struct rules_t *rule, struct webrequest_t *webreq, struct webconn_t *conn, int *status ) {
+    struct webresponse_t *webresp;
+    struct webcache_entry_t *pending = NULL;
+    lerror *my_error = NULL;
+    lstring *data = NULL;
+    const char *expect;
+
+    l_assert( self!=NULL );
+    l_assert( rule!=NULL );
+    l_assert( conn!=NULL );
+
+    webresp = webresp_new( self, conn );
+
+    if ( webreq_get_content_length( webreq )>self->max_body_size ) {
+        /* The body is not read: the connection can't be reused */
+        webconn_set_must_close( conn );
+        webresp_set_http_status( webresp, 413 );
+        webresp_set_http_status_description( webresp, "Request Entity Too Large" );
+        webresp_commit( webresp );
+        *status = webresp->http_status;
+        webresp_destroy( webresp );
+        return 1;
+    }
+
+    expect = webconn_get_header( conn, "Expect" );
+    if ( expect!=NULL && 0==l_stricmp( expect, "100-continue" ) &&
+         0==strcmp( webreq->info->http_version, "1.1" ) ) {
+        /* The client waits for this before sending the body */
+        webconn_write( conn, "HTTP/1.1 100 Continue\r\n\r\n", 25 );
+    }
+
+    if ( rule->cache_ttl>0 && self->cache!=NULL && 0==strcmp( webreq->info->request_method, "GET" ) ) {
+        data = webcache_key_f( lstring_new(), webreq->info->uri, webreq->info->query_string );
+        if ( webcache_lookup( self->cache, data, webresp, &pending )==WEBCACHE_READY ) {
+            lstring_delete( data );
+            webreq_discard_body( conn );
+            webresp_commit( webresp );
+            *status = webresp->http_status;
+            webresp_destroy( webresp );
+            return 1;
+        }
+        lstring_delete( data );
+        data = NULL;
+    }
+
+    rule->handler( rule->ctx, webreq, webresp, &my_error );
+    if ( pending!=NULL ) {
+        webcache_complete( self->cache, pending, webresp, my_error==NULL && webcache_is_cacheable( webresp ), rule->cache_ttl );
+    }
+    if ( my_error!=NULL && webresp->headers_sent ) {
+        /* The status was already sent: the response is truncated, without
+         * the last chunk, so the client can't take it for complete */
+        data = lstring_new();
+        data = lerror_fill_f( my_error, data );
+        l_error( "Error while streaming %s: %s", webreq->info->uri, data );
+        lstring_delete( data );
+        lerror_delete( &my_error );
+
+        *status = 500;
+        webresp_destroy( webresp );
+        return 1;
+    } else if ( my_error!=NULL ) {
+        webresp_discard_file( webresp );
+        data = lstring_new();
+        data = lerror_fill_f( my_error, data );
+
+        webresp_set_http_status( webresp, 500 );
+        webresp_set_http_status_description( webresp, "Internal Error" );
+        webresp_write_lstring( webresp, data );
+        lstring_delete( data );
+        lerror_delete( &my_error );
+    }
+
+    webreq_discard_body( conn );
+    webresp_commit( webresp );
+    *status = webresp->http_status;
+    webresp_destroy( webresp );
+
+    return 1;
+}
+
+static int handle_method_not_allowed( struct webserver_t *self, struct webconn_t *conn, const char *uri ) {
+    lstring *response = lstring_new();
+    lstring *allowed = lstring_new();
+
+    allowed = webrouter_allowed_methods_f( self->router, allowed, uri );
+    webreq_discard_body( conn );
+    response = lstring_append_sprintf_f( response,
+               "HTTP/1.1 405 Method Not Allowed\r\n"
+               "Allow: %s\r\n"
+               "Content-Length: 0\r\n"
+               "Connection: %s\r\n"
+               "\r\n",
+               allowed, webconn_should_keep_alive( conn ) ? "keep-alive" : "close" );
+    webconn_write( conn, response, lstring_len( response ) );
+    lstring_delete( allowed );
+    lstring_delete( response );
+
+    return 1;
+}
+
+/* Serve a file of the document root, for the event-driven engine (mongoose
+ * serves them by itself) */
+static int handle_static_file( struct webserver_t *self, struct webconn_t *conn, int *status ) {
+    struct webresponse_t *webresp = webresp_new( self, conn );
+    const char *method = conn->info->request_method;
+    const char *uri = conn->info->uri;
+    lstring *path = NULL;
+    struct stat st;
+
+    webreq_discard_body( conn );
+
+    if ( 0!=strcmp( method, "GET" ) && 0!=strcmp( method, "HEAD" ) ) {
+        webresp_set_http_status( webresp, 405 );
+        webresp_set_http_status_description( webresp, "Method Not Allowed" );
+        webresp_add_header( webresp, "Allow", "GET, HEAD" );
+    } else if ( strstr( uri, ".." )!=NULL || strchr( uri, '\\' )!=NULL ) {
+        webresp_set_http_status( webresp, 403 );
+        webresp_set_http_status_description( webresp, "Forbidden" );
+    } else {
+        path = lstring_new_from_cstr( self->docRoot );
+        path = lstring_append_cstr_f( path, uri );
+        if ( 0==stat( path, &st ) && S_ISDIR( st.st_mode ) ) {
+            path = lstring_append_cstr_f( path, uri[strlen(uri)-1]=='/' ? "index.html" : "/index.html" );
+        }
+
+        if ( !webresp_send_file( webresp, path, 0, -1 ) ) {
+            webresp_write_text( webresp, "Not Found" );
+        }
+        lstring_delete( path );
+    }
+
+    webresp_commit( webresp );
+    *status = webresp->http_status;
+    webresp_destroy( webresp );
+
+    return 1;
+}
+
+/* Decide if a request for a service can run now, waiting for a free slot
+ * of the service up to its queue time budget */
+static lbool webserver_admit( struct webserver_t *self, struct rules_t *rule ) {
+    long long deadline;
+    long long remaining;
+
+    if ( !self->adaptive_limit && rule->max_concurrent==0 ) {
+        return LTRUE;
+    }
+
+    lcom_mutex_lock( self->admission_mutex );
+
+    if ( self->adaptive_limit && self->in_flight>=(int)self->limit ) {
+        lcom_mutex_unlock( self->admission_mutex );
+        return LFALSE;
+    }
+
+    if ( rule->max_concurrent>0 ) {
+        deadline = l_monotonic_time_micros() + rule->max_queue_millis*1000LL;
+        while ( rule->active>=rule->max_concurrent ) {
+            remaining = deadline - l_monotonic_time_micros();
+            if ( remaining<=0 ) {
+                lcom_mutex_unlock( self->admission_mutex );
+                return LFALSE;
+            }
+            lcom_cond_timed_wait( rule->slot_freed, self->admission_mutex, (int)((remaining+999)/1000) );
+        }
+        rule->active++;
+    }
+    self->in_flight++;
+
+    lcom_mutex_unlock( self->admission_mutex );
+    return LTRUE;
+}
+
+/* Release the slot taken by webserver_admit, adapting the global limit:
+ * it is cut by 10% (at most once per target latency) when a request is
+ * slower than the target and grows by about one every "limit" requests
+ * otherwise, if it is used */
+static void webserver_release( struct webserver_t *self, struct rules_t *rule, long long latency ) {
+    long long now;
+
+    if ( !self->adaptive_limit && rule->max_concurrent==0 ) {
+        return;
+    }
+
+    lcom_mutex_lock( self->admission_mutex );
+
+    if ( rule->max_concurrent>0 ) {
+        rule->active--;
+        lcom_cond_signal( rule->slot_freed );
+    }
+
+    if ( self->adaptive_limit ) {
+        if ( latency>self->target_latency ) {
+            now = l_monotonic_time_micros();
+            if ( now-self->last_decrease>self->target_latency ) {
+                self->limit = self->limit*0.9 < self->min_limit ? self->min_limit : self->limit*0.9;
+                self->last_decrease = now;
+            }
+        } else if ( self->in_flight*2>=(int)self->limit ) {
+            self->limit += 1.0/self->limit;
+            if ( self->limit>self->max_limit ) self->limit = self->max_limit;
+        }
+    }
+    self->in_flight--;
+
+    lcom_mutex_unlock( self->admission_mutex );
+}
+
+static int handle_overloaded( struct webserver_t *self, struct webconn_t *conn ) {
+    lstring *response = lstring_new();
+
+    webreq_discard_body( conn );
+    response = lstring_append_sprintf_f( response,
+               "HTTP/1.1 503 Service Unavailable\r\n"
+               "Retry-After: %i\r\n"
+               "Content-Length: 0\r\n"
+               "Connection: %s\r\n"
+               "\r\n",
+               OVERLOAD_RETRY_AFTER, webconn_should_keep_alive( conn ) ? "keep-alive" : "close" );
+    webconn_write( conn, response, lstring_len( response ) );
+    lstring_delete( response );
+
+    return 1;
+}
+
+/* Dispatch a request to the service matching the path */
+static int webserver_dispatch( struct webserver_t *self, struct webconn_t *conn ) {
+    struct mg_request_info *info = conn->info;
+    struct webrequest_t *webreq;
+    struct rules_t *rule = NULL;
+    long long start = l_monotonic_time_micros();
+    long long admitted;
+    int status = 0;
+    int result = 0;
+
+    l_assert( self!=NULL );
+
+    webreq = webreq_new( conn );
+
+    switch ( webrouter_match( self->router, info->request_method, info->uri, webreq->pathParams, (void **)&rule ) ) {
+    case WEBROUTER_FOUND:
+        webmetrics_begin( rule->metrics );
+        if ( webserver_admit( self, rule ) ) {
+            admitted = l_monotonic_time_micros();
+            result = handle_rule( self, rule, webreq, conn, &status );
+            webserver_release( self, rule, l_monotonic_time_micros()-admitted );
+        } else {
+            result = handle_overloaded( self, conn );
+            status = 503;
+        }
+        webmetrics_end( rule->metrics, status, l_monotonic_time_micros()-start );
+        break;
+    case WEBROUTER_METHOD_NOT_ALLOWED:
+        result = handle_method_not_allowed( self, conn, info->uri );
+        status = 405;
+        break;
+    default:
+        if ( conn->ev!=NULL ) {
+            result = handle_static_file( self, conn, &status );
+        } else {
+            /* mongoose will serve the static files */
+            result = 0;
+        }
+        break;
+    }
+
+    webreq_destroy( webreq );
+
+    /* The files served by mongoose are logged without the status */
+    if ( self->access_log!=NULL ) {
+        webaccesslog_write( self->access_log, info, status, l_monotonic_time_micros()-start );
+    }
+
+    return result;
+}
+
+static int request_handler( struct mg_connection *conn ) {
+    struct webconn_t webconn;
+
+    webconn.mg = conn;
+    webconn.ev = NULL;
+    webconn.info = mg_get_request_info( conn );
+
+    return webserver_dispatch( (struct webserver_t *)webconn.info->user_data, &webconn );
+}
+
+static void event_request_handler( void *ctx, struct webevent_conn_t *conn ) {
+    const struct webevent_request_t *request = webevent_get_request( conn );
+    struct mg_request_info info;
+    struct webconn_t webconn;
+
+    memset( &info, 0, sizeof(info) );
+    info.request_method = request->method;
+    info.uri = request->uri;
+    info.http_version = request->http_version;
+    info.query_string = request->query_string;
+    info.user_data = ctx;
+
+    webconn.mg = NULL;
+    webconn.ev = conn;
+    webconn.info = &info;
+
+    webserver_dispatch( (struct webserver_t *)ctx, &webconn );
+}
+
+void webserver_set_keep_alive( struct webserver_t *self, lbool enabled ) {
+    l_assert( self!=NULL );
+    self->keep_alive = enabled;
+}
+
+void webserver_set_request_timeout( struct webserver_t *self, int millis ) {
+    l_assert( self!=NULL );
+    l_assert( millis>0 );
+
+    if ( self->request_timeout==NULL ) self->request_timeout = lstring_new();
+    lstring_reset( self->request_timeout );
+    self->request_timeout = lstring_append_sprintf_f( self->request_timeout, "%i", millis );
+}
+
+void webserver_set_listen_backlog( struct webserver_t *self, int backlog ) {
+    l_assert( self!=NULL );
+    l_assert( backlog>0 );
+
+    if ( self->listen_backlog==NULL ) self->listen_backlog = lstring_new();
+    lstring_reset( self->listen_backlog );
+    self->listen_backlog = lstring_append_sprintf_f( self->listen_backlog, "%i", backlog );
+}
+
+void webserver_enable_compression( struct webserver_t *self, int level, int minSize ) {
+    l_assert( self!=NULL );
+    l_assert( level>=-1 && level<=9 );
+    l_assert( minSize>=0 );
+
+#ifdef WEBSERVER_USE_ZLIB
+    self->compression = LTRUE;
+    self->compression_level = level;
+    self->compression_min_size = minSize;
+#else
+    l_error( "The web server was compiled without zlib, responses will not be compressed" );
+#endif
+}
+
+void webserver_add_compressible_type( struct webserver_t *self, const char *contentType ) {
+    int len;
+
+    l_assert( self!=NULL );
+    l_assert( contentType!=NULL );
+
+    len = slist_len( self->compressible_types );
+    slist_resize( self->compressible_types, len+1 );
+    slist_set( self->compressible_types, len, contentType );
+}
+
+void webserver_set_max_body_size( struct webserver_t *self, long long maxSize ) {
+    l_assert( self!=NULL );
+    l_assert( maxSize>=0 );
+
+    self->max_body_size = maxSize;
+}
+
+void webserver_set_access_log( struct webserver_t *self, lbool enabled ) {
+    l_assert( self!=NULL );
+    l_assert( self->ctx==NULL && self->event==NULL );
+
+    self->access_log_enabled = enabled;
+}
+
+static void metrics_handler( void *ctx, struct webrequest_t *req, struct webresponse_t *resp, lerror **error ) {
+    struct webserver_t *self = (struct webserver_t *)ctx;
+    lstring *text = lstring_new();
+
+    text = webmetrics_format_f( self->metrics, text, "webserver" );
+    webresp_set_content_type( resp, "text/plain; version=0.0.4" );
+    webresp_write_lstring( resp, text );
+    lstring_delete( text );
+}
+
+void webserver_enable_metrics( struct webserver_t *self, const char *uri ) {
+    l_assert( self!=NULL );
+    l_assert( uri!=NULL );
+
+    webserver_add_route( self, "GET", uri, metrics_handler, self );
+}
+
+/* Find the service registered for a method (NULL for every method)
+ * and a pattern */
+static struct rules_t *webserver_find_rule( struct webserver_t *self, const char *method, const char *pattern ) {
+    struct rules_t *rule;
+    int i;
+
+    for ( i=0; i<lvector_len( self->rules ); i++ ) {
+        rule = (struct rules_t *)lvector_at( self->rules, i );
+        if ( 0==strcmp( rule->pattern, pattern ) &&
+             ( method==NULL ? rule->method[0]=='\0' : 0==strcmp( rule->method, method ) ) ) {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+long long webserver_get_latency_percentile( struct webserver_t *self, const char *method, const char *pattern, double quantile ) {
+    struct rules_t *rule;
+
+    l_assert( self!=NULL );
+    l_assert( pattern!=NULL );
+
+    rule = webserver_find_rule( self, method, pattern );
+    return rule!=NULL ? webmetrics_get_percentile( rule->metrics, quantile ) : -1;
+}
+
+void webserver_enable_cache( struct webserver_t *self, long long maxSize ) {
+    l_assert( self!=NULL );
+    l_assert( maxSize>0 );
+    l_assert( self->cache==NULL );
+
+    self->cache = webcache_new( maxSize );
+}
+
+void webserver_set_route_cache( struct webserver_t *self, const char *pattern, int ttlMillis ) {
+    struct rules_t *rule;
+
+    l_assert( self!=NULL );
+    l_assert( pattern!=NULL );
+    l_assert( ttlMillis>=0 );
+
+    rule = webserver_find_rule( self, "GET", pattern );
+    if ( rule==NULL ) {
+        rule = webserver_find_rule( self, NULL, pattern );
+    }
+    if ( rule==NULL ) {
+        l_error( "No service to cache for %s", pattern );
+        return;
+    }
+
+    rule->cache_ttl = ttlMillis;
+}
+
+void webserver_set_route_limit( struct webserver_t *self, const char *method, const char *pattern, int maxConcurrent, int maxQueueMillis ) {
+    struct rules_t *rule;
+
+    l_assert( self!=NULL );
+    l_assert( pattern!=NULL );
+    l_assert( maxConcurrent>=0 );
+    l_assert( maxQueueMillis>=0 );
+    l_assert( self->ctx==NULL && self->event==NULL );
+
+    rule = webserver_find_rule( self, method, pattern );
+    if ( rule==NULL ) {
+        l_error( "No service to limit for %s", pattern );
+        return;
+    }
+
+    rule->max_concurrent = maxConcurrent;
+    rule->max_queue_millis = maxQueueMillis;
+    if ( rule->slot_freed==NULL ) {
+        rule->slot_freed = lcom_cond_new();
+    }
+}
+
+void webserver_enable_adaptive_limit( struct webserver_t *self, int targetLatencyMillis, int minLimit, int maxLimit ) {
+    l_assert( self!=NULL );
+    l_assert( targetLatencyMillis>0 );
+    l_assert( minLimit>0 && minLimit<=maxLimit );
+    l_assert( self->ctx==NULL && self->event==NULL );
+
+    self->adaptive_limit = LTRUE;
+    self->target_latency = targetLatencyMillis*1000LL;
+    self->min_limit = minLimit;
+    self->max_limit = maxLimit;
+    self->limit = maxLimit;
+}
+
+int webserver_get_concurrency_limit( struct webserver_t *self ) {
+    int result;
+
+    l_assert( self!=NULL );
+
+    lcom_mutex_lock( self->admission_mutex );
+    result = self->adaptive_limit ? (int)self->limit : 0;
+    lcom_mutex_unlock( self->admission_mutex );
+
+    return result;
+}
+
+void webserver_invalidate_cache( struct webserver_t *self, const char *uriPrefix ) {
+    l_assert( self!=NULL );
+
+    if ( self->cache!=NULL ) {
+        webcache_invalidate( self->cache, uriPrefix );
+    }
+}
+
+void webserver_set_engine( struct webserver_t *self, enum webserver_engine engine ) {
+    l_assert( self!=NULL );
+    l_assert( self->ctx==NULL && self->event==NULL );
+
+    self->engine = engine;
+}
+
+/* Start the event-driven engine */
+static void webserver_start_event( struct webserver_t *self, lerror **error ) {
+    self->event = webevent_new( self->addr, self->port, l_atoi( self->n_threads ), event_request_handler, self );
+    webevent_set_keep_alive( self->event, self->keep_alive );
+    webevent_set_max_body_size( self->event, self->max_body_size );
+    if ( self->request_timeout!=NULL ) {
+        webevent_set_request_timeout( self->event, l_atoi( self->request_timeout ) );
+    }
+    if ( self->listen_backlog!=NULL ) {
+        webevent_set_listen_backlog( self->event, l_atoi( self->listen_backlog ) );
+    }
+
+    if ( !webevent_start( self->event, error ) ) {
+        webevent_destroy( self->event );
+        self->event = NULL;
+    }
+}
+
+void webserver_start( struct webserver_t *self, lerror **error ) {
+    const char *options[16];
+    int n = 0;
+
+    struct mg_callbacks callbacks;
+
+    memset( &callbacks, 0, sizeof(struct mg_callbacks) );
+    callbacks.begin_request = request_handler;
+
+    l_assert( self!=NULL );
+    l_assert( error==NULL || (*error)==NULL );
+
+    if ( self->access_log_enabled && self->access_log==NULL ) {
+        self->access_log = webaccesslog_new();
+    }
+
+    if ( self->engine==WEBSERVER_ENGINE_EVENT ) {
+        webserver_start_event( self, error );
+        return;
+    }
+
+    options[n++] = "document_root";
+    options[n++] = self->docRoot;
+    options[n++] = "listening_ports";
+    options[n++] = self->port;
+    options[n++] = "num_threads";
+    options[n++] = self->n_threads;
+    options[n++] = "enable_keep_alive";
+    options[n++] = self->keep_alive ? "yes" : "no";
+    if ( self->request_timeout!=NULL ) {
+        options[n++] = "request_timeout_ms";
+        options[n++] = self->request_timeout;
+    }
+    if ( self->listen_backlog!=NULL ) {
+        options[n++] = "listen_backlog";
+        options[n++] = self->listen_backlog;
+    }
+    options[n] = NULL;
+
+    self->ctx = mg_start( &callbacks, self, options );
+    if ( self->ctx==NULL ) {
+        lerror_set( error, "Can't start the web server." );
+        return;
+    }
+}
+
+void webserver_destroy( struct webserver_t *self ) {
+    struct webzstream_t *zstream;
+    struct rules_t *rule;
+    int i;
+
+    l_assert( self!=NULL );
+
+    if ( self->ctx ) mg_stop( self->ctx );
+    self->ctx = NULL;
+    webevent_destroy( self->event );
+    self->event = NULL;
+    webaccesslog_destroy( self->access_log );
+    self->access_log = NULL;
+
+    for ( i=0; i<lvector_len( self->rules ); i++ ) {
+        rule = (struct rules_t *)lvector_at( self->rules, i );
+        lstring_delete( rule->method );
+        lstring_delete( rule->pattern );
+        if ( rule->slot_freed!=NULL ) lcom_cond_destroy( rule->slot_freed );
+        lfree( rule );
+    }
+    lvector_delete( self->rules );
+    webrouter_destroy( self->router );
+    lhashtable_destroy( self->file_info );
+    lcom_mutex_destroy( self->file_info_mutex );
+
+    slist_destroy( self->compressible_types );
+    while ( self->zstreams!=NULL ) {
+        zstream = self->zstreams;
+        self->zstreams = zstream->next;
+        webzstream_destroy( zstream );
+    }
+    lcom_mutex_destroy( self->zstreams_mutex );
+    webcache_destroy( self->cache );
+    lcom_mutex_destroy( self->admission_mutex );
+    webmetrics_destroy( self->metrics );
+
+    lstring_delete( self->addr );
+    lstring_delete( self->docRoot );
+    lstring_delete( self->port );
+    lstring_delete( self->n_threads );
+    lstring_delete( self->request_timeout );
+    lstring_delete( self->listen_backlog );
+    lfree( self );
+}
+
+void webserver_add_service( struct webserver_t *self, const char *uri, webservice_handler_t handler, void *ctx ) {
+    webserver_add_route( self, NULL, uri, handler, ctx );
+}
+
+void webserver_add_route( struct webserver_t *self, const char *method, const char *pattern, webservice_handler_t handler, void *ctx ) {
+    struct rules_t *rule;
+    lstring *name;
+
+    l_assert( self!=NULL );
+    l_assert( pattern!=NULL );
+    l_assert( handler!=NULL );
+
+    rule = (struct rules_t *)lmalloc( sizeof(struct rules_t) );
+    rule->ctx = ctx;
+    rule->handler = handler;
+    rule->cache_ttl = 0;
+    rule->max_concurrent = 0;
+    rule->max_queue_millis = 0;
+    rule->active = 0;
+    rule->slot_freed = NULL;
+
+    if ( !webrouter_add( self->router, method, pattern, rule ) ) {
+        l_error( "Invalid route pattern: %s", pattern );
+        lfree( rule );
+        return;
+    }
+
+    rule->method = lstring_new_from_cstr( method!=NULL ? method : "" );
+    rule->pattern = lstring_new_from_cstr( pattern );
+    name = lstring_new();
+    if ( method!=NULL ) {
+        name = lstring_append_sprintf_f( name, "%s ", method );
+    }
+    name = lstring_append_cstr_f( name, pattern );
+    rule->metrics = webmetrics_add_service( self->metrics, name );
+    lstring_delete( name );
 
-    self->rules_count++;
+    lvector_resize( self->rules, lvector_len( self->rules )+1 );
+    lvector_set( self->rules, lvector_len( self->rules )-1, rule );
 }
 
 void webserver_wait() {
@@ -54,6 +54,251 @@ struct webresponse_t;
  */
 struct webserver_t *webserver_new( const char *address, const char *port, int n_threads, const char *docRoot );
 
+/**
+ * Enum: webserver_engine
+ * The engine accepting the connections and parsing the requests
+ *
+ * WEBSERVER_ENGINE_THREADED - The embedded mongoose server, with a thread
+ *     for every connection (the default)
+ * WEBSERVER_ENGINE_EVENT - An epoll event loop reading the requests from
+ *     every connection and a pool of threads executing the services (see
+ *     webevent.h). The number of threads only limits the concurrent
+ *     requests, so many idle keep-alive connections can be served.
+ *     Only available on Linux.
+ */
+enum webserver_engine {
+    WEBSERVER_ENGINE_THREADED,
+    WEBSERVER_ENGINE_EVENT
+};
+
+/**
+ * Function: webserver_set_engine
+ * Choose the engine of the web server, must be done before the server is
+ * started. The services work in the same way with both engines.
+ *
+ * Parameters:
+ *     self - The web server
+ *     engine - The engine
+ */
+void webserver_set_engine( struct webserver_t *self, enum webserver_engine engine );
+
+/**
+ * Function: webserver_set_keep_alive
+ * Keep the HTTP/1.1 connections open between requests. Disabled by default.
+ * Every connection kept alive takes a server thread until the client closes
+ * it or the request timeout expires. Must be called before the server is
+ * started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     enabled - LTRUE to keep the connections alive
+ */
+void webserver_set_keep_alive( struct webserver_t *self, lbool enabled );
+
+/**
+ * Function: webserver_set_request_timeout
+ * Change the time waited for a request (and for the next one on a
+ * kept-alive connection). The default is 30 seconds. Must be called before
+ * the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     millis - The timeout in milliseconds (greater than zero)
+ */
+void webserver_set_request_timeout( struct webserver_t *self, int millis );
+
+/**
+ * Function: webserver_set_listen_backlog
+ * Change the length of the queue of the connections waiting to be
+ * accepted. The default is the system maximum (SOMAXCONN). Must be called
+ * before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     backlog - The queue length (greater than zero)
+ */
+void webserver_set_listen_backlog( struct webserver_t *self, int backlog );
+
+/**
+ * Function: webserver_enable_compression
+ * Compress the buffered responses with gzip or deflate when the client
+ * accepts it (see the Accept-Encoding header), the body is big enough and
+ * the content type is compressible (see <webserver_add_compressible_type>).
+ * The streamed responses and the files are sent as they are. This
+ * function only works if CommonLib is compiled with WEBSERVER_USE_ZLIB
+ * and must be called before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     level - The zlib compression level, from 1 (fastest) to 9 (smallest),
+ *         or -1 for the zlib default
+ *     minSize - The size, in bytes, of the smallest body to compress
+ */
+void webserver_enable_compression( struct webserver_t *self, int level, int minSize );
+
+/**
+ * Function: webserver_add_compressible_type
+ * Add a content type to the ones that can be compressed. The response
+ * content type is compared with the start of the registered ones, so
+ * "text/" matches every text type. By default the text types, JSON,
+ * JavaScript, XML and SVG are compressible.
+ *
+ * Parameters:
+ *     self - The web server
+ *     contentType - The content type or its prefix
+ */
+void webserver_add_compressible_type( struct webserver_t *self, const char *contentType );
+
+/**
+ * Function: webserver_set_max_body_size
+ * Change the maximum size of the request bodies. The requests declaring
+ * a bigger Content-Length receive a "413 Request Entity Too Large"
+ * without calling the service. The default is 16MB. Must be called
+ * before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     maxSize - The maximum body size in bytes
+ */
+void webserver_set_max_body_size( struct webserver_t *self, long long maxSize );
+
+/**
+ * Function: webserver_set_access_log
+ * Log every request, with the status and the time spent, as an info
+ * message. The messages are written by a separate thread and dropped when
+ * it can't keep up. Enabled by default. Must be called before the server
+ * is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     enabled - LTRUE to log the requests
+ */
+void webserver_set_access_log( struct webserver_t *self, lbool enabled );
+
+/**
+ * Function: webserver_enable_metrics
+ * Add a service publishing the statistics of every service in the
+ * Prometheus text format: the requests completed by status class, the
+ * requests in progress and the latency percentiles (see <webmetrics_t>).
+ * The static files are not included.
+ *
+ * Parameters:
+ *     self - The web server
+ *     uri - The path of the statistics, usually "/metrics"
+ */
+void webserver_enable_metrics( struct webserver_t *self, const char *uri );
+
+/**
+ * Function: webserver_get_latency_percentile
+ * Compute a latency percentile of a service
+ *
+ * Parameters:
+ *     self - The web server
+ *     method - The method of the route, NULL for the services added with
+ *         <webserver_add_service>
+ *     pattern - The path pattern of the route
+ *     quantile - The quantile, between 0 and 1 (ex. 0.99)
+ * Returns:
+ *     The latency in microseconds, 0 if the service wasn't called yet or -1
+ *     if there is no such service
+ */
+long long webserver_get_latency_percentile( struct webserver_t *self, const char *method, const char *pattern, double quantile );
+
+/**
+ * Function: webserver_enable_cache
+ * Enable the cache of the responses of the GET services, see
+ * <webserver_set_route_cache>. Must be called before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     maxSize - The memory, in bytes, used by the cache at most. The least
+ *         recently used responses are discarded to stay below this limit.
+ */
+void webserver_enable_cache( struct webserver_t *self, long long maxSize );
+
+/**
+ * Function: webserver_set_route_cache
+ * Cache the responses of a service for GET requests. The responses are
+ * stored by path and query string (the order of the parameters doesn't
+ * matter), so they can't depend on the headers of the request. Only the
+ * complete "200 OK" responses without cookies are stored, the streamed
+ * responses and the files are not. When a response is missing the
+ * concurrent requests for it wait for the first one instead of calling
+ * the service too. Must be called after the service is added, before the
+ * server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     pattern - The pattern of the service, as given to <webserver_add_route>
+ *         for GET or <webserver_add_service>
+ *     ttlMillis - How long, in milliseconds, the responses are kept. Zero
+ *         disables the cache for the service.
+ */
+void webserver_set_route_cache( struct webserver_t *self, const char *pattern, int ttlMillis );
+
+/**
+ * Function: webserver_invalidate_cache
+ * Remove some responses from the cache, usually because the data they show
+ * was changed. The responses being produced are not stored. Can be called
+ * by the services.
+ *
+ * Parameters:
+ *     self - The web server
+ *     uriPrefix - The start of the path of the responses to remove (ex.
+ *         "/customers" removes "/customers/1" and "/customers?page=2") or
+ *         NULL to empty the cache
+ */
+void webserver_invalidate_cache( struct webserver_t *self, const char *uriPrefix );
+
+/**
+ * Function: webserver_set_route_limit
+ * Limit the number of requests served at the same time by a service, so
+ * a slow service can't take every thread of the server. The requests
+ * beyond the limit wait for a free slot up to the queue time budget and
+ * then receive a "503 Service Unavailable" with a Retry-After header.
+ * Must be called after the service is added, before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     method - The method of the route, NULL for the services added with
+ *         <webserver_add_service>
+ *     pattern - The path pattern of the route
+ *     maxConcurrent - The maximum number of requests served at the same
+ *         time, zero to remove the limit
+ *     maxQueueMillis - How long, in milliseconds, a request can wait for
+ *         a free slot. Zero rejects the requests immediately.
+ */
+void webserver_set_route_limit( struct webserver_t *self, const char *method, const char *pattern, int maxConcurrent, int maxQueueMillis );
+
+/**
+ * Function: webserver_enable_adaptive_limit
+ * Limit the number of requests served at the same time by all the services,
+ * adapting the limit to the latency. When the services answer slower than
+ * the target the limit is cut by 10%, when they are faster it grows slowly.
+ * The requests beyond the limit are rejected immediately with a "503
+ * Service Unavailable". The static files are not limited. Must be called
+ * before the server is started.
+ *
+ * Parameters:
+ *     self - The web server
+ *     targetLatencyMillis - The expected latency of the services in
+ *         milliseconds, the time waited for a free slot is not included
+ *     minLimit - The lowest limit (greater than zero)
+ *     maxLimit - The highest limit, which is also the initial one
+ */
+void webserver_enable_adaptive_limit( struct webserver_t *self, int targetLatencyMillis, int minLimit, int maxLimit );
+
+/**
+ * Function: webserver_get_concurrency_limit
+ * Get the current adaptive limit
+ *
+ * Parameters:
+ *     self - The web server
+ * Returns:
+ *     The limit, zero if the adaptive limit is not enabled
+ */
+int webserver_get_concurrency_limit( struct webserver_t *self );
+
 /**
  * Function: webserver_start
  * Start this web server
@@ -76,7 +321,8 @@ typedef void (*webservice_handler_t)( void *ctx, struct webrequest_t *req, struc
 
 /**
  * Function: webserver_add_service
- * Register a web service, must be done before the server is started
+ * Register a web service for every HTTP method, must be done before the
+ * server is started. The URI can be a route pattern (see <webserver_add_route>).
  *
  * Parameters:
  *     self - The web server
@@ -86,6 +332,23 @@ typedef void (*webservice_handler_t)( void *ctx, struct webrequest_t *req, struc
  */     
 void webserver_add_service( struct webserver_t *self, const char *uri, webservice_handler_t handler, void *ctx );
 
+/**
+ * Function: webserver_add_route
+ * Register a web service for an HTTP method, must be done before the
+ * server is started. The pattern can contain "{name}" segments, whose
+ * values are available with <webreq_get_path_param>, and can end with a
+ * "*" segment matching the remaining path. If the path matches but
+ * the method doesn't, the client receives a "405 Method Not Allowed".
+ *
+ * Parameters:
+ *     self - The web server
+ *     method - The HTTP method (ex. "GET") or NULL for every method
+ *     pattern - The URI pattern, ex. "/customers/{id}/orders"
+ *     handler - The handler
+ *     ctx - Will be passed to the handler
+ */
+void webserver_add_route( struct webserver_t *self, const char *method, const char *pattern, webservice_handler_t handler, void *ctx );
+
 /**
  * Function: webresp_set_http_status
  * Change the HTTP status code
@@ -110,6 +373,20 @@ int webresp_get_http_status( struct webresponse_t *self );
  */
 void webresp_set_content_type( struct webresponse_t *self, const char *content_type );
 
+/**
+ * Function: webresp_add_header
+ * Add a header to the response. The Content-Type, Content-Length,
+ * Connection and Transfer-Encoding headers are managed by the web server.
+ * Headers can't be added after a streaming flush and names or values
+ * containing line breaks are refused.
+ *
+ * Parameters:
+ *     self - The response
+ *     name - The header name, ex. "Cache-Control"
+ *     value - The header value
+ */
+void webresp_add_header( struct webresponse_t *self, const char *name, const char *value );
+
 /**
  * Function: webresp_write_text
  * Write a text response to the client
@@ -128,9 +405,90 @@ void webresp_write_lstring( struct webresponse_t *conn, lstring *txt );
  */
 void webresp_write_text_len( struct webresponse_t *conn, const char *txt, int len );
 
+/**
+ * Function: webresp_enable_streaming
+ * Switch the response to the streaming mode. By default the response is
+ * buffered and sent when the handler returns. In the streaming mode the
+ * status and the headers are sent as soon as the buffered data reaches
+ * the threshold and then the data is sent every time the threshold is
+ * reached, as a chunk of a "Transfer-Encoding: chunked" body (or as raw
+ * data before closing the connection for HTTP/1.0 clients). A streamed
+ * response that fits in the threshold is sent as a buffered one.
+ *
+ * The status and the content type must be set before the first flush. If
+ * the handler fails after the first flush the response is truncated
+ * without the final chunk.
+ *
+ * Parameters:
+ *     self - The response
+ *     flushThreshold - The amount of data, in bytes, buffered before
+ *         sending it (greater than zero)
+ */
+void webresp_enable_streaming( struct webresponse_t *self, int flushThreshold );
+
+/**
+ * Function: webresp_flush
+ * In the streaming mode, send the status, the headers and the buffered
+ * data now. In the buffered mode this function does nothing.
+ *
+ * Returns:
+ *     LFALSE if the data could not be sent. The connection will then be
+ *     closed and the data written later is discarded, so a long response
+ *     should stop being produced.
+ */
+lbool webresp_flush( struct webresponse_t *conn );
+
+/**
+ * Function: webresp_send_file
+ * Use a file, or a part of it, as the response body. The file is sent
+ * after the handler returns, directly from the kernel with sendfile when
+ * possible, replacing the text written in the response.
+ *
+ * The response has the ETag and Last-Modified headers (cached per file
+ * path and recomputed when the file changes) and, when the whole file is
+ * sent, honors the conditional requests (If-None-Match,
+ * If-Modified-Since) and single range requests.
+ *
+ * If the content type was not set it's guessed from the file extension.
+ * This function can't be used after a streaming flush.
+ *
+ * Parameters:
+ *     self - The response
+ *     path - The file path
+ *     offset - The offset of the first byte to send
+ *     len - The number of bytes to send, or -1 to send up to the end of the file
+ * Returns:
+ *     LTRUE if the file will be sent, LFALSE if the file can't be opened
+ *     (the response status is set to 404)
+ */
+lbool webresp_send_file( struct webresponse_t *self, const char *path, long long offset, long long len );
+
+/**
+ * Function: webresp_send_fd
+ * Like <webresp_send_file> but sending a file already open. The response
+ * takes the ownership of the file descriptor.
+ *
+ * Parameters:
+ *     self - The response
+ *     fd - The file descriptor
+ *     offset - The offset of the first byte to send
+ *     len - The number of bytes to send, or -1 to send up to the end of the file
+ * Returns:
+ *     LTRUE if the file will be sent, LFALSE if the file can't be used
+ *     (the descriptor is closed)
+ */
+lbool webresp_send_fd( struct webresponse_t *self, int fd, long long offset, long long len );
+
 /**
  * Function: webreq_get_param
- * Get a parameter from an HTTP request
+ * Get a parameter from an HTTP request. The parameters are read from the
+ * query string and, for the "application/x-www-form-urlencoded" requests,
+ * from the body. They are decoded the first time a parameter is requested.
+ * Parameter names are case insensitive and the first occurrence wins.
+ *
+ * Returns:
+ *     The parameter value, or an empty string if the parameter doesn't
+ *     exist
  */
 lstring *webreq_get_param_f( struct webrequest_t *req, lstring *dest, const char *paramName );
 
@@ -146,4 +504,72 @@ lbool webreq_has_param( struct webrequest_t *req, const char *paramName );
  */
 lstring *webreq_get_required_param_f(struct webrequest_t *req, lstring *dest, const char *paramName, lerror **error);
 
+/**
+ * Function: webreq_get_header
+ * Get a request header
+ *
+ * Parameters:
+ *     req - The request
+ *     name - The header name (case insensitive)
+ * Returns:
+ *     The header value or NULL if the request doesn't have the header
+ */
+const char *webreq_get_header( struct webrequest_t *req, const char *name );
+
+/**
+ * Function: webreq_get_content_length
+ * Get the declared size of the request body
+ *
+ * Returns:
+ *     The size in bytes, or -1 if the request doesn't have a Content-Length
+ */
+long long webreq_get_content_length( struct webrequest_t *req );
+
+/**
+ * Function: webreq_get_body
+ * Read the whole request body in memory. The body is kept by the request,
+ * so the function can be called many times, and is terminated by a zero
+ * byte, so a JSON or text body can be used as a C string. Reading the
+ * parameters of a form reads the body too.
+ *
+ * Parameters:
+ *     req - The request
+ *     len - If not NULL, receives the body size
+ *     error - The error object
+ * Returns:
+ *     The body, valid until the handler returns, or NULL if it can't be
+ *     read or was already read with <webreq_read_body>
+ */
+const char *webreq_get_body( struct webrequest_t *req, int *len, lerror **error );
+
+/**
+ * Function: webreq_read_body
+ * Read the next part of the request body into a caller buffer, to
+ * process big uploads without keeping them in memory. Can't be used
+ * together with <webreq_get_body>.
+ *
+ * Parameters:
+ *     req - The request
+ *     buffer - The destination buffer
+ *     len - The buffer size
+ *     error - The error object
+ * Returns:
+ *     The number of bytes read, 0 at the end of the body, -1 on errors
+ */
+int webreq_read_body( struct webrequest_t *req, void *buffer, int len, lerror **error );
+
+/**
+ * Function: webreq_get_path_param
+ * Get a parameter captured from the path by the route pattern
+ *
+ * Parameters:
+ *     req - The request
+ *     paramName - The parameter name, without braces. The remaining path
+ *         matched by a "*" segment is named "*".
+ * Returns:
+ *     The decoded parameter value or NULL if the route doesn't have
+ *     such parameter
+ */
+const char *webreq_get_path_param( struct webrequest_t *req, const char *paramName );
+
 #endif
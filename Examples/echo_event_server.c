@@ -0,0 +1,126 @@
+#include "../CommonLib/net_socket.h"
+#include "../CommonLib/evloop.h"
+#include "../CommonLib/lmemory.h"
+#include "../CommonLib/threading.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Clients idle for more than this are disconnected */
+#define IDLE_TIMEOUT 30000
+
+/* Every thread has its own event loop and listening socket */
+#define THREADS 4
+
+struct client {
+	TCPSocket *socket;
+	EventLoop_timer *idleTimer;
+};
+
+void panic(lerror *error) {
+	lstring *buf = NULL;
+	
+	l_assert(error!=NULL);
+	buf = lstring_new();
+	buf = lerror_fill_f(error, buf);
+	fprintf(stderr, "%s", buf);
+	lstring_delete(buf);
+
+	abort();
+}
+
+void client_close(EventLoop *loop, struct client *client) {
+	EventLoop_remove(loop, TCPSocket_get_fd(client->socket));
+	EventLoop_timer_destroy(client->idleTimer);
+	TCPSocket_destroy(client->socket);
+	lfree(client);
+}
+
+void client_idle(EventLoop *loop, EventLoop_timer *timer, void *ctx) {
+	client_close(loop, (struct client *)ctx);
+}
+
+void client_readable(EventLoop *loop, int fd, int events, void *ctx) {
+	struct client *client = (struct client *)ctx;
+	lerror *myError = NULL;
+	char buffer[4096];
+	int len;
+
+	while (1) {
+		len = TCPSocket_recv(client->socket, buffer, sizeof(buffer), &myError);
+		if (len==TCPSOCKET_WOULD_BLOCK) {
+			break;
+		} else if (len<=0) {
+			lerror_delete(&myError);
+			client_close(loop, client);
+			return;
+		}
+
+		TCPSocket_send_full(client->socket, buffer, len, &myError);
+		if (myError!=NULL) {
+			lerror_delete(&myError);
+			client_close(loop, client);
+			return;
+		}
+	}
+
+	EventLoop_timer_start(client->idleTimer, IDLE_TIMEOUT, 0);
+}
+
+void server_readable(EventLoop *loop, int fd, int events, void *ctx) {
+	TCPListenSocket *listeningSocket = (TCPListenSocket *)ctx;
+	lerror *myError = NULL;
+	struct client *client;
+	TCPSocket *socket;
+
+	while ((socket = TCPListenSocket_accept(listeningSocket, &myError))!=NULL) {
+		client = (struct client *)lmalloc(sizeof(struct client));
+		client->socket = socket;
+		client->idleTimer = EventLoop_timer_new(loop, client_idle, client);
+
+		EventLoop_add(loop, TCPSocket_get_fd(socket), EVENTLOOP_READ, client_readable, client, &myError);
+		if (myError!=NULL) panic(myError);
+		EventLoop_timer_start(client->idleTimer, IDLE_TIMEOUT, 0);
+	}
+	if (myError!=NULL) panic(myError);
+}
+
+void serve(void *ctx) {
+	TCPListenSocket *listeningSocket = (TCPListenSocket *)ctx;
+	lerror *myError = NULL;
+	EventLoop *loop = NULL;
+
+	loop = EventLoop_new(&myError);
+	if (myError!=NULL) panic(myError);
+
+	EventLoop_add(loop, TCPListenSocket_get_fd(listeningSocket), EVENTLOOP_READ, server_readable, listeningSocket, &myError);
+	if (myError!=NULL) panic(myError);
+
+	EventLoop_run(loop);
+	EventLoop_destroy(loop);
+}
+
+int main() {
+	lerror *myError = NULL;
+	TCPListenOptions options;
+	lvector *listeningSockets = NULL;
+	lcom_thread_t *threads[THREADS];
+	int i;
+
+	/* The kernel distributes the connections between the sockets */
+	TCPListenOptions_init(&options);
+	options.nonBlocking = LTRUE;
+	listeningSockets = TCPListenSocket_new_shards("0.0.0.0", "3234", THREADS, &options, &myError);
+	if (myError!=NULL) panic(myError);
+
+	puts("Echo server is accepting connections"); fflush(stdout);
+	for (i=0; i<THREADS; i++) {
+		threads[i] = lcom_thread_start(serve, lvector_at(listeningSockets, i));
+	}
+	for (i=0; i<THREADS; i++) {
+		lcom_thread_join(threads[i]);
+		TCPListenSocket_destroy((TCPListenSocket *)lvector_at(listeningSockets, i));
+	}
+
+	lvector_delete(listeningSockets);
+	return 0;
+}